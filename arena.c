@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "arena.h"
+
+/* A cache line, which is more than any SIMD load needs */
+#define ARENA_ALIGNMENT       64
+/* The smallest block asked of the allocator */
+#define ARENA_MIN_BLOCK_BYTES (64 * 1024)
+
+#define ARENA_ROUND_UP(x) (((x) + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1))
+
+/* Blocks are kept in the order they were first filled. Those after the
+ * current one are empty, left over from a release. */
+typedef struct arena_block_s {
+   struct arena_block_s *next;
+   unsigned char        *data;
+   size_t                size;
+   size_t                used;
+} arena_block;
+
+struct jpeg_arena_s {
+   jpeg_allocator allocator;
+   arena_block   *blocks;
+   arena_block   *current;
+   /* Bytes in the blocks before the current one */
+   size_t         current_start;
+};
+
+static void *default_alloc(void *user, size_t size) {
+   (void) user;
+   return malloc(size);
+}
+
+static void default_free(void *user, void *ptr) {
+   (void) user;
+   free(ptr);
+}
+
+/* The block header and its data come from one allocation */
+static arena_block *block_create(jpeg_arena *arena, size_t size) {
+   arena_block *block = arena->allocator.alloc(arena->allocator.user
+                                              ,sizeof(arena_block) + ARENA_ALIGNMENT + size);
+   uintptr_t    data;
+   assert(block);
+   data = (uintptr_t) (block + 1);
+   data = (data + ARENA_ALIGNMENT - 1) & ~((uintptr_t) ARENA_ALIGNMENT - 1);
+   block->next = NULL;
+   block->data = (unsigned char *) data;
+   block->size = size;
+   block->used = 0;
+   return block;
+}
+
+static void free_blocks(jpeg_arena *arena) {
+   arena_block *block = arena->blocks;
+   while (block) {
+      arena_block *next = block->next;
+      arena->allocator.free(arena->allocator.user, block);
+      block = next;
+   }
+   arena->blocks        = NULL;
+   arena->current       = NULL;
+   arena->current_start = 0;
+}
+
+jpeg_arena *jpeg_arena_create(const jpeg_allocator *allocator) {
+   jpeg_arena    *arena;
+   jpeg_allocator heap = {default_alloc, default_free, NULL};
+   if (!allocator) {
+      allocator = &heap;
+   }
+   arena = allocator->alloc(allocator->user, sizeof(jpeg_arena));
+   assert(arena);
+   arena->allocator     = *allocator;
+   arena->blocks        = NULL;
+   arena->current       = NULL;
+   arena->current_start = 0;
+   return arena;
+}
+
+void jpeg_arena_destroy(jpeg_arena *arena) {
+   if (arena) {
+      jpeg_allocator allocator = arena->allocator;
+      free_blocks(arena);
+      allocator.free(allocator.user, arena);
+   }
+}
+
+void *jpeg_arena_alloc(jpeg_arena *arena, size_t size) {
+   arena_block *block = arena->current;
+   void        *ptr;
+   size = ARENA_ROUND_UP(size > 0 ? size : 1);
+   /* Move on through the empty blocks until one is big enough, and only
+    * then add another */
+   while (block && block->used + size > block->size) {
+      if (!block->next) {
+         size_t block_size = arena->current_start + block->size;
+         if (block_size < size) {
+            block_size = size;
+         }
+         /* Doubling keeps the number of blocks down */
+         block->next = block_create(arena, ARENA_ROUND_UP(block_size));
+      }
+      arena->current_start += block->size;
+      block       = block->next;
+      block->used = 0;
+   }
+   if (!block) {
+      block = block_create(arena, ARENA_ROUND_UP(size > ARENA_MIN_BLOCK_BYTES ? size : ARENA_MIN_BLOCK_BYTES));
+      arena->blocks = block;
+   }
+   arena->current = block;
+   ptr = block->data + block->used;
+   block->used += size;
+   return ptr;
+}
+
+void jpeg_arena_reset(jpeg_arena *arena) {
+   if (arena->blocks && arena->blocks->next) {
+      size_t       size  = 0;
+      arena_block *block;
+      for (block = arena->blocks; block; block = block->next) {
+         size += block->size;
+      }
+      free_blocks(arena);
+      arena->blocks = block_create(arena, size);
+   } else if (arena->blocks) {
+      arena->blocks->used = 0;
+   }
+   arena->current       = arena->blocks;
+   arena->current_start = 0;
+}
+
+size_t jpeg_arena_mark(const jpeg_arena *arena) {
+   return arena->current ? arena->current_start + arena->current->used : 0;
+}
+
+void jpeg_arena_release(jpeg_arena *arena, size_t mark) {
+   arena_block *block = arena->blocks;
+   size_t       start = 0;
+   if (!block) {
+      return;
+   }
+   /* The mark is in the current block or one before it */
+   while (block != arena->current && mark >= start + block->size) {
+      start += block->size;
+      block  = block->next;
+   }
+   assert(mark >= start && mark - start <= block->used);
+   block->used          = mark - start;
+   arena->current       = block;
+   arena->current_start = start;
+}
@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Where an arena gets its memory from. alloc returns NULL if there is
+ * none, and free is only given pointers that alloc returned. */
+typedef struct jpeg_allocator_s {
+   void *(*alloc)(void *user, size_t size);
+   void  (*free)(void *user, void *ptr);
+   void  *user;
+} jpeg_allocator;
+
+/* Memory for decoding one image at a time. The headers, tables and
+ * buffers of an image come out of the arena, and all go back at once when
+ * the image is destroyed. The memory is kept for the next image, so once
+ * the arena has grown to fit the images it is given, decoding another
+ * doesn't go to the allocator at all. Only one thread may use an arena at
+ * a time. */
+typedef struct jpeg_arena_s jpeg_arena;
+
+/* allocator may be NULL for malloc and free. It is copied. */
+jpeg_arena *jpeg_arena_create(const jpeg_allocator *allocator);
+
+void        jpeg_arena_destroy(jpeg_arena *arena);
+
+/* Aligned for any type, including SIMD vectors. Never returns NULL. */
+void       *jpeg_arena_alloc(jpeg_arena *arena, size_t size);
+
+/* Forgets everything allocated but keeps the memory. If it took more than
+ * one block, they are replaced by one big enough for all of it. */
+void        jpeg_arena_reset(jpeg_arena *arena);
+
+/* How much has been allocated, so that everything allocated after this
+ * point can be given back with jpeg_arena_release */
+size_t      jpeg_arena_mark(const jpeg_arena *arena);
+
+void        jpeg_arena_release(jpeg_arena *arena, size_t mark);
+
+#endif
@@ -0,0 +1,120 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "batch.h"
+#include "decoder.h"
+#include "cpu.h"
+#include "thread_pool.h"
+
+/* Each worker decodes whole images serially with its own decoder, which
+ * has its own counts and soon grows big enough that decoding doesn't
+ * allocate */
+typedef struct batch_worker_s {
+   convert_stats   stats;
+   jpeg_decoder   *decoder;
+} batch_worker;
+
+struct jpeg_batch_s {
+   thread_pool   *pool;
+   convert_stats *stats;
+   batch_worker  *workers;
+   unsigned int   num_workers;
+};
+
+typedef struct batch_task_s {
+   jpeg_batch      *batch;
+   jpeg_batch_item *item;
+} batch_task;
+
+static void decode_item(void *arg, unsigned int worker_index) {
+   batch_task      *task   = arg;
+   batch_worker    *worker = &task->batch->workers[worker_index];
+   jpeg_batch_item *item   = task->item;
+   jpeg_decoder_status status;
+   bitmap *b;
+   item->b = NULL;
+   status = item->in_data
+          ? jpeg_decoder_decode(worker->decoder, item->in_data, item->in_size, &b)
+          : jpeg_decoder_decode_file(worker->decoder, item->in_file, &b);
+   if (status == JPEG_DECODER_ERROR_READ) {
+      item->status = JPEG_BATCH_ERROR_READ;
+      return;
+   }
+   item->status = status == JPEG_DECODER_OK ? JPEG_BATCH_OK : JPEG_BATCH_ERROR_DECODE;
+   if (b && item->out_file) {
+      /* The decoder keeps the bitmap for the worker's next image */
+      if (bitmap_write_format(b, item->out_file, item->out_format) != 0 && item->status == JPEG_BATCH_OK) {
+         item->status = JPEG_BATCH_ERROR_WRITE;
+      }
+   } else if (b) {
+      item->b = jpeg_decoder_take_output(worker->decoder);
+   }
+}
+
+jpeg_batch *jpeg_batch_create(const convert_options *options) {
+   jpeg_batch *batch = malloc(sizeof(jpeg_batch));
+   convert_options defaults;
+   unsigned int i;
+   assert(batch);
+   if (!options) {
+      convert_options_init(&defaults);
+      options = &defaults;
+   }
+   batch->pool        = thread_pool_create(options->num_threads ? options->num_threads : cpu_num_cores());
+   batch->stats       = options->stats;
+   batch->num_workers = thread_pool_num_threads(batch->pool);
+   batch->workers     = malloc(batch->num_workers * sizeof(batch_worker));
+   assert(batch->workers);
+   for (i = 0; i < batch->num_workers; i++) {
+      batch_worker   *worker = &batch->workers[i];
+      convert_options worker_options = *options;
+      /* The images themselves are the parallelism */
+      worker_options.num_threads = 1;
+      worker_options.stats       = &worker->stats;
+      memset(&worker->stats, 0, sizeof(worker->stats));
+      worker->decoder = jpeg_decoder_create(&worker_options, NULL);
+   }
+   return batch;
+}
+
+void jpeg_batch_destroy(jpeg_batch *batch) {
+   unsigned int i;
+   thread_pool_destroy(batch->pool);
+   for (i = 0; i < batch->num_workers; i++) {
+      jpeg_decoder_destroy(batch->workers[i].decoder);
+   }
+   free(batch->workers);
+   free(batch);
+}
+
+size_t jpeg_decode_batch(jpeg_batch *batch, jpeg_batch_item *items, size_t num_items) {
+   batch_task *tasks = malloc(num_items * sizeof(batch_task));
+   size_t num_failed = 0;
+   size_t i;
+   unsigned int w;
+   assert(tasks || num_items == 0);
+   for (i = 0; i < num_items; i++) {
+      tasks[i].batch = batch;
+      tasks[i].item  = &items[i];
+      thread_pool_submit(batch->pool, decode_item, &tasks[i]);
+   }
+   thread_pool_wait(batch->pool);
+   free(tasks);
+   for (i = 0; i < num_items; i++) {
+      if (items[i].status != JPEG_BATCH_OK) {
+         num_failed += 1;
+      }
+   }
+   /* The workers are idle now, so their counts can be collected */
+   for (w = 0; w < batch->num_workers; w++) {
+      batch_worker *worker = &batch->workers[w];
+      if (batch->stats) {
+         unsigned int p;
+         for (p = 0; p < CONVERT_NUM_IDCT_PATHS; p++) {
+            batch->stats->idct_blocks[p] += worker->stats.idct_blocks[p];
+         }
+      }
+      memset(&worker->stats, 0, sizeof(worker->stats));
+   }
+   return num_failed;
+}
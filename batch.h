@@ -0,0 +1,44 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include "bitmap.h"
+#include "convert.h"
+
+/* Decodes many images at once, one per thread, each thread with a
+ * jpeg_decoder that it reuses from image to image */
+typedef struct jpeg_batch_s jpeg_batch;
+
+typedef enum {
+   JPEG_BATCH_OK           = 0,
+   JPEG_BATCH_ERROR_READ   = 1,
+   /* The bitmap is still produced, but may be incomplete */
+   JPEG_BATCH_ERROR_DECODE = 2,
+   JPEG_BATCH_ERROR_WRITE  = 3
+} jpeg_batch_status;
+
+typedef struct jpeg_batch_item_s {
+   /* Read from in_data, which must last until the batch returns, if it
+    * isn't NULL, otherwise from in_file */
+   const unsigned char *in_data;
+   size_t               in_size;
+   const char          *in_file;
+   /* If NULL the bitmap is kept in b for the caller to destroy, otherwise
+    * it's written here and b is left NULL */
+   const char          *out_file;
+   bitmap_format        out_format;
+   bitmap              *b;
+   jpeg_batch_status    status;
+} jpeg_batch_item;
+
+/* Starts options->num_threads worker threads, or one per core if 0, which
+ * live until the batch is destroyed. options may be NULL for the defaults,
+ * and options->stats gets the counts for every image decoded. */
+jpeg_batch *jpeg_batch_create(const convert_options *options);
+void        jpeg_batch_destroy(jpeg_batch *batch);
+
+/* Decode num_items items, returning when all are done with the number
+ * that failed */
+size_t      jpeg_decode_batch(jpeg_batch *batch, jpeg_batch_item *items, size_t num_items);
+
+#endif
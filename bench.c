@@ -0,0 +1,273 @@
+/*
+* japeg bench - end to end decode timings over a generated corpus.
+*/
+
+/* For clock_gettime, fork and getrusage under --std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "bench_encode.h"
+#include "convert.h"
+#include "cpu.h"
+#include "decoder.h"
+
+#define BENCH_QUALITY      85
+#define BENCH_MIN_DECODES  3
+#define BENCH_MAX_THREADS  16
+/* Sizes past this are left out by -q */
+#define BENCH_QUICK_PIXELS (1920 * 1080)
+
+/* From a thumbnail up to 24 megapixels */
+static const size_t bench_sizes[][2] = {{64, 64}
+                                       ,{640, 480}
+                                       ,{1920, 1080}
+                                       ,{4000, 3000}
+                                       ,{6000, 4000}};
+
+static const bench_sampling bench_samplings[] = {BENCH_SAMPLING_444
+                                                ,BENCH_SAMPLING_422
+                                                ,BENCH_SAMPLING_420
+                                                ,BENCH_SAMPLING_GRAY};
+
+/* What a child process reports back for one configuration */
+typedef struct bench_result_s {
+   int    error;
+   size_t decodes;
+   /* The fastest decode, which is the steadiest number to compare */
+   double best_seconds;
+   long   peak_rss_kb;
+} bench_result;
+
+static void usage(const char *program) {
+   printf("Usage: %s [-t threads,...] [-m min_ms] [-q] [-w corpus_dir]\n", program);
+   printf("  -t  thread counts to time each image with (default 1 and powers of two up to the cores)\n");
+   printf("  -m  keep decoding each configuration for at least this long (default 300)\n");
+   printf("  -q  leave out the images over %d pixels\n", BENCH_QUICK_PIXELS);
+   printf("  -w  also write the corpus to this directory\n");
+   printf("Images without restart markers decode on more than one thread with speculative huffman decoding.\n");
+   printf("Prints one tab separated line per configuration, after a header line.\n");
+}
+
+static double now_seconds(void) {
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Returns the number of counts, or 0 if the list is malformed */
+static unsigned int parse_threads(const char *list, unsigned int threads[BENCH_MAX_THREADS]) {
+   unsigned int num_threads = 0;
+   while (*list) {
+      char *end;
+      unsigned long n = strtoul(list, &end, 10);
+      if (end == list || n == 0 || num_threads == BENCH_MAX_THREADS || (*end != ',' && *end != '\0')) {
+         return 0;
+      }
+      threads[num_threads++] = (unsigned int) n;
+      list = *end == ',' ? end + 1 : end;
+   }
+   return num_threads;
+}
+
+static unsigned int default_threads(unsigned int threads[BENCH_MAX_THREADS]) {
+   unsigned int cores       = cpu_num_cores();
+   unsigned int num_threads = 0;
+   unsigned int n;
+   for (n = 1; n < cores && num_threads < BENCH_MAX_THREADS - 1; n *= 2) {
+      threads[num_threads++] = n;
+   }
+   threads[num_threads++] = cores;
+   return num_threads;
+}
+
+/* Decode the image over and over in this process, which is a fresh child,
+ * so that its peak memory is the decoder's and the data's alone. The first
+ * decode warms up the decoder and isn't timed. */
+static void run_decodes(const unsigned char *data
+                       ,size_t               size
+                       ,unsigned int         num_threads
+                       ,double               min_seconds
+                       ,bench_result        *result) {
+   convert_options options;
+   jpeg_decoder   *d;
+   bitmap         *b;
+   double          start;
+   struct rusage   usage;
+   convert_options_init(&options);
+   options.num_threads = num_threads;
+   /* Images without restart intervals only decode in parallel this way */
+   options.speculative_huffman = 1;
+   d = jpeg_decoder_create(&options, NULL);
+   result->error        = jpeg_decoder_decode(d, data, size, &b) != JPEG_DECODER_OK;
+   result->decodes      = 0;
+   result->best_seconds = 0;
+   start = now_seconds();
+   while (   !result->error
+          && (result->decodes < BENCH_MIN_DECODES || now_seconds() - start < min_seconds)) {
+      double before = now_seconds();
+      double seconds;
+      result->error |= jpeg_decoder_decode(d, data, size, &b) != JPEG_DECODER_OK;
+      seconds = now_seconds() - before;
+      if (result->decodes == 0 || seconds < result->best_seconds) {
+         result->best_seconds = seconds;
+      }
+      result->decodes += 1;
+   }
+   jpeg_decoder_destroy(d);
+   getrusage(RUSAGE_SELF, &usage);
+   /* Linux counts in kilobytes, macOS in bytes */
+#ifdef __APPLE__
+   result->peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+   result->peak_rss_kb = usage.ru_maxrss;
+#endif
+}
+
+/* Returns 0 on success, 1 if the child couldn't be run */
+static int run_child(const unsigned char *data
+                    ,size_t               size
+                    ,unsigned int         num_threads
+                    ,double               min_seconds
+                    ,bench_result        *result) {
+   int   fds[2];
+   pid_t pid;
+   int   status;
+   if (pipe(fds) != 0) {
+      return 1;
+   }
+   fflush(stdout);
+   pid = fork();
+   if (pid < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      return 1;
+   }
+   if (pid == 0) {
+      /* The decoder's messages would get in the way of the results */
+      if (!freopen("/dev/null", "w", stdout)) {
+         _exit(EXIT_FAILURE);
+      }
+      close(fds[0]);
+      run_decodes(data, size, num_threads, min_seconds, result);
+      _exit(write(fds[1], result, sizeof(*result)) == sizeof(*result) ? EXIT_SUCCESS : EXIT_FAILURE);
+   }
+   close(fds[1]);
+   status = read(fds[0], result, sizeof(*result)) != sizeof(*result);
+   close(fds[0]);
+   waitpid(pid, NULL, 0);
+   return status;
+}
+
+static int write_corpus_file(const char *dir, const bench_image *image, const unsigned char *data, size_t size) {
+   char  filename[1024];
+   FILE *fp;
+   int   error;
+   snprintf(filename, sizeof(filename), "%s/%zux%zu_%s%s.jpg"
+           ,dir, image->width, image->height, bench_sampling_name(image->sampling), image->restart ? "_rst" : "");
+   fp = fopen(filename, "wb");
+   if (!fp) {
+      perror("Error opening corpus file");
+      return 1;
+   }
+   error = fwrite(data, 1, size, fp) != size;
+   error |= fclose(fp) != 0;
+   if (error) {
+      fprintf(stderr, "Error writing %s\n", filename);
+   }
+   return error;
+}
+
+int main(int argc, char *argv[]) {
+   unsigned int threads[BENCH_MAX_THREADS];
+   unsigned int num_threads = default_threads(threads);
+   double       min_seconds = 0.3;
+   int          quick       = 0;
+   const char  *corpus_dir  = NULL;
+   int          arg         = 1;
+   int          failed      = 0;
+   size_t       s, p;
+   int          restart;
+   while (arg < argc) {
+      int error = 1;
+      if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+         num_threads = parse_threads(argv[arg + 1], threads);
+         error = num_threads == 0;
+         arg += 1;
+      } else if (strcmp(argv[arg], "-m") == 0 && arg + 1 < argc) {
+         char *end;
+         min_seconds = strtoul(argv[arg + 1], &end, 10) / 1000.0;
+         error = *end != '\0';
+         arg += 1;
+      } else if (strcmp(argv[arg], "-q") == 0) {
+         quick = 1;
+         error = 0;
+      } else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc) {
+         corpus_dir = argv[arg + 1];
+         error = 0;
+         arg += 1;
+      }
+      if (error) {
+         usage(argv[0]);
+         return EXIT_FAILURE;
+      }
+      arg += 1;
+   }
+   printf("width\theight\tsampling\trestart\tthreads\tbytes\tmcus\tdecodes\tbest_ms\tmp_per_s\tns_per_mcu\tpeak_rss_kb\tspeedup\n");
+   for (s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+      if (quick && bench_sizes[s][0] * bench_sizes[s][1] > BENCH_QUICK_PIXELS) {
+         continue;
+      }
+      for (p = 0; p < sizeof(bench_samplings) / sizeof(bench_samplings[0]); p++) {
+         for (restart = 0; restart <= 1; restart++) {
+            bench_image    image;
+            unsigned char *data;
+            size_t         size;
+            size_t         num_mcus;
+            double         serial_seconds = 0;
+            unsigned int   t;
+            image.width    = bench_sizes[s][0];
+            image.height   = bench_sizes[s][1];
+            image.sampling = bench_samplings[p];
+            image.restart  = restart;
+            image.quality  = BENCH_QUALITY;
+            data     = bench_encode(&image, &size);
+            num_mcus = bench_num_mcus(&image);
+            if (corpus_dir && write_corpus_file(corpus_dir, &image, data, size) != 0) {
+               free(data);
+               return EXIT_FAILURE;
+            }
+            for (t = 0; t < num_threads; t++) {
+               bench_result result;
+               double       megapixels = image.width * image.height / 1e6;
+               if (run_child(data, size, threads[t], min_seconds, &result) != 0 || result.error) {
+                  fprintf(stderr, "Failed to decode %zux%zu %s with %u threads\n"
+                        ,image.width, image.height, bench_sampling_name(image.sampling), threads[t]);
+                  failed = 1;
+                  continue;
+               }
+               if (threads[t] == 1) {
+                  serial_seconds = result.best_seconds;
+               }
+               printf("%zu\t%zu\t%s\t%d\t%u\t%zu\t%zu\t%zu\t%.3f\t%.2f\t%.1f\t%ld\t"
+                     ,image.width, image.height, bench_sampling_name(image.sampling), restart, threads[t]
+                     ,size, num_mcus, result.decodes, result.best_seconds * 1e3
+                     ,megapixels / result.best_seconds, result.best_seconds * 1e9 / num_mcus
+                     ,result.peak_rss_kb);
+               if (serial_seconds > 0) {
+                  printf("%.2f\n", serial_seconds / result.best_seconds);
+               } else {
+                  printf("-\n");
+               }
+            }
+            free(data);
+         }
+      }
+   }
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,499 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench_encode.h"
+
+#define BLOCK_SIDE    8
+#define BLOCK_SAMPLES 64
+#define SINE_STEPS    1024
+#define PI            3.14159265358979323846
+
+#define MARKER_SOI  0xD8
+#define MARKER_EOI  0xD9
+#define MARKER_APP0 0xE0
+#define MARKER_SOF0 0xC0
+#define MARKER_DHT  0xC4
+#define MARKER_DQT  0xDB
+#define MARKER_DRI  0xDD
+#define MARKER_SOS  0xDA
+#define MARKER_RST0 0xD0
+
+/* Zigzag index to natural (row major) index */
+static const unsigned char zigzag[BLOCK_SAMPLES]
+   = { 0,  1,  8, 16,  9,  2,  3, 10
+     ,17, 24, 32, 25, 18, 11,  4,  5
+     ,12, 19, 26, 33, 40, 48, 41, 34
+     ,27, 20, 13,  6,  7, 14, 21, 28
+     ,35, 42, 49, 56, 57, 50, 43, 36
+     ,29, 22, 15, 23, 30, 37, 44, 51
+     ,58, 59, 52, 45, 38, 31, 39, 46
+     ,53, 60, 61, 54, 47, 55, 62, 63};
+
+/* The example tables from Annex K of the standard, in natural order */
+static const unsigned char luma_quant[BLOCK_SAMPLES]
+   = {16,  11,  10,  16,  24,  40,  51,  61
+     ,12,  12,  14,  19,  26,  58,  60,  55
+     ,14,  13,  16,  24,  40,  57,  69,  56
+     ,14,  17,  22,  29,  51,  87,  80,  62
+     ,18,  22,  37,  56,  68, 109, 103,  77
+     ,24,  35,  55,  64,  81, 104, 113,  92
+     ,49,  64,  78,  87, 103, 121, 120, 101
+     ,72,  92,  95,  98, 112, 100, 103,  99};
+
+static const unsigned char chroma_quant[BLOCK_SAMPLES]
+   = {17,  18,  24,  47,  99,  99,  99,  99
+     ,18,  21,  26,  66,  99,  99,  99,  99
+     ,24,  26,  56,  99,  99,  99,  99,  99
+     ,47,  66,  99,  99,  99,  99,  99,  99
+     ,99,  99,  99,  99,  99,  99,  99,  99
+     ,99,  99,  99,  99,  99,  99,  99,  99
+     ,99,  99,  99,  99,  99,  99,  99,  99
+     ,99,  99,  99,  99,  99,  99,  99,  99};
+
+static const unsigned char dc_luma_bits[16]   = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const unsigned char dc_chroma_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const unsigned char dc_values[12]      = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const unsigned char ac_luma_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D};
+static const unsigned char ac_luma_values[162]
+   = {0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07
+     ,0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0
+     ,0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28
+     ,0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49
+     ,0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69
+     ,0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89
+     ,0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7
+     ,0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5
+     ,0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2
+     ,0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8
+     ,0xF9, 0xFA};
+
+static const unsigned char ac_chroma_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const unsigned char ac_chroma_values[162]
+   = {0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71
+     ,0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0
+     ,0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26
+     ,0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48
+     ,0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68
+     ,0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87
+     ,0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5
+     ,0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3
+     ,0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA
+     ,0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8
+     ,0xF9, 0xFA};
+
+/* Code and length for each symbol, as Annex C assigns them */
+typedef struct huffman_codes_s {
+   uint16_t      code[256];
+   unsigned char length[256];
+} huffman_codes;
+
+typedef struct huffman_spec_s {
+   const unsigned char *bits;
+   const unsigned char *values;
+} huffman_spec;
+
+/* Table 0 is luma and table 1 chroma */
+static const huffman_spec dc_specs[2] = {{dc_luma_bits, dc_values}, {dc_chroma_bits, dc_values}};
+static const huffman_spec ac_specs[2] = {{ac_luma_bits, ac_luma_values}, {ac_chroma_bits, ac_chroma_values}};
+
+typedef struct writer_s {
+   unsigned char *data;
+   size_t         size;
+   size_t         capacity;
+   uint32_t       bits;
+   unsigned int   num_bits;
+} writer;
+
+/* Everything about the layout that encoding an MCU needs */
+typedef struct layout_s {
+   unsigned int num_components;
+   unsigned int h[3];
+   unsigned int v[3];
+   unsigned int mcu_width;
+   unsigned int mcu_height;
+   size_t       mcus_across;
+   size_t       mcus_down;
+} layout;
+
+static float sine[SINE_STEPS];
+static float dct_cos[BLOCK_SIDE][BLOCK_SIDE];
+
+static void init_tables(void) {
+   unsigned int i, u;
+   for (i = 0; i < SINE_STEPS; i++) {
+      sine[i] = (float) sin(2 * PI * i / SINE_STEPS);
+   }
+   for (u = 0; u < BLOCK_SIDE; u++) {
+      for (i = 0; i < BLOCK_SIDE; i++) {
+         double scale = u == 0 ? sqrt(0.125) : 0.5;
+         dct_cos[u][i] = (float) (scale * cos((2 * i + 1) * u * PI / 16));
+      }
+   }
+}
+
+/* sin of that many turns */
+static float sine_turns(double turns) {
+   return sine[(size_t) ((turns - floor(turns)) * SINE_STEPS) % SINE_STEPS];
+}
+
+/* Repeatable noise from -8 to 7 */
+static int noise(size_t x, size_t y) {
+   uint32_t n = (uint32_t) x * 0x9E3779B1u ^ (uint32_t) y * 0x85EBCA77u;
+   n ^= n >> 15;
+   n *= 0x2C1B3C6Du;
+   n ^= n >> 12;
+   return (int) (n & 15) - 8;
+}
+
+/* Sample c of pixel (x, y). Broad gradients scale with the image, while
+ * the tiles, texture and noise stay the same size in pixels, as detail in
+ * a photo does. */
+static int sample_at(const bench_image *image, unsigned int c, size_t x, size_t y) {
+   double fx    = (double) x / image->width;
+   double fy    = (double) y / image->height;
+   size_t tile  = (x / 97) + (y / 61);
+   int    edge  = tile % 3 == 0 ? 24 : (tile % 3 == 1 ? -16 : 0);
+   float  value;
+   if (c == 0) {
+      value = 128 + 48 * sine_turns(1.5 * fx + 0.25 * fy) + 24 * sine_turns(fy + 0.1) + edge;
+      if (tile % 5 == 2) {
+         value += 14 * sine_turns(x * 0.137) * sine_turns(y * 0.211);
+      }
+      value += noise(x, y);
+   } else if (c == 1) {
+      value = 128 + 40 * sine_turns(fx + 0.5 * fy) + edge / 2 + noise(y, x) / 4;
+   } else {
+      value = 128 + 40 * sine_turns(0.75 * fy - 0.5 * fx + 0.3) - edge / 2 + noise(x + 7, y) / 4;
+   }
+   if (value < 0) {
+      return 0;
+   }
+   return value > 255 ? 255 : (int) value;
+}
+
+static void make_layout(const bench_image *image, layout *l) {
+   unsigned int c;
+   l->num_components = image->sampling == BENCH_SAMPLING_GRAY ? 1 : 3;
+   for (c = 0; c < 3; c++) {
+      l->h[c] = 1;
+      l->v[c] = 1;
+   }
+   if (image->sampling == BENCH_SAMPLING_422 || image->sampling == BENCH_SAMPLING_420) {
+      l->h[0] = 2;
+   }
+   if (image->sampling == BENCH_SAMPLING_420) {
+      l->v[0] = 2;
+   }
+   l->mcu_width   = l->h[0] * BLOCK_SIDE;
+   l->mcu_height  = l->v[0] * BLOCK_SIDE;
+   l->mcus_across = (image->width  + l->mcu_width  - 1) / l->mcu_width;
+   l->mcus_down   = (image->height + l->mcu_height - 1) / l->mcu_height;
+}
+
+size_t bench_num_mcus(const bench_image *image) {
+   layout l;
+   make_layout(image, &l);
+   return l.mcus_across * l.mcus_down;
+}
+
+const char *bench_sampling_name(bench_sampling sampling) {
+   switch (sampling) {
+      case BENCH_SAMPLING_444:  return "444";
+      case BENCH_SAMPLING_422:  return "422";
+      case BENCH_SAMPLING_420:  return "420";
+      case BENCH_SAMPLING_GRAY: return "gray";
+   }
+   return "?";
+}
+
+static void write_byte(writer *w, unsigned int byte) {
+   if (w->size == w->capacity) {
+      w->capacity = w->capacity * 2 + 4096;
+      w->data     = realloc(w->data, w->capacity);
+      assert(w->data);
+   }
+   w->data[w->size] = (unsigned char) byte;
+   w->size += 1;
+}
+
+static void write_word(writer *w, unsigned int word) {
+   write_byte(w, word >> 8);
+   write_byte(w, word & 0xFF);
+}
+
+static void write_marker(writer *w, unsigned int marker) {
+   write_byte(w, 0xFF);
+   write_byte(w, marker);
+}
+
+/* Append the low length bits of value to the entropy coded data, stuffing
+ * a zero after any 0xFF byte */
+static void write_bits(writer *w, uint32_t value, unsigned int length) {
+   w->bits      = (w->bits << length) | (value & ((1u << length) - 1));
+   w->num_bits += length;
+   while (w->num_bits >= 8) {
+      unsigned int byte = (w->bits >> (w->num_bits - 8)) & 0xFF;
+      write_byte(w, byte);
+      if (byte == 0xFF) {
+         write_byte(w, 0);
+      }
+      w->num_bits -= 8;
+   }
+}
+
+/* Pad to a byte boundary with one bits */
+static void flush_bits(writer *w) {
+   if (w->num_bits > 0) {
+      write_bits(w, 0x7F, 8 - w->num_bits);
+   }
+   w->bits = 0;
+}
+
+static void build_codes(const huffman_spec *spec, huffman_codes *codes) {
+   unsigned int length, n;
+   unsigned int k    = 0;
+   uint16_t     code = 0;
+   memset(codes, 0, sizeof(*codes));
+   for (length = 1; length <= 16; length++) {
+      for (n = 0; n < spec->bits[length - 1]; n++) {
+         codes->code[spec->values[k]]   = code;
+         codes->length[spec->values[k]] = (unsigned char) length;
+         code += 1;
+         k    += 1;
+      }
+      code <<= 1;
+   }
+}
+
+/* The decoder wants a JFIF header straight after the SOI */
+static void write_jfif(writer *w) {
+   static const char identifier[] = "JFIF";
+   size_t            i;
+   write_marker(w, MARKER_APP0);
+   write_word(w, 16);
+   for (i = 0; i < sizeof(identifier); i++) {
+      write_byte(w, (unsigned char) identifier[i]);
+   }
+   /* Version 1.01, no units, a 1:1 pixel aspect ratio and no thumbnail */
+   write_word(w, 0x0101);
+   write_byte(w, 0);
+   write_word(w, 1);
+   write_word(w, 1);
+   write_byte(w, 0);
+   write_byte(w, 0);
+}
+
+static void write_dqt(writer *w, unsigned int id, const uint16_t table[BLOCK_SAMPLES]) {
+   unsigned int k;
+   write_marker(w, MARKER_DQT);
+   write_word(w, 2 + 1 + BLOCK_SAMPLES);
+   write_byte(w, id);
+   for (k = 0; k < BLOCK_SAMPLES; k++) {
+      write_byte(w, table[zigzag[k]]);
+   }
+}
+
+static void write_dht(writer *w, unsigned int class_id, const huffman_spec *spec) {
+   unsigned int num_values = 0;
+   unsigned int n;
+   for (n = 0; n < 16; n++) {
+      num_values += spec->bits[n];
+   }
+   write_marker(w, MARKER_DHT);
+   write_word(w, 2 + 1 + 16 + num_values);
+   write_byte(w, class_id);
+   for (n = 0; n < 16; n++) {
+      write_byte(w, spec->bits[n]);
+   }
+   for (n = 0; n < num_values; n++) {
+      write_byte(w, spec->values[n]);
+   }
+}
+
+/* The bits needed for the magnitude of value */
+static unsigned int category(int value) {
+   unsigned int bits      = 0;
+   unsigned int magnitude = (unsigned int) (value < 0 ? -value : value);
+   while (magnitude > 0) {
+      bits      += 1;
+      magnitude >>= 1;
+   }
+   return bits;
+}
+
+static void write_value(writer *w, const huffman_codes *codes, unsigned int symbol, int value, unsigned int bits) {
+   write_bits(w, codes->code[symbol], codes->length[symbol]);
+   if (bits > 0) {
+      write_bits(w, (uint32_t) (value < 0 ? value - 1 : value), bits);
+   }
+}
+
+/* Forward DCT, quantise and entropy code one block of level shifted
+ * samples */
+static void encode_block(writer              *w
+                        ,const float          samples[BLOCK_SAMPLES]
+                        ,const uint16_t       quant[BLOCK_SAMPLES]
+                        ,const huffman_codes *dc
+                        ,const huffman_codes *ac
+                        ,int                 *prev_dc) {
+   float        rows[BLOCK_SAMPLES];
+   int          coeffs[BLOCK_SAMPLES];
+   unsigned int u, v, i, k;
+   unsigned int run = 0;
+   for (v = 0; v < BLOCK_SIDE; v++) {
+      for (u = 0; u < BLOCK_SIDE; u++) {
+         float sum = 0;
+         for (i = 0; i < BLOCK_SIDE; i++) {
+            sum += dct_cos[u][i] * samples[v * BLOCK_SIDE + i];
+         }
+         rows[v * BLOCK_SIDE + u] = sum;
+      }
+   }
+   for (u = 0; u < BLOCK_SIDE; u++) {
+      for (v = 0; v < BLOCK_SIDE; v++) {
+         float sum = 0;
+         for (i = 0; i < BLOCK_SIDE; i++) {
+            sum += dct_cos[v][i] * rows[i * BLOCK_SIDE + u];
+         }
+         coeffs[v * BLOCK_SIDE + u] = (int) lroundf(sum / quant[v * BLOCK_SIDE + u]);
+      }
+   }
+   i = category(coeffs[0] - *prev_dc);
+   write_value(w, dc, i, coeffs[0] - *prev_dc, i);
+   *prev_dc = coeffs[0];
+   for (k = 1; k < BLOCK_SAMPLES; k++) {
+      int value = coeffs[zigzag[k]];
+      if (value == 0) {
+         run += 1;
+         continue;
+      }
+      while (run > 15) {
+         write_value(w, ac, 0xF0, 0, 0);
+         run -= 16;
+      }
+      i = category(value);
+      write_value(w, ac, (run << 4) | i, value, i);
+      run = 0;
+   }
+   if (run > 0) {
+      write_value(w, ac, 0x00, 0, 0);
+   }
+}
+
+/* Block (bx, by) of component c, averaged down from the pixels it covers
+ * and repeating the edge pixels past the image */
+static void read_block(const bench_image *image
+                      ,const layout      *l
+                      ,unsigned int       c
+                      ,size_t             bx
+                      ,size_t             by
+                      ,float              samples[BLOCK_SAMPLES]) {
+   unsigned int sx = l->h[0] / l->h[c];
+   unsigned int sy = l->v[0] / l->v[c];
+   unsigned int i, j, dx, dy;
+   for (j = 0; j < BLOCK_SIDE; j++) {
+      for (i = 0; i < BLOCK_SIDE; i++) {
+         int sum = 0;
+         for (dy = 0; dy < sy; dy++) {
+            for (dx = 0; dx < sx; dx++) {
+               size_t x = ((bx * BLOCK_SIDE + i) * sx + dx);
+               size_t y = ((by * BLOCK_SIDE + j) * sy + dy);
+               sum += sample_at(image
+                               ,c
+                               ,x < image->width  ? x : image->width  - 1
+                               ,y < image->height ? y : image->height - 1);
+            }
+         }
+         samples[j * BLOCK_SIDE + i] = (float) sum / (sx * sy) - 128;
+      }
+   }
+}
+
+unsigned char *bench_encode(const bench_image *image, size_t *size) {
+   writer        w = {NULL, 0, 0, 0, 0};
+   layout        l;
+   uint16_t      quant[2][BLOCK_SAMPLES];
+   huffman_codes dc_codes[2];
+   huffman_codes ac_codes[2];
+   int           prev_dc[3] = {0, 0, 0};
+   unsigned int  scale = image->quality < 50 ? 5000 / image->quality : 200 - 2 * image->quality;
+   unsigned int  num_tables;
+   unsigned int  c, k;
+   size_t        mcu, num_mcus;
+   assert(image->quality >= 1 && image->quality <= 100);
+   assert(image->width > 0 && image->height > 0 && image->width <= 65535 && image->height <= 65535);
+   init_tables();
+   make_layout(image, &l);
+   num_tables = l.num_components > 1 ? 2 : 1;
+   for (k = 0; k < BLOCK_SAMPLES; k++) {
+      unsigned int luma   = (luma_quant[k]   * scale + 50) / 100;
+      unsigned int chroma = (chroma_quant[k] * scale + 50) / 100;
+      quant[0][k] = (uint16_t) (luma   < 1 ? 1 : (luma   > 255 ? 255 : luma));
+      quant[1][k] = (uint16_t) (chroma < 1 ? 1 : (chroma > 255 ? 255 : chroma));
+   }
+   write_marker(&w, MARKER_SOI);
+   write_jfif(&w);
+   for (k = 0; k < num_tables; k++) {
+      write_dqt(&w, k, quant[k]);
+   }
+   write_marker(&w, MARKER_SOF0);
+   write_word(&w, 2 + 6 + 3 * l.num_components);
+   write_byte(&w, 8);
+   write_word(&w, (unsigned int) image->height);
+   write_word(&w, (unsigned int) image->width);
+   write_byte(&w, l.num_components);
+   for (c = 0; c < l.num_components; c++) {
+      write_byte(&w, c + 1);
+      write_byte(&w, (l.h[c] << 4) | l.v[c]);
+      write_byte(&w, c > 0);
+   }
+   for (k = 0; k < num_tables; k++) {
+      write_dht(&w, 0x00 | k, &dc_specs[k]);
+      write_dht(&w, 0x10 | k, &ac_specs[k]);
+      build_codes(&dc_specs[k], &dc_codes[k]);
+      build_codes(&ac_specs[k], &ac_codes[k]);
+   }
+   if (image->restart) {
+      write_marker(&w, MARKER_DRI);
+      write_word(&w, 4);
+      write_word(&w, (unsigned int) l.mcus_across);
+   }
+   write_marker(&w, MARKER_SOS);
+   write_word(&w, 2 + 1 + 2 * l.num_components + 3);
+   write_byte(&w, l.num_components);
+   for (c = 0; c < l.num_components; c++) {
+      write_byte(&w, c + 1);
+      write_byte(&w, c > 0 ? 0x11 : 0x00);
+   }
+   write_byte(&w, 0);
+   write_byte(&w, 63);
+   write_byte(&w, 0);
+   num_mcus = l.mcus_across * l.mcus_down;
+   for (mcu = 0; mcu < num_mcus; mcu++) {
+      size_t mx = mcu % l.mcus_across;
+      size_t my = mcu / l.mcus_across;
+      if (image->restart && mcu > 0 && mx == 0) {
+         flush_bits(&w);
+         write_marker(&w, MARKER_RST0 + (unsigned int) ((my - 1) % 8));
+         memset(prev_dc, 0, sizeof(prev_dc));
+      }
+      for (c = 0; c < l.num_components; c++) {
+         unsigned int t = c > 0;
+         unsigned int h, v;
+         for (v = 0; v < l.v[c]; v++) {
+            for (h = 0; h < l.h[c]; h++) {
+               float samples[BLOCK_SAMPLES];
+               read_block(image, &l, c, mx * l.h[c] + h, my * l.v[c] + v, samples);
+               encode_block(&w, samples, quant[t], &dc_codes[t], &ac_codes[t], &prev_dc[c]);
+            }
+         }
+      }
+   }
+   flush_bits(&w);
+   write_marker(&w, MARKER_EOI);
+   *size = w.size;
+   return w.data;
+}
@@ -0,0 +1,38 @@
+#ifndef BENCH_ENCODE_H
+#define BENCH_ENCODE_H
+
+#include <stddef.h>
+
+/* A minimal baseline encoder for the benchmark corpus, so that the
+ * benchmark needs nothing but this repository. The images are synthetic
+ * but photo-like: smooth gradients, hard edges, fine texture and noise,
+ * all from a fixed formula, so the same parameters always give the same
+ * bytes. */
+
+typedef enum {
+   BENCH_SAMPLING_444  = 0,
+   BENCH_SAMPLING_422  = 1,
+   BENCH_SAMPLING_420  = 2,
+   BENCH_SAMPLING_GRAY = 3
+} bench_sampling;
+
+typedef struct bench_image_s {
+   size_t         width;
+   size_t         height;
+   bench_sampling sampling;
+   /* With a restart marker after every row of MCUs, or none if 0 */
+   int            restart;
+   /* 1 to 100, as libjpeg scales the example tables */
+   unsigned int   quality;
+} bench_image;
+
+/* Returns the JPEG in a buffer for the caller to free, and its size in
+ * *size */
+unsigned char *bench_encode(const bench_image *image, size_t *size);
+
+/* MCUs in the image, for per-MCU timings */
+size_t         bench_num_mcus(const bench_image *image);
+
+const char    *bench_sampling_name(bench_sampling sampling);
+
+#endif
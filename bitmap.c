@@ -1,34 +1,46 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <assert.h>
 #include "bitmap.h"
 #include "bitmap_internal.h"
+#include "colour.h"
+
+/* Rows are gathered into blocks of about this many bytes for each write */
+#define BITMAP_BLOCK_BYTES    (1024 * 1024)
 
 /* Values for bitmap header */
 #define BITMAP_FILETYPE       19778
 #define BITMAP_RESERVED_BITS  0
-#define BITMAP_PIXEL_OFFSET   0x36
+/* Filled in per image */
+#define BITMAP_PIXEL_OFFSET   0
 #define BITMAP_HEADER_SIZE    4
 
 /* Values for DIB header for bitmap image */
 #define DIB_HEADER_SIZE           11
 #define DIB_NUM_BYTES             0x28
 #define BITMAP_NUM_COLOUR_PLANES  1
-#define BITMAP_BITS_PER_PIXEL    (8 * BITMAP_BYTES_PER_PIXEL)
+#define BITMAP_BITS_PER_PIXEL     0
 #define BITMAP_COMPRESSION        0
 
 #define BITMAP_HORIZ_RESOLUTION   2835
 #define BITMAP_VERT_RESOLUTION    2835
 #define BITMAP_COLOURS_IN_PALETTE 0
+/* Greyscale images are 8-bit, with a palette of every grey */
+#define BITMAP_GRAY_PALETTE_COLOURS 256
+#define BITMAP_PALETTE_ENTRY_BYTES  4
 #define BITMAP_IMPORTANT_COLOURS  0
 
 #define BITMAP_HEADER_TOTAL_BYTES 54
 
 #define BITMAP_HEADER_FILE_SIZE_POS     1
+#define BITMAP_HEADER_PIXEL_OFFSET_POS  3
 #define DIB_HEADER_WIDTH_POS            1
 #define DIB_HEADER_HEIGHT_POS           2
+#define DIB_HEADER_BITS_PER_PIXEL_POS   4
 #define DIB_HEADER_PIXEL_ARRAY_SIZE_POS 6
+#define DIB_HEADER_COLOURS_POS          9
 
 /* Used to index into the bitmap_header and dib_header arrays */
 #define BITMAP_HEADER_VALUE     0
@@ -63,115 +75,349 @@ static const unsigned long dib_header[DIB_HEADER_SIZE][2]
 
 
 /* Padding so each row is a multiple of 4 bytes */
-static unsigned long get_num_padding_bytes(bitmap *b) {
-   assert(b);
-   return (4 - ((unsigned long) b->num_cols * BITMAP_BYTES_PER_PIXEL) % 4) % 4;
+static unsigned long get_num_padding_bytes(size_t num_cols, unsigned int num_channels) {
+   return (4 - ((unsigned long) num_cols * num_channels * BITMAP_BYTES_PER_CHANNEL) % 4) % 4;
 }
 
-/* Total number of bytes (3 for each pixel) 
+/* Total number of bytes (num_channels for each pixel) 
  * plus padding for each row */
-static unsigned long get_pixel_array_size(bitmap *b) {
-   assert(b);
-   return ((unsigned long) b->num_rows * (unsigned long) b->num_cols * BITMAP_BYTES_PER_PIXEL 
-           + (unsigned long) b->num_rows * get_num_padding_bytes(b));
+static unsigned long get_pixel_array_size(size_t num_rows, size_t num_cols, unsigned int num_channels) {
+   return ((unsigned long) num_rows * (unsigned long) num_cols * num_channels * BITMAP_BYTES_PER_CHANNEL
+           + (unsigned long) num_rows * get_num_padding_bytes(num_cols, num_channels));
+}
+
+/* The headers, and the palette if there is one */
+static unsigned long get_header_size(unsigned int num_channels) {
+   if (num_channels == BITMAP_GRAY_CHANNELS) {
+      return BITMAP_HEADER_TOTAL_BYTES + BITMAP_GRAY_PALETTE_COLOURS * BITMAP_PALETTE_ENTRY_BYTES;
+   }
+   return BITMAP_HEADER_TOTAL_BYTES;
 }
 
 /* Total number of bytes in the file */
-static unsigned long get_file_size(bitmap *b) {
-   assert(b);
-   return BITMAP_HEADER_TOTAL_BYTES + get_pixel_array_size(b);
+static unsigned long get_file_size(size_t num_rows, size_t num_cols, unsigned int num_channels) {
+   return get_header_size(num_channels) + get_pixel_array_size(num_rows, num_cols, num_channels);
 }
 
 static int can_fit_in_four_bytes(size_t n) {
    return ((size_t) ((unsigned long) n) == n);
 }
 
-static unsigned int clip(float f) {
-   if (f > 255.0f) {
-      f = 255.0f;
-   } else if (f < 0.0f) {
-      f = 0.0f;
+/* Stores the low num_bytes bytes of value, returning the end */
+static unsigned char *put_little_endian(unsigned char *p, unsigned long value, unsigned long num_bytes) {
+   unsigned long i;
+   for (i = 0; i < num_bytes; i++) {
+      *p++ = (unsigned char) (value >> (8 * i));
    }
-   return (unsigned int) f;
+   return p;
 }
 
-int bitmap_write(bitmap *b, const char *filename) {
-   FILE *fp;
+/* Both headers, little endian, and the palette for greyscale. Rows are
+ * stored bottom up unless top_down is set, which is marked by a negative
+ * height. */
+static void pack_headers(unsigned char *header
+                        ,size_t         num_rows
+                        ,size_t         num_cols
+                        ,unsigned int   num_channels
+                        ,int            top_down) {
    size_t i;
-   size_t bytes_written;
-   if (!filename || !b) {
-      return (-1);
-   }
-   /* If the number of pixels in a row/column doesn't fit in four bytes,
-    * give up. We can then safely cast num_rows and num_cols to unsigned long. */
-   if (  !can_fit_in_four_bytes(b->num_cols) 
-      || !can_fit_in_four_bytes(b->num_rows)) {
-      return (-1);
-   }
-   fp = fopen(filename, "wb");
-   if (!fp) {
-      perror("Error opening file");
-      return (-1);
-   }
    for (i = 0; i < BITMAP_HEADER_SIZE; i++) {
       unsigned long value = bitmap_header[i][BITMAP_HEADER_VALUE];
       if (i == BITMAP_HEADER_FILE_SIZE_POS) {
-         value = get_file_size(b);
-      }
-      bytes_written = fwrite(&value, 1, bitmap_header[i][BITMAP_HEADER_NUM_BYTES], fp);
-      if (bytes_written != bitmap_header[i][BITMAP_HEADER_NUM_BYTES]) {
-         perror("Error writing to bitmap file");
-         fclose(fp);
-         return (-1);
+         value = get_file_size(num_rows, num_cols, num_channels);
+      } else if (i == BITMAP_HEADER_PIXEL_OFFSET_POS) {
+         value = get_header_size(num_channels);
       }
+      header = put_little_endian(header, value, bitmap_header[i][BITMAP_HEADER_NUM_BYTES]);
    }
   
    for (i = 0; i < DIB_HEADER_SIZE; i++) {
       unsigned long value = dib_header[i][BITMAP_HEADER_VALUE];
       if (i == DIB_HEADER_HEIGHT_POS) {
-         value = (unsigned long) b->num_rows;
+         value = top_down ? (unsigned long) -(long) num_rows : (unsigned long) num_rows;
       } else if (i == DIB_HEADER_WIDTH_POS) {
-         value = (unsigned long) b->num_cols;
+         value = (unsigned long) num_cols;
+      } else if (i == DIB_HEADER_BITS_PER_PIXEL_POS) {
+         value = 8 * BITMAP_BYTES_PER_CHANNEL * num_channels;
       } else if (i == DIB_HEADER_PIXEL_ARRAY_SIZE_POS) {
-         value = get_pixel_array_size(b);
+         value = get_pixel_array_size(num_rows, num_cols, num_channels);
+      } else if (i == DIB_HEADER_COLOURS_POS && num_channels == BITMAP_GRAY_CHANNELS) {
+         value = BITMAP_GRAY_PALETTE_COLOURS;
       }
-      bytes_written = fwrite(&value, 1, dib_header[i][BITMAP_HEADER_NUM_BYTES], fp);
-      if (bytes_written != dib_header[i][BITMAP_HEADER_NUM_BYTES]) {
-         perror("Error writing to bitmap file");
-         fclose(fp);
-         return (-1);
+      header = put_little_endian(header, value, dib_header[i][BITMAP_HEADER_NUM_BYTES]);
+   }
+   if (num_channels == BITMAP_GRAY_CHANNELS) {
+      for (i = 0; i < BITMAP_GRAY_PALETTE_COLOURS; i++) {
+         /* Blue, green, red and a reserved zero */
+         *header++ = (unsigned char) i;
+         *header++ = (unsigned char) i;
+         *header++ = (unsigned char) i;
+         *header++ = 0;
       }
    }
+}
 
-   for (i = 0; i < b->num_rows; i++) {
-      size_t j;
-      for (j = 0; j < b->num_cols; j++) {
-         size_t k;
-         for (k = 0; k < BITMAP_NUM_CHANNELS; k++) {
-            unsigned int val = clip(b->samples[k][(b->num_rows - i - 1) * b->num_cols + j]);
-            if (fwrite(&val, 1, 1, fp) != 1) {
-               perror("Error writing to bitmap file");
-               fclose(fp);
-               return (-1);
-            }
-         }
+struct bitmap_writer_s {
+   FILE          *fp;
+   size_t         num_rows;
+   size_t         num_cols;
+   unsigned int   num_channels;
+   /* Bytes of padding after each row */
+   size_t         padding;
+   size_t         rows_written;
+   int            error;
+   /* Rows are packed here with their padding, after the headers to begin
+    * with, and written out a block at a time */
+   unsigned char *block;
+   size_t         block_size;
+   size_t         block_used;
+   colour_kernels colour;
+};
+
+/* Raw files are written top down, with no headers or padding */
+static bitmap_writer *writer_create(const char   *filename
+                                   ,size_t        num_rows
+                                   ,size_t        num_cols
+                                   ,unsigned int  num_channels
+                                   ,bitmap_format format
+                                   ,int           top_down) {
+   bitmap_writer *w;
+   size_t         row_bytes;
+   size_t         header_bytes = format == BITMAP_FORMAT_BMP ? get_header_size(num_channels) : 0;
+   /* If the number of pixels in a row/column doesn't fit in four bytes,
+    * give up. We can then safely cast num_rows and num_cols to unsigned long. */
+   if (  !filename
+      || !can_fit_in_four_bytes(num_cols) 
+      || !can_fit_in_four_bytes(num_rows)) {
+      return NULL;
+   }
+   w = malloc(sizeof(bitmap_writer));
+   assert(w);
+   w->fp = fopen(filename, "wb");
+   if (!w->fp) {
+      perror("Error opening file");
+      free(w);
+      return NULL;
+   }
+   /* Blocks are far bigger than a stdio buffer, so copying them into one
+    * would just be in the way */
+   setvbuf(w->fp, NULL, _IONBF, 0);
+   w->num_rows     = num_rows;
+   w->num_cols     = num_cols;
+   w->num_channels = num_channels;
+   w->padding      = format == BITMAP_FORMAT_BMP ? get_num_padding_bytes(num_cols, num_channels) : 0;
+   row_bytes = num_cols * num_channels * BITMAP_BYTES_PER_CHANNEL + w->padding;
+   w->rows_written = 0;
+   w->error        = 0;
+   w->block_size   = BITMAP_BLOCK_BYTES;
+   if (w->block_size < header_bytes + row_bytes) {
+      w->block_size = header_bytes + row_bytes;
+   }
+   w->block = malloc(w->block_size);
+   assert(w->block);
+   if (format == BITMAP_FORMAT_BMP) {
+      pack_headers(w->block, num_rows, num_cols, num_channels, top_down);
+   }
+   w->block_used = header_bytes;
+   colour_select(&w->colour);
+   return w;
+}
+
+static void flush_block(bitmap_writer *w) {
+   if (!w->error && fwrite(w->block, 1, w->block_used, w->fp) != w->block_used) {
+      perror("Error writing to bitmap file");
+      w->error = 1;
+   }
+   w->block_used = 0;
+}
+
+/* Space for the next row's pixels in the block, with the padding after
+ * them already zeroed, or NULL once there's been an error */
+static unsigned char *next_row(bitmap_writer *w) {
+   size_t         pixel_bytes = w->num_cols * w->num_channels * BITMAP_BYTES_PER_CHANNEL;
+   size_t         padding     = w->padding;
+   unsigned char *row;
+   if (!w->error && w->rows_written == w->num_rows) {
+      printf("Too many rows written to bitmap file\n");
+      w->error = 1;
+   }
+   if (w->error) {
+      return NULL;
+   }
+   if (w->block_used + pixel_bytes + padding > w->block_size) {
+      flush_block(w);
+   }
+   row = w->block + w->block_used;
+   memset(row + pixel_bytes, 0, padding);
+   w->block_used   += pixel_bytes + padding;
+   w->rows_written += 1;
+   return row;
+}
+
+/* Writes any rows still in the block and closes the file. Returns 0 if
+ * every row was written. */
+static int writer_finish(bitmap_writer *w) {
+   int ret;
+   flush_block(w);
+   if (fclose(w->fp) != 0) {
+      perror("Error writing to bitmap file");
+      w->error = 1;
+   }
+   ret = w->error || w->rows_written != w->num_rows ? (-1) : 0;
+   free(w->block);
+   free(w);
+   return ret;
+}
+
+int bitmap_write(bitmap *b, const char *filename) {
+   return bitmap_write_format(b, filename, BITMAP_FORMAT_BMP);
+}
+
+int bitmap_write_format(bitmap *b, const char *filename, bitmap_format format) {
+   bitmap_writer *w;
+   size_t         row_bytes;
+   size_t         i;
+   if (!filename || !b) {
+      return (-1);
+   }
+   w = writer_create(filename, b->num_rows, b->num_cols, b->num_channels, format, 0);
+   if (!w) {
+      return (-1);
+   }
+   row_bytes = b->num_cols * b->num_channels * BITMAP_BYTES_PER_CHANNEL;
+   for (i = 0; i < b->num_rows && !w->error; i++) {
+      /* Bitmap rows are stored bottom up */
+      size_t         row = format == BITMAP_FORMAT_BMP ? b->num_rows - i - 1 : i;
+      unsigned char *out = next_row(w);
+      if (!out) {
+         break;
       }
-      for (j = 0; j < get_num_padding_bytes(b); j++) {
-         if (fputc('\0', fp) != '\0') {
-            perror("Error writing to bitmap file");
-            fclose(fp);
-            return (-1);
-         }
+      if (b->high_precision && b->num_channels == BITMAP_GRAY_CHANNELS) {
+         colour_float_to_gray(&b->samples[0][row * b->num_cols], out, b->num_cols);
+      } else if (b->high_precision) {
+         size_t offset = row * b->num_cols;
+         w->colour.from_float(&b->samples[BITMAP_CHANNEL_B][offset]
+                             ,&b->samples[BITMAP_CHANNEL_G][offset]
+                             ,&b->samples[BITMAP_CHANNEL_R][offset]
+                             ,out
+                             ,b->num_cols);
+      } else {
+         memcpy(out, &b->pixels[row * row_bytes], row_bytes);
       }
    }
-   return 0;
+   return writer_finish(w);
 }
 
+unsigned int bitmap_num_channels(const bitmap *b) {
+   return b->num_channels;
+}
 
-void bitmap_destroy(bitmap *b) {
+bitmap_writer *bitmap_writer_create(const char   *filename
+                                   ,size_t        num_rows
+                                   ,size_t        num_cols
+                                   ,unsigned int  num_channels
+                                   ,bitmap_format format) {
+   /* Top down, so rows can be written as soon as they are decoded */
+   return writer_create(filename, num_rows, num_cols, num_channels, format, 1);
+}
+
+int bitmap_writer_write_rows(bitmap_writer       *w
+                            ,const unsigned char *pixels
+                            ,size_t               stride
+                            ,size_t               num_rows) {
+   size_t row_bytes = w->num_cols * w->num_channels * BITMAP_BYTES_PER_CHANNEL;
    size_t i;
+   for (i = 0; i < num_rows && !w->error; i++) {
+      unsigned char *out = next_row(w);
+      if (out) {
+         memcpy(out, &pixels[i * stride], row_bytes);
+      }
+   }
+   return w->error ? (-1) : 0;
+}
+
+int bitmap_writer_destroy(bitmap_writer *w) {
+   if (w) {
+      return writer_finish(w);
+   }
+   return 0;
+}
+
+static void bitmap_free_buffers(bitmap *b) {
+   size_t i;
+   free(b->pixels);
+   b->pixels = NULL;
    for (i = 0; i < BITMAP_NUM_CHANNELS; i++) {
       free(b->samples[i]);
+      b->samples[i] = NULL;
+   }
+   b->capacity = 0;
+}
+
+bitmap *bitmap_create(size_t num_rows, size_t num_cols, unsigned int num_channels, int high_precision) {
+   size_t i;
+   bitmap *b = malloc(sizeof(bitmap));
+   assert(b);
+   b->high_precision = high_precision;
+   b->pixels         = NULL;
+   for (i = 0; i < BITMAP_NUM_CHANNELS; i++) {
+      b->samples[i] = NULL;
+   }
+   b->capacity       = 0;
+   bitmap_reshape(b, num_rows, num_cols, num_channels, high_precision);
+   return b;
+}
+
+void bitmap_reshape(bitmap *b, size_t num_rows, size_t num_cols, unsigned int num_channels, int high_precision) {
+   size_t needed = high_precision ? num_rows * num_cols
+                                  : num_rows * num_cols * num_channels * BITMAP_BYTES_PER_CHANNEL;
+   size_t i;
+   assert(num_channels == BITMAP_NUM_CHANNELS || num_channels == BITMAP_GRAY_CHANNELS);
+   if (  high_precision != b->high_precision
+      || needed > b->capacity
+      || (high_precision && !b->samples[num_channels - 1])) {
+      bitmap_free_buffers(b);
+      if (high_precision) {
+         for (i = 0; i < num_channels; i++) {
+            b->samples[i] = calloc(needed, sizeof(float));
+            assert(b->samples[i]);
+         }
+      } else {
+         b->pixels = malloc(needed);
+         assert(b->pixels);
+      }
+      b->capacity = needed;
+   } else if (high_precision) {
+      for (i = 0; i < num_channels; i++) {
+         memset(b->samples[i], 0, needed * sizeof(float));
+      }
+   }
+   b->num_rows       = num_rows;
+   b->num_cols       = num_cols;
+   b->num_channels   = num_channels;
+   b->high_precision = high_precision;
+}
+
+void bitmap_init(bitmap *b, size_t num_rows, size_t num_cols, unsigned int num_channels, unsigned char *pixels) {
+   size_t i;
+   b->num_rows       = num_rows;
+   b->num_cols       = num_cols;
+   b->num_channels   = num_channels;
+   b->high_precision = 0;
+   b->pixels         = pixels;
+   for (i = 0; i < BITMAP_NUM_CHANNELS; i++) {
+      b->samples[i] = NULL;
    }
+   b->capacity       = num_rows * num_cols * num_channels * BITMAP_BYTES_PER_CHANNEL;
 }
 
+void bitmap_destroy(bitmap *b) {
+   size_t i;
+   if (b) {
+      for (i = 0; i < BITMAP_NUM_CHANNELS; i++) {
+         free(b->samples[i]);
+      }
+      free(b->pixels);
+   }
+   free(b);
+}
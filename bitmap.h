@@ -1,10 +1,47 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <stddef.h>
+
 typedef struct bitmap_s bitmap;
 
+typedef enum {
+   /* Windows bitmap: 24-bit BGR, or 8-bit with a grey palette for
+    * greyscale images */
+   BITMAP_FORMAT_BMP = 0,
+   /* Just the pixels, top row first without padding: BGR, or luma for
+    * greyscale images */
+   BITMAP_FORMAT_RAW = 1
+} bitmap_format;
+
+/* As BITMAP_FORMAT_BMP */
 int  bitmap_write(bitmap *b, const char *filename);
 
+int  bitmap_write_format(bitmap *b, const char *filename, bitmap_format format);
+
+/* 3 for BGR, or 1 for greyscale */
+unsigned int bitmap_num_channels(const bitmap *b);
+
 void bitmap_destroy(bitmap *b);
 
+/* Writes a bitmap file a few rows at a time, top row first, so the whole
+ * image never has to be in memory */
+typedef struct bitmap_writer_s bitmap_writer;
+
+bitmap_writer *bitmap_writer_create(const char   *filename
+                                   ,size_t        num_rows
+                                   ,size_t        num_cols
+                                   ,unsigned int  num_channels
+                                   ,bitmap_format format);
+
+/* pixels holds num_rows rows of num_channels bytes a pixel, stride bytes
+ * apart */
+int            bitmap_writer_write_rows(bitmap_writer       *w
+                                       ,const unsigned char *pixels
+                                       ,size_t               stride
+                                       ,size_t               num_rows);
+
+/* Returns 0 if every row was written */
+int            bitmap_writer_destroy(bitmap_writer *w);
+
 #endif
@@ -9,13 +9,36 @@
 #define BITMAP_CHANNEL_R          2
 #define BITMAP_NUM_CHANNELS       3
 
+/* Greyscale bitmaps have just the one */
+#define BITMAP_GRAY_CHANNELS      1
+
 #define BITMAP_BYTES_PER_CHANNEL  1
 #define BITMAP_BYTES_PER_PIXEL   (BITMAP_BYTES_PER_CHANNEL * BITMAP_NUM_CHANNELS)
 
 struct bitmap_s {
-   size_t  num_rows;
-   size_t  num_cols;
-   float  *samples[BITMAP_NUM_CHANNELS];
+   size_t         num_rows;
+   size_t         num_cols;
+   /* BITMAP_NUM_CHANNELS, or BITMAP_GRAY_CHANNELS */
+   unsigned int   num_channels;
+   /* Packed pixels, num_channels bytes each in BGR order, top row first */
+   unsigned char *pixels;
+   /* In high precision mode pixels is NULL and these hold one unclamped
+    * plane per channel instead */
+   int            high_precision;
+   float         *samples[BITMAP_NUM_CHANNELS];
+   /* Elements pixels, or each of the planes, has room for */
+   size_t         capacity;
 };
 
+bitmap *bitmap_create(size_t num_rows, size_t num_cols, unsigned int num_channels, int high_precision);
+
+/* Give b a new shape, keeping its memory unless it needs more. The
+ * contents are lost; high precision planes are zeroed as bitmap_create
+ * leaves them. */
+void    bitmap_reshape(bitmap *b, size_t num_rows, size_t num_cols, unsigned int num_channels, int high_precision);
+
+/* An 8-bit bitmap over pixels the caller owns, which is never given to
+ * bitmap_destroy */
+void    bitmap_init(bitmap *b, size_t num_rows, size_t num_cols, unsigned int num_channels, unsigned char *pixels);
+
 #endif
@@ -0,0 +1,151 @@
+#include "colour.h"
+
+/* Pixels the scalar merged kernel works on at once */
+#define COLOUR_MERGED_STRETCH 64
+
+static unsigned char clamp_sample(int32_t x) {
+   if (x < 0) {
+      return 0;
+   } else if (x > 255) {
+      return 255;
+   }
+   return (unsigned char) x;
+}
+
+void colour_select(colour_kernels *kernels) {
+   kernels->convert    = colour_ycc_to_bgr;
+   kernels->merged     = colour_merged_h2_to_bgr;
+   kernels->from_float = colour_float_to_bgr;
+#if CPU_X86
+   /* The merged and float kernels are mostly unpacking and packing, which
+    * AVX2 lanes don't help with, so they stay SSE2 */
+   switch (cpu_simd_level()) {
+      case CPU_SIMD_AVX2:
+         kernels->convert    = colour_ycc_to_bgr_avx2;
+         kernels->merged     = colour_merged_h2_to_bgr_sse2;
+         kernels->from_float = colour_float_to_bgr_sse2;
+         break;
+      case CPU_SIMD_SSE2:
+         kernels->convert    = colour_ycc_to_bgr_sse2;
+         kernels->merged     = colour_merged_h2_to_bgr_sse2;
+         kernels->from_float = colour_float_to_bgr_sse2;
+         break;
+      default:
+         break;
+   }
+#endif
+}
+
+void colour_ycc_to_bgr(const unsigned char *y
+                      ,const unsigned char *cb
+                      ,const unsigned char *cr
+                      ,unsigned char       *out
+                      ,size_t               num_pixels) {
+   size_t i;
+   for (i = 0; i < num_pixels; i++, out += 3) {
+      int32_t luma   = y[i];
+      int32_t blue   = (int32_t) cb[i] - COLOUR_CHROMA_ZERO;
+      int32_t red    = (int32_t) cr[i] - COLOUR_CHROMA_ZERO;
+      out[0] = clamp_sample(luma + ((COLOUR_FIX_B_CB * blue + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS));
+      out[1] = clamp_sample(luma + ((COLOUR_FIX_G_CB * blue
+                                   + COLOUR_FIX_G_CR * red
+                                   + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS));
+      out[2] = clamp_sample(luma + ((COLOUR_FIX_R_CR * red + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS));
+   }
+}
+
+/* One row of colour_merged_h2_to_bgr */
+static void merged_row(const unsigned char *y
+                      ,const int32_t       *terms
+                      ,unsigned char       *out
+                      ,size_t               num_pixels) {
+   size_t i;
+   for (i = 0; i < num_pixels; i++, out += 3) {
+      const int32_t *t = &terms[(i / 2) * 3];
+      out[0] = clamp_sample(y[i] + t[0]);
+      out[1] = clamp_sample(y[i] + t[1]);
+      out[2] = clamp_sample(y[i] + t[2]);
+   }
+}
+
+void colour_merged_h2_to_bgr(const unsigned char *y0
+                            ,const unsigned char *y1
+                            ,const unsigned char *cb
+                            ,const unsigned char *cr
+                            ,unsigned char       *out0
+                            ,unsigned char       *out1
+                            ,size_t               num_pixels) {
+   /* The chroma part of each channel, once per chroma sample, for a
+    * stretch of pixels at a time */
+   int32_t terms[COLOUR_MERGED_STRETCH / 2 * 3];
+   size_t  start;
+   for (start = 0; start < num_pixels; start += COLOUR_MERGED_STRETCH) {
+      size_t num = num_pixels - start < COLOUR_MERGED_STRETCH ? num_pixels - start : COLOUR_MERGED_STRETCH;
+      size_t i;
+      for (i = 0; i < (num + 1) / 2; i++) {
+         int32_t blue = (int32_t) cb[start / 2 + i] - COLOUR_CHROMA_ZERO;
+         int32_t red  = (int32_t) cr[start / 2 + i] - COLOUR_CHROMA_ZERO;
+         terms[i * 3]     = (COLOUR_FIX_B_CB * blue + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS;
+         terms[i * 3 + 1] = (COLOUR_FIX_G_CB * blue + COLOUR_FIX_G_CR * red + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS;
+         terms[i * 3 + 2] = (COLOUR_FIX_R_CR * red + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS;
+      }
+      merged_row(y0 + start, terms, out0 + start * 3, num);
+      if (y1) {
+         merged_row(y1 + start, terms, out1 + start * 3, num);
+      }
+   }
+}
+
+static unsigned char clamp_float(float f) {
+   if (!(f >= 0.0f)) {
+      return 0;
+   } else if (f > 255.0f) {
+      return 255;
+   }
+   return (unsigned char) f;
+}
+
+void colour_float_to_bgr(const float   *b
+                        ,const float   *g
+                        ,const float   *r
+                        ,unsigned char *out
+                        ,size_t         num_pixels) {
+   size_t i;
+   for (i = 0; i < num_pixels; i++, out += 3) {
+      out[0] = clamp_float(b[i]);
+      out[1] = clamp_float(g[i]);
+      out[2] = clamp_float(r[i]);
+   }
+}
+
+void colour_float_to_gray(const float   *y
+                         ,unsigned char *out
+                         ,size_t         num_pixels) {
+   size_t i;
+   for (i = 0; i < num_pixels; i++) {
+      out[i] = clamp_float(y[i]);
+   }
+}
+
+void colour_ycc_to_bgr_float(const float *y
+                            ,const float *cb
+                            ,const float *cr
+                            ,float       *b
+                            ,float       *g
+                            ,float       *r
+                            ,size_t       num_pixels) {
+   size_t i;
+   if (!cb) {
+      for (i = 0; i < num_pixels; i++) {
+         b[i] = g[i] = r[i] = y[i];
+      }
+      return;
+   }
+   for (i = 0; i < num_pixels; i++) {
+      float blue = cb[i] - COLOUR_CHROMA_ZERO;
+      float red  = cr[i] - COLOUR_CHROMA_ZERO;
+      b[i] = y[i] + 1.772f * blue;
+      g[i] = y[i] - 0.34414f * blue - 0.71414f * red;
+      r[i] = y[i] + 1.402f * red;
+   }
+}
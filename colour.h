@@ -0,0 +1,127 @@
+#ifndef COLOUR_H
+#define COLOUR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* Fixed point YCbCr -> RGB, with the same constants and rounding as libjpeg.
+ * With cb and cr centred on zero:
+ *    R = y + (COLOUR_FIX_R_CR * cr + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS
+ *    G = y + (COLOUR_FIX_G_CB * cb + COLOUR_FIX_G_CR * cr + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS
+ *    B = y + (COLOUR_FIX_B_CB * cb + COLOUR_ONE_HALF) >> COLOUR_SCALE_BITS
+ * each clamped to 0..255. */
+#define COLOUR_SCALE_BITS  16
+#define COLOUR_ONE_HALF    ((int32_t) 1 << (COLOUR_SCALE_BITS - 1))
+#define COLOUR_FIX(x)      ((int32_t) ((x) * (1L << COLOUR_SCALE_BITS) + 0.5))
+#define COLOUR_CHROMA_ZERO 128
+
+#define COLOUR_FIX_R_CR    ( COLOUR_FIX(1.40200))
+#define COLOUR_FIX_G_CB    (-COLOUR_FIX(0.34414))
+#define COLOUR_FIX_G_CR    (-COLOUR_FIX(0.71414))
+#define COLOUR_FIX_B_CB    ( COLOUR_FIX(1.77200))
+
+/* Convert num_pixels of Y, Cb and Cr samples, all at the output resolution,
+ * to packed 8-bit BGR */
+typedef void (*colour_kernel)(const unsigned char *y
+                             ,const unsigned char *cb
+                             ,const unsigned char *cr
+                             ,unsigned char       *out
+                             ,size_t               num_pixels);
+
+/* Merged upsampling and colour conversion for chroma at half the
+ * horizontal resolution, which is never replicated in memory. y0 is a row
+ * of num_pixels samples, and pixel i takes its chroma from cb[i / 2] and
+ * cr[i / 2]. When the chroma is at half the vertical resolution too, y1
+ * and out1 are the next row, which shares the chroma, otherwise NULL. */
+typedef void (*colour_merged_kernel)(const unsigned char *y0
+                                    ,const unsigned char *y1
+                                    ,const unsigned char *cb
+                                    ,const unsigned char *cr
+                                    ,unsigned char       *out0
+                                    ,unsigned char       *out1
+                                    ,size_t               num_pixels);
+
+/* High precision planes to packed 8-bit BGR. Each sample is clamped to
+ * 0..255 and truncated, and NaN becomes 0. */
+typedef void (*colour_float_kernel)(const float   *b
+                                   ,const float   *g
+                                   ,const float   *r
+                                   ,unsigned char *out
+                                   ,size_t         num_pixels);
+
+typedef struct colour_kernels_s {
+   colour_kernel        convert;
+   colour_merged_kernel merged;
+   colour_float_kernel  from_float;
+} colour_kernels;
+
+/* The fastest kernels on this CPU. They all give identical output. */
+void colour_select(colour_kernels *kernels);
+
+/* Scalar reference */
+void colour_ycc_to_bgr(const unsigned char *y
+                      ,const unsigned char *cb
+                      ,const unsigned char *cr
+                      ,unsigned char       *out
+                      ,size_t               num_pixels);
+
+void colour_merged_h2_to_bgr(const unsigned char *y0
+                            ,const unsigned char *y1
+                            ,const unsigned char *cb
+                            ,const unsigned char *cr
+                            ,unsigned char       *out0
+                            ,unsigned char       *out1
+                            ,size_t               num_pixels);
+
+void colour_float_to_bgr(const float   *b
+                        ,const float   *g
+                        ,const float   *r
+                        ,unsigned char *out
+                        ,size_t         num_pixels);
+
+#if CPU_X86
+void colour_ycc_to_bgr_sse2(const unsigned char *y
+                           ,const unsigned char *cb
+                           ,const unsigned char *cr
+                           ,unsigned char       *out
+                           ,size_t               num_pixels);
+
+void colour_merged_h2_to_bgr_sse2(const unsigned char *y0
+                                 ,const unsigned char *y1
+                                 ,const unsigned char *cb
+                                 ,const unsigned char *cr
+                                 ,unsigned char       *out0
+                                 ,unsigned char       *out1
+                                 ,size_t               num_pixels);
+
+void colour_float_to_bgr_sse2(const float   *b
+                             ,const float   *g
+                             ,const float   *r
+                             ,unsigned char *out
+                             ,size_t         num_pixels);
+
+void colour_ycc_to_bgr_avx2(const unsigned char *y
+                           ,const unsigned char *cb
+                           ,const unsigned char *cr
+                           ,unsigned char       *out
+                           ,size_t               num_pixels);
+#endif
+
+/* A high precision grey plane to 8-bit, clamped and truncated as
+ * colour_float_to_bgr does */
+void colour_float_to_gray(const float   *y
+                         ,unsigned char *out
+                         ,size_t         num_pixels);
+
+/* High precision versions, into separate unclamped float planes. cb and cr
+ * are NULL for greyscale. */
+void colour_ycc_to_bgr_float(const float *y
+                            ,const float *cb
+                            ,const float *cr
+                            ,float       *b
+                            ,float       *g
+                            ,float       *r
+                            ,size_t       num_pixels);
+
+#endif
@@ -0,0 +1,83 @@
+#include "colour.h"
+
+#if CPU_X86
+
+#include <immintrin.h>
+
+/* AVX2 version of colour_ycc_to_bgr, sixteen pixels at a time, with the
+ * same arithmetic as the SSE2 one and pshufb to pack the pixels. Anything
+ * left over goes to the SSE2 kernel. Compiled with a target attribute so
+ * the rest of the build doesn't need -mavx2. */
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define COLOUR_AVX2_PIXELS 16
+
+#define PAIR(first, second) _mm256_set1_epi32((int) (((uint32_t) (uint16_t) (second) << 16) \
+                                                    | (uint16_t) (first)))
+
+AVX2 static inline __m256i load16(const unsigned char *p) {
+   return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p));
+}
+
+AVX2 static inline __m256i channel(__m256i lo, __m256i hi, __m256i y) {
+   const __m256i half = _mm256_set1_epi32(COLOUR_ONE_HALF);
+   __m256i v;
+   lo = _mm256_srai_epi32(_mm256_add_epi32(lo, half), COLOUR_SCALE_BITS);
+   hi = _mm256_srai_epi32(_mm256_add_epi32(hi, half), COLOUR_SCALE_BITS);
+   v  = _mm256_add_epi16(_mm256_packs_epi32(lo, hi), y);
+   return _mm256_min_epi16(_mm256_max_epi16(v, _mm256_setzero_si256()), _mm256_set1_epi16(255));
+}
+
+AVX2 void colour_ycc_to_bgr_avx2(const unsigned char *y
+                                ,const unsigned char *cb
+                                ,const unsigned char *cr
+                                ,unsigned char       *out
+                                ,size_t               num_pixels) {
+   const __m256i zero   = _mm256_setzero_si256();
+   const __m256i centre = _mm256_set1_epi16(COLOUR_CHROMA_ZERO);
+   const __m256i k_r    = PAIR(0, COLOUR_FIX_R_CR - (1 << COLOUR_SCALE_BITS));
+   const __m256i k_g    = PAIR(COLOUR_FIX_G_CB, COLOUR_FIX_G_CR + (1 << COLOUR_SCALE_BITS));
+   const __m256i k_b    = PAIR(COLOUR_FIX_B_CB - (2 << COLOUR_SCALE_BITS), 0);
+   /* BGR0 BGR0 BGR0 BGR0 -> BGRBGRBGRBGR0000 in each lane */
+   const __m256i pack   = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+                                          ,0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+   size_t i;
+   for (i = 0; i + COLOUR_AVX2_PIXELS <= num_pixels; i += COLOUR_AVX2_PIXELS) {
+      /* Unpacking works within lanes, so lo holds pixels 0-3 and 8-11 and
+       * hi pixels 4-7 and 12-15, which packing puts back in order */
+      __m256i luma  = load16(y + i);
+      __m256i blue  = _mm256_sub_epi16(load16(cb + i), centre);
+      __m256i red   = _mm256_sub_epi16(load16(cr + i), centre);
+      __m256i bc_lo = _mm256_unpacklo_epi16(blue, red);
+      __m256i bc_hi = _mm256_unpackhi_epi16(blue, red);
+      __m256i b_lo  = _mm256_unpacklo_epi16(zero, blue);
+      __m256i b_hi  = _mm256_unpackhi_epi16(zero, blue);
+      __m256i r_lo  = _mm256_unpacklo_epi16(zero, red);
+      __m256i r_hi  = _mm256_unpackhi_epi16(zero, red);
+      __m256i out_b = channel(_mm256_add_epi32(_mm256_madd_epi16(bc_lo, k_b), _mm256_slli_epi32(b_lo, 1))
+                             ,_mm256_add_epi32(_mm256_madd_epi16(bc_hi, k_b), _mm256_slli_epi32(b_hi, 1))
+                             ,luma);
+      __m256i out_g = channel(_mm256_sub_epi32(_mm256_madd_epi16(bc_lo, k_g), r_lo)
+                             ,_mm256_sub_epi32(_mm256_madd_epi16(bc_hi, k_g), r_hi)
+                             ,luma);
+      __m256i out_r = channel(_mm256_add_epi32(_mm256_madd_epi16(bc_lo, k_r), r_lo)
+                             ,_mm256_add_epi32(_mm256_madd_epi16(bc_hi, k_r), r_hi)
+                             ,luma);
+      __m256i bg    = _mm256_or_si256(out_b, _mm256_slli_epi16(out_g, 8));
+      __m256i lo    = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(bg, out_r), pack);
+      __m256i hi    = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(bg, out_r), pack);
+      /* Twelve bytes of pixels 0-3, 4-7, 8-11 and 12-15, joined up into
+       * three full stores */
+      __m128i p0    = _mm256_castsi256_si128(lo);
+      __m128i p1    = _mm256_castsi256_si128(hi);
+      __m128i p2    = _mm256_extracti128_si256(lo, 1);
+      __m128i p3    = _mm256_extracti128_si256(hi, 1);
+      _mm_storeu_si128((__m128i *) (out + i * 3),      _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+      _mm_storeu_si128((__m128i *) (out + i * 3 + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+      _mm_storeu_si128((__m128i *) (out + i * 3 + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+   }
+   colour_ycc_to_bgr_sse2(y + i, cb + i, cr + i, out + i * 3, num_pixels - i);
+}
+
+#endif
@@ -0,0 +1,173 @@
+#include "colour.h"
+
+#if CPU_X86
+
+#include <emmintrin.h>
+
+/* SSE2 versions of colour_ycc_to_bgr, colour_merged_h2_to_bgr and
+ * colour_float_to_bgr, eight chroma samples at a time. The products are
+ * formed with pmaddwd on interleaved cb, cr pairs, and the parts of the
+ * constants that don't fit in 16 bits are added as shifts, so the 32-bit
+ * sums are exactly the scalar ones. */
+
+#define COLOUR_SSE2_PIXELS 8
+
+/* Constant for pmaddwd: first * cb + second * cr */
+#define PAIR(first, second) _mm_set1_epi32((int) (((uint32_t) (uint16_t) (second) << 16) \
+                                                 | (uint16_t) (first)))
+
+/* Eight samples widened to 16 bits */
+static inline __m128i load8(const unsigned char *p) {
+   return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) p), _mm_setzero_si128());
+}
+
+/* (sum + 1/2) >> COLOUR_SCALE_BITS for eight 32-bit sums */
+static inline __m128i descale(__m128i lo, __m128i hi) {
+   const __m128i half = _mm_set1_epi32(COLOUR_ONE_HALF);
+   lo = _mm_srai_epi32(_mm_add_epi32(lo, half), COLOUR_SCALE_BITS);
+   hi = _mm_srai_epi32(_mm_add_epi32(hi, half), COLOUR_SCALE_BITS);
+   return _mm_packs_epi32(lo, hi);
+}
+
+/* The chroma part of each channel for eight pairs of centred cb and cr */
+static inline void chroma_terms(__m128i  blue
+                               ,__m128i  red
+                               ,__m128i *term_b
+                               ,__m128i *term_g
+                               ,__m128i *term_r) {
+   const __m128i zero  = _mm_setzero_si128();
+   const __m128i k_r   = PAIR(0, COLOUR_FIX_R_CR - (1 << COLOUR_SCALE_BITS));
+   const __m128i k_g   = PAIR(COLOUR_FIX_G_CB, COLOUR_FIX_G_CR + (1 << COLOUR_SCALE_BITS));
+   const __m128i k_b   = PAIR(COLOUR_FIX_B_CB - (2 << COLOUR_SCALE_BITS), 0);
+   __m128i       bc_lo = _mm_unpacklo_epi16(blue, red);
+   __m128i       bc_hi = _mm_unpackhi_epi16(blue, red);
+   /* blue and red times 2^COLOUR_SCALE_BITS */
+   __m128i       b_lo  = _mm_unpacklo_epi16(zero, blue);
+   __m128i       b_hi  = _mm_unpackhi_epi16(zero, blue);
+   __m128i       r_lo  = _mm_unpacklo_epi16(zero, red);
+   __m128i       r_hi  = _mm_unpackhi_epi16(zero, red);
+   *term_b = descale(_mm_add_epi32(_mm_madd_epi16(bc_lo, k_b), _mm_slli_epi32(b_lo, 1))
+                    ,_mm_add_epi32(_mm_madd_epi16(bc_hi, k_b), _mm_slli_epi32(b_hi, 1)));
+   *term_g = descale(_mm_sub_epi32(_mm_madd_epi16(bc_lo, k_g), r_lo)
+                    ,_mm_sub_epi32(_mm_madd_epi16(bc_hi, k_g), r_hi));
+   *term_r = descale(_mm_add_epi32(_mm_madd_epi16(bc_lo, k_r), r_lo)
+                    ,_mm_add_epi32(_mm_madd_epi16(bc_hi, k_r), r_hi));
+}
+
+/* Centred chroma samples, widened to 16 bits */
+static inline __m128i load_chroma(const unsigned char *p) {
+   return _mm_sub_epi16(load8(p), _mm_set1_epi16(COLOUR_CHROMA_ZERO));
+}
+
+/* y + term, clamped to 0..255 */
+static inline __m128i channel(__m128i term, __m128i y) {
+   __m128i v = _mm_add_epi16(term, y);
+   return _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), _mm_set1_epi16(255));
+}
+
+/* Four BGR0 pixels to twelve bytes of BGR, with the top four bytes zero.
+ * Without pshufb this drops the zero byte from each pixel in two steps:
+ * within each half, then closing the gap between the halves. */
+static inline __m128i pack_pixels(__m128i pixels) {
+   const __m128i first  = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+   const __m128i second = _mm_set_epi32(0x0000FFFF, (int) 0xFF000000, 0x0000FFFF, (int) 0xFF000000);
+   const __m128i low    = _mm_set_epi32(0, 0, 0x0000FFFF, -1);
+   const __m128i high   = _mm_set_epi32(0, -1, (int) 0xFFFF0000, 0);
+   __m128i pairs = _mm_or_si128(_mm_and_si128(pixels, first)
+                               ,_mm_and_si128(_mm_srli_epi64(pixels, 8), second));
+   return _mm_or_si128(_mm_and_si128(pairs, low)
+                      ,_mm_and_si128(_mm_srli_si128(pairs, 2), high));
+}
+
+/* Write eight pixels of 16-bit channels as 24 bytes of BGR */
+static inline void store8(unsigned char *out, __m128i b, __m128i g, __m128i r) {
+   __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+   __m128i lo = pack_pixels(_mm_unpacklo_epi16(bg, r));
+   __m128i hi = pack_pixels(_mm_unpackhi_epi16(bg, r));
+   _mm_storeu_si128((__m128i *) out, _mm_or_si128(lo, _mm_slli_si128(hi, 12)));
+   _mm_storel_epi64((__m128i *) (out + 16), _mm_srli_si128(hi, 4));
+}
+
+void colour_ycc_to_bgr_sse2(const unsigned char *y
+                           ,const unsigned char *cb
+                           ,const unsigned char *cr
+                           ,unsigned char       *out
+                           ,size_t               num_pixels) {
+   size_t i;
+   for (i = 0; i + COLOUR_SSE2_PIXELS <= num_pixels; i += COLOUR_SSE2_PIXELS) {
+      __m128i luma = load8(y + i);
+      __m128i term_b, term_g, term_r;
+      chroma_terms(load_chroma(cb + i), load_chroma(cr + i), &term_b, &term_g, &term_r);
+      store8(out + i * 3, channel(term_b, luma), channel(term_g, luma), channel(term_r, luma));
+   }
+   colour_ycc_to_bgr(y + i, cb + i, cr + i, out + i * 3, num_pixels - i);
+}
+
+/* One row of colour_merged_h2_to_bgr_sse2, sixteen pixels from terms that
+ * have been doubled up into lo and hi */
+static inline void merged_row(const unsigned char *y
+                             ,unsigned char       *out
+                             ,const __m128i        lo[3]
+                             ,const __m128i        hi[3]) {
+   __m128i luma    = _mm_loadu_si128((const __m128i *) y);
+   __m128i luma_lo = _mm_unpacklo_epi8(luma, _mm_setzero_si128());
+   __m128i luma_hi = _mm_unpackhi_epi8(luma, _mm_setzero_si128());
+   store8(out,      channel(lo[0], luma_lo), channel(lo[1], luma_lo), channel(lo[2], luma_lo));
+   store8(out + 24, channel(hi[0], luma_hi), channel(hi[1], luma_hi), channel(hi[2], luma_hi));
+}
+
+void colour_merged_h2_to_bgr_sse2(const unsigned char *y0
+                                 ,const unsigned char *y1
+                                 ,const unsigned char *cb
+                                 ,const unsigned char *cr
+                                 ,unsigned char       *out0
+                                 ,unsigned char       *out1
+                                 ,size_t               num_pixels) {
+   size_t i;
+   for (i = 0; i + 2 * COLOUR_SSE2_PIXELS <= num_pixels; i += 2 * COLOUR_SSE2_PIXELS) {
+      __m128i terms[3];
+      __m128i lo[3];
+      __m128i hi[3];
+      unsigned int t;
+      chroma_terms(load_chroma(cb + i / 2), load_chroma(cr + i / 2), &terms[0], &terms[1], &terms[2]);
+      for (t = 0; t < 3; t++) {
+         lo[t] = _mm_unpacklo_epi16(terms[t], terms[t]);
+         hi[t] = _mm_unpackhi_epi16(terms[t], terms[t]);
+      }
+      merged_row(y0 + i, out0 + i * 3, lo, hi);
+      if (y1) {
+         merged_row(y1 + i, out1 + i * 3, lo, hi);
+      }
+   }
+   colour_merged_h2_to_bgr(y0 + i
+                          ,y1 ? y1 + i : NULL
+                          ,cb + i / 2
+                          ,cr + i / 2
+                          ,out0 + i * 3
+                          ,out1 ? out1 + i * 3 : NULL
+                          ,num_pixels - i);
+}
+
+/* Eight float samples clamped and truncated to 16 bits. max returns its
+ * second operand for NaN, so that comes out as 0. */
+static inline __m128i load_float8(const float *p) {
+   const __m128  low  = _mm_setzero_ps();
+   const __m128  high = _mm_set1_ps(255.0f);
+   __m128i lo = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p),     low), high));
+   __m128i hi = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p + 4), low), high));
+   return _mm_packs_epi32(lo, hi);
+}
+
+void colour_float_to_bgr_sse2(const float   *b
+                             ,const float   *g
+                             ,const float   *r
+                             ,unsigned char *out
+                             ,size_t         num_pixels) {
+   size_t i;
+   for (i = 0; i + COLOUR_SSE2_PIXELS <= num_pixels; i += COLOUR_SSE2_PIXELS) {
+      store8(out + i * 3, load_float8(b + i), load_float8(g + i), load_float8(r + i));
+   }
+   colour_float_to_bgr(b + i, g + i, r + i, out + i * 3, num_pixels - i);
+}
+
+#endif
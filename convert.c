@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 #include "convert.h"
 #include "jpeg.h"
 #include "dct.h"
@@ -8,212 +11,1241 @@
 #include "bitmap.h"
 #include "bitmap_internal.h"
 #include "scan_start.h"
+#include "jpeg_stream_internal.h"
+#include "cpu.h"
+#include "colour.h"
+#include "upsample.h"
+#include "convert_internal.h"
 
-static float contribution(unsigned int bitmap_channel, component_id component, float value);
-
-typedef struct scale_s {
-   float factor;
-   float offset;
-} scale;
-
-static const scale y_to_rgb[BITMAP_NUM_CHANNELS]  
-                                    = {{ 1.0f,        0.0f}
-                                      ,{ 1.0f,        0.0f}
-                                      ,{ 1.0f,        0.0f}};
-static const scale cb_to_rgb[BITMAP_NUM_CHANNELS] 
-                                    = {{ 1.772f,   -128.0f}
-                                      ,{-0.34414f, -128.0f}
-                                      ,{ 0.0f,        0.0f}}; 
-static const scale cr_to_rgb[BITMAP_NUM_CHANNELS] 
-                                    = {{ 0.0f,        0.0f}
-                                      ,{-0.71414f, -128.0f}
-                                      ,{ 1.402f,   -128.0f}}; 
-
-static const scale *ycbcr_to_rgb[NUM_COMPONENTS] = {y_to_rgb, cb_to_rgb, cr_to_rgb};
-
-
-static float contribution(unsigned int bitmap_channel
-                         ,component_id component
-                         ,float        value) {
-   scale s = ycbcr_to_rgb[component - 1][bitmap_channel];
-   return (value + s.offset) * s.factor;
-} 
-
-static int read_data_unit(const jpeg *j
-                         ,component *c
-                         ,int chunk[JPEG_CHUNK_NUM_SAMPLES]);
-
-static int convert_mcu(const jpeg *j, bitmap *b, int restart, int row, int col);
-static void write_pixels_to_bitmap(float pixels[JPEG_CHUNK_SIDE_LENGTH][JPEG_CHUNK_SIDE_LENGTH]
-                                  ,const jpeg *j
-                                  ,component *component 
-                                  ,unsigned int row
-                                  ,unsigned int col
-                                  ,unsigned int h
-                                  ,unsigned int v
-                                  ,bitmap *b);
-
-
-bitmap *jpeg_to_bitmap(const jpeg *j) {
-   jpeg_stream *stream;
-   bitmap *b = malloc(sizeof(bitmap));
-   int error = 0;
-   int done = 0;
-   unsigned int i;
-   unsigned int row = 0;
-   unsigned int col = 0;
-   size_t mcus_read = 0;
-   int restart = 0;
+/* A run of whole restart intervals, decoded by one thread */
+typedef struct convert_job_s {
+   convert_state *state;
+   size_t         first_mcu;
+   size_t         num_mcus;
+   int            error;
+} convert_job;
+
+/* Rows of MCUs to upsample from the planes, by one thread */
+typedef struct finish_job_s {
+   convert_state *state;
+   size_t         end_row;
+} finish_job;
+
+static unsigned char clamp_sample(int32_t x) {
+   if (x < 0) {
+      return 0;
+   } else if (x > 255) {
+      return 255;
+   }
+   return (unsigned char) x;
+}
+
+static int  read_data_unit(convert_state            *state
+                          ,const convert_block_plan *block
+                          ,int16_t                   coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                          ,unsigned int             *last_nonzero);
+static int  skip_data_unit(convert_state *state, const convert_block_plan *block);
+static void plan_mcu(convert_state *state);
+static int  decode_mcus(convert_state *state, size_t first_mcu, size_t num_mcus, int finish_rows);
+static int  emit_rows(convert_state *state);
+static int  decode_restart_intervals(const jpeg            *j
+                                    ,const convert_options *options
+                                    ,bitmap                *b
+                                    ,convert_planes        *planes
+                                    ,unsigned int           num_threads
+                                    ,int                   *error);
+static void upsample_mcu_row(convert_state *state, size_t mcu_row);
+static int  has_scan(const jpeg *j);
+static int  has_tables(const jpeg *j);
+static int  convert_mcu(convert_state *state, size_t mcu);
+static int  skip_mcu(convert_state *state);
+
+size_t convert_num_mcus(const jpeg *j) {
+   unsigned int mcu_height = j->frame->highest_sampling_factor_vertical * JPEG_CHUNK_SIDE_LENGTH;
+   size_t mcu_rows = (j->frame->num_lines + mcu_height - 1) / mcu_height;
+   return convert_mcus_per_row(j) * mcu_rows;
+}
+
+size_t convert_mcus_per_row(const jpeg *j) {
+   unsigned int mcu_width = j->frame->highest_sampling_factor_horizontal * JPEG_CHUNK_SIDE_LENGTH;
+   return (j->frame->samples_per_line + mcu_width - 1) / mcu_width;
+}
+
+size_t convert_num_mcus_needed(const jpeg *j, const convert_options *options) {
+   unsigned int mcu_height = j->frame->highest_sampling_factor_vertical * (JPEG_CHUNK_SIDE_LENGTH / options->scale_denom);
+   size_t       total      = convert_num_mcus(j);
+   size_t       mcu_rows;
+   size_t       needed;
+   convert_rect rect;
+   convert_output_rect(j, options, &rect);
+   mcu_rows = (rect.row + rect.num_rows + mcu_height - 1) / mcu_height;
+   if (convert_fancy_upsampling(j, options)) {
+      mcu_rows += 1;
+   }
+   needed = mcu_rows * convert_mcus_per_row(j);
+   return needed < total ? needed : total;
+}
+
+/* Output side of a component's blocks. When scaled, subsampled components
+ * get bigger blocks than the output so they need less upsampling, up to
+ * the full 8. */
+static unsigned int component_block_side(const jpeg *j, const convert_options *options, unsigned int c) {
+   const frame     *f         = j->frame;
+   const component *component = &f->components[c];
+   unsigned int     across    = f->highest_sampling_factor_horizontal / component->sampling_factor_horizontal;
+   unsigned int     down      = f->highest_sampling_factor_vertical   / component->sampling_factor_vertical;
+   unsigned int     side      = (JPEG_CHUNK_SIDE_LENGTH / options->scale_denom) * (across < down ? across : down);
+   return side < JPEG_CHUNK_SIDE_LENGTH ? side : JPEG_CHUNK_SIDE_LENGTH;
+}
+
+int convert_fancy_upsampling(const jpeg *j, const convert_options *options) {
+   const frame *f = j->frame;
+   unsigned int block_side = JPEG_CHUNK_SIDE_LENGTH / options->scale_denom;
+   unsigned int c;
+   int          subsampled = 0;
+   /* Like libjpeg, blocks of a single sample are just replicated */
+   if (   options->upsampling != JPEG_UPSAMPLE_FANCY
+       || options->high_precision
+       || f->num_components != NUM_COMPONENTS
+       || block_side == 1) {
+      return 0;
+   }
+   for (c = 0; c < f->num_components; c++) {
+      const component *component = &f->components[c];
+      unsigned int     side      = component_block_side(j, options, c);
+      unsigned int     across    = f->highest_sampling_factor_horizontal * block_side;
+      unsigned int     down      = f->highest_sampling_factor_vertical   * block_side;
+      unsigned int     cols      = component->sampling_factor_horizontal * side;
+      unsigned int     rows      = component->sampling_factor_vertical   * side;
+      if (cols == across && rows == down) {
+         continue;
+      } else if (cols * 2 == across && (rows == down || rows * 2 == down)) {
+         subsampled = 1;
+      } else {
+         return 0;
+      }
+   }
+   return subsampled;
+}
+
+void convert_output_rect(const jpeg *j, const convert_options *options, convert_rect *rect) {
+   if (!j->frame) {
+      memset(rect, 0, sizeof(*rect));
+   } else if (options->crop.num_rows > 0 && options->crop.num_cols > 0) {
+      *rect = options->crop;
+   } else {
+      rect->row      = 0;
+      rect->col      = 0;
+      rect->num_rows = convert_scaled_size(j->frame->num_lines, options);
+      rect->num_cols = convert_scaled_size(j->frame->samples_per_line, options);
+   }
+}
+
+jpeg_dct_method convert_dct_method(const convert_options *options) {
+   if (options->high_precision) {
+      return JPEG_DCT_FLOAT;
+   } else if (options->scale_denom > 1 && options->dct_method == JPEG_DCT_IFAST) {
+      return JPEG_DCT_ISLOW;
+   }
+   return options->dct_method;
+}
+
+size_t convert_scaled_size(size_t n, const convert_options *options) {
+   return (n + options->scale_denom - 1) / options->scale_denom;
+}
+
+void convert_options_init(convert_options *options) {
+   assert(options);
+   options->dct_method     = JPEG_DCT_ISLOW;
+   options->high_precision = 0;
+   options->num_threads    = 0;
+   options->speculative_huffman = 0;
+   options->stats          = NULL;
+   options->scale_denom    = 1;
+   memset(&options->crop, 0, sizeof(options->crop));
+   options->upsampling     = JPEG_UPSAMPLE_NEAREST;
+   options->scan_callback  = NULL;
+   options->scan_user      = NULL;
+}
+
+int jpeg_output_size(const jpeg            *j
+                    ,const convert_options *options
+                    ,size_t                *num_rows
+                    ,size_t                *num_cols) {
+   convert_options defaults;
+   convert_rect    rect;
+   assert(j && num_rows && num_cols);
+   if (!options) {
+      convert_options_init(&defaults);
+      options = &defaults;
+   }
+   convert_output_rect(j, options, &rect);
+   *num_rows = rect.num_rows;
+   *num_cols = rect.num_cols;
+   return !has_scan(j);
+}
+
+bitmap *jpeg_to_bitmap(const jpeg *j, const convert_options *options) {
+   convert_options defaults;
+   int error;
+   if (!options) {
+      convert_options_init(&defaults);
+      options = &defaults;
+   }
+   return convert_image(j, options, NULL, NULL, &error);
+}
+
+int jpeg_decode_rows(const jpeg            *j
+                    ,const convert_options *options
+                    ,convert_row_callback   callback
+                    ,void                  *user) {
+   convert_options row_options;
+   convert_state  *state;
+   convert_planes *planes = NULL;
+   bitmap          strip;
+   size_t          mark;
+   int             error;
+   assert(j && callback);
+   if (options) {
+      row_options = *options;
+   } else {
+      convert_options_init(&row_options);
+   }
+   row_options.high_precision = 0;
+   if (!has_scan(j) || !convert_supported(j, &row_options) || !has_tables(j)) {
+      return 1;
+   }
+   mark  = jpeg_arena_mark(j->arena);
+   state = convert_state_create(j, &row_options, NULL, j->scan_start->stream);
+   bitmap_init(&strip
+              ,state->mcu_height
+              ,state->region.num_cols
+              ,jpeg_output_channels(j)
+              ,jpeg_arena_alloc(j->arena, state->mcu_height * state->region.num_cols * jpeg_output_channels(j)));
+   if (convert_fancy_upsampling(j, &row_options)) {
+      planes = convert_planes_create(j, &row_options, CONVERT_RING_BANDS);
+   }
+   /* The strip starts at the top of the image, even above the region */
+   state->b            = &strip;
+   state->first_row    = 0;
+   state->row_callback = callback;
+   state->row_user     = user;
+   state->planes       = planes;
+   if (j->progressive) {
+      /* The rows can only be rendered once every scan is in */
+      convert_progressive *p = convert_progressive_create(j);
+      error = convert_progressive_decode_scans(p, &row_options, NULL);
+      if (!error) {
+         error = convert_progressive_render_mcus(state, p, 0, convert_num_mcus_needed(j, &row_options), 1);
+      }
+   } else {
+      error = decode_mcus(state, 0, convert_num_mcus_needed(j, &row_options), 1);
+   }
+   convert_state_destroy(state);
+   jpeg_arena_release(j->arena, mark);
+   if (error) {
+      printf("Error reading image.\n");
+   } else {
+      printf("Finished reading image.\n");
+   }
+   return error;
+}
+
+bitmap *convert_image(const jpeg            *j
+                     ,const convert_options *options
+                     ,convert_state         *scratch
+                     ,bitmap                *reuse
+                     ,int                   *error) {
+   bitmap         *b;
+   convert_planes *planes = NULL;
+   unsigned int    num_threads;
+   int             fancy;
+   int             decoded = 0;
+   size_t          mark;
    assert(j);
-   stream = j->scan_start->stream;
-   b->num_cols = j->frame->samples_per_line;
-   b->num_rows = j->frame->num_lines;
-   for (i = 0; i < BITMAP_NUM_CHANNELS; i++) {
-      b->samples[i] = calloc(b->num_rows * b->num_cols, sizeof(float));
-   }
-   while (!done && !error) {
-      int state;
-      if (restart) {
-         jpeg_stream_restart(stream);
-      }
-      error = convert_mcu(j, b, restart, row, col);      
-      col += j->frame->highest_sampling_factor * JPEG_CHUNK_SIDE_LENGTH;
-      if (col >= b->num_cols) {
-         col  = 0;
-         row += j->frame->highest_sampling_factor * JPEG_CHUNK_SIDE_LENGTH;
-      } 
-      mcus_read += 1;
-      restart = 0;
-      if (j->has_restart_interval && mcus_read % j->restart_interval == 0) {
-         restart = 1;
-      }
-      state = jpeg_stream_get_state(stream);
-      if (state == JPEG_STREAM_STATE_OUT_OF_DATA) {
-         printf("Error reading image.\n");
-         error = 1;
-      /* Check for EOI marker */
-      } else if (state == JPEG_STREAM_STATE_EOI) {
-         printf("Finished reading image.\n");
-         done = 1;
-      } 
+   *error = 1;
+   /* The bitmap is the caller's, so comes from the heap */
+   b = convert_create_bitmap(j, options, reuse);
+   if (!b) {
+      return NULL;
+   }
+   mark = jpeg_arena_mark(j->arena);
+   if (j->progressive) {
+      convert_progressive *p = convert_progressive_create(j);
+      *error = convert_progressive_decode_scans(p, options, b);
+      /* Whatever did decode is still worth having */
+      convert_progressive_render(p, options, b);
+      decoded = 1;
+   }
+   num_threads = options->num_threads ? options->num_threads : cpu_num_cores();
+   fancy       = convert_fancy_upsampling(j, options);
+   if (!decoded && num_threads >= 2 && (j->has_restart_interval || options->speculative_huffman)) {
+      /* Threads finish MCUs in any order, so the planes hold them all */
+      if (fancy) {
+         planes = convert_planes_create(j, options, convert_num_mcus_needed(j, options) / convert_mcus_per_row(j));
+      }
+      decoded = j->has_restart_interval
+              ? decode_restart_intervals(j, options, b, planes, num_threads, error)
+              : convert_decode_speculative(j, options, b, planes, num_threads, error);
+      if (decoded && planes) {
+         convert_finish_rows_parallel(j, options, b, planes, num_threads);
+      }
+   }
+   if (!decoded) {
+      convert_state *state = scratch ? scratch : convert_state_create(j, options, b, j->scan_start->stream);
+      if (scratch) {
+         convert_state_init(scratch, j, options, b, j->scan_start->stream);
+      }
+      if (fancy && !planes) {
+         planes = convert_planes_create(j, options, CONVERT_RING_BANDS);
+      }
+      state->planes = planes;
+      *error = decode_mcus(state, 0, convert_num_mcus_needed(j, options), 1);
+      if (scratch) {
+         convert_state_flush_stats(scratch);
+      } else {
+         convert_state_destroy(state);
+      }
+   }
+   jpeg_arena_release(j->arena, mark);
+   if (*error) {
+      printf("Error reading image.\n");
+   } else {
+      printf("Finished reading image.\n");
    }
    return b;
 }
 
-static int convert_mcu(const jpeg *j, bitmap *b, int restart, int row, int col) {
+/* The headers were parsed as far as the first scan */
+static int has_scan(const jpeg *j) {
+   if (!j->frame || !j->scan_start) {
+      printf("Image has no frame or scan that can be decoded\n");
+      return 0;
+   }
+   return 1;
+}
+
+/* The tables were parsed along with the headers, which a probe doesn't do,
+ * so only a decode checks for them */
+static int has_tables(const jpeg *j) {
    unsigned int c;
-   int error = 0;
-   for (c = 0; c < j->frame->num_components && !error; c++) {
-      unsigned int v;
-      component *component = &j->frame->components[c];
-      if (restart) {
-         component->prev_dc_coeff = 0;
-      }
-      for (v = 0; v < component->sampling_factor_vertical && !error; v++) {
-         unsigned int h;
-         for (h = 0; h < component->sampling_factor_horizontal && !error; h++) {
-            int chunk[JPEG_CHUNK_NUM_SAMPLES];
-            float   pixels[JPEG_CHUNK_SIDE_LENGTH][JPEG_CHUNK_SIDE_LENGTH];
-            error = read_data_unit(j, component, chunk);
-            if (!error) {
-               qtable_dequantise(j->qtables[component->qtable_id], chunk);
-               dct_inverse(chunk, pixels);
-               write_pixels_to_bitmap(pixels, j, component, row, col, h, v, b);
-            }
+   for (c = 0; c < j->frame->num_components; c++) {
+      const component *component = &j->frame->components[c];
+      if (component->qtable_id >= JPEG_MAX_QTABLES || !j->qtables[component->qtable_id]) {
+         printf("No quantisation table for component %u\n", c);
+         return 0;
+      }
+      /* A progressive image's scans bring their own */
+      if (   !j->progressive
+          && (   !htable_get_table(j->htables, HTABLE_TYPE_DC, component->dc_htable_id)
+              || !htable_get_table(j->htables, HTABLE_TYPE_AC, component->ac_htable_id))) {
+         printf("No huffman table for component %u\n", c);
+         return 0;
+      }
+   }
+   return 1;
+}
+
+int convert_supported(const jpeg *j, const convert_options *options) {
+   unsigned int c;
+   if (   options->scale_denom != 1 && options->scale_denom != 2
+       && options->scale_denom != 4 && options->scale_denom != 8) {
+      printf("Unsupported scale 1/%u\n", options->scale_denom);
+      return 0;
+   }
+   if (j->frame->num_lines == 0 || j->frame->samples_per_line == 0) {
+      printf("Unsupported image size %ux%u\n", j->frame->samples_per_line, j->frame->num_lines);
+      return 0;
+   }
+   if (j->frame->num_components != 1 && j->frame->num_components != NUM_COMPONENTS) {
+      printf("Unsupported number of components %u\n", j->frame->num_components);
+      return 0;
+   }
+   for (c = 0; c < j->frame->num_components; c++) {
+      if (   j->frame->components[c].sampling_factor_horizontal == 0
+          || j->frame->components[c].sampling_factor_vertical   == 0) {
+         printf("Invalid sampling factor of 0\n");
+         return 0;
+      }
+   }
+   if (   j->frame->highest_sampling_factor_horizontal > CONVERT_MAX_SAMPLING_FACTOR
+       || j->frame->highest_sampling_factor_vertical   > CONVERT_MAX_SAMPLING_FACTOR) {
+      printf("Unsupported sampling factors %ux%u\n"
+            ,j->frame->highest_sampling_factor_horizontal
+            ,j->frame->highest_sampling_factor_vertical);
+      return 0;
+   }
+   if (options->crop.num_rows > 0 && options->crop.num_cols > 0) {
+      const convert_rect *crop = &options->crop;
+      size_t num_rows = convert_scaled_size(j->frame->num_lines, options);
+      size_t num_cols = convert_scaled_size(j->frame->samples_per_line, options);
+      if (   crop->row >= num_rows || crop->num_rows > num_rows - crop->row
+          || crop->col >= num_cols || crop->num_cols > num_cols - crop->col) {
+         printf("Crop rectangle is outside the %zux%zu image\n", num_cols, num_rows);
+         return 0;
+      }
+   }
+   if (options->high_precision && options->upsampling == JPEG_UPSAMPLE_FANCY) {
+      /* Only an error if fancy upsampling would have had something to do */
+      convert_options integer = *options;
+      integer.high_precision = 0;
+      if (convert_fancy_upsampling(j, &integer)) {
+         printf("Fancy upsampling is not supported with high precision output\n");
+         return 0;
+      }
+   }
+   return 1;
+}
+
+bitmap *convert_create_bitmap(const jpeg *j, const convert_options *options, bitmap *reuse) {
+   convert_rect rect;
+   if (!has_scan(j) || !convert_supported(j, options) || !has_tables(j)) {
+      return NULL;
+   }
+   convert_output_rect(j, options, &rect);
+   if (reuse) {
+      bitmap_reshape(reuse, rect.num_rows, rect.num_cols, jpeg_output_channels(j), options->high_precision);
+      return reuse;
+   }
+   return bitmap_create(rect.num_rows, rect.num_cols, jpeg_output_channels(j), options->high_precision);
+}
+
+unsigned int jpeg_output_channels(const jpeg *j) {
+   return j->frame && j->frame->num_components == 1 ? BITMAP_GRAY_CHANNELS : BITMAP_NUM_CHANNELS;
+}
+
+convert_state *convert_state_create(const jpeg            *j
+                                   ,const convert_options *options
+                                   ,bitmap                *b
+                                   ,jpeg_stream           *stream) {
+   convert_state *state = jpeg_arena_alloc(j->arena, sizeof(convert_state));
+   convert_state_init(state, j, options, b, stream);
+   return state;
+}
+
+void convert_state_init(convert_state         *state
+                       ,const jpeg            *j
+                       ,const convert_options *options
+                       ,bitmap                *b
+                       ,jpeg_stream           *stream) {
+   unsigned int c;
+   state->j          = j;
+   state->options    = options;
+   state->dct_method = convert_dct_method(options);
+   colour_select(&state->colour);
+   state->block_side = JPEG_CHUNK_SIDE_LENGTH / options->scale_denom;
+   state->mcu_width  = j->frame->highest_sampling_factor_horizontal * state->block_side;
+   state->mcu_height = j->frame->highest_sampling_factor_vertical   * state->block_side;
+   convert_output_rect(j, options, &state->region);
+   state->b          = b;
+   state->first_row  = state->region.row;
+   state->first_col  = state->region.col;
+   state->row_callback = NULL;
+   state->row_user   = NULL;
+   state->planes     = NULL;
+   state->mcu_rows_finished = 0;
+   state->stream     = stream;
+   memset(state->prev_dc_coeff, 0, sizeof(state->prev_dc_coeff));
+   memset(&state->stats, 0, sizeof(state->stats));
+   for (c = 0; c < j->frame->num_components; c++) {
+      const component *component = &j->frame->components[c];
+      mcu_buffer      *buffer    = &state->mcu[c];
+      buffer->block_side = component_block_side(j, options, c);
+      buffer->cols       = component->sampling_factor_horizontal * buffer->block_side;
+      buffer->rows       = component->sampling_factor_vertical   * buffer->block_side;
+      buffer->stride     = buffer->cols;
+      dct_select(state->dct_method, buffer->block_side, buffer->idct, buffer->idct_counted);
+   }
+   plan_mcu(state);
+   state->merged_v = 0;
+   if (   j->frame->num_components == NUM_COMPONENTS
+       && state->mcu[0].cols == state->mcu_width
+       && state->mcu[0].rows == state->mcu_height
+       && state->mcu[1].cols == state->mcu[2].cols
+       && state->mcu[1].rows == state->mcu[2].rows
+       && state->mcu[1].cols * 2 == state->mcu_width) {
+      if (state->mcu[1].rows == state->mcu_height) {
+         state->merged_v = 1;
+      } else if (state->mcu[1].rows * 2 == state->mcu_height) {
+         state->merged_v = 2;
+      }
+   }
+}
+
+/* Decode the blocks of an MCU into the MCU buffers. The common layouts get
+ * their own copy with a fixed number of blocks, which the compiler can
+ * unroll, and anything else takes the plan's count. */
+#define DECODE_BLOCKS(name, count)                                        \
+   static int name(convert_state *state) {                                \
+      unsigned int n;                                                     \
+      for (n = 0; n < (count); n++) {                                     \
+         const convert_block_plan *block = &state->blocks[n];             \
+         int16_t      coeffs[JPEG_CHUNK_NUM_SAMPLES];                     \
+         unsigned int last_nonzero;                                       \
+         memset(coeffs, 0, sizeof(coeffs));                               \
+         if (read_data_unit(state, block, coeffs, &last_nonzero)) {       \
+            return 1;                                                     \
+         }                                                                \
+         convert_transform_block(state, block, coeffs, last_nonzero);     \
+      }                                                                   \
+      return 0;                                                           \
+   }
+
+DECODE_BLOCKS(decode_blocks_gray, 1)
+DECODE_BLOCKS(decode_blocks_h1v1, 3)
+DECODE_BLOCKS(decode_blocks_h2v1, 4)
+DECODE_BLOCKS(decode_blocks_h2v2, 6)
+DECODE_BLOCKS(decode_blocks_any,  state->num_blocks)
+
+/* Look up the tables for each block of an MCU, where it goes, and where
+ * each output pixel comes from, so none of it is done per MCU */
+static void plan_mcu(convert_state *state) {
+   const jpeg  *j = state->j;
+   const frame *f = j->frame;
+   unsigned int c, n;
+   state->num_blocks = 0;
+   for (c = 0; c < f->num_components; c++) {
+      const component *component = &f->components[c];
+      const mcu_buffer *buffer   = &state->mcu[c];
+      const htable    *dc_table  = htable_get_table(j->htables, HTABLE_TYPE_DC, component->dc_htable_id);
+      const htable    *ac_table  = htable_get_table(j->htables, HTABLE_TYPE_AC, component->ac_htable_id);
+      const int32_t   *multipliers = qtable_get_multipliers(j->qtables[component->qtable_id], state->dct_method);
+      unsigned int     h, v;
+      for (v = 0; v < component->sampling_factor_vertical; v++) {
+         for (h = 0; h < component->sampling_factor_horizontal; h++) {
+            convert_block_plan *block = &state->blocks[state->num_blocks];
+            block->component   = c;
+            block->h           = h;
+            block->v           = v;
+            block->offset      = v * buffer->block_side * buffer->stride + h * buffer->block_side;
+            block->dc_table    = dc_table;
+            block->ac_table    = ac_table;
+            block->multipliers = multipliers;
+            state->num_blocks += 1;
          }
       }
+      for (n = 0; n < state->mcu_height; n++) {
+         state->row_offset[c][n] = (n * buffer->rows / state->mcu_height) * buffer->stride;
+      }
+      for (n = 0; n < state->mcu_width; n++) {
+         state->col_offset[c][n] = n * buffer->cols / state->mcu_width;
+      }
+   }
+   state->decode_blocks = decode_blocks_any;
+   if (f->num_components == 1) {
+      state->decode_blocks = decode_blocks_gray;
+   } else if (   f->num_components == NUM_COMPONENTS
+              && state->num_blocks == f->components[0].sampling_factor_horizontal
+                                    * f->components[0].sampling_factor_vertical + 2) {
+      /* Luma carries all the sampling, each chroma is one block */
+      const component *luma = &f->components[0];
+      if (luma->sampling_factor_horizontal == 1 && luma->sampling_factor_vertical == 1) {
+         state->decode_blocks = decode_blocks_h1v1;
+      } else if (luma->sampling_factor_horizontal == 2 && luma->sampling_factor_vertical == 1) {
+         state->decode_blocks = decode_blocks_h2v1;
+      } else if (luma->sampling_factor_horizontal == 2 && luma->sampling_factor_vertical == 2) {
+         state->decode_blocks = decode_blocks_h2v2;
+      }
+   }
+}
+
+convert_planes *convert_planes_create(const jpeg *j, const convert_options *options, size_t num_bands) {
+   const frame    *f          = j->frame;
+   convert_planes *planes     = jpeg_arena_alloc(j->arena, sizeof(convert_planes));
+   unsigned int    block_side = JPEG_CHUNK_SIDE_LENGTH / options->scale_denom;
+   unsigned int    mcu_width  = f->highest_sampling_factor_horizontal * block_side;
+   unsigned int    mcu_height = f->highest_sampling_factor_vertical   * block_side;
+   size_t          num_cols   = convert_scaled_size(f->samples_per_line, options);
+   size_t          num_rows   = convert_scaled_size(f->num_lines, options);
+   unsigned int    c;
+   planes->num_bands = num_bands;
+   for (c = 0; c < NUM_COMPONENTS; c++) {
+      planes->samples[c] = NULL;
+   }
+   for (c = 0; c < f->num_components; c++) {
+      const component *component = &f->components[c];
+      unsigned int     side      = component_block_side(j, options, c);
+      unsigned int     cols      = component->sampling_factor_horizontal * side;
+      unsigned int     rows      = component->sampling_factor_vertical   * side;
+      planes->stride[c]    = convert_mcus_per_row(j) * cols;
+      planes->band_rows[c] = rows;
+      planes->num_cols[c]  = (num_cols * cols + mcu_width  - 1) / mcu_width;
+      planes->num_rows[c]  = (num_rows * rows + mcu_height - 1) / mcu_height;
+      planes->samples[c]   = jpeg_arena_alloc(j->arena, planes->stride[c] * rows * num_bands);
+   }
+   return planes;
+}
+
+size_t convert_planes_bytes(const jpeg *j, const convert_options *options, size_t num_bands) {
+   const frame *f     = j->frame;
+   size_t       bytes = sizeof(convert_planes);
+   unsigned int c;
+   for (c = 0; c < f->num_components; c++) {
+      const component *component = &f->components[c];
+      unsigned int     side      = component_block_side(j, options, c);
+      bytes += convert_mcus_per_row(j) * component->sampling_factor_horizontal * side
+             * component->sampling_factor_vertical * side * num_bands;
+   }
+   return bytes;
+}
+
+void convert_state_flush_stats(convert_state *state) {
+   if (state->options->stats) {
+      unsigned int i;
+      for (i = 0; i < CONVERT_NUM_IDCT_PATHS; i++) {
+         state->options->stats->idct_blocks[i] += state->stats.idct_blocks[i];
+      }
+   }
+   memset(&state->stats, 0, sizeof(state->stats));
+}
+
+void convert_state_destroy(convert_state *state) {
+   convert_state_flush_stats(state);
+}
+
+/* Decode MCUs first_mcu onwards from the state's stream, which must be at
+ * the start of first_mcu's data. Stops early at EOI. If finish_rows is set
+ * the state is decoding the whole image on its own, so finishes rows of
+ * MCUs as they are completed. */
+static int decode_mcus(convert_state *state, size_t first_mcu, size_t num_mcus, int finish_rows) {
+   const jpeg  *j = state->j;
+   size_t       mcus_per_row = convert_mcus_per_row(j);
+   size_t       mcu;
+   size_t       rows_done = 0;
+   int          error   = 0;
+   int          done    = 0;
+   int          stopped = 0;
+   for (mcu = first_mcu; mcu < first_mcu + num_mcus && !done && !error; mcu++) {
+      int state_code;
+      if (   j->has_restart_interval
+          && mcu != first_mcu
+          && mcu % j->restart_interval == 0) {
+         jpeg_stream_restart(state->stream);
+         memset(state->prev_dc_coeff, 0, sizeof(state->prev_dc_coeff));
+      }
+      error = convert_decode_mcu(state, mcu);
+      if (error) {
+         printf("Error during huffman decoding\n");
+      } else if (finish_rows && (mcu + 1) % mcus_per_row == 0) {
+         rows_done = (mcu + 1) / mcus_per_row;
+         error = stopped = convert_finish_rows(state, rows_done, 0);
+      }
+      /* The stream may legitimately run dry after the last MCU */
+      if (!error && mcu + 1 < first_mcu + num_mcus) {
+         state_code = jpeg_stream_get_state(state->stream);
+         if (state_code == JPEG_STREAM_STATE_OUT_OF_DATA) {
+            error = 1;
+         } else if (state_code == JPEG_STREAM_STATE_EOI) {
+            done = 1;
+         }
+      }
+   }
+   if (finish_rows && !error) {
+      error = convert_finish_rows(state, rows_done, 1);
+   }
+   return error;
+}
+
+int convert_finish_rows(convert_state *state, size_t num_rows, int final) {
+   size_t end  = num_rows;
+   int    stop = 0;
+   if (state->planes && !final && end > 0) {
+      end--;
+   }
+   for (; state->mcu_rows_finished < end && !stop; state->mcu_rows_finished++) {
+      size_t row = state->mcu_rows_finished;
+      if (state->planes) {
+         if (state->row_callback) {
+            state->first_row = row * state->mcu_height;
+         }
+         upsample_mcu_row(state, row);
+      }
+      if (state->row_callback) {
+         stop = emit_rows(state);
+      }
+   }
+   return stop;
+}
+
+int convert_decode_mcu(convert_state *state, size_t mcu) {
+   if (convert_mcu_visible(state, mcu)) {
+      return convert_mcu(state, mcu);
+   }
+   return skip_mcu(state);
+}
+
+int convert_mcu_visible(const convert_state *state, size_t mcu) {
+   const convert_rect *region   = &state->region;
+   size_t              width    = state->mcu_width;
+   size_t              height   = state->mcu_height;
+   size_t              mcus_per_row = convert_mcus_per_row(state->j);
+   size_t              top      = (mcu / mcus_per_row) * height;
+   size_t              left     = (mcu % mcus_per_row) * width;
+   /* Fancy upsampling reads the chroma of neighbouring MCUs */
+   size_t              margin_v = state->planes ? height : 0;
+   size_t              margin_h = state->planes ? width  : 0;
+   return    top  < region->row + region->num_rows + margin_v && top  + height + margin_v > region->row
+          && left < region->col + region->num_cols + margin_h && left + width  + margin_h > region->col;
+}
+
+/* Hand the rows of the finished strip that are in the region to the row
+ * callback, and move the strip down a row of MCUs. Returns non-zero if the
+ * callback wants to stop. */
+static int emit_rows(convert_state *state) {
+   const convert_rect *region = &state->region;
+   bitmap *strip  = state->b;
+   size_t  stride = strip->num_cols * strip->num_channels * BITMAP_BYTES_PER_CHANNEL;
+   size_t  start  = state->first_row > region->row ? state->first_row : region->row;
+   size_t  end    = state->first_row + strip->num_rows;
+   int     stop   = 0;
+   if (end > region->row + region->num_rows) {
+      end = region->row + region->num_rows;
+   }
+   if (start < end) {
+      stop = state->row_callback(state->row_user
+                                ,strip->pixels + (start - state->first_row) * stride
+                                ,stride
+                                ,start - region->row
+                                ,end - start);
+   }
+   state->first_row += strip->num_rows;
+   return stop;
+}
+
+/* A job for a thread pool, which runs fn the way a thread would */
+typedef struct pool_job_s {
+   void *(*fn)(void *);
+   void  *job;
+} pool_job;
+
+static void pool_job_run(void *arg, unsigned int worker) {
+   pool_job *p = arg;
+   (void) worker;
+   p->fn(p->job);
+}
+
+void convert_run_jobs(const jpeg *j, void *(*fn)(void *), void *jobs, size_t job_size, unsigned int num_jobs) {
+   unsigned char *job = jobs;
+   pthread_t     *threads;
+   int           *started;
+   unsigned int   i;
+   if (j->pool) {
+      pool_job *pool_jobs = jpeg_arena_alloc(j->arena, num_jobs * sizeof(pool_job));
+      for (i = 1; i < num_jobs; i++) {
+         pool_jobs[i].fn  = fn;
+         pool_jobs[i].job = job + i * job_size;
+         thread_pool_submit(j->pool, pool_job_run, &pool_jobs[i]);
+      }
+      fn(job);
+      thread_pool_wait(j->pool);
+      return;
+   }
+   threads = malloc(num_jobs * sizeof(pthread_t));
+   started = malloc(num_jobs * sizeof(int));
+   assert(threads && started);
+   for (i = 1; i < num_jobs; i++) {
+      started[i] = pthread_create(&threads[i], NULL, fn, job + i * job_size) == 0;
+      if (!started[i]) {
+         fn(job + i * job_size);
+      }
+   }
+   fn(job);
+   for (i = 1; i < num_jobs; i++) {
+      if (started[i]) {
+         pthread_join(threads[i], NULL);
+      }
+   }
+   free(started);
+   free(threads);
+}
+
+static void *decode_job(void *arg) {
+   convert_job *job = arg;
+   job->error = decode_mcus(job->state, job->first_mcu, job->num_mcus, 0);
+   return NULL;
+}
+
+/* Restart intervals are independent, so once the RSTn markers have been
+ * found each thread can decode a contiguous run of them straight into the
+ * bitmap. MCUs never overlap, so the threads write disjoint pixels.
+ * Returns 0 without decoding anything if the markers don't match the
+ * frame, leaving the serial decoder to deal with the damage. */
+static int decode_restart_intervals(const jpeg            *j
+                                   ,const convert_options *options
+                                   ,bitmap                *b
+                                   ,convert_planes        *planes
+                                   ,unsigned int           num_threads
+                                   ,int                   *error) {
+   jpeg_stream *stream        = j->scan_start->stream;
+   size_t       total_mcus    = convert_num_mcus_needed(j, options);
+   size_t       num_intervals = (total_mcus + j->restart_interval - 1) / j->restart_interval;
+   size_t      *offsets;
+   convert_job *jobs;
+   unsigned int num_jobs;
+   unsigned int i;
+   if (num_intervals < 2) {
+      return 0;
+   }
+   /* offsets[n] is where interval n starts */
+   offsets = jpeg_arena_alloc(j->arena, num_intervals * sizeof(size_t));
+   offsets[0] = 0;
+   if (jpeg_stream_find_restarts(stream, &offsets[1], num_intervals - 1) < num_intervals - 1) {
+      return 0;
+   }
+   num_jobs = num_threads < num_intervals ? num_threads : (unsigned int) num_intervals;
+   jobs = jpeg_arena_alloc(j->arena, num_jobs * sizeof(convert_job));
+   for (i = 0; i < num_jobs; i++) {
+      size_t       first_interval = i * num_intervals / num_jobs;
+      size_t       end_interval   = (i + 1) * num_intervals / num_jobs;
+      size_t       end_mcu        = end_interval * j->restart_interval;
+      jpeg_stream *job_stream     = stream;
+      if (i > 0) {
+         size_t offset = offsets[first_interval];
+         job_stream = jpeg_arena_alloc(j->arena, sizeof(jpeg_stream));
+         jpeg_stream_init(job_stream, stream->data_size_bytes - offset, stream->data + offset);
+      }
+      jobs[i].first_mcu = first_interval * j->restart_interval;
+      jobs[i].num_mcus  = (end_mcu < total_mcus ? end_mcu : total_mcus) - jobs[i].first_mcu;
+      jobs[i].state     = convert_state_create(j, options, b, job_stream);
+      jobs[i].state->planes = planes;
+      jobs[i].error     = 0;
+   }
+   convert_run_jobs(j, decode_job, jobs, sizeof(convert_job), num_jobs);
+   *error = 0;
+   for (i = 0; i < num_jobs; i++) {
+      *error |= jobs[i].error;
+      convert_state_destroy(jobs[i].state);
+   }
+   return 1;
+}
+
+static void *finish_rows_job(void *arg) {
+   finish_job *job = arg;
+   convert_finish_rows(job->state, job->end_row, 1);
+   return NULL;
+}
+
+void convert_finish_rows_parallel(const jpeg            *j
+                                 ,const convert_options *options
+                                 ,bitmap                *b
+                                 ,convert_planes        *planes
+                                 ,unsigned int           num_threads) {
+   size_t        num_rows = convert_num_mcus_needed(j, options) / convert_mcus_per_row(j);
+   unsigned int  num_jobs = num_threads < num_rows ? num_threads : (unsigned int) num_rows;
+   finish_job   *jobs;
+   unsigned int  i;
+   if (num_jobs == 0) {
+      return;
+   }
+   jobs = jpeg_arena_alloc(j->arena, num_jobs * sizeof(finish_job));
+   for (i = 0; i < num_jobs; i++) {
+      jobs[i].state   = convert_state_create(j, options, b, NULL);
+      jobs[i].state->planes            = planes;
+      jobs[i].state->mcu_rows_finished = i * num_rows / num_jobs;
+      jobs[i].end_row = (i + 1) * num_rows / num_jobs;
+   }
+   convert_run_jobs(j, finish_rows_job, jobs, sizeof(finish_job), num_jobs);
+   for (i = 0; i < num_jobs; i++) {
+      convert_state_destroy(jobs[i].state);
+   }
+}
+
+static int convert_mcu(convert_state *state, size_t mcu) {
+   int error = state->decode_blocks(state);
+   if (!error) {
+      convert_write_mcu(state, mcu);
    }
    return error;
 }
 
-static void write_pixels_to_bitmap(float pixels[JPEG_CHUNK_SIDE_LENGTH][JPEG_CHUNK_SIDE_LENGTH]
-                                  ,const jpeg *j
-                                  ,component *component 
-                                  ,unsigned int row
-                                  ,unsigned int col
-                                  ,unsigned int h
-                                  ,unsigned int v
-                                  ,bitmap *b) {
-   unsigned int n, m;
-   float pixel;
-   for (n = 0; n < (JPEG_CHUNK_SIDE_LENGTH * j->frame->highest_sampling_factor) 
-                    / component->sampling_factor_horizontal; n++) {
-      for (m = 0; m < (JPEG_CHUNK_SIDE_LENGTH * j->frame->highest_sampling_factor) 
-                     / component->sampling_factor_vertical; m++) {
-         pixel = pixels[n * component->sampling_factor_horizontal / j->frame->highest_sampling_factor]
-                       [m * component->sampling_factor_vertical   / j->frame->highest_sampling_factor];
-         unsigned int real_col = col + h * JPEG_CHUNK_SIDE_LENGTH;
-         unsigned int real_row = row + v * JPEG_CHUNK_SIDE_LENGTH;
-         if ((real_row + n) < b->num_rows && (real_col + m) < b->num_cols) {
-            unsigned int channel;
-            for (channel = 0; channel < BITMAP_NUM_CHANNELS; channel++) {
-               b->samples[channel][(real_row + n) * b->num_cols + (real_col + m)] 
-                  += contribution(channel, component->id, pixel);
+/* Entropy decode an MCU outside the region, keeping the DC predictions */
+static int skip_mcu(convert_state *state) {
+   unsigned int n;
+   int error = 0;
+   for (n = 0; n < state->num_blocks && !error; n++) {
+      error = skip_data_unit(state, &state->blocks[n]);
+   }
+   return error;
+}
+
+void convert_transform_block(convert_state            *state
+                            ,const convert_block_plan *block
+                            ,const int16_t             coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                            ,unsigned int              last_nonzero) {
+   mcu_buffer  *buffer = &state->mcu[block->component];
+   unsigned int side   = buffer->block_side;
+   size_t       offset = block->offset;
+   dct_path     path   = dct_path_for(last_nonzero);
+   unsigned int i;
+   if (state->b->high_precision) {
+      state->stats.idct_blocks[path] += 1;
+      dct_inverse_float_scaled(coeffs, dct_path_size(path), side, &buffer->float_samples[offset], buffer->stride);
+   } else if (state->dct_method == JPEG_DCT_FLOAT) {
+      float pixels[JPEG_CHUNK_NUM_SAMPLES];
+      state->stats.idct_blocks[path] += 1;
+      dct_inverse_float_scaled(coeffs, dct_path_size(path), side, pixels, side);
+      for (i = 0; i < side * side; i++) {
+         buffer->samples[offset + (i / side) * buffer->stride + i % side]
+            = clamp_sample((int32_t) (pixels[i] + 0.5f));
+      }
+   } else {
+      state->stats.idct_blocks[buffer->idct_counted[path]] += 1;
+      buffer->idct[path](coeffs, &buffer->samples[offset], buffer->stride);
+   }
+}
+
+/* The range [*from, *to) of the length positions from start that are in
+ * both [lo1, hi1) and [lo2, hi2) */
+static void clip(size_t        start
+                ,unsigned int  length
+                ,size_t        lo1
+                ,size_t        hi1
+                ,size_t        lo2
+                ,size_t        hi2
+                ,unsigned int *from
+                ,unsigned int *to) {
+   size_t lo = lo1 > lo2 ? lo1 : lo2;
+   size_t hi = hi1 < hi2 ? hi1 : hi2;
+   *from = lo > start ? (unsigned int) (lo - start) : 0;
+   *to   = hi < start + length ? (hi > start ? (unsigned int) (hi - start) : 0) : length;
+}
+
+/* Row n of a component's MCU buffer at the output resolution, either in
+ * place or replicated into spare */
+static const unsigned char *component_row(const mcu_buffer *buffer
+                                         ,size_t            row_offset
+                                         ,const size_t     *col_offset
+                                         ,unsigned int      mcu_width
+                                         ,unsigned char    *spare) {
+   const unsigned char *samples = &buffer->samples[row_offset];
+   unsigned int m;
+   if (col_offset[mcu_width - 1] == mcu_width - 1) {
+      return samples;
+   }
+   for (m = 0; m < mcu_width; m++) {
+      spare[m] = samples[col_offset[m]];
+   }
+   return spare;
+}
+
+static const float *component_float_row(const mcu_buffer *buffer
+                                       ,size_t            row_offset
+                                       ,const size_t     *col_offset
+                                       ,unsigned int      mcu_width
+                                       ,float            *spare) {
+   const float *samples = &buffer->float_samples[row_offset];
+   unsigned int m;
+   if (col_offset[mcu_width - 1] == mcu_width - 1) {
+      return samples;
+   }
+   for (m = 0; m < mcu_width; m++) {
+      spare[m] = samples[col_offset[m]];
+   }
+   return spare;
+}
+
+/* Copy a decoded MCU into its place in the planes */
+static void store_mcu(convert_state *state, size_t mcu) {
+   const convert_planes *planes = state->planes;
+   size_t       mcus_per_row = convert_mcus_per_row(state->j);
+   size_t       band = (mcu / mcus_per_row) % planes->num_bands;
+   unsigned int c, n;
+   for (c = 0; c < state->j->frame->num_components; c++) {
+      const mcu_buffer *buffer = &state->mcu[c];
+      unsigned char    *dest   = planes->samples[c]
+                               + band * buffer->rows * planes->stride[c]
+                               + (mcu % mcus_per_row) * buffer->cols;
+      for (n = 0; n < buffer->rows; n++) {
+         memcpy(dest + n * planes->stride[c], &buffer->samples[n * buffer->stride], buffer->cols);
+      }
+   }
+}
+
+/* Rows of 4:2:2 and 4:2:0 MCUs go straight from the MCU buffers through the
+ * merged kernel, two rows at a time for 4:2:0 */
+static void write_merged(convert_state *state
+                        ,size_t         top
+                        ,size_t         left
+                        ,unsigned int   first_n
+                        ,unsigned int   end_n
+                        ,unsigned int   first_m
+                        ,unsigned int   end_m) {
+   const mcu_buffer *luma = &state->mcu[0];
+   bitmap      *b      = state->b;
+   size_t       stride = b->num_cols * BITMAP_BYTES_PER_PIXEL;
+   unsigned int n      = first_n;
+   while (n < end_n) {
+      size_t               pixel = (top + n - state->first_row) * b->num_cols + left + first_m - state->first_col;
+      unsigned char       *out   = &b->pixels[pixel * BITMAP_BYTES_PER_PIXEL];
+      const unsigned char *y     = &luma->samples[n * luma->stride];
+      size_t               chroma = (n / state->merged_v) * state->mcu[1].stride;
+      const unsigned char *cb    = &state->mcu[1].samples[chroma];
+      const unsigned char *cr    = &state->mcu[2].samples[chroma];
+      int                  pair  = state->merged_v == 2 && n % 2 == 0 && n + 1 < end_n;
+      unsigned int         m     = first_m;
+      /* The merged kernel starts on a chroma sample */
+      if (m % 2 == 1) {
+         state->colour.convert(y + m, cb + m / 2, cr + m / 2, out, 1);
+         if (pair) {
+            state->colour.convert(y + luma->stride + m, cb + m / 2, cr + m / 2, out + stride, 1);
+         }
+         out += BITMAP_BYTES_PER_PIXEL;
+         m++;
+      }
+      if (m < end_m) {
+         state->colour.merged(y + m
+                             ,pair ? y + luma->stride + m : NULL
+                             ,cb + m / 2
+                             ,cr + m / 2
+                             ,out
+                             ,pair ? out + stride : NULL
+                             ,end_m - m);
+      }
+      n += pair ? 2 : 1;
+   }
+}
+
+/* Greyscale MCUs are a single block, which is copied row by row */
+static void write_gray(convert_state *state
+                      ,size_t         top
+                      ,size_t         left
+                      ,unsigned int   first_n
+                      ,unsigned int   end_n
+                      ,unsigned int   first_m
+                      ,unsigned int   end_m) {
+   const mcu_buffer *luma = &state->mcu[0];
+   bitmap      *b = state->b;
+   unsigned int n;
+   for (n = first_n; n < end_n; n++) {
+      size_t pixel = (top + n - state->first_row) * b->num_cols + left + first_m - state->first_col;
+      if (b->high_precision) {
+         memcpy(&b->samples[0][pixel], &luma->float_samples[n * luma->stride + first_m], (end_m - first_m) * sizeof(float));
+      } else {
+         memcpy(&b->pixels[pixel], &luma->samples[n * luma->stride + first_m], end_m - first_m);
+      }
+   }
+}
+
+/* Subsampled components are replicated up to the output resolution a row
+ * at a time, and each row goes through the colour converter in one call */
+void convert_write_mcu(convert_state *state, size_t mcu) {
+   const frame        *f      = state->j->frame;
+   const convert_rect *region = &state->region;
+   bitmap      *b = state->b;
+   unsigned int mcu_width  = state->mcu_width;
+   unsigned int mcu_height = state->mcu_height;
+   size_t       mcus_per_row = convert_mcus_per_row(state->j);
+   size_t       top  = (mcu / mcus_per_row) * mcu_height;
+   size_t       left = (mcu % mcus_per_row) * mcu_width;
+   unsigned int first_n, end_n, first_m, end_m;
+   unsigned int n, c;
+   if (state->planes) {
+      store_mcu(state, mcu);
+      return;
+   }
+   clip(top, mcu_height
+       ,region->row, region->row + region->num_rows
+       ,state->first_row, state->first_row + b->num_rows
+       ,&first_n, &end_n);
+   clip(left, mcu_width
+       ,region->col, region->col + region->num_cols
+       ,state->first_col, state->first_col + b->num_cols
+       ,&first_m, &end_m);
+   if (first_m >= end_m) {
+      return;
+   }
+   if (f->num_components == 1) {
+      write_gray(state, top, left, first_n, end_n, first_m, end_m);
+      return;
+   }
+   if (state->merged_v && !b->high_precision) {
+      write_merged(state, top, left, first_n, end_n, first_m, end_m);
+      return;
+   }
+   for (n = first_n; n < end_n; n++) {
+      size_t pixel = (top + n - state->first_row) * b->num_cols + left + first_m - state->first_col;
+      if (b->high_precision) {
+         float        spare[NUM_COMPONENTS][CONVERT_MAX_MCU_SIDE];
+         const float *rows[NUM_COMPONENTS] = {NULL, NULL, NULL};
+         for (c = 0; c < f->num_components; c++) {
+            rows[c] = component_float_row(&state->mcu[c], state->row_offset[c][n], state->col_offset[c], mcu_width, spare[c]) + first_m;
+         }
+         colour_ycc_to_bgr_float(rows[0], rows[1], rows[2]
+                                ,&b->samples[BITMAP_CHANNEL_B][pixel]
+                                ,&b->samples[BITMAP_CHANNEL_G][pixel]
+                                ,&b->samples[BITMAP_CHANNEL_R][pixel]
+                                ,end_m - first_m);
+      } else {
+         unsigned char        spare[NUM_COMPONENTS][CONVERT_MAX_MCU_SIDE];
+         const unsigned char *rows[NUM_COMPONENTS];
+         unsigned char       *out = &b->pixels[pixel * BITMAP_BYTES_PER_PIXEL];
+         for (c = 0; c < f->num_components; c++) {
+            rows[c] = component_row(&state->mcu[c], state->row_offset[c][n], state->col_offset[c], mcu_width, spare[c]) + first_m;
+         }
+         state->colour.convert(rows[0], rows[1], rows[2], out, end_m - first_m);
+      }
+   }
+}
+
+/* Row y of a component's plane, which is clamped to the bottom edge */
+static const unsigned char *plane_row(const convert_planes *planes, unsigned int c, size_t y) {
+   if (y >= planes->num_rows[c]) {
+      y = planes->num_rows[c] - 1;
+   }
+   y %= planes->num_bands * planes->band_rows[c];
+   return planes->samples[c] + y * planes->stride[c];
+}
+
+/* Upsample a row of MCUs from the planes into the bitmap. The rows of
+ * MCUs either side of it must be in the planes too, where there are any.
+ * Each row goes through in pieces small enough to upsample on the stack. */
+static void upsample_mcu_row(convert_state *state, size_t mcu_row) {
+   const convert_planes *planes = state->planes;
+   const convert_rect   *region = &state->region;
+   const frame          *f      = state->j->frame;
+   bitmap        *b     = state->b;
+   size_t         top   = mcu_row * state->mcu_height;
+   unsigned int   first_n, end_n;
+   unsigned char  spare[NUM_COMPONENTS][CONVERT_UPSAMPLE_COLS];
+   unsigned int   n, c;
+   clip(top, state->mcu_height
+       ,region->row, region->row + region->num_rows
+       ,state->first_row, state->first_row + b->num_rows
+       ,&first_n, &end_n);
+   for (n = first_n; n < end_n; n++) {
+      size_t y = top + n;
+      size_t col;
+      for (col = region->col; col < region->col + region->num_cols; col += CONVERT_UPSAMPLE_COLS) {
+         size_t               width = region->col + region->num_cols - col;
+         const unsigned char *rows[NUM_COMPONENTS];
+         unsigned char       *out = &b->pixels[((y - state->first_row) * b->num_cols
+                                                + col - state->first_col) * BITMAP_BYTES_PER_PIXEL];
+         if (width > CONVERT_UPSAMPLE_COLS) {
+            width = CONVERT_UPSAMPLE_COLS;
+         }
+         for (c = 0; c < f->num_components; c++) {
+            unsigned int         fh = state->mcu_width  / state->mcu[c].cols;
+            unsigned int         fv = state->mcu_height / state->mcu[c].rows;
+            size_t               cy = y / fv;
+            const unsigned char *in = plane_row(planes, c, cy);
+            if (fh == 1) {
+               rows[c] = in + col;
+            } else if (fv == 1) {
+               upsample_fancy_h2v1(in, planes->num_cols[c], col, width, spare[c]);
+               rows[c] = spare[c];
+            } else {
+               size_t near = y % 2 == 0 ? (cy > 0 ? cy - 1 : 0) : cy + 1;
+               upsample_fancy_h2v2(in, plane_row(planes, c, near), planes->num_cols[c], col, width, spare[c]);
+               rows[c] = spare[c];
             }
-         } 
+         }
+         state->colour.convert(rows[0], rows[1], rows[2], out, width);
       }
    }
 }
 
-static int read_data_unit(const jpeg *j
-                         ,component *c
-                         ,int chunk[JPEG_CHUNK_NUM_SAMPLES]) {
+int16_t convert_dequantise(int value, int32_t multiplier) {
+   int32_t product = (int32_t) value * multiplier;
+   if (product > INT16_MAX) {
+      product = INT16_MAX;
+   } else if (product < INT16_MIN) {
+      product = INT16_MIN;
+   }
+   return (int16_t) product;
+}
+
+int convert_decode_block(convert_state            *state
+                        ,const convert_block_plan *block
+                        ,int16_t                   coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                        ,int                      *dc_delta
+                        ,unsigned int             *last_nonzero) {
    int status;
    int error = 0;
-   jpeg_stream *stream;
+   const int32_t *multipliers = block->multipliers;
+   jpeg_stream   *stream      = state->stream;
    size_t num_previous_zeros = 0;
-   stream = j->scan_start->stream;
-   /* Read DC coefficient */
-   htable *table = htable_get_table(j->htables
-                                   ,HTABLE_TYPE_DC
-                                   ,c->dc_htable_id);
-   int dc_delta = 0;
    size_t sample = 0;
-   status = htable_decode(stream, table, &dc_delta, &num_previous_zeros);
+   *dc_delta = 0;
+   *last_nonzero = 0;
+   /* Read DC coefficient */
+   status = htable_decode(stream, block->dc_table, dc_delta, &num_previous_zeros);
    if (status == HTABLE_OK || status == HTABLE_END_OF_BLOCK) {
-      c->prev_dc_coeff += dc_delta;
-      chunk[sample] = c->prev_dc_coeff;
       sample += 1;
       /* Read AC coefficients */
       status = HTABLE_OK;
       while (status == HTABLE_OK && sample < JPEG_CHUNK_NUM_SAMPLES) {
          int ac_coeff;
          num_previous_zeros = 0;
-         table = htable_get_table(j->htables
-                                 ,HTABLE_TYPE_AC
-                                 ,c->ac_htable_id);
-         status = htable_decode(stream, table, &ac_coeff, &num_previous_zeros);
+         status = htable_decode(stream, block->ac_table, &ac_coeff, &num_previous_zeros);
          if (status == HTABLE_OK) {
-            unsigned int i;
-            for (i = 0; i < num_previous_zeros; i++) {
-               if ((sample + i) < JPEG_CHUNK_NUM_SAMPLES) {
-                  chunk[sample + i] = 0;
-               } else {
-                  status = HTABLE_ERR_DECODE;
+            /* Skipped coefficients are already zero */
+            size_t next = sample + num_previous_zeros;
+            if (next < JPEG_CHUNK_NUM_SAMPLES) {
+               size_t natural = qtable_natural_order[next];
+               coeffs[natural] = convert_dequantise(ac_coeff, multipliers[natural]);
+               if (ac_coeff != 0) {
+                  *last_nonzero = next;
                }
-            }
-            if (status == HTABLE_OK) {
-               sample += num_previous_zeros;
-               chunk[sample] = ac_coeff;
-               sample += 1;
+               sample = next + 1;
+            } else {
+               status = HTABLE_ERR_DECODE;
             }
          } 
       }
-      /* Fill in zeros at end of block */
-      if (status == HTABLE_END_OF_BLOCK) {
-         while (sample < JPEG_CHUNK_NUM_SAMPLES) {
-            chunk[sample] = 0;
-            sample += 1;
-         }
-      } else if (sample < JPEG_CHUNK_NUM_SAMPLES) {
-         printf("Error during huffman decoding\n");
+      /* The block ends with an end of block code or its 64th coefficient */
+      if (status != HTABLE_END_OF_BLOCK && status != HTABLE_OK) {
          error = 1;
       } 
    } else {
-      printf("Error during huffman decoding\n");
       error = 1;
    }
    return error;
 }
 
+/* Decode the next block of a component, applying DC prediction */
+static int read_data_unit(convert_state            *state
+                         ,const convert_block_plan *block
+                         ,int16_t                   coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                         ,unsigned int             *last_nonzero) {
+   int dc_delta;
+   int error = convert_decode_block(state, block, coeffs, &dc_delta, last_nonzero);
+   if (!error) {
+      state->prev_dc_coeff[block->component] += dc_delta;
+      coeffs[0] = convert_dequantise(state->prev_dc_coeff[block->component], block->multipliers[0]);
+   }
+   return error;
+}
 
+/* Decode the next block of a component without keeping its coefficients,
+ * only following the DC prediction */
+static int skip_data_unit(convert_state *state, const convert_block_plan *block) {
+   jpeg_stream *stream = state->stream;
+   size_t       num_previous_zeros = 0;
+   size_t       sample = 1;
+   int          dc_delta = 0;
+   int          status;
+   status = htable_decode(stream
+                         ,block->dc_table
+                         ,&dc_delta
+                         ,&num_previous_zeros);
+   if (status != HTABLE_OK && status != HTABLE_END_OF_BLOCK) {
+      return 1;
+   }
+   state->prev_dc_coeff[block->component] += dc_delta;
+   status = HTABLE_OK;
+   while (status == HTABLE_OK && sample < JPEG_CHUNK_NUM_SAMPLES) {
+      status = htable_skip(stream
+                          ,block->ac_table
+                          ,&num_previous_zeros);
+      if (status == HTABLE_OK) {
+         size_t next = sample + num_previous_zeros;
+         if (next < JPEG_CHUNK_NUM_SAMPLES) {
+            sample = next + 1;
+         } else {
+            status = HTABLE_ERR_DECODE;
+         }
+      }
+   }
+   /* As convert_decode_block, an end of block code or the 64th coefficient */
+   return status != HTABLE_END_OF_BLOCK && status != HTABLE_OK;
+}
@@ -4,6 +4,122 @@
 #include "bitmap.h"
 #include "jpeg.h"
 
-bitmap *jpeg_to_bitmap(const jpeg   *j);
+#include <stddef.h>
 
-#endif
\ No newline at end of file
+/* Inverse DCT algorithms that can be chosen at decode time */
+typedef enum {
+   /* Accurate fixed point (Loeffler, Ligtenberg and Moschytz) */
+   JPEG_DCT_ISLOW = 0,
+   /* Fast scaled fixed point (Arai, Agui and Nakajima), slightly less accurate */
+   JPEG_DCT_IFAST = 1,
+   /* Floating point reference */
+   JPEG_DCT_FLOAT = 2
+} jpeg_dct_method;
+
+/* How chroma at lower resolution than the image is brought up to it */
+typedef enum {
+   /* Repeat each sample. The fastest, and 4:2:0 and 4:2:2 images are
+    * upsampled and colour converted in one step. */
+   JPEG_UPSAMPLE_NEAREST = 0,
+   /* libjpeg's triangle filter for chroma at half resolution across or
+    * both ways, which is smoother. Samples from neighbouring MCUs are
+    * needed, so a row of MCUs is held back until the next one is decoded.
+    * Other layouts, and high precision mode, repeat samples. */
+   JPEG_UPSAMPLE_FANCY   = 1
+} jpeg_upsample_method;
+
+/* Counts of blocks by which inverse DCT kernel transformed them: DC only,
+ * 2x2 corner, 4x4 corner and full */
+#define CONVERT_NUM_IDCT_PATHS 4
+
+typedef struct convert_stats_s {
+   size_t idct_blocks[CONVERT_NUM_IDCT_PATHS];
+} convert_stats;
+
+/* A rectangle of the output image, in pixels after any scaling */
+typedef struct convert_rect_s {
+   size_t row;
+   size_t col;
+   size_t num_rows;
+   size_t num_cols;
+} convert_rect;
+
+/* Called after each scan of a progressive image with the image as the
+ * scans so far leave it, and the bytes of the file they take up, so that
+ * a first approximation can be shown early. preview is only valid during
+ * the call. Return non-zero to stop. */
+typedef int (*convert_scan_callback)(void   *user
+                                    ,bitmap *preview
+                                    ,size_t  num_scans
+                                    ,size_t  bytes_read);
+
+typedef struct convert_options_s {
+   jpeg_dct_method dct_method;
+   /* Keep the decoded image as float planes, with no rounding or clamping
+    * until the bitmap is written. Always uses the floating point IDCT, and
+    * needs four times as much memory. */
+   int             high_precision;
+   /* Threads to decode with when the image has restart intervals, or 0
+    * for one per core */
+   unsigned int    num_threads;
+   /* Also decode images without restart intervals on num_threads threads,
+    * by guessing where blocks start and checking the guesses line up */
+   int             speculative_huffman;
+   /* If not NULL, counts for the decode are added to this */
+   convert_stats  *stats;
+   /* Decode at 1/scale_denom of full size, which may be 1, 2, 4 or 8,
+    * using smaller IDCTs rather than shrinking the full image */
+   unsigned int    scale_denom;
+   /* If crop has rows and columns, only that part of the image is
+    * decoded and the output is its size. MCUs beside it are only entropy
+    * decoded, and those below it aren't read at all. */
+   convert_rect    crop;
+   /* JPEG_UPSAMPLE_NEAREST unless set. Fancy upsampling of subsampled
+    * images isn't supported with high_precision. */
+   jpeg_upsample_method upsampling;
+   /* If set, progressive images are rendered after every scan for this.
+    * Each render costs about as much as a baseline decode. */
+   convert_scan_callback scan_callback;
+   void                 *scan_user;
+} convert_options;
+
+/* Called with each band of decoded rows, top to bottom. pixels holds
+ * num_rows rows of 8-bit pixels starting at image row first_row, stride
+ * bytes apart, and is only valid during the call. Pixels are BGR, or a
+ * single grey byte for greyscale images. Return non-zero to stop. */
+typedef int (*convert_row_callback)(void                *user
+                                   ,const unsigned char *pixels
+                                   ,size_t               stride
+                                   ,size_t               first_row
+                                   ,size_t               num_rows);
+
+/* Fill in the default options */
+void    convert_options_init(convert_options *options);
+
+/* Size of the image jpeg_to_bitmap would give, after scaling and cropping.
+ * Returns 1, with a size of 0x0, if the headers were cut short before the
+ * frame or first scan */
+int     jpeg_output_size(const jpeg            *j
+                        ,const convert_options *options
+                        ,size_t                *num_rows
+                        ,size_t                *num_cols);
+
+/* Bytes in each output pixel: 1 for greyscale images, which skip colour
+ * conversion, otherwise 3 */
+unsigned int jpeg_output_channels(const jpeg *j);
+
+/* options may be NULL to use the defaults */
+bitmap *jpeg_to_bitmap(const jpeg            *j
+                      ,const convert_options *options);
+
+/* Decode through a buffer one MCU row high rather than a whole bitmap, so
+ * memory use doesn't grow with the image height, except for the
+ * coefficients of a progressive image. Runs on the calling thread, and
+ * high_precision and scan_callback are ignored. Returns 0 if every row was
+ * decoded and the callback never stopped it. */
+int     jpeg_decode_rows(const jpeg            *j
+                        ,const convert_options *options
+                        ,convert_row_callback   callback
+                        ,void                  *user);
+
+#endif
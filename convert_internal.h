@@ -0,0 +1,315 @@
+#ifndef CONVERT_INTERNAL_H
+#define CONVERT_INTERNAL_H
+
+#include <stdint.h>
+#include "colour.h"
+#include "convert.h"
+#include "dct.h"
+#include "jpeg_internal.h"
+#include "jpeg_stream.h"
+
+/* Largest sampling factor the standard allows, which bounds the MCU size */
+#define CONVERT_MAX_SAMPLING_FACTOR 4
+#define CONVERT_MAX_MCU_SIDE       (CONVERT_MAX_SAMPLING_FACTOR * JPEG_CHUNK_SIDE_LENGTH)
+#define CONVERT_MAX_MCU_SAMPLES    (CONVERT_MAX_MCU_SIDE * CONVERT_MAX_MCU_SIDE)
+#define CONVERT_MAX_MCU_BLOCKS     (NUM_COMPONENTS * CONVERT_MAX_SAMPLING_FACTOR * CONVERT_MAX_SAMPLING_FACTOR)
+
+/* Samples for one MCU of each component, at the component's own resolution.
+ * Only one of samples and float_samples is used, depending on whether the
+ * bitmap is in high precision mode. */
+typedef struct mcu_buffer_s {
+   /* Samples along each side of a block. When scaled, subsampled
+    * components get bigger blocks than the output so they need less
+    * replicating, up to the full 8. */
+   unsigned int  block_side;
+   /* Samples in the MCU across and down */
+   unsigned int  cols;
+   unsigned int  rows;
+   dct_kernel    idct[DCT_NUM_PATHS];
+   /* The path each idct kernel is counted under in the stats */
+   dct_path      idct_counted[DCT_NUM_PATHS];
+   size_t        stride;
+   unsigned char samples[CONVERT_MAX_MCU_SAMPLES];
+   float         float_samples[CONVERT_MAX_MCU_SAMPLES];
+} mcu_buffer;
+
+/* A block of an MCU, in decode order, with everything needed to decode it
+ * looked up once for the scan */
+typedef struct convert_block_plan_s {
+   unsigned int   component;
+   /* Blocks across and down in the component's MCU buffer, and the offset
+    * of the block's first sample there */
+   unsigned int   h;
+   unsigned int   v;
+   size_t         offset;
+   const htable  *dc_table;
+   const htable  *ac_table;
+   const int32_t *multipliers;
+} convert_block_plan;
+
+/* Component samples for rows of MCUs, for upsampling that needs samples
+ * from neighbouring MCUs. There are num_bands rows of MCUs, which are
+ * reused in turn, so a ring of three is enough to decode one row while
+ * upsampling the one before. */
+#define CONVERT_RING_BANDS 3
+
+/* Columns upsampled at a time, so the upsampled chroma fits on the stack */
+#define CONVERT_UPSAMPLE_COLS 512
+
+typedef struct convert_planes_s {
+   size_t         num_bands;
+   /* Samples in each row of a plane, and rows in each band */
+   size_t         stride[NUM_COMPONENTS];
+   size_t         band_rows[NUM_COMPONENTS];
+   /* Samples of each component that cover the image, beyond which the
+    * edge is repeated */
+   size_t         num_cols[NUM_COMPONENTS];
+   size_t         num_rows[NUM_COMPONENTS];
+   unsigned char *samples[NUM_COMPONENTS];
+} convert_planes;
+
+/* Everything one thread needs to decode and convert MCUs */
+typedef struct convert_state_s {
+   const jpeg            *j;
+   const convert_options *options;
+   /* The method actually used, see convert_dct_method */
+   jpeg_dct_method        dct_method;
+   colour_kernels         colour;
+   /* Output pixels along each side of a block of the most sampled
+    * component, less than 8 when scaled, and across and down an MCU */
+   unsigned int           block_side;
+   unsigned int           mcu_width;
+   unsigned int           mcu_height;
+   /* If the chroma is at half the horizontal resolution of the output,
+    * and that is all there is to upsampling, its vertical factor (1 or 2)
+    * for the merged kernel, otherwise 0 */
+   unsigned int           merged_v;
+   /* The part of the output image to decode, see convert_output_rect */
+   convert_rect           region;
+   /* b holds the image from first_row and first_col, clipped to region */
+   bitmap                *b;
+   size_t                 first_row;
+   size_t                 first_col;
+   /* If set, b is a strip one MCU row high, which is handed to
+    * row_callback as each row finishes */
+   convert_row_callback   row_callback;
+   void                  *row_user;
+   /* If set, MCUs go into these rather than b, and are upsampled into b a
+    * row of MCUs at a time by convert_finish_rows */
+   convert_planes        *planes;
+   /* Rows of MCUs from the top that are finished in b */
+   size_t                 mcu_rows_finished;
+   /* Entropy decoding state, so that each thread has its own */
+   jpeg_stream           *stream;
+   int                    prev_dc_coeff[NUM_COMPONENTS];
+   convert_stats          stats;
+   /* The blocks of an MCU, and the loop that decodes them, which is
+    * specialised for the common layouts */
+   unsigned int           num_blocks;
+   convert_block_plan     blocks[CONVERT_MAX_MCU_BLOCKS];
+   int                  (*decode_blocks)(struct convert_state_s *state);
+   /* Where each output row and column of an MCU comes from in each
+    * component's MCU buffer */
+   size_t                 row_offset[NUM_COMPONENTS][CONVERT_MAX_MCU_SIDE];
+   size_t                 col_offset[NUM_COMPONENTS][CONVERT_MAX_MCU_SIDE];
+   mcu_buffer             mcu[NUM_COMPONENTS];
+} convert_state;
+
+/* Allocated from the jpeg's arena, so must be called on the thread
+ * decoding it */
+convert_state *convert_state_create(const jpeg            *j
+                                   ,const convert_options *options
+                                   ,bitmap                *b
+                                   ,jpeg_stream           *stream);
+
+/* Point an existing state, which may be uninitialised memory, at a new
+ * image, and plan how its MCUs are decoded */
+void convert_state_init(convert_state         *state
+                       ,const jpeg            *j
+                       ,const convert_options *options
+                       ,bitmap                *b
+                       ,jpeg_stream           *stream);
+
+/* Non-zero if the options ask for fancy upsampling and the image has
+ * chroma it applies to */
+int convert_fancy_upsampling(const jpeg *j, const convert_options *options);
+
+/* Planes for the image, with num_bands rows of MCUs, from the jpeg's arena */
+convert_planes *convert_planes_create(const jpeg *j, const convert_options *options, size_t num_bands);
+/* What convert_planes_create would allocate */
+size_t          convert_planes_bytes(const jpeg *j, const convert_options *options, size_t num_bands);
+
+/* Finish the rows of MCUs from mcu_rows_finished up to num_mcu_rows
+ * decoded, upsampling them from the planes if there are any, and hand them
+ * to the row callback if there is one. Unless final is set, the last row
+ * is held back when upsampling, as it needs the first samples of the next.
+ * Returns non-zero if the callback wants to stop. */
+int convert_finish_rows(convert_state *state, size_t num_mcu_rows, int final);
+
+/* Adds the state's counts to the caller's and clears them, so must be
+ * called on the thread that owns options->stats */
+void convert_state_flush_stats(convert_state *state);
+
+/* Flushes the counts. The memory goes back with the rest of the arena. */
+void convert_state_destroy(convert_state *state);
+
+/* jpeg_to_bitmap, reusing scratch (which may be NULL) for a serial decode
+ * and flushing its counts afterwards, and decoding into reuse if it isn't
+ * NULL. error is set if the image could only be partly decoded. */
+bitmap *convert_image(const jpeg            *j
+                     ,const convert_options *options
+                     ,convert_state         *scratch
+                     ,bitmap                *reuse
+                     ,int                   *error);
+
+/* Returns 0, after saying why, if the image can't be decoded with the
+ * options */
+int convert_supported(const jpeg *j, const convert_options *options);
+
+/* An empty bitmap for the image, or NULL if it can't be decoded. If reuse
+ * isn't NULL it is reshaped and returned rather than making a new one, and
+ * is left alone if the image can't be decoded. */
+bitmap *convert_create_bitmap(const jpeg *j, const convert_options *options, bitmap *reuse);
+
+/* Decode MCU number mcu from the state's stream, which must be at its
+ * start, into the bitmap. MCUs outside the region are only entropy
+ * decoded. Restart markers are left to the caller, and errors are silent. */
+int convert_decode_mcu(convert_state *state, size_t mcu);
+
+/* Non-zero if MCU number mcu has to be decoded: if any of it is inside
+ * the state's region, or with planes if it is next to an MCU that is */
+int convert_mcu_visible(const convert_state *state, size_t mcu);
+
+/* MCUs in the image, including partial ones at the right and bottom */
+size_t convert_num_mcus(const jpeg *j);
+size_t convert_mcus_per_row(const jpeg *j);
+
+/* MCUs from the start of the scan that cover the output rectangle, and
+ * the row after it for fancy upsampling, which stops short of
+ * convert_num_mcus when cropping */
+size_t convert_num_mcus_needed(const jpeg *j, const convert_options *options);
+
+/* The crop rectangle, or the whole scaled image if there isn't one */
+void convert_output_rect(const jpeg *j, const convert_options *options, convert_rect *rect);
+
+/* High precision mode always uses the float IDCT, and ifast has no scaled
+ * kernels so gets islow instead */
+jpeg_dct_method convert_dct_method(const convert_options *options);
+
+/* Output size of a dimension of n samples */
+size_t convert_scaled_size(size_t n, const convert_options *options);
+
+/* Run fn on each of num_jobs jobs of job_size bytes, with the calling
+ * thread taking the first. The others go to j's thread pool if it has one,
+ * otherwise they get a thread each. Returns when all have finished. */
+void convert_run_jobs(const jpeg *j, void *(*fn)(void *), void *jobs, size_t job_size, unsigned int num_jobs);
+
+/* Store a dequantised coefficient, saturating to 16 bits */
+int16_t convert_dequantise(int value, int32_t multiplier);
+
+/* Huffman decode the next block from the state's stream into coeffs,
+ * which must be zeroed beforehand. The AC coefficients are dequantised
+ * into natural order, and coeffs[0] is left for the caller to fill from
+ * dc_delta. last_nonzero gets the zigzag index of the last nonzero AC
+ * coefficient, or 0 if there are none. */
+int convert_decode_block(convert_state            *state
+                        ,const convert_block_plan *block
+                        ,int16_t                   coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                        ,int                      *dc_delta
+                        ,unsigned int             *last_nonzero);
+
+/* Inverse transform one block into its place in its component's MCU
+ * buffer */
+void convert_transform_block(convert_state            *state
+                            ,const convert_block_plan *block
+                            ,const int16_t             coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                            ,unsigned int              last_nonzero);
+
+/* Colour convert the MCU buffers into MCU number mcu's place in the
+ * bitmap, clipped to the region, or copy them into the planes */
+void convert_write_mcu(convert_state *state, size_t mcu);
+
+/* Once every MCU is in the planes, upsample the rows into b in parallel */
+void convert_finish_rows_parallel(const jpeg            *j
+                                 ,const convert_options *options
+                                 ,bitmap                *b
+                                 ,convert_planes        *planes
+                                 ,unsigned int           num_threads);
+
+/* Roughly the most convert_decode_speculative allocates for the blocks it
+ * holds, which is every block in the image */
+size_t convert_speculative_bytes(const jpeg *j);
+
+/* The lists of decoded blocks, one pair for each thread, which only grow.
+ * The cache itself comes from arena, but the lists grow on the decoding
+ * threads so they come from the heap, and go back when it is destroyed. */
+convert_spec_cache *convert_spec_cache_create(jpeg_arena *arena);
+void                convert_spec_cache_destroy(convert_spec_cache *cache);
+
+/* Decode a scan without restart markers on several threads by speculating
+ * where blocks start. Returns 0 without touching the bitmap if it can't,
+ * otherwise sets error and returns 1. The block lists come from
+ * j->spec_cache if there is one, and everything else from j->arena. */
+int convert_decode_speculative(const jpeg            *j
+                              ,const convert_options *options
+                              ,bitmap                *b
+                              ,convert_planes        *planes
+                              ,unsigned int           num_threads
+                              ,int                   *error);
+
+/* The coefficients of a progressive image, which its scans build up */
+typedef struct convert_progressive_s convert_progressive;
+
+typedef enum {
+   CONVERT_SCAN_NEED_MORE_DATA = 0,
+   /* A scan was decoded, and there may be more */
+   CONVERT_SCAN_DECODED        = 1,
+   /* The end of the image has been reached */
+   CONVERT_SCAN_DONE           = 2,
+   /* Decoding can't go on, but what was decoded can still be rendered */
+   CONVERT_SCAN_ERROR          = 3
+} convert_scan_status;
+
+/* All coefficients zero, with the jpeg's first scan to decode next. It and
+ * the tables and scans it reads are allocated from the jpeg's arena. */
+convert_progressive *convert_progressive_create(const jpeg *j);
+/* Roughly what convert_progressive_create allocates */
+size_t               convert_progressive_bytes(const jpeg *j);
+
+/* Decode the next scan, and any tables or restart interval before it.
+ * data is the whole file so far, which may have moved since the last
+ * call. Unless complete is set, a scan is only decoded once the marker
+ * after it has arrived. */
+convert_scan_status  convert_progressive_next_scan(convert_progressive *p
+                                                  ,const unsigned char *data
+                                                  ,size_t               data_size
+                                                  ,int                  complete);
+
+size_t               convert_progressive_scans_done(const convert_progressive *p);
+/* Bytes of the file the decoded scans take up */
+size_t               convert_progressive_bytes_done(const convert_progressive *p);
+
+/* Decode the rest of the scans of the jpeg's data. If preview and
+ * options->scan_callback are set, preview is rendered and handed to the
+ * callback after each. Returns non-zero on error, or if the callback
+ * stopped it. */
+int                  convert_progressive_decode_scans(convert_progressive   *p
+                                                     ,const convert_options *options
+                                                     ,bitmap                *preview);
+
+/* Render the coefficients as they stand into b, which is the size the
+ * options give, on options->num_threads threads */
+void                 convert_progressive_render(const convert_progressive *p
+                                               ,const convert_options     *options
+                                               ,bitmap                    *b);
+
+/* Render MCUs with the state as convert_decode_mcu would decode them,
+ * finishing rows if finish_rows is set. Returns non-zero if the row
+ * callback stopped it. */
+int                  convert_progressive_render_mcus(convert_state             *state
+                                                    ,const convert_progressive *p
+                                                    ,size_t                     first_mcu
+                                                    ,size_t                     num_mcus
+                                                    ,int                        finish_rows);
+
+#endif
@@ -0,0 +1,682 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "convert_internal.h"
+#include "cpu.h"
+#include "jpeg_segment.h"
+#include "jpeg_stream_internal.h"
+#include "scan_start.h"
+
+/* Progressive decoding, as per Annex G of the standard.
+ *
+ * Each scan refines the quantised coefficients of every block a little: a
+ * band of zigzag positions (spectral selection), some of their bits
+ * (successive approximation), or both. So the coefficients of the whole
+ * image are kept, and the scans are decoded into them one at a time along
+ * with any tables defined between them. The image can be rendered from the
+ * coefficients after any scan, which is how previews work, and is rendered
+ * once more at the end. */
+
+/* The largest successive approximation shift that fits a 16-bit coefficient */
+#define PROGRESSIVE_MAX_APPROX_BITS 13
+
+struct convert_progressive_s {
+   const jpeg  *j;
+   /* Tables defined between scans, which take over from the jpeg's */
+   htable      *htables[JPEG_MAX_HTABLES];
+   size_t       num_htables;
+   /* The jpeg's quantisation tables and any defined between scans */
+   qtable      *qtables[JPEG_MAX_QTABLES];
+   size_t       num_qtables;
+   /* As libjpeg does, each component keeps the table it had in its first
+    * scan, or NULL before that, when its coefficients are still zero */
+   const qtable *component_qtables[NUM_COMPONENTS];
+   /* MCUs between restart markers, or 0, which a DRI between scans changes */
+   size_t       restart_interval;
+   /* The header of the next scan once it has been read, otherwise NULL.
+    * The first is the jpeg's. */
+   scan_start  *scan;
+   /* Offset in the data of the next scan's entropy coded data if the
+    * header has been read, otherwise of the next segment */
+   size_t       offset;
+   size_t       scans_done;
+   int          done;
+   /* Blocks of each component across and down, covering whole MCUs, and
+    * their quantised coefficients in natural order */
+   size_t       blocks_across[NUM_COMPONENTS];
+   size_t       blocks_down[NUM_COMPONENTS];
+   int16_t     *coeffs[NUM_COMPONENTS];
+   /* Entropy decoding state within a scan */
+   int          prev_dc_coeff[NUM_COMPONENTS];
+   size_t       eob_run;
+};
+
+/* Rows of MCUs to render, by one thread */
+typedef struct render_job_s {
+   convert_state             *state;
+   const convert_progressive *p;
+   size_t                     first_mcu;
+   size_t                     num_mcus;
+} render_job;
+
+convert_progressive *convert_progressive_create(const jpeg *j) {
+   const frame         *f = j->frame;
+   convert_progressive *p = jpeg_arena_alloc(j->arena, sizeof(convert_progressive));
+   unsigned int         c;
+   assert(j->scan_start);
+   p->j                = j;
+   memset(p->htables, 0, sizeof(p->htables));
+   p->num_htables      = 0;
+   memcpy(p->qtables, j->qtables, sizeof(p->qtables));
+   p->num_qtables      = j->num_qtables;
+   memset(p->component_qtables, 0, sizeof(p->component_qtables));
+   p->restart_interval = j->has_restart_interval ? j->restart_interval : 0;
+   p->scan             = j->scan_start;
+   p->offset           = (size_t) (j->scan_start->stream->data - j->data);
+   p->scans_done       = 0;
+   p->done             = 0;
+   p->eob_run          = 0;
+   for (c = 0; c < NUM_COMPONENTS; c++) {
+      p->blocks_across[c] = 0;
+      p->blocks_down[c]   = 0;
+      p->coeffs[c]        = NULL;
+   }
+   for (c = 0; c < f->num_components && c < NUM_COMPONENTS; c++) {
+      const component *component = &f->components[c];
+      size_t           num_blocks;
+      p->blocks_across[c] = convert_mcus_per_row(j) * component->sampling_factor_horizontal;
+      p->blocks_down[c]   = convert_num_mcus(j) / convert_mcus_per_row(j) * component->sampling_factor_vertical;
+      num_blocks          = p->blocks_across[c] * p->blocks_down[c];
+      p->coeffs[c]        = jpeg_arena_alloc(j->arena, num_blocks * JPEG_CHUNK_NUM_SAMPLES * sizeof(int16_t));
+      memset(p->coeffs[c], 0, num_blocks * JPEG_CHUNK_NUM_SAMPLES * sizeof(int16_t));
+   }
+   return p;
+}
+
+size_t convert_progressive_bytes(const jpeg *j) {
+   const frame *f = j->frame;
+   size_t       blocks_per_mcu = 0;
+   unsigned int c;
+   for (c = 0; c < f->num_components && c < NUM_COMPONENTS; c++) {
+      blocks_per_mcu += f->components[c].sampling_factor_horizontal
+                      * f->components[c].sampling_factor_vertical;
+   }
+   return sizeof(convert_progressive)
+        + convert_num_mcus(j) * blocks_per_mcu * JPEG_CHUNK_NUM_SAMPLES * sizeof(int16_t);
+}
+
+size_t convert_progressive_scans_done(const convert_progressive *p) {
+   return p->scans_done;
+}
+
+size_t convert_progressive_bytes_done(const convert_progressive *p) {
+   return p->offset;
+}
+
+static int16_t *block_at(const convert_progressive *p, unsigned int c, size_t row, size_t col) {
+   return p->coeffs[c] + (row * p->blocks_across[c] + col) * JPEG_CHUNK_NUM_SAMPLES;
+}
+
+/* Tables defined between scans win over those before the first */
+static htable *scan_table(const convert_progressive *p, htable_type type, htable_id id) {
+   htable *table = htable_get_table(p->htables, type, id);
+   return table ? table : htable_get_table(p->j->htables, type, id);
+}
+
+/* Read num_bits of extra bits and extend them to a signed value as per
+ * section F.2.2.1 of the standard */
+static int receive_extend(jpeg_stream *stream, unsigned int num_bits) {
+   int value;
+   if (num_bits == 0) {
+      return 0;
+   }
+   value = (int) jpeg_stream_get_bits(stream, num_bits);
+   if (value < (1 << (num_bits - 1))) {
+      value -= (1 << num_bits) - 1;
+   }
+   return value;
+}
+
+/* The first scan of a DC coefficient gives its top bits, predicted from
+ * the last block of the component as in a sequential scan */
+static int decode_dc_first(convert_progressive *p
+                          ,jpeg_stream         *stream
+                          ,const htable        *table
+                          ,unsigned int         c
+                          ,int16_t             *block) {
+   unsigned int num_bits;
+   if (htable_decode_symbol(stream, table, &num_bits) != 0 || num_bits > 15) {
+      return 1;
+   }
+   p->prev_dc_coeff[c] += receive_extend(stream, num_bits);
+   block[0] = (int16_t) (p->prev_dc_coeff[c] * (1 << p->scan->successive_approx_low));
+   return 0;
+}
+
+/* Later DC scans send one more bit, uncoded */
+static void decode_dc_refine(const convert_progressive *p
+                            ,jpeg_stream               *stream
+                            ,int16_t                   *block) {
+   if (jpeg_stream_get_bits(stream, 1)) {
+      block[0] |= (int16_t) (1 << p->scan->successive_approx_low);
+   }
+}
+
+/* The first scan of a band of AC coefficients is coded much as in a
+ * sequential scan, except that an end of block can cover a run of blocks */
+static int decode_ac_first(convert_progressive *p
+                          ,jpeg_stream         *stream
+                          ,const htable        *table
+                          ,int16_t             *block) {
+   const scan_start *scan = p->scan;
+   unsigned int      k;
+   if (p->eob_run > 0) {
+      p->eob_run -= 1;
+      return 0;
+   }
+   for (k = scan->spectral_selection_start; k <= scan->spectral_selection_end; k++) {
+      unsigned int symbol;
+      unsigned int run;
+      unsigned int num_bits;
+      if (htable_decode_symbol(stream, table, &symbol) != 0) {
+         return 1;
+      }
+      run      = symbol >> 4;
+      num_bits = symbol & 0xF;
+      if (num_bits) {
+         k += run;
+         if (k > scan->spectral_selection_end) {
+            return 1;
+         }
+         block[qtable_natural_order[k]] = (int16_t) (receive_extend(stream, num_bits)
+                                                     * (1 << scan->successive_approx_low));
+      } else if (run == 15) {
+         /* Sixteen zeros, counting the one the loop skips */
+         k += 15;
+      } else {
+         p->eob_run = (size_t) 1 << run;
+         if (run) {
+            p->eob_run += jpeg_stream_get_bits(stream, run);
+         }
+         p->eob_run -= 1;
+         break;
+      }
+   }
+   return 0;
+}
+
+/* Add the next bit to a coefficient that is already nonzero, if the stream
+ * says to, away from zero */
+static void refine_nonzero(jpeg_stream *stream, int16_t *coeff, int bit) {
+   if (jpeg_stream_get_bits(stream, 1) && (*coeff & bit) == 0) {
+      *coeff = (int16_t) (*coeff >= 0 ? *coeff + bit : *coeff - bit);
+   }
+}
+
+/* Later scans of a band refine it a bit at a time. Coefficients that
+ * become nonzero are coded with a run of the zero ones to skip, and every
+ * nonzero one passed on the way, or after the end of block, gets a
+ * correction bit. This follows section G.1.2.3 and libjpeg's
+ * decode_mcu_AC_refine. */
+static int decode_ac_refine(convert_progressive *p
+                           ,jpeg_stream         *stream
+                           ,const htable        *table
+                           ,int16_t             *block) {
+   const scan_start *scan = p->scan;
+   int               bit  = 1 << scan->successive_approx_low;
+   unsigned int      k    = scan->spectral_selection_start;
+   if (p->eob_run == 0) {
+      for (; k <= scan->spectral_selection_end; k++) {
+         unsigned int symbol;
+         int          run;
+         int          value = 0;
+         if (htable_decode_symbol(stream, table, &symbol) != 0) {
+            return 1;
+         }
+         run = (int) (symbol >> 4);
+         if (symbol & 0xF) {
+            /* The new coefficient is always +-1 at this bit */
+            value = jpeg_stream_get_bits(stream, 1) ? bit : -bit;
+         } else if (run != 15) {
+            p->eob_run = (size_t) 1 << run;
+            if (run) {
+               p->eob_run += jpeg_stream_get_bits(stream, (size_t) run);
+            }
+            break;
+         }
+         /* Skip run zeros, refining the nonzero coefficients among them */
+         for (; k <= scan->spectral_selection_end; k++) {
+            int16_t *coeff = &block[qtable_natural_order[k]];
+            if (*coeff != 0) {
+               refine_nonzero(stream, coeff, bit);
+            } else if (run == 0) {
+               break;
+            } else {
+               run -= 1;
+            }
+         }
+         if (value) {
+            if (k > scan->spectral_selection_end) {
+               return 1;
+            }
+            block[qtable_natural_order[k]] = (int16_t) value;
+         }
+      }
+   }
+   if (p->eob_run > 0) {
+      /* The rest of the band is in an end of block run */
+      for (; k <= scan->spectral_selection_end; k++) {
+         int16_t *coeff = &block[qtable_natural_order[k]];
+         if (*coeff != 0) {
+            refine_nonzero(stream, coeff, bit);
+         }
+      }
+      p->eob_run -= 1;
+   }
+   return 0;
+}
+
+static int decode_block(convert_progressive *p
+                       ,jpeg_stream         *stream
+                       ,const htable        *table
+                       ,unsigned int         c
+                       ,int16_t             *block) {
+   const scan_start *scan = p->scan;
+   if (scan->spectral_selection_start == 0) {
+      if (scan->successive_approx_high == 0) {
+         return decode_dc_first(p, stream, table, c, block);
+      }
+      decode_dc_refine(p, stream, block);
+      return 0;
+   }
+   if (scan->successive_approx_high == 0) {
+      return decode_ac_first(p, stream, table, block);
+   }
+   return decode_ac_refine(p, stream, table, block);
+}
+
+/* Check the scan against the rules of section G.1.1.1.1, and look up the
+ * tables it needs. Returns 0 if it can be decoded. */
+static int check_scan(const convert_progressive *p, htable *tables[SCAN_START_MAX_COMPONENTS]) {
+   const scan_start *scan = p->scan;
+   int               dc   = scan->spectral_selection_start == 0;
+   unsigned int      n;
+   if (   (dc && scan->spectral_selection_end != 0)
+       || (!dc && (   scan->spectral_selection_end < scan->spectral_selection_start
+                   || scan->spectral_selection_end >= JPEG_CHUNK_NUM_SAMPLES
+                   || scan->num_components != 1))
+       || scan->successive_approx_low  > PROGRESSIVE_MAX_APPROX_BITS
+       || scan->successive_approx_high > PROGRESSIVE_MAX_APPROX_BITS) {
+      printf("Invalid progressive scan %u..%u, bits %u %u\n"
+            ,scan->spectral_selection_start, scan->spectral_selection_end
+            ,scan->successive_approx_high, scan->successive_approx_low);
+      return 1;
+   }
+   for (n = 0; n < scan->num_components; n++) {
+      tables[n] = NULL;
+      if (scan->component_index[n] >= NUM_COMPONENTS) {
+         printf("Unsupported component in scan\n");
+         return 1;
+      }
+      if (!dc) {
+         tables[n] = scan_table(p, HTABLE_TYPE_AC, scan->ac_htable_id[n]);
+      } else if (scan->successive_approx_high == 0) {
+         tables[n] = scan_table(p, HTABLE_TYPE_DC, scan->dc_htable_id[n]);
+      } else {
+         /* Refining DC bits are uncoded */
+         continue;
+      }
+      if (!tables[n]) {
+         printf("Scan uses an undefined huffman table\n");
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/* Decode the current scan from the start of stream. A scan of one
+ * component goes through its blocks in raster order, only as far as the
+ * component covers the image, and each block is a restart unit. A scan of
+ * several goes through whole MCUs. */
+static int decode_scan(convert_progressive *p, jpeg_stream *stream) {
+   const jpeg       *j    = p->j;
+   const frame      *f    = j->frame;
+   const scan_start *scan = p->scan;
+   htable           *tables[SCAN_START_MAX_COMPONENTS];
+   size_t            units_across;
+   size_t            num_units;
+   size_t            unit;
+   int               error;
+   error = check_scan(p, tables);
+   if (error) {
+      return error;
+   }
+   if (scan->num_components == 1) {
+      const component *component = &f->components[scan->component_index[0]];
+      size_t           cols = ((size_t) f->samples_per_line * component->sampling_factor_horizontal
+                               + f->highest_sampling_factor_horizontal - 1)
+                            / f->highest_sampling_factor_horizontal;
+      size_t           rows = ((size_t) f->num_lines * component->sampling_factor_vertical
+                               + f->highest_sampling_factor_vertical - 1)
+                            / f->highest_sampling_factor_vertical;
+      units_across = (cols + JPEG_CHUNK_SIDE_LENGTH - 1) / JPEG_CHUNK_SIDE_LENGTH;
+      num_units    = units_across * ((rows + JPEG_CHUNK_SIDE_LENGTH - 1) / JPEG_CHUNK_SIDE_LENGTH);
+   } else {
+      units_across = convert_mcus_per_row(j);
+      num_units    = convert_num_mcus(j);
+   }
+   memset(p->prev_dc_coeff, 0, sizeof(p->prev_dc_coeff));
+   p->eob_run = 0;
+   for (unit = 0; unit < num_units && !error; unit++) {
+      size_t       row = unit / units_across;
+      size_t       col = unit % units_across;
+      unsigned int n;
+      if (p->restart_interval && unit > 0 && unit % p->restart_interval == 0) {
+         jpeg_stream_restart(stream);
+         memset(p->prev_dc_coeff, 0, sizeof(p->prev_dc_coeff));
+         p->eob_run = 0;
+      }
+      for (n = 0; n < scan->num_components && !error; n++) {
+         unsigned int     c         = scan->component_index[n];
+         const component *component = &f->components[c];
+         unsigned int     h_blocks  = scan->num_components == 1 ? 1 : component->sampling_factor_horizontal;
+         unsigned int     v_blocks  = scan->num_components == 1 ? 1 : component->sampling_factor_vertical;
+         unsigned int     v;
+         for (v = 0; v < v_blocks && !error; v++) {
+            unsigned int h;
+            for (h = 0; h < h_blocks && !error; h++) {
+               error = decode_block(p
+                                   ,stream
+                                   ,tables[n]
+                                   ,c
+                                   ,block_at(p, c, row * v_blocks + v, col * h_blocks + h));
+            }
+         }
+      }
+      /* A truncated scan leaves the rest of the blocks as they were */
+      if (   !error
+          && unit + 1 < num_units
+          && jpeg_stream_get_state(stream) == JPEG_STREAM_STATE_OUT_OF_DATA) {
+         error = 1;
+      }
+   }
+   return error;
+}
+
+/* Not all there yet, or never will be */
+static convert_scan_status need_more_data(int complete) {
+   if (complete) {
+      printf("Data ended before the end of the image\n");
+      return CONVERT_SCAN_ERROR;
+   }
+   return CONVERT_SCAN_NEED_MORE_DATA;
+}
+
+/* Read segments from the end of the last scan up to the header of the
+ * next, or the end of the image */
+static convert_scan_status read_segments(convert_progressive *p
+                                        ,const unsigned char *data
+                                        ,size_t               data_size
+                                        ,int                  complete) {
+   while (!p->scan) {
+      size_t        i = p->offset;
+      size_t        length;
+      unsigned char marker;
+      jpeg_segment  segment;
+      int           error = 0;
+      /* Fill bytes may come before a marker */
+      while (   i + 1 < data_size
+             && data[i]     == JPEG_MARKER_MAGIC_BYTE
+             && data[i + 1] == JPEG_MARKER_MAGIC_BYTE) {
+         i += 1;
+      }
+      if (i + JPEG_MARKER_LENGTH_BYTES > data_size) {
+         return need_more_data(complete);
+      }
+      if (data[i] != JPEG_MARKER_MAGIC_BYTE) {
+         printf("Expected a marker after the scan\n");
+         return CONVERT_SCAN_ERROR;
+      }
+      marker = data[i + 1];
+      if (marker == JPEG_MARKER_EOI) {
+         p->offset = i + JPEG_MARKER_LENGTH_BYTES;
+         p->done   = 1;
+         return CONVERT_SCAN_DONE;
+      }
+      if ((marker & 0xF8) == 0xD0) {
+         /* A stray RSTn has no length */
+         p->offset = i + JPEG_MARKER_LENGTH_BYTES;
+         continue;
+      }
+      if (i + JPEG_MARKER_LENGTH_BYTES + JPEG_SEGMENT_SIZE_LENGTH_BYTES > data_size) {
+         return need_more_data(complete);
+      }
+      length = read_word(&data[i + JPEG_MARKER_LENGTH_BYTES]);
+      if (length < JPEG_SEGMENT_SIZE_LENGTH_BYTES) {
+         printf("Invalid segment length\n");
+         return CONVERT_SCAN_ERROR;
+      }
+      if (i + JPEG_MARKER_LENGTH_BYTES + length > data_size) {
+         return need_more_data(complete);
+      }
+      i += JPEG_MARKER_LENGTH_BYTES + JPEG_SEGMENT_SIZE_LENGTH_BYTES;
+      segment.marker    = marker;
+      segment.data      = &data[i];
+      segment.data_size = length - JPEG_SEGMENT_SIZE_LENGTH_BYTES;
+      switch (marker) {
+         case JPEG_MARKER_DHT:
+            if (htable_create(&segment, p->j->arena, NULL, p->htables, &p->num_htables) != 0) {
+               printf("Unable to parse DHT segment\n");
+               error = 1;
+            }
+            break;
+         case JPEG_MARKER_DRI:
+            if (segment.data_size != 2) {
+               printf("Invalid DRI segment\n");
+               error = 1;
+            } else {
+               p->restart_interval = read_word(segment.data);
+            }
+            break;
+         case JPEG_MARKER_SOS:
+            p->scan = scan_start_create(&segment, p->j->frame, data_size - i, p->j->arena);
+            if (!p->scan) {
+               printf("Unable to parse SOS segment\n");
+               error = 1;
+            }
+            break;
+         case JPEG_MARKER_DQT:
+            if (qtable_create(&segment, p->j->arena, NULL, p->qtables, &p->num_qtables) != 0) {
+               printf("Unable to parse DQT segment\n");
+               error = 1;
+            }
+            break;
+         default:
+            printf("Unknown marker %02x, ignoring\n", marker);
+            break;
+      }
+      p->offset = i + segment.data_size;
+      if (error) {
+         return CONVERT_SCAN_ERROR;
+      }
+   }
+   return CONVERT_SCAN_DECODED;
+}
+
+/* Give the components in the next scan that haven't been in one the
+ * tables they have now */
+static int latch_qtables(convert_progressive *p) {
+   const scan_start *scan = p->scan;
+   unsigned int      n;
+   for (n = 0; n < scan->num_components; n++) {
+      unsigned int     c         = scan->component_index[n];
+      const component *component = &p->j->frame->components[c];
+      if (p->component_qtables[c]) {
+         continue;
+      }
+      if (component->qtable_id >= JPEG_MAX_QTABLES || !p->qtables[component->qtable_id]) {
+         printf("No quantisation table for component %u\n", c);
+         return 1;
+      }
+      p->component_qtables[c] = p->qtables[component->qtable_id];
+   }
+   return 0;
+}
+
+convert_scan_status convert_progressive_next_scan(convert_progressive *p
+                                                 ,const unsigned char *data
+                                                 ,size_t               data_size
+                                                 ,int                  complete) {
+   convert_scan_status status;
+   jpeg_stream         stream;
+   size_t              end;
+   int                 error;
+   if (p->done) {
+      return CONVERT_SCAN_DONE;
+   }
+   status = read_segments(p, data, data_size, complete);
+   if (!p->scan) {
+      return status;
+   }
+   jpeg_stream_init(&stream, data_size - p->offset, data + p->offset);
+   end = jpeg_stream_find_scan_end(&stream);
+   if (end == data_size - p->offset && !complete) {
+      return CONVERT_SCAN_NEED_MORE_DATA;
+   }
+   if (latch_qtables(p) != 0) {
+      return CONVERT_SCAN_ERROR;
+   }
+   error = decode_scan(p, &stream);
+   p->scan        = NULL;
+   p->offset     += end;
+   p->scans_done += 1;
+   if (error) {
+      printf("Error during huffman decoding\n");
+      return CONVERT_SCAN_ERROR;
+   }
+   return CONVERT_SCAN_DECODED;
+}
+
+int convert_progressive_decode_scans(convert_progressive   *p
+                                    ,const convert_options *options
+                                    ,bitmap                *preview) {
+   convert_scan_status status;
+   const jpeg         *j    = p->j;
+   int                 stop = 0;
+   do {
+      status = convert_progressive_next_scan(p, j->data, j->data_size, 1);
+      if (status == CONVERT_SCAN_DECODED && preview && options->scan_callback) {
+         convert_progressive_render(p, options, preview);
+         stop = options->scan_callback(options->scan_user, preview, p->scans_done, p->offset);
+      }
+   } while (status == CONVERT_SCAN_DECODED && !stop);
+   return status != CONVERT_SCAN_DONE;
+}
+
+/* Dequantise and transform each block of an MCU, then write it */
+static void render_mcu(convert_state *state, const convert_progressive *p, size_t mcu) {
+   const jpeg  *j   = p->j;
+   size_t       row = mcu / convert_mcus_per_row(j);
+   size_t       col = mcu % convert_mcus_per_row(j);
+   unsigned int n;
+   for (n = 0; n < state->num_blocks; n++) {
+      const convert_block_plan *plan      = &state->blocks[n];
+      const component          *component = &j->frame->components[plan->component];
+      const int16_t *block = block_at(p
+                                     ,plan->component
+                                     ,row * component->sampling_factor_vertical + plan->v
+                                     ,col * component->sampling_factor_horizontal + plan->h);
+      const qtable  *table = p->component_qtables[plan->component];
+      const int32_t *multipliers = table ? qtable_get_multipliers(table, state->dct_method) : plan->multipliers;
+      int16_t        coeffs[JPEG_CHUNK_NUM_SAMPLES];
+      unsigned int   last_nonzero;
+      unsigned int   k;
+      for (k = 0; k < JPEG_CHUNK_NUM_SAMPLES; k++) {
+         coeffs[k] = convert_dequantise(block[k], multipliers[k]);
+      }
+      for (last_nonzero = JPEG_CHUNK_NUM_SAMPLES - 1; last_nonzero > 0; last_nonzero--) {
+         if (block[qtable_natural_order[last_nonzero]] != 0) {
+            break;
+         }
+      }
+      convert_transform_block(state, plan, coeffs, last_nonzero);
+   }
+   convert_write_mcu(state, mcu);
+}
+
+int convert_progressive_render_mcus(convert_state             *state
+                                   ,const convert_progressive *p
+                                   ,size_t                     first_mcu
+                                   ,size_t                     num_mcus
+                                   ,int                        finish_rows) {
+   size_t mcus_per_row = convert_mcus_per_row(p->j);
+   size_t mcu;
+   int    stop = 0;
+   for (mcu = first_mcu; mcu < first_mcu + num_mcus && !stop; mcu++) {
+      if (convert_mcu_visible(state, mcu)) {
+         render_mcu(state, p, mcu);
+      }
+      if (finish_rows && (mcu + 1) % mcus_per_row == 0) {
+         stop = convert_finish_rows(state, (mcu + 1) / mcus_per_row, 0);
+      }
+   }
+   if (finish_rows && !stop) {
+      stop = convert_finish_rows(state, (first_mcu + num_mcus) / mcus_per_row, 1);
+   }
+   return stop;
+}
+
+static void *render_job_run(void *arg) {
+   render_job *job = arg;
+   convert_progressive_render_mcus(job->state, job->p, job->first_mcu, job->num_mcus, 0);
+   return NULL;
+}
+
+/* Blocks don't depend on each other once the scans are decoded, so rows
+ * of MCUs are rendered in parallel as restart intervals are */
+void convert_progressive_render(const convert_progressive *p
+                               ,const convert_options     *options
+                               ,bitmap                    *b) {
+   const jpeg     *j            = p->j;
+   size_t          mcus_per_row = convert_mcus_per_row(j);
+   size_t          num_rows     = convert_num_mcus_needed(j, options) / mcus_per_row;
+   unsigned int    num_threads  = options->num_threads ? options->num_threads : cpu_num_cores();
+   int             fancy        = convert_fancy_upsampling(j, options);
+   convert_planes *planes       = NULL;
+   /* Previews render again and again, so give back what each used */
+   size_t          mark         = jpeg_arena_mark(j->arena);
+   if (num_threads >= 2 && num_rows >= 2) {
+      unsigned int num_jobs = num_threads < num_rows ? num_threads : (unsigned int) num_rows;
+      render_job  *jobs     = jpeg_arena_alloc(j->arena, num_jobs * sizeof(render_job));
+      unsigned int i;
+      if (fancy) {
+         planes = convert_planes_create(j, options, num_rows);
+      }
+      for (i = 0; i < num_jobs; i++) {
+         size_t first_row = i * num_rows / num_jobs;
+         size_t end_row   = (i + 1) * num_rows / num_jobs;
+         jobs[i].state     = convert_state_create(j, options, b, NULL);
+         jobs[i].state->planes = planes;
+         jobs[i].p         = p;
+         jobs[i].first_mcu = first_row * mcus_per_row;
+         jobs[i].num_mcus  = (end_row - first_row) * mcus_per_row;
+      }
+      convert_run_jobs(p->j, render_job_run, jobs, sizeof(render_job), num_jobs);
+      for (i = 0; i < num_jobs; i++) {
+         convert_state_destroy(jobs[i].state);
+      }
+      if (planes) {
+         convert_finish_rows_parallel(j, options, b, planes, num_threads);
+      }
+   } else {
+      convert_state *state = convert_state_create(j, options, b, NULL);
+      if (fancy) {
+         planes = convert_planes_create(j, options, CONVERT_RING_BANDS);
+      }
+      state->planes = planes;
+      convert_progressive_render_mcus(state, p, 0, num_rows * mcus_per_row, 1);
+      convert_state_destroy(state);
+   }
+   jpeg_arena_release(j->arena, mark);
+}
@@ -0,0 +1,425 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "convert_internal.h"
+#include "jpeg_stream_internal.h"
+#include "scan_start.h"
+
+/* Speculative parallel Huffman decoding, for scans without restart markers.
+ *
+ * The scan is split into byte ranges, one per thread. The first thread
+ * starts at a known block boundary; the others guess that a block starts at
+ * the first byte of their range, and record the stream position and block
+ * within the MCU of every block they decode. Huffman codes resynchronise
+ * quickly, so once each thread has reached the end of its range it keeps
+ * decoding into the next one until it arrives at a position and block that
+ * the next thread also recorded. From there on the next thread's blocks
+ * are exactly what a serial decode would give. Finally the DC predictions
+ * are added up across ranges, and the blocks are transformed and written to
+ * the bitmap in parallel. */
+
+/* Ranges smaller than this take longer to synchronise than to decode */
+#define SPECULATIVE_MIN_CHUNK_BYTES (16 * 1024)
+/* Start positions a thread tries before giving up on its range */
+#define SPECULATIVE_MAX_ATTEMPTS    64
+/* Bits of fill that can follow the last block of the scan */
+#define SPECULATIVE_MAX_FILL_BITS   8
+
+/* One block, decoded without knowing its DC predictor */
+typedef struct spec_block_s {
+   /* Position of the block's first bit in the scan, not counting stuff bytes */
+   size_t        position;
+   /* Which block of the MCU this is */
+   unsigned char unit;
+   unsigned char last_nonzero;
+   int           dc_delta;
+   int16_t       coeffs[JPEG_CHUNK_NUM_SAMPLES];
+} spec_block;
+
+/* A growable array of blocks */
+typedef struct spec_list_s {
+   spec_block *blocks;
+   size_t      num_blocks;
+   size_t      capacity;
+} spec_list;
+
+struct convert_spec_cache_s {
+   /* A speculated and an extension list for each chunk */
+   spec_list   *lists;
+   unsigned int num_lists;
+};
+
+typedef struct spec_scan_s spec_scan;
+
+typedef struct spec_chunk_s {
+   spec_scan     *scan;
+   unsigned int   index;
+   convert_state *state;
+   /* Byte range of the scan, and its start in the same units as positions */
+   size_t         start;
+   size_t         end;
+   size_t         start_bits;
+   size_t         end_bits;
+   /* Where the stream was started, which moves on after a failed guess */
+   size_t         stream_bits;
+   /* Blocks that start in the chunk's range, which the previous chunk reads
+    * while synchronising, and those after it up to the next chunk's first
+    * valid block */
+   spec_list     *speculated;
+   spec_list     *extension;
+   /* Block of the MCU that the stream is at */
+   unsigned int   unit;
+   /* Speculated blocks before first_valid came from a wrong guess */
+   size_t         first_valid;
+   /* Index in the whole scan of the first valid block */
+   size_t         first_index;
+   int            dc[NUM_COMPONENTS];
+   int            failed;
+} spec_chunk;
+
+struct spec_scan_s {
+   const jpeg    *j;
+   jpeg_stream   *stream;
+   unsigned int   num_units;
+   unsigned int   unit_component[CONVERT_MAX_MCU_BLOCKS];
+   const int32_t *multipliers[NUM_COMPONENTS];
+   spec_chunk    *chunks;
+   unsigned int   num_chunks;
+   /* Every block of the image in decode order, once stitched */
+   spec_block   **blocks;
+   size_t         num_blocks;
+};
+
+/* A run of MCUs to transform and write */
+typedef struct spec_convert_job_s {
+   spec_scan     *scan;
+   convert_state *state;
+   size_t         first_mcu;
+   size_t         num_mcus;
+} spec_convert_job;
+
+static size_t stream_position(const spec_chunk *chunk) {
+   return chunk->stream_bits + jpeg_stream_bit_position(chunk->state->stream);
+}
+
+static void start_stream(spec_chunk *chunk, size_t offset) {
+   const spec_scan *scan = chunk->scan;
+   size_t stuff_bytes = jpeg_stream_count_stuff_bytes(scan->stream, chunk->start, offset);
+   jpeg_stream_init(chunk->state->stream, scan->stream->data_size_bytes - offset, scan->stream->data + offset);
+   chunk->stream_bits = chunk->start_bits + (offset - chunk->start - stuff_bytes) * 8;
+   chunk->speculated->num_blocks = 0;
+   chunk->unit        = 0;
+}
+
+/* Valid blocks in the chunk, and the nth of them */
+static size_t chunk_num_valid(const spec_chunk *chunk) {
+   return chunk->speculated->num_blocks - chunk->first_valid + chunk->extension->num_blocks;
+}
+
+static spec_block *chunk_valid_block(spec_chunk *chunk, size_t n) {
+   size_t num_speculated = chunk->speculated->num_blocks - chunk->first_valid;
+   if (n < num_speculated) {
+      return &chunk->speculated->blocks[chunk->first_valid + n];
+   }
+   return &chunk->extension->blocks[n - num_speculated];
+}
+
+/* Decode the block at the stream's position and append it to list. Lists
+ * only ever grow, so once they are big enough for the images a decoder is
+ * given this doesn't allocate. */
+static int decode_next_block(spec_chunk *chunk, spec_list *list) {
+   const spec_scan *scan = chunk->scan;
+   spec_block      *block;
+   unsigned int     last_nonzero;
+   if (list->num_blocks == list->capacity) {
+      list->capacity = list->capacity * 2 + 64;
+      list->blocks   = realloc(list->blocks, list->capacity * sizeof(spec_block));
+      assert(list->blocks);
+   }
+   block = &list->blocks[list->num_blocks];
+   block->position = stream_position(chunk);
+   block->unit     = (unsigned char) chunk->unit;
+   memset(block->coeffs, 0, sizeof(block->coeffs));
+   if (convert_decode_block(chunk->state
+                           ,&chunk->state->blocks[chunk->unit]
+                           ,block->coeffs
+                           ,&block->dc_delta
+                           ,&last_nonzero)) {
+      return 1;
+   }
+   block->last_nonzero = (unsigned char) last_nonzero;
+   list->num_blocks += 1;
+   chunk->unit        = (chunk->unit + 1) % scan->num_units;
+   return 0;
+}
+
+/* Decode every block that starts in the chunk's range. A decode error means
+ * the guess was wrong, so try again from the next byte. */
+static void *speculate_job(void *arg) {
+   spec_chunk  *chunk    = arg;
+   int          last     = chunk->index + 1 == chunk->scan->num_chunks;
+   size_t       offset   = chunk->start;
+   unsigned int attempts = 0;
+   int          done     = 0;
+   start_stream(chunk, offset);
+   while (!done) {
+      size_t position = stream_position(chunk);
+      if (position >= chunk->end_bits) {
+         done = 1;
+      } else if (decode_next_block(chunk, chunk->speculated)) {
+         attempts += 1;
+         if (last && position + SPECULATIVE_MAX_FILL_BITS >= chunk->end_bits) {
+            /* Ran into the fill bits at the end of the scan */
+            done = 1;
+         } else if (chunk->index == 0 || attempts == SPECULATIVE_MAX_ATTEMPTS) {
+            chunk->failed = 1;
+            done = 1;
+         } else {
+            offset = jpeg_stream_split_point(chunk->scan->stream, offset + 1);
+            if (offset >= chunk->end) {
+               chunk->failed = 1;
+               done = 1;
+            } else {
+               start_stream(chunk, offset);
+            }
+         }
+      }
+   }
+   return NULL;
+}
+
+/* Carry on decoding into the next chunk until we reach a block it decoded
+ * too, which makes that block and every one after it correct */
+static void *synchronise_job(void *arg) {
+   spec_chunk      *chunk = arg;
+   spec_chunk      *next  = &chunk->scan->chunks[chunk->index + 1];
+   const spec_list *guess = next->speculated;
+   size_t           i     = 0;
+   int              done  = chunk->failed || next->failed;
+   while (!done) {
+      size_t position = stream_position(chunk);
+      while (i < guess->num_blocks && guess->blocks[i].position < position) {
+         i += 1;
+      }
+      if (i == guess->num_blocks) {
+         chunk->failed = 1;
+         done = 1;
+      } else if (   guess->blocks[i].position == position
+                 && guess->blocks[i].unit     == chunk->unit) {
+         next->first_valid = i;
+         done = 1;
+      } else if (decode_next_block(chunk, chunk->extension)) {
+         chunk->failed = 1;
+         done = 1;
+      }
+   }
+   return NULL;
+}
+
+/* Sum the DC deltas of each component over the chunk's valid blocks */
+static void *sum_dc_job(void *arg) {
+   spec_chunk *chunk = arg;
+   spec_scan  *scan  = chunk->scan;
+   size_t      num_valid = chunk_num_valid(chunk);
+   size_t      n;
+   memset(chunk->dc, 0, sizeof(chunk->dc));
+   for (n = 0; n < num_valid && chunk->first_index + n < scan->num_blocks; n++) {
+      const spec_block *block = chunk_valid_block(chunk, n);
+      chunk->dc[scan->unit_component[block->unit]] += block->dc_delta;
+   }
+   return NULL;
+}
+
+/* Fill in the DC coefficients, starting from the predictors at the start of
+ * the chunk, and list the chunk's blocks in scan order */
+static void *fix_dc_job(void *arg) {
+   spec_chunk *chunk = arg;
+   spec_scan  *scan  = chunk->scan;
+   size_t      num_valid = chunk_num_valid(chunk);
+   int         dc[NUM_COMPONENTS];
+   size_t      n;
+   memcpy(dc, chunk->dc, sizeof(dc));
+   for (n = 0; n < num_valid && chunk->first_index + n < scan->num_blocks; n++) {
+      spec_block  *block = chunk_valid_block(chunk, n);
+      unsigned int c     = scan->unit_component[block->unit];
+      dc[c] += block->dc_delta;
+      block->coeffs[0] = convert_dequantise(dc[c], scan->multipliers[c][0]);
+      scan->blocks[chunk->first_index + n] = block;
+   }
+   return NULL;
+}
+
+static void *convert_job(void *arg) {
+   spec_convert_job *job   = arg;
+   spec_scan        *scan  = job->scan;
+   convert_state    *state = job->state;
+   size_t            mcu;
+   for (mcu = job->first_mcu; mcu < job->first_mcu + job->num_mcus; mcu++) {
+      unsigned int u;
+      if (!convert_mcu_visible(state, mcu)) {
+         continue;
+      }
+      for (u = 0; u < scan->num_units; u++) {
+         const spec_block *block = scan->blocks[mcu * scan->num_units + u];
+         convert_transform_block(state, &state->blocks[u], block->coeffs, block->last_nonzero);
+      }
+      convert_write_mcu(state, mcu);
+   }
+   return NULL;
+}
+
+/* Check the chunks line up, and number their valid blocks */
+static int stitch(spec_scan *scan) {
+   size_t       index = 0;
+   unsigned int i;
+   for (i = 0; i < scan->num_chunks; i++) {
+      spec_chunk *chunk = &scan->chunks[i];
+      if (chunk->failed) {
+         return 1;
+      }
+      if (   index < scan->num_blocks
+          && chunk_num_valid(chunk) > 0
+          && chunk_valid_block(chunk, 0)->unit != index % scan->num_units) {
+         return 1;
+      }
+      chunk->first_index = index;
+      index += chunk_num_valid(chunk);
+   }
+   /* The last chunk may have picked up spurious blocks from the fill bits */
+   return index < scan->num_blocks;
+}
+
+static void init_layout(spec_scan *scan, const convert_options *options) {
+   const frame    *f = scan->j->frame;
+   jpeg_dct_method method = convert_dct_method(options);
+   unsigned int    c;
+   scan->num_units = 0;
+   for (c = 0; c < f->num_components; c++) {
+      const component *component = &f->components[c];
+      unsigned int     n;
+      for (n = 0; n < component->sampling_factor_vertical * component->sampling_factor_horizontal; n++) {
+         scan->unit_component[scan->num_units] = c;
+         scan->num_units += 1;
+      }
+      scan->multipliers[c] = qtable_get_multipliers(scan->j->qtables[component->qtable_id], method);
+   }
+}
+
+convert_spec_cache *convert_spec_cache_create(jpeg_arena *arena) {
+   convert_spec_cache *cache = jpeg_arena_alloc(arena, sizeof(convert_spec_cache));
+   cache->lists     = NULL;
+   cache->num_lists = 0;
+   return cache;
+}
+
+void convert_spec_cache_destroy(convert_spec_cache *cache) {
+   unsigned int i;
+   for (i = 0; i < cache->num_lists; i++) {
+      free(cache->lists[i].blocks);
+   }
+   free(cache->lists);
+   cache->lists     = NULL;
+   cache->num_lists = 0;
+}
+
+size_t convert_speculative_bytes(const jpeg *j) {
+   size_t       num_units = 0;
+   unsigned int c;
+   for (c = 0; c < j->frame->num_components; c++) {
+      num_units += j->frame->components[c].sampling_factor_horizontal
+                 * j->frame->components[c].sampling_factor_vertical;
+   }
+   return convert_num_mcus(j) * num_units * (sizeof(spec_block) + sizeof(spec_block *));
+}
+
+int convert_decode_speculative(const jpeg            *j
+                              ,const convert_options *options
+                              ,bitmap                *b
+                              ,convert_planes        *planes
+                              ,unsigned int           num_threads
+                              ,int                   *error) {
+   spec_scan          scan;
+   spec_convert_job  *jobs;
+   convert_spec_cache own_cache = {NULL, 0};
+   convert_spec_cache *cache    = j->spec_cache ? j->spec_cache : &own_cache;
+   size_t            scan_end;
+   size_t            stuff_bytes = 0;
+   size_t            total_mcus  = convert_num_mcus(j);
+   size_t            needed_mcus = convert_num_mcus_needed(j, options);
+   unsigned int      i;
+   int               ok;
+   scan.j      = j;
+   scan.stream = j->scan_start->stream;
+   scan_end    = jpeg_stream_find_scan_end(scan.stream);
+   scan.num_chunks = (unsigned int) (scan_end / SPECULATIVE_MIN_CHUNK_BYTES);
+   if (scan.num_chunks > num_threads) {
+      scan.num_chunks = num_threads;
+   }
+   if (scan.num_chunks < 2) {
+      return 0;
+   }
+   init_layout(&scan, options);
+   scan.num_blocks = total_mcus * scan.num_units;
+   if (cache->num_lists < 2 * scan.num_chunks) {
+      cache->lists = realloc(cache->lists, 2 * scan.num_chunks * sizeof(spec_list));
+      assert(cache->lists);
+      memset(&cache->lists[cache->num_lists], 0, (2 * scan.num_chunks - cache->num_lists) * sizeof(spec_list));
+      cache->num_lists = 2 * scan.num_chunks;
+   }
+   /* The caller releases the arena once the image is done */
+   scan.chunks = jpeg_arena_alloc(j->arena, scan.num_chunks * sizeof(spec_chunk));
+   memset(scan.chunks, 0, scan.num_chunks * sizeof(spec_chunk));
+   for (i = 0; i < scan.num_chunks; i++) {
+      spec_chunk *chunk = &scan.chunks[i];
+      chunk->scan       = &scan;
+      chunk->index      = i;
+      chunk->state      = convert_state_create(j, options, b, jpeg_arena_alloc(j->arena, sizeof(jpeg_stream)));
+      chunk->state->planes = planes;
+      chunk->speculated = &cache->lists[2 * i];
+      chunk->extension  = &cache->lists[2 * i + 1];
+      chunk->speculated->num_blocks = 0;
+      chunk->extension->num_blocks  = 0;
+      chunk->start = i == 0 ? 0 : jpeg_stream_split_point(scan.stream, (size_t) i * scan_end / scan.num_chunks);
+   }
+   for (i = 0; i < scan.num_chunks; i++) {
+      spec_chunk *chunk = &scan.chunks[i];
+      chunk->end        = i + 1 < scan.num_chunks ? scan.chunks[i + 1].start : scan_end;
+      chunk->start_bits = (chunk->start - stuff_bytes) * 8;
+      stuff_bytes      += jpeg_stream_count_stuff_bytes(scan.stream, chunk->start, chunk->end);
+      chunk->end_bits   = (chunk->end - stuff_bytes) * 8;
+   }
+   convert_run_jobs(scan.j, speculate_job, scan.chunks, sizeof(spec_chunk), scan.num_chunks);
+   convert_run_jobs(scan.j, synchronise_job, scan.chunks, sizeof(spec_chunk), scan.num_chunks - 1);
+   ok = !stitch(&scan);
+   if (ok) {
+      int dc[NUM_COMPONENTS] = {0};
+      unsigned int c;
+      scan.blocks = jpeg_arena_alloc(j->arena, scan.num_blocks * sizeof(spec_block *));
+      convert_run_jobs(scan.j, sum_dc_job, scan.chunks, sizeof(spec_chunk), scan.num_chunks);
+      /* Turn the sums into the predictors at the start of each chunk */
+      for (i = 0; i < scan.num_chunks; i++) {
+         for (c = 0; c < NUM_COMPONENTS; c++) {
+            int sum = scan.chunks[i].dc[c];
+            scan.chunks[i].dc[c] = dc[c];
+            dc[c] += sum;
+         }
+      }
+      convert_run_jobs(scan.j, fix_dc_job, scan.chunks, sizeof(spec_chunk), scan.num_chunks);
+      jobs = jpeg_arena_alloc(j->arena, scan.num_chunks * sizeof(spec_convert_job));
+      for (i = 0; i < scan.num_chunks; i++) {
+         jobs[i].scan      = &scan;
+         jobs[i].state     = scan.chunks[i].state;
+         jobs[i].first_mcu = i * needed_mcus / scan.num_chunks;
+         jobs[i].num_mcus  = (i + 1) * needed_mcus / scan.num_chunks - jobs[i].first_mcu;
+      }
+      convert_run_jobs(scan.j, convert_job, jobs, sizeof(spec_convert_job), scan.num_chunks);
+      *error = 0;
+   }
+   for (i = 0; i < scan.num_chunks; i++) {
+      convert_state_destroy(scan.chunks[i].state);
+   }
+   if (cache == &own_cache) {
+      convert_spec_cache_destroy(cache);
+   }
+   return ok;
+}
@@ -0,0 +1,33 @@
+/* For sysconf(_SC_NPROCESSORS_ONLN) under --std=c99 */
+#define _DEFAULT_SOURCE
+
+#include "cpu.h"
+
+#include <unistd.h>
+
+cpu_simd cpu_simd_level(void) {
+#if defined(JAPEG_FORCE_SIMD_NONE)
+   return CPU_SIMD_NONE;
+#elif defined(JAPEG_FORCE_SIMD_SSE2)
+   return CPU_SIMD_SSE2;
+#elif defined(JAPEG_FORCE_SIMD_AVX2)
+   return CPU_SIMD_AVX2;
+#elif CPU_X86 && defined(__GNUC__)
+   /* Reads the cpuid results cached by the compiler runtime */
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      return CPU_SIMD_AVX2;
+   }
+   if (__builtin_cpu_supports("sse2")) {
+      return CPU_SIMD_SSE2;
+   }
+   return CPU_SIMD_NONE;
+#else
+   return CPU_SIMD_NONE;
+#endif
+}
+
+unsigned int cpu_num_cores(void) {
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   return cores > 0 ? (unsigned int) cores : 1;
+}
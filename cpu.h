@@ -0,0 +1,25 @@
+#ifndef CPU_H
+#define CPU_H
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define CPU_X86 1
+#else
+#define CPU_X86 0
+#endif
+
+/* Instruction set levels, each implying the ones before it */
+typedef enum {
+   CPU_SIMD_NONE = 0,
+   CPU_SIMD_SSE2 = 1,
+   CPU_SIMD_AVX2 = 2
+} cpu_simd;
+
+/* Best SIMD level the running CPU supports. Building with one of
+ * JAPEG_FORCE_SIMD_NONE, JAPEG_FORCE_SIMD_SSE2 or JAPEG_FORCE_SIMD_AVX2
+ * defined skips detection and always uses that level. */
+cpu_simd cpu_simd_level(void);
+
+/* Number of online processors, at least 1 */
+unsigned int cpu_num_cores(void);
+
+#endif
@@ -1,37 +1,529 @@
 #include "dct.h"
 #include "jpeg_internal.h"
 
-#include <math.h>
-#include <stdio.h>
-
-void dct_inverse(int   chunk [JPEG_CHUNK_NUM_SAMPLES]
-                ,float pixels[JPEG_CHUNK_SIDE_LENGTH][JPEG_CHUNK_SIDE_LENGTH]) {
-   unsigned int x, y;
-   /* Super naive and inefficient version for the moment */
-   for (x = 0; x < JPEG_CHUNK_SIDE_LENGTH; x++) {
-      for (y = 0; y < JPEG_CHUNK_SIDE_LENGTH; y++) {
-         unsigned int u, v;
-         pixels[x][y] = 0.0f;
-         for (u = 0; u < JPEG_CHUNK_SIDE_LENGTH; u++) {
-            float u_scaling_factor = 1.0f;
-            if (u == 0) {
-               u_scaling_factor = 1.0f / sqrt(2);
-            }
-            for (v = 0; v < JPEG_CHUNK_SIDE_LENGTH; v++) {
-               float v_scaling_factor = 1.0f;
-               if (v == 0) {
-                  v_scaling_factor = 1.0f / sqrt(2);
-               }
-               pixels[x][y] += (float) chunk[u * JPEG_CHUNK_SIDE_LENGTH + v]
-                              * cosf((2.0f * (float) x + 1.0f) / 16.0f * (float) u * M_PI)
-                              * cosf((2.0f * (float) y + 1.0f) / 16.0f * (float) v * M_PI)
-                              * u_scaling_factor
-                              * v_scaling_factor;
-            }
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+
+/* Fast scaled integer IDCT, after Arai, Agui and Nakajima. The scale
+ * factors that AAN leaves over are folded into the dequantisation, so
+ * only five multiplications are needed per 1-D pass. */
+#define IFAST_CONST_BITS  8
+#define IFAST_PASS1_BITS  DCT_IFAST_SCALE_BITS
+
+#define IFAST_FIX_1_082392200  ((int32_t) 277)
+#define IFAST_FIX_1_414213562  ((int32_t) 362)
+#define IFAST_FIX_1_847759065  ((int32_t) 473)
+#define IFAST_FIX_2_613125930  ((int32_t) 669)
+
+#define IFAST_MULTIPLY(v, c) DESCALE((v) * (c), IFAST_CONST_BITS)
+
+const int dct_aan_scales[JPEG_CHUNK_NUM_SAMPLES]
+                        = {16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520
+                          ,22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270
+                          ,21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906
+                          ,19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315
+                          ,16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520
+                          ,12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552
+                          , 8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446
+                          , 4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247};
+
+/* basis[x][u] = C(u) / 2 * cos((2x + 1) * u * pi / 16), C(0) = 1 / sqrt(2) */
+static const float basis[JPEG_CHUNK_SIDE_LENGTH][JPEG_CHUNK_SIDE_LENGTH]
+   = {{0.353553391f,  0.490392640f,  0.461939766f,  0.415734806f,  0.353553391f,  0.277785117f,  0.191341716f,  0.097545161f}
+     ,{0.353553391f,  0.415734806f,  0.191341716f, -0.097545161f, -0.353553391f, -0.490392640f, -0.461939766f, -0.277785117f}
+     ,{0.353553391f,  0.277785117f, -0.191341716f, -0.490392640f, -0.353553391f,  0.097545161f,  0.461939766f,  0.415734806f}
+     ,{0.353553391f,  0.097545161f, -0.461939766f, -0.277785117f,  0.353553391f,  0.415734806f, -0.191341716f, -0.490392640f}
+     ,{0.353553391f, -0.097545161f, -0.461939766f,  0.277785117f,  0.353553391f, -0.415734806f, -0.191341716f,  0.490392640f}
+     ,{0.353553391f, -0.277785117f, -0.191341716f,  0.490392640f, -0.353553391f, -0.097545161f,  0.461939766f, -0.415734806f}
+     ,{0.353553391f, -0.415734806f,  0.191341716f,  0.097545161f, -0.353553391f,  0.490392640f, -0.461939766f,  0.277785117f}
+     ,{0.353553391f, -0.490392640f,  0.461939766f, -0.415734806f,  0.353553391f, -0.277785117f,  0.191341716f, -0.097545161f}};
+
+static unsigned char range_limit(int32_t x) {
+   if (x < 0) {
+      return 0;
+   } else if (x > 255) {
+      return 255;
+   }
+   return (unsigned char) x;
+}
+
+static void fill_block(unsigned char value, unsigned char *out, size_t out_stride) {
+   unsigned int i;
+   for (i = 0; i < JPEG_CHUNK_SIDE_LENGTH; i++) {
+      memset(&out[i * out_stride], value, JPEG_CHUNK_SIDE_LENGTH);
+   }
+}
+
+/* Inputs past the nonzero corner of a reduced block are known to be zero.
+ * With size a compile time constant the compiler drops them entirely. */
+#define TERM(p, k, size, step) ((k) < (size) ? (int32_t) (p)[(k) * (step)] : 0)
+
+/* 1-D islow pass down one column, for a block whose nonzero coefficients
+ * all lie in the top left size x size corner */
+static inline void islow_column(const int16_t *in, int32_t *ws, const unsigned int size) {
+   int32_t tmp0, tmp1, tmp2, tmp3;
+   int32_t tmp10, tmp11, tmp12, tmp13;
+   int32_t z1, z2, z3, z4, z5;
+   if (   TERM(in, 1, size, 8) == 0 && TERM(in, 2, size, 8) == 0
+       && TERM(in, 3, size, 8) == 0 && TERM(in, 4, size, 8) == 0
+       && TERM(in, 5, size, 8) == 0 && TERM(in, 6, size, 8) == 0
+       && TERM(in, 7, size, 8) == 0) {
+      /* Column has no AC terms, so its output is constant */
+      int32_t dc = (int32_t) in[0] * (DCT_ONE << ISLOW_PASS1_BITS);
+      ws[0] = ws[8] = ws[16] = ws[24] = ws[32] = ws[40] = ws[48] = ws[56] = dc;
+      return;
+   }
+   /* Even part */
+   z2 = TERM(in, 2, size, 8);
+   z3 = TERM(in, 6, size, 8);
+   z1 = (z2 + z3) * FIX_0_541196100;
+   tmp2 = z1 + z3 * (-FIX_1_847759065);
+   tmp3 = z1 + z2 *   FIX_0_765366865;
+   z2 = in[0];
+   z3 = TERM(in, 4, size, 8);
+   tmp0 = (z2 + z3) * (DCT_ONE << ISLOW_CONST_BITS);
+   tmp1 = (z2 - z3) * (DCT_ONE << ISLOW_CONST_BITS);
+   tmp10 = tmp0 + tmp3;
+   tmp13 = tmp0 - tmp3;
+   tmp11 = tmp1 + tmp2;
+   tmp12 = tmp1 - tmp2;
+   /* Odd part */
+   tmp0 = TERM(in, 7, size, 8);
+   tmp1 = TERM(in, 5, size, 8);
+   tmp2 = TERM(in, 3, size, 8);
+   tmp3 = TERM(in, 1, size, 8);
+   z1 = tmp0 + tmp3;
+   z2 = tmp1 + tmp2;
+   z3 = tmp0 + tmp2;
+   z4 = tmp1 + tmp3;
+   z5 = (z3 + z4) * FIX_1_175875602;
+   tmp0 *=  FIX_0_298631336;
+   tmp1 *=  FIX_2_053119869;
+   tmp2 *=  FIX_3_072711026;
+   tmp3 *=  FIX_1_501321110;
+   z1   *= -FIX_0_899976223;
+   z2   *= -FIX_2_562915447;
+   z3   *= -FIX_1_961570560;
+   z4   *= -FIX_0_390180644;
+   z3 += z5;
+   z4 += z5;
+   tmp0 += z1 + z3;
+   tmp1 += z2 + z4;
+   tmp2 += z2 + z3;
+   tmp3 += z1 + z4;
+   ws[0]  = DESCALE(tmp10 + tmp3, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   ws[56] = DESCALE(tmp10 - tmp3, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   ws[8]  = DESCALE(tmp11 + tmp2, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   ws[48] = DESCALE(tmp11 - tmp2, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   ws[16] = DESCALE(tmp12 + tmp1, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   ws[40] = DESCALE(tmp12 - tmp1, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   ws[24] = DESCALE(tmp13 + tmp0, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   ws[32] = DESCALE(tmp13 - tmp0, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+}
+
+/* 1-D islow pass along one row of the workspace. The extra factor of 8 in
+ * the descale comes from the 1/8 normalisation of the 2-D transform. */
+static inline void islow_row(const int32_t *ws, unsigned char *row, const unsigned int size) {
+   int32_t tmp0, tmp1, tmp2, tmp3;
+   int32_t tmp10, tmp11, tmp12, tmp13;
+   int32_t z1, z2, z3, z4, z5;
+   /* Even part */
+   z2 = TERM(ws, 2, size, 1);
+   z3 = TERM(ws, 6, size, 1);
+   z1 = (z2 + z3) * FIX_0_541196100;
+   tmp2 = z1 + z3 * (-FIX_1_847759065);
+   tmp3 = z1 + z2 *   FIX_0_765366865;
+   tmp0 = (ws[0] + TERM(ws, 4, size, 1)) * (DCT_ONE << ISLOW_CONST_BITS);
+   tmp1 = (ws[0] - TERM(ws, 4, size, 1)) * (DCT_ONE << ISLOW_CONST_BITS);
+   tmp10 = tmp0 + tmp3;
+   tmp13 = tmp0 - tmp3;
+   tmp11 = tmp1 + tmp2;
+   tmp12 = tmp1 - tmp2;
+   /* Odd part */
+   tmp0 = TERM(ws, 7, size, 1);
+   tmp1 = TERM(ws, 5, size, 1);
+   tmp2 = TERM(ws, 3, size, 1);
+   tmp3 = TERM(ws, 1, size, 1);
+   z1 = tmp0 + tmp3;
+   z2 = tmp1 + tmp2;
+   z3 = tmp0 + tmp2;
+   z4 = tmp1 + tmp3;
+   z5 = (z3 + z4) * FIX_1_175875602;
+   tmp0 *=  FIX_0_298631336;
+   tmp1 *=  FIX_2_053119869;
+   tmp2 *=  FIX_3_072711026;
+   tmp3 *=  FIX_1_501321110;
+   z1   *= -FIX_0_899976223;
+   z2   *= -FIX_2_562915447;
+   z3   *= -FIX_1_961570560;
+   z4   *= -FIX_0_390180644;
+   z3 += z5;
+   z4 += z5;
+   tmp0 += z1 + z3;
+   tmp1 += z2 + z4;
+   tmp2 += z2 + z3;
+   tmp3 += z1 + z4;
+#define ISLOW_OUT(x) range_limit(DESCALE((x), ISLOW_CONST_BITS + ISLOW_PASS1_BITS + 3) + DCT_LEVEL_SHIFT)
+   row[0] = ISLOW_OUT(tmp10 + tmp3);
+   row[7] = ISLOW_OUT(tmp10 - tmp3);
+   row[1] = ISLOW_OUT(tmp11 + tmp2);
+   row[6] = ISLOW_OUT(tmp11 - tmp2);
+   row[2] = ISLOW_OUT(tmp12 + tmp1);
+   row[5] = ISLOW_OUT(tmp12 - tmp1);
+   row[3] = ISLOW_OUT(tmp13 + tmp0);
+   row[4] = ISLOW_OUT(tmp13 - tmp0);
+#undef ISLOW_OUT
+}
+
+/* Columns past size are all zero, so their workspace columns are too */
+static inline void islow_reduced(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                                ,unsigned char *out
+                                ,size_t         out_stride
+                                ,const unsigned int size) {
+   int32_t workspace[JPEG_CHUNK_NUM_SAMPLES];
+   unsigned int i;
+   for (i = 0; i < size; i++) {
+      islow_column(&coeffs[i], &workspace[i], size);
+   }
+   for (i = 0; i < JPEG_CHUNK_SIDE_LENGTH; i++) {
+      islow_row(&workspace[i * JPEG_CHUNK_SIDE_LENGTH], &out[i * out_stride], size);
+   }
+}
+
+void dct_inverse_islow(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                      ,unsigned char *out
+                      ,size_t         out_stride) {
+   islow_reduced(coeffs, out, out_stride, JPEG_CHUNK_SIDE_LENGTH);
+}
+
+void dct_inverse_islow_4x4(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                          ,unsigned char *out
+                          ,size_t         out_stride) {
+   islow_reduced(coeffs, out, out_stride, 4);
+}
+
+void dct_inverse_islow_2x2(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                          ,unsigned char *out
+                          ,size_t         out_stride) {
+   islow_reduced(coeffs, out, out_stride, 2);
+}
+
+/* Both passes of islow leave a lone DC term as a constant */
+void dct_inverse_islow_dc(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                         ,unsigned char *out
+                         ,size_t         out_stride) {
+   int32_t dc = (int32_t) coeffs[0] * (DCT_ONE << ISLOW_PASS1_BITS);
+   fill_block(range_limit(DESCALE(dc, ISLOW_PASS1_BITS + 3) + DCT_LEVEL_SHIFT), out, out_stride);
+}
+
+void dct_inverse_ifast(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                      ,unsigned char *out
+                      ,size_t         out_stride) {
+   int32_t workspace[JPEG_CHUNK_NUM_SAMPLES];
+   int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+   int32_t tmp10, tmp11, tmp12, tmp13;
+   int32_t z5, z10, z11, z12, z13;
+   unsigned int i;
+   /* Pass 1: process columns, storing into the workspace */
+   for (i = 0; i < JPEG_CHUNK_SIDE_LENGTH; i++) {
+      const int16_t *in = &coeffs[i];
+      int32_t       *ws = &workspace[i];
+      if (   in[8]  == 0 && in[16] == 0 && in[24] == 0 && in[32] == 0
+          && in[40] == 0 && in[48] == 0 && in[56] == 0) {
+         int32_t dc = in[0];
+         ws[0] = ws[8] = ws[16] = ws[24] = ws[32] = ws[40] = ws[48] = ws[56] = dc;
+         continue;
+      }
+      /* Even part */
+      tmp0 = in[0];
+      tmp1 = in[16];
+      tmp2 = in[32];
+      tmp3 = in[48];
+      tmp10 = tmp0 + tmp2;
+      tmp11 = tmp0 - tmp2;
+      tmp13 = tmp1 + tmp3;
+      tmp12 = IFAST_MULTIPLY(tmp1 - tmp3, IFAST_FIX_1_414213562) - tmp13;
+      tmp0 = tmp10 + tmp13;
+      tmp3 = tmp10 - tmp13;
+      tmp1 = tmp11 + tmp12;
+      tmp2 = tmp11 - tmp12;
+      /* Odd part */
+      tmp4 = in[8];
+      tmp5 = in[24];
+      tmp6 = in[40];
+      tmp7 = in[56];
+      z13 = tmp6 + tmp5;
+      z10 = tmp6 - tmp5;
+      z11 = tmp4 + tmp7;
+      z12 = tmp4 - tmp7;
+      tmp7  = z11 + z13;
+      tmp11 = IFAST_MULTIPLY(z11 - z13, IFAST_FIX_1_414213562);
+      z5    = IFAST_MULTIPLY(z10 + z12, IFAST_FIX_1_847759065);
+      tmp10 = IFAST_MULTIPLY(z12,  IFAST_FIX_1_082392200) - z5;
+      tmp12 = IFAST_MULTIPLY(z10, -IFAST_FIX_2_613125930) + z5;
+      tmp6 = tmp12 - tmp7;
+      tmp5 = tmp11 - tmp6;
+      tmp4 = tmp10 + tmp5;
+      ws[0]  = tmp0 + tmp7;
+      ws[56] = tmp0 - tmp7;
+      ws[8]  = tmp1 + tmp6;
+      ws[48] = tmp1 - tmp6;
+      ws[16] = tmp2 + tmp5;
+      ws[40] = tmp2 - tmp5;
+      ws[32] = tmp3 + tmp4;
+      ws[24] = tmp3 - tmp4;
+   }
+   /* Pass 2: process rows from the workspace */
+   for (i = 0; i < JPEG_CHUNK_SIDE_LENGTH; i++) {
+      int32_t       *ws  = &workspace[i * JPEG_CHUNK_SIDE_LENGTH];
+      unsigned char *row = &out[i * out_stride];
+      /* Even part */
+      tmp10 = ws[0] + ws[4];
+      tmp11 = ws[0] - ws[4];
+      tmp13 = ws[2] + ws[6];
+      tmp12 = IFAST_MULTIPLY(ws[2] - ws[6], IFAST_FIX_1_414213562) - tmp13;
+      tmp0 = tmp10 + tmp13;
+      tmp3 = tmp10 - tmp13;
+      tmp1 = tmp11 + tmp12;
+      tmp2 = tmp11 - tmp12;
+      /* Odd part */
+      z13 = ws[5] + ws[3];
+      z10 = ws[5] - ws[3];
+      z11 = ws[1] + ws[7];
+      z12 = ws[1] - ws[7];
+      tmp7  = z11 + z13;
+      tmp11 = IFAST_MULTIPLY(z11 - z13, IFAST_FIX_1_414213562);
+      z5    = IFAST_MULTIPLY(z10 + z12, IFAST_FIX_1_847759065);
+      tmp10 = IFAST_MULTIPLY(z12,  IFAST_FIX_1_082392200) - z5;
+      tmp12 = IFAST_MULTIPLY(z10, -IFAST_FIX_2_613125930) + z5;
+      tmp6 = tmp12 - tmp7;
+      tmp5 = tmp11 - tmp6;
+      tmp4 = tmp10 + tmp5;
+#define IFAST_OUT(x) range_limit(DESCALE((x), IFAST_PASS1_BITS + 3) + DCT_LEVEL_SHIFT)
+      row[0] = IFAST_OUT(tmp0 + tmp7);
+      row[7] = IFAST_OUT(tmp0 - tmp7);
+      row[1] = IFAST_OUT(tmp1 + tmp6);
+      row[6] = IFAST_OUT(tmp1 - tmp6);
+      row[2] = IFAST_OUT(tmp2 + tmp5);
+      row[5] = IFAST_OUT(tmp2 - tmp5);
+      row[4] = IFAST_OUT(tmp3 + tmp4);
+      row[3] = IFAST_OUT(tmp3 - tmp4);
+#undef IFAST_OUT
+   }
+}
+
+/* ifast passes a lone DC term straight through both passes */
+void dct_inverse_ifast_dc(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                         ,unsigned char *out
+                         ,size_t         out_stride) {
+   int32_t dc = coeffs[0];
+   fill_block(range_limit(DESCALE(dc, IFAST_PASS1_BITS + 3) + DCT_LEVEL_SHIFT), out, out_stride);
+}
+
+/* Separable floating point IDCT, kept as the high precision reference.
+ * Rows and columns of coefficients past size are skipped. The side-point
+ * basis is every (8 / side)th column of the 8-point one. */
+static inline void float_idct(const int16_t coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                             ,unsigned int  size
+                             ,float        *out
+                             ,size_t        out_stride
+                             ,const unsigned int side) {
+   const unsigned int step = JPEG_CHUNK_SIDE_LENGTH / side;
+   float workspace[JPEG_CHUNK_SIDE_LENGTH][JPEG_CHUNK_SIDE_LENGTH];
+   unsigned int x, y, u, v;
+   /* Pass 1: transform each row of coefficients */
+   for (u = 0; u < size; u++) {
+      for (y = 0; y < side; y++) {
+         float sum = 0.0f;
+         for (v = 0; v < size; v++) {
+            sum += (float) coeffs[u * JPEG_CHUNK_SIDE_LENGTH + v] * basis[y][v * step];
          }
-         /* Do level shift */
-         pixels[x][y] *= 0.25f;
-         pixels[x][y] += 128.0f;
+         workspace[u][y] = sum;
       }
    }
+   /* Pass 2: transform each column */
+   for (x = 0; x < side; x++) {
+      for (y = 0; y < side; y++) {
+         float sum = 0.0f;
+         for (u = 0; u < size; u++) {
+            sum += basis[x][u * step] * workspace[u][y];
+         }
+         out[x * out_stride + y] = sum + (float) DCT_LEVEL_SHIFT;
+      }
+   }
+}
+
+void dct_inverse_float(const int16_t coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                      ,unsigned int  size
+                      ,float        *out
+                      ,size_t        out_stride) {
+   float_idct(coeffs, size, out, out_stride, JPEG_CHUNK_SIDE_LENGTH);
+}
+
+void dct_inverse_float_scaled(const int16_t coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                             ,unsigned int  size
+                             ,unsigned int  side
+                             ,float        *out
+                             ,size_t        out_stride) {
+   if (size > side) {
+      size = side;
+   }
+   switch (side) {
+      case 4:
+         float_idct(coeffs, size, out, out_stride, 4);
+         break;
+      case 2:
+         float_idct(coeffs, size, out, out_stride, 2);
+         break;
+      case 1:
+         float_idct(coeffs, size, out, out_stride, 1);
+         break;
+      default:
+         float_idct(coeffs, size, out, out_stride, JPEG_CHUNK_SIDE_LENGTH);
+         break;
+   }
+}
+
+/* 4-point islow on the top left 4x4 coefficients. The even part is the
+ * 2-point transform of terms 0 and 2, and the odd part is the rotation
+ * islow uses for its even part. */
+void dct_inverse_islow_scaled_4x4(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                                 ,unsigned char *out
+                                 ,size_t         out_stride) {
+   int32_t workspace[4 * 4];
+   int32_t tmp0, tmp2, tmp10, tmp12;
+   int32_t z1, z2, z3;
+   unsigned int i;
+   for (i = 0; i < 4; i++) {
+      const int16_t *in = &coeffs[i];
+      int32_t       *ws = &workspace[i];
+      /* Even part */
+      tmp0 = in[0];
+      tmp2 = in[16];
+      tmp10 = (tmp0 + tmp2) * (DCT_ONE << ISLOW_PASS1_BITS);
+      tmp12 = (tmp0 - tmp2) * (DCT_ONE << ISLOW_PASS1_BITS);
+      /* Odd part */
+      z2 = in[8];
+      z3 = in[24];
+      z1 = (z2 + z3) * FIX_0_541196100;
+      tmp0 = DESCALE(z1 + z2 * FIX_0_765366865, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+      tmp2 = DESCALE(z1 - z3 * FIX_1_847759065, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+      ws[0]  = tmp10 + tmp0;
+      ws[12] = tmp10 - tmp0;
+      ws[4]  = tmp12 + tmp2;
+      ws[8]  = tmp12 - tmp2;
+   }
+   for (i = 0; i < 4; i++) {
+      const int32_t *ws  = &workspace[i * 4];
+      unsigned char *row = &out[i * out_stride];
+      /* Even part */
+      tmp10 = (ws[0] + ws[2]) * (DCT_ONE << ISLOW_CONST_BITS);
+      tmp12 = (ws[0] - ws[2]) * (DCT_ONE << ISLOW_CONST_BITS);
+      /* Odd part */
+      z2 = ws[1];
+      z3 = ws[3];
+      z1 = (z2 + z3) * FIX_0_541196100;
+      tmp0 = z1 + z2 * FIX_0_765366865;
+      tmp2 = z1 - z3 * FIX_1_847759065;
+#define ISLOW_OUT(x) range_limit(DESCALE((x), ISLOW_CONST_BITS + ISLOW_PASS1_BITS + 3) + DCT_LEVEL_SHIFT)
+      row[0] = ISLOW_OUT(tmp10 + tmp0);
+      row[3] = ISLOW_OUT(tmp10 - tmp0);
+      row[1] = ISLOW_OUT(tmp12 + tmp2);
+      row[2] = ISLOW_OUT(tmp12 - tmp2);
+#undef ISLOW_OUT
+   }
+}
+
+/* The 2-point transform is just a sum and a difference */
+void dct_inverse_islow_scaled_2x2(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                                 ,unsigned char *out
+                                 ,size_t         out_stride) {
+   int32_t top     = (int32_t) coeffs[0] + coeffs[8];
+   int32_t bottom  = (int32_t) coeffs[0] - coeffs[8];
+   int32_t top1    = (int32_t) coeffs[1] + coeffs[9];
+   int32_t bottom1 = (int32_t) coeffs[1] - coeffs[9];
+   out[0]              = range_limit(DESCALE(top + top1, 3) + DCT_LEVEL_SHIFT);
+   out[1]              = range_limit(DESCALE(top - top1, 3) + DCT_LEVEL_SHIFT);
+   out[out_stride]     = range_limit(DESCALE(bottom + bottom1, 3) + DCT_LEVEL_SHIFT);
+   out[out_stride + 1] = range_limit(DESCALE(bottom - bottom1, 3) + DCT_LEVEL_SHIFT);
+}
+
+void dct_inverse_islow_scaled_1x1(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                                 ,unsigned char *out
+                                 ,size_t         out_stride) {
+   (void) out_stride;
+   out[0] = range_limit(DESCALE((int32_t) coeffs[0], 3) + DCT_LEVEL_SHIFT);
+}
+
+void dct_select(jpeg_dct_method  method
+               ,unsigned int     side
+               ,dct_kernel       kernels[DCT_NUM_PATHS]
+               ,dct_path         counted[DCT_NUM_PATHS]) {
+   unsigned int i;
+   for (i = 0; i < DCT_NUM_PATHS; i++) {
+      counted[i] = (dct_path) i;
+   }
+   if (side != JPEG_CHUNK_SIDE_LENGTH) {
+      /* Only the corner matters, so one kernel does for every path */
+      dct_kernel kernel = side == 4 ? dct_inverse_islow_scaled_4x4
+                        : side == 2 ? dct_inverse_islow_scaled_2x2
+                        :             dct_inverse_islow_scaled_1x1;
+      for (i = 0; i < DCT_NUM_PATHS; i++) {
+         kernels[i] = kernel;
+         counted[i] = DCT_PATH_FULL;
+      }
+      return;
+   }
+   if (method == JPEG_DCT_IFAST) {
+      kernels[DCT_PATH_DC_ONLY] = dct_inverse_ifast_dc;
+      kernels[DCT_PATH_2X2]     = dct_inverse_ifast;
+      kernels[DCT_PATH_4X4]     = dct_inverse_ifast;
+      kernels[DCT_PATH_FULL]    = dct_inverse_ifast;
+      counted[DCT_PATH_2X2]     = DCT_PATH_FULL;
+      counted[DCT_PATH_4X4]     = DCT_PATH_FULL;
+      return;
+   }
+   kernels[DCT_PATH_DC_ONLY] = dct_inverse_islow_dc;
+   kernels[DCT_PATH_2X2]     = dct_inverse_islow_2x2;
+   kernels[DCT_PATH_4X4]     = dct_inverse_islow_4x4;
+   kernels[DCT_PATH_FULL]    = dct_inverse_islow;
+#if CPU_X86
+   /* The vector kernels cost the same whatever the block holds, and still
+    * beat the scalar reduced ones, so only the DC only path stays scalar */
+   switch (cpu_simd_level()) {
+      case CPU_SIMD_AVX2:
+         kernels[DCT_PATH_2X2]  = dct_inverse_islow_avx2;
+         kernels[DCT_PATH_4X4]  = dct_inverse_islow_avx2;
+         kernels[DCT_PATH_FULL] = dct_inverse_islow_avx2;
+         counted[DCT_PATH_2X2]  = DCT_PATH_FULL;
+         counted[DCT_PATH_4X4]  = DCT_PATH_FULL;
+         break;
+      case CPU_SIMD_SSE2:
+         kernels[DCT_PATH_2X2]  = dct_inverse_islow_sse2;
+         kernels[DCT_PATH_4X4]  = dct_inverse_islow_sse2;
+         kernels[DCT_PATH_FULL] = dct_inverse_islow_sse2;
+         counted[DCT_PATH_2X2]  = DCT_PATH_FULL;
+         counted[DCT_PATH_4X4]  = DCT_PATH_FULL;
+         break;
+      default:
+         break;
+   }
+#endif
+}
+
+dct_path dct_path_for(unsigned int last_nonzero) {
+   if (last_nonzero == 0) {
+      return DCT_PATH_DC_ONLY;
+   } else if (last_nonzero <= DCT_LAST_2X2) {
+      return DCT_PATH_2X2;
+   } else if (last_nonzero <= DCT_LAST_4X4) {
+      return DCT_PATH_4X4;
+   }
+   return DCT_PATH_FULL;
+}
+
+unsigned int dct_path_size(dct_path path) {
+   static const unsigned int sizes[DCT_NUM_PATHS] = {1, 2, 4, JPEG_CHUNK_SIDE_LENGTH};
+   return sizes[path];
 }
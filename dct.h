@@ -1,9 +1,144 @@
 #ifndef DCT_H
 #define DCT_H
 
+#include <stdint.h>
 #include "jpeg_internal.h"
+#include "convert.h"
+#include "cpu.h"
 
-void dct_inverse(int   chunk [JPEG_CHUNK_NUM_SAMPLES]
-                ,float pixels[JPEG_CHUNK_SIDE_LENGTH][JPEG_CHUNK_SIDE_LENGTH]);
+/* The AAN scale factors, scaled up by 2^DCT_AAN_SCALE_BITS. The fast
+ * integer IDCT expects its input to have been multiplied by these, which
+ * qtable folds into its dequantisation multipliers. */
+#define DCT_AAN_SCALE_BITS  14
+#define DCT_IFAST_SCALE_BITS 2
+
+/* Fixed point helpers. DESCALE divides by 2^n with rounding. */
+#define DCT_ONE          ((int32_t) 1)
+#define DESCALE(x, n)    (((x) + (DCT_ONE << ((n) - 1))) >> (n))
+
+#define DCT_LEVEL_SHIFT  128
+
+/* Accurate integer IDCT, after Loeffler, Ligtenberg and Moschytz.
+ * Constants are scaled up by 2^ISLOW_CONST_BITS, and the intermediate
+ * results between the two passes keep ISLOW_PASS1_BITS of extra precision. */
+#define ISLOW_CONST_BITS  13
+#define ISLOW_PASS1_BITS  2
+
+#define FIX_0_298631336  ((int32_t)  2446)
+#define FIX_0_390180644  ((int32_t)  3196)
+#define FIX_0_541196100  ((int32_t)  4433)
+#define FIX_0_765366865  ((int32_t)  6270)
+#define FIX_0_899976223  ((int32_t)  7373)
+#define FIX_1_175875602  ((int32_t)  9633)
+#define FIX_1_501321110  ((int32_t) 12299)
+#define FIX_1_847759065  ((int32_t) 15137)
+#define FIX_1_961570560  ((int32_t) 16069)
+#define FIX_2_053119869  ((int32_t) 16819)
+#define FIX_2_562915447  ((int32_t) 20995)
+#define FIX_3_072711026  ((int32_t) 25172)
+
+extern const int dct_aan_scales[JPEG_CHUNK_NUM_SAMPLES];
+
+/* An integer IDCT of one block of dequantised coefficients in natural
+ * (row major) order, writing range limited samples to an 8x8 area of out */
+typedef void (*dct_kernel)(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                          ,unsigned char *out
+                          ,size_t         out_stride);
+
+/* Kernels for sparse blocks. Zigzag order fills the block one antidiagonal
+ * at a time, so a block whose last nonzero coefficient has zigzag index at
+ * most DCT_LAST_2X2 (or DCT_LAST_4X4) only has nonzero coefficients in the
+ * top left 2x2 (or 4x4) corner. */
+typedef enum {
+   DCT_PATH_DC_ONLY = 0,
+   DCT_PATH_2X2     = 1,
+   DCT_PATH_4X4     = 2,
+   DCT_PATH_FULL    = 3,
+   DCT_NUM_PATHS    = CONVERT_NUM_IDCT_PATHS
+} dct_path;
+
+#define DCT_LAST_2X2 2
+#define DCT_LAST_4X4 9
+
+dct_path     dct_path_for(unsigned int last_nonzero);
+
+/* Side length of the corner that may hold nonzero coefficients */
+unsigned int dct_path_size(dct_path path);
+
+/* Pick the fastest kernel for each path for the method on this CPU, with
+ * side x side output. JPEG_DCT_FLOAT has no integer kernels and gets the
+ * accurate ones, as do scaled sizes, which expect islow multipliers.
+ * counted gives the path each kernel really does the work of, since a
+ * path may get the full kernel, for convert_stats to count it under. */
+void dct_select(jpeg_dct_method  method
+               ,unsigned int     side
+               ,dct_kernel       kernels[DCT_NUM_PATHS]
+               ,dct_path         counted[DCT_NUM_PATHS]);
+
+void dct_inverse_islow(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                      ,unsigned char *out
+                      ,size_t         out_stride);
+
+/* Reduced versions of dct_inverse_islow, with identical output for blocks
+ * of the matching path */
+void dct_inverse_islow_4x4(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                          ,unsigned char *out
+                          ,size_t         out_stride);
+
+void dct_inverse_islow_2x2(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                          ,unsigned char *out
+                          ,size_t         out_stride);
+
+void dct_inverse_islow_dc(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                         ,unsigned char *out
+                         ,size_t         out_stride);
+
+/* coeffs must have been prescaled by dct_aan_scales */
+void dct_inverse_ifast(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                      ,unsigned char *out
+                      ,size_t         out_stride);
+
+void dct_inverse_ifast_dc(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                         ,unsigned char *out
+                         ,size_t         out_stride);
+
+#if CPU_X86
+void dct_inverse_islow_sse2(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                           ,unsigned char *out
+                           ,size_t         out_stride);
+
+void dct_inverse_islow_avx2(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                           ,unsigned char *out
+                           ,size_t         out_stride);
+#endif
+
+/* Level shifted but not range limited floating point output. Only the top
+ * left size x size coefficients are read. */
+void dct_inverse_float(const int16_t coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                      ,unsigned int  size
+                      ,float        *out
+                      ,size_t        out_stride);
+
+/* Kernels for decoding at 1/2, 1/4 and 1/8 size. Each is the side-point
+ * IDCT of the top left side x side coefficients, with the same 1/8
+ * normalisation as the full transform, and writes a side x side block. */
+void dct_inverse_islow_scaled_4x4(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                                 ,unsigned char *out
+                                 ,size_t         out_stride);
+
+void dct_inverse_islow_scaled_2x2(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                                 ,unsigned char *out
+                                 ,size_t         out_stride);
+
+void dct_inverse_islow_scaled_1x1(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                                 ,unsigned char *out
+                                 ,size_t         out_stride);
+
+/* dct_inverse_float with side x side output, side being 8, 4, 2 or 1 */
+void dct_inverse_float_scaled(const int16_t coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                             ,unsigned int  size
+                             ,unsigned int  side
+                             ,float        *out
+                             ,size_t        out_stride);
 
 #endif
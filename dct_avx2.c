@@ -0,0 +1,124 @@
+#include "dct.h"
+
+#if CPU_X86
+
+#include <immintrin.h>
+
+/* AVX2 version of dct_inverse_islow. The coefficients are widened to 32
+ * bits so that a whole row fits in one register and both passes can
+ * follow the scalar code operation for operation. Compiled with a target
+ * attribute so the rest of the build doesn't need -mavx2. */
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define MUL(x, c) _mm256_mullo_epi32((x), _mm256_set1_epi32(c))
+
+AVX2 static inline void idct_1d(__m256i in[JPEG_CHUNK_SIDE_LENGTH], int shift_bits) {
+   const __m256i round = _mm256_set1_epi32(1 << (shift_bits - 1));
+   const __m128i shift = _mm_cvtsi32_si128(shift_bits);
+   __m256i tmp0, tmp1, tmp2, tmp3;
+   __m256i tmp10, tmp11, tmp12, tmp13;
+   __m256i z1, z2, z3, z4, z5;
+   /* Even part */
+   z1 = MUL(_mm256_add_epi32(in[2], in[6]), FIX_0_541196100);
+   tmp2 = _mm256_add_epi32(z1, MUL(in[6], -FIX_1_847759065));
+   tmp3 = _mm256_add_epi32(z1, MUL(in[2],  FIX_0_765366865));
+   tmp0 = _mm256_slli_epi32(_mm256_add_epi32(in[0], in[4]), ISLOW_CONST_BITS);
+   tmp1 = _mm256_slli_epi32(_mm256_sub_epi32(in[0], in[4]), ISLOW_CONST_BITS);
+   tmp10 = _mm256_add_epi32(tmp0, tmp3);
+   tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+   tmp11 = _mm256_add_epi32(tmp1, tmp2);
+   tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+   /* Odd part */
+   z1 = _mm256_add_epi32(in[7], in[1]);
+   z2 = _mm256_add_epi32(in[5], in[3]);
+   z3 = _mm256_add_epi32(in[7], in[3]);
+   z4 = _mm256_add_epi32(in[5], in[1]);
+   z5 = MUL(_mm256_add_epi32(z3, z4), FIX_1_175875602);
+   tmp0 = MUL(in[7],  FIX_0_298631336);
+   tmp1 = MUL(in[5],  FIX_2_053119869);
+   tmp2 = MUL(in[3],  FIX_3_072711026);
+   tmp3 = MUL(in[1],  FIX_1_501321110);
+   z1   = MUL(z1,    -FIX_0_899976223);
+   z2   = MUL(z2,    -FIX_2_562915447);
+   z3   = _mm256_add_epi32(MUL(z3, -FIX_1_961570560), z5);
+   z4   = _mm256_add_epi32(MUL(z4, -FIX_0_390180644), z5);
+   tmp0 = _mm256_add_epi32(tmp0, _mm256_add_epi32(z1, z3));
+   tmp1 = _mm256_add_epi32(tmp1, _mm256_add_epi32(z2, z4));
+   tmp2 = _mm256_add_epi32(tmp2, _mm256_add_epi32(z2, z3));
+   tmp3 = _mm256_add_epi32(tmp3, _mm256_add_epi32(z1, z4));
+#define OUT(x) _mm256_sra_epi32(_mm256_add_epi32((x), round), shift)
+   in[0] = OUT(_mm256_add_epi32(tmp10, tmp3));
+   in[7] = OUT(_mm256_sub_epi32(tmp10, tmp3));
+   in[1] = OUT(_mm256_add_epi32(tmp11, tmp2));
+   in[6] = OUT(_mm256_sub_epi32(tmp11, tmp2));
+   in[2] = OUT(_mm256_add_epi32(tmp12, tmp1));
+   in[5] = OUT(_mm256_sub_epi32(tmp12, tmp1));
+   in[3] = OUT(_mm256_add_epi32(tmp13, tmp0));
+   in[4] = OUT(_mm256_sub_epi32(tmp13, tmp0));
+#undef OUT
+}
+
+AVX2 static inline void transpose(__m256i r[JPEG_CHUNK_SIDE_LENGTH]) {
+   __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+   __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+   __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+   __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+   __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+   __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+   __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+   __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+   __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+   __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+   __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+   __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+   __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+   __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+   __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+   __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+   r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+   r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+   r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+   r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+   r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+   r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+   r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+   r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+AVX2 void dct_inverse_islow_avx2(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                                ,unsigned char *out
+                                ,size_t         out_stride) {
+   __m256i rows[JPEG_CHUNK_SIDE_LENGTH];
+   __m256i level_shift = _mm256_set1_epi32(DCT_LEVEL_SHIFT);
+   unsigned int i;
+   for (i = 0; i < JPEG_CHUNK_SIDE_LENGTH; i++) {
+      __m128i row = _mm_loadu_si128((const __m128i *) &coeffs[i * JPEG_CHUNK_SIDE_LENGTH]);
+      rows[i] = _mm256_cvtepi16_epi32(row);
+   }
+   /* Pass 1 works down the columns */
+   idct_1d(rows, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   transpose(rows);
+   /* Pass 2 works along the rows, and leaves them transposed */
+   idct_1d(rows, ISLOW_CONST_BITS + ISLOW_PASS1_BITS + 3);
+   transpose(rows);
+   for (i = 0; i < JPEG_CHUNK_SIDE_LENGTH; i += 4) {
+      /* packs works within 128-bit lanes, so put each row back in order */
+      __m256i first  = _mm256_packs_epi32(_mm256_add_epi32(rows[i],     level_shift)
+                                         ,_mm256_add_epi32(rows[i + 1], level_shift));
+      __m256i second = _mm256_packs_epi32(_mm256_add_epi32(rows[i + 2], level_shift)
+                                         ,_mm256_add_epi32(rows[i + 3], level_shift));
+      first  = _mm256_permute4x64_epi64(first,  0xD8);
+      second = _mm256_permute4x64_epi64(second, 0xD8);
+      /* Lane 0 now holds rows i and i + 2, lane 1 rows i + 1 and i + 3 */
+      __m256i packed = _mm256_packus_epi16(first, second);
+      __m128i lane0  = _mm256_castsi256_si128(packed);
+      __m128i lane1  = _mm256_extracti128_si256(packed, 1);
+      _mm_storel_epi64((__m128i *) &out[i * out_stride],       lane0);
+      _mm_storel_epi64((__m128i *) &out[(i + 1) * out_stride], lane1);
+      _mm_storel_epi64((__m128i *) &out[(i + 2) * out_stride], _mm_srli_si128(lane0, 8));
+      _mm_storel_epi64((__m128i *) &out[(i + 3) * out_stride], _mm_srli_si128(lane1, 8));
+   }
+}
+
+#endif
@@ -0,0 +1,162 @@
+#include "dct.h"
+
+#if CPU_X86
+
+#include <emmintrin.h>
+
+/* SSE2 version of dct_inverse_islow. Each register holds one row of eight
+ * 16-bit values, so a 1-D pass over all eight columns is done with vertical
+ * operations. The rotations are done with pmaddwd on interleaved pairs of
+ * rows, which gives the same 32-bit intermediates as the scalar code. Only
+ * the results of pass 1 are narrowed to 16 bits, and a block whose pass 1
+ * doesn't fit, which no real image gives, goes to the scalar code. */
+
+/* Constant for pmaddwd: first * a + second * b for interleaved a, b */
+#define PAIR(first, second) _mm_set1_epi32((int) (((uint32_t) (uint16_t) (second) << 16) \
+                                                 | (uint16_t) (first)))
+
+typedef struct {
+   __m128i lo;
+   __m128i hi;
+} wide;
+
+static inline wide madd_pair(__m128i a, __m128i b, __m128i k) {
+   wide w;
+   w.lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+   w.hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+   return w;
+}
+
+static inline wide wide_add(wide a, wide b) {
+   wide w;
+   w.lo = _mm_add_epi32(a.lo, b.lo);
+   w.hi = _mm_add_epi32(a.hi, b.hi);
+   return w;
+}
+
+static inline wide wide_sub(wide a, wide b) {
+   wide w;
+   w.lo = _mm_sub_epi32(a.lo, b.lo);
+   w.hi = _mm_sub_epi32(a.hi, b.hi);
+   return w;
+}
+
+/* Round, shift right and narrow back to 16 bits */
+static inline __m128i descale(wide w, __m128i round, __m128i shift) {
+   __m128i lo = _mm_sra_epi32(_mm_add_epi32(w.lo, round), shift);
+   __m128i hi = _mm_sra_epi32(_mm_add_epi32(w.hi, round), shift);
+   return _mm_packs_epi32(lo, hi);
+}
+
+static void idct_1d(__m128i in[JPEG_CHUNK_SIDE_LENGTH], int shift_bits) {
+   const __m128i round = _mm_set1_epi32(1 << (shift_bits - 1));
+   const __m128i shift = _mm_cvtsi32_si128(shift_bits);
+   wide tmp0, tmp1, tmp2, tmp3;
+   wide tmp10, tmp11, tmp12, tmp13;
+   wide in71, in35;
+   /* Even part */
+   tmp3 = madd_pair(in[2], in[6], PAIR(FIX_0_541196100 + FIX_0_765366865,  FIX_0_541196100));
+   tmp2 = madd_pair(in[2], in[6], PAIR(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065));
+   tmp0 = madd_pair(in[0], in[4], PAIR( DCT_ONE << ISLOW_CONST_BITS,  DCT_ONE << ISLOW_CONST_BITS));
+   tmp1 = madd_pair(in[0], in[4], PAIR( DCT_ONE << ISLOW_CONST_BITS, -(DCT_ONE << ISLOW_CONST_BITS)));
+   tmp10 = wide_add(tmp0, tmp3);
+   tmp13 = wide_sub(tmp0, tmp3);
+   tmp11 = wide_add(tmp1, tmp2);
+   tmp12 = wide_sub(tmp1, tmp2);
+   /* Odd part. z3 and z4 are sums of two inputs, which needn't fit in 16
+    * bits in pass 2, so each is multiplied out and its share folded into
+    * the constants for the pairs 7, 1 and 3, 5. */
+#define Z3_73 (FIX_1_175875602 - FIX_1_961570560)
+#define Z3_51  FIX_1_175875602
+#define Z4_73  FIX_1_175875602
+#define Z4_51 (FIX_1_175875602 - FIX_0_390180644)
+   in71 = madd_pair(in[7], in[1], PAIR(Z3_73, Z3_51));
+   in35 = madd_pair(in[3], in[5], PAIR(Z3_73, Z3_51));
+   tmp0 = wide_add(madd_pair(in[7], in[1], PAIR(FIX_0_298631336 - FIX_0_899976223 + Z3_73, -FIX_0_899976223 + Z3_51)), in35);
+   tmp2 = wide_add(madd_pair(in[3], in[5], PAIR(FIX_3_072711026 - FIX_2_562915447 + Z3_73, -FIX_2_562915447 + Z3_51)), in71);
+   in71 = madd_pair(in[7], in[1], PAIR(Z4_73, Z4_51));
+   in35 = madd_pair(in[3], in[5], PAIR(Z4_73, Z4_51));
+   tmp3 = wide_add(madd_pair(in[7], in[1], PAIR(-FIX_0_899976223 + Z4_73, FIX_1_501321110 - FIX_0_899976223 + Z4_51)), in35);
+   tmp1 = wide_add(madd_pair(in[3], in[5], PAIR(-FIX_2_562915447 + Z4_73, FIX_2_053119869 - FIX_2_562915447 + Z4_51)), in71);
+#undef Z3_73
+#undef Z3_51
+#undef Z4_73
+#undef Z4_51
+   in[0] = descale(wide_add(tmp10, tmp3), round, shift);
+   in[7] = descale(wide_sub(tmp10, tmp3), round, shift);
+   in[1] = descale(wide_add(tmp11, tmp2), round, shift);
+   in[6] = descale(wide_sub(tmp11, tmp2), round, shift);
+   in[2] = descale(wide_add(tmp12, tmp1), round, shift);
+   in[5] = descale(wide_sub(tmp12, tmp1), round, shift);
+   in[3] = descale(wide_add(tmp13, tmp0), round, shift);
+   in[4] = descale(wide_sub(tmp13, tmp0), round, shift);
+}
+
+/* Whether descale may have saturated any of the rows. A value really at
+ * one of the limits gives a false positive, which is harmless. */
+static inline int saturated(const __m128i r[JPEG_CHUNK_SIDE_LENGTH]) {
+   __m128i hi = _mm_max_epi16(_mm_max_epi16(_mm_max_epi16(r[0], r[1]), _mm_max_epi16(r[2], r[3]))
+                             ,_mm_max_epi16(_mm_max_epi16(r[4], r[5]), _mm_max_epi16(r[6], r[7])));
+   __m128i lo = _mm_min_epi16(_mm_min_epi16(_mm_min_epi16(r[0], r[1]), _mm_min_epi16(r[2], r[3]))
+                             ,_mm_min_epi16(_mm_min_epi16(r[4], r[5]), _mm_min_epi16(r[6], r[7])));
+   __m128i hit = _mm_or_si128(_mm_cmpeq_epi16(hi, _mm_set1_epi16(INT16_MAX))
+                             ,_mm_cmpeq_epi16(lo, _mm_set1_epi16(INT16_MIN)));
+   return _mm_movemask_epi8(hit) != 0;
+}
+
+static void transpose(__m128i r[JPEG_CHUNK_SIDE_LENGTH]) {
+   __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+   __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+   __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+   __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+   __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+   __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+   __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+   __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+   __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+   __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+   __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+   __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+   __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+   __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+   __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+   __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+   r[0] = _mm_unpacklo_epi64(b0, b4);
+   r[1] = _mm_unpackhi_epi64(b0, b4);
+   r[2] = _mm_unpacklo_epi64(b1, b5);
+   r[3] = _mm_unpackhi_epi64(b1, b5);
+   r[4] = _mm_unpacklo_epi64(b2, b6);
+   r[5] = _mm_unpackhi_epi64(b2, b6);
+   r[6] = _mm_unpacklo_epi64(b3, b7);
+   r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+void dct_inverse_islow_sse2(const int16_t  coeffs[JPEG_CHUNK_NUM_SAMPLES]
+                           ,unsigned char *out
+                           ,size_t         out_stride) {
+   __m128i rows[JPEG_CHUNK_SIDE_LENGTH];
+   __m128i level_shift = _mm_set1_epi16(DCT_LEVEL_SHIFT);
+   unsigned int i;
+   for (i = 0; i < JPEG_CHUNK_SIDE_LENGTH; i++) {
+      rows[i] = _mm_loadu_si128((const __m128i *) &coeffs[i * JPEG_CHUNK_SIDE_LENGTH]);
+   }
+   /* Pass 1 works down the columns */
+   idct_1d(rows, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+   if (saturated(rows)) {
+      dct_inverse_islow(coeffs, out, out_stride);
+      return;
+   }
+   transpose(rows);
+   /* Pass 2 works along the rows, and leaves them transposed */
+   idct_1d(rows, ISLOW_CONST_BITS + ISLOW_PASS1_BITS + 3);
+   transpose(rows);
+   for (i = 0; i < JPEG_CHUNK_SIDE_LENGTH; i += 2) {
+      __m128i first  = _mm_adds_epi16(rows[i],     level_shift);
+      __m128i second = _mm_adds_epi16(rows[i + 1], level_shift);
+      __m128i packed = _mm_packus_epi16(first, second);
+      _mm_storel_epi64((__m128i *) &out[i * out_stride], packed);
+      _mm_storel_epi64((__m128i *) &out[(i + 1) * out_stride], _mm_srli_si128(packed, 8));
+   }
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include <assert.h>
+#include "decoder.h"
+#include "jpeg_internal.h"
+#include "convert_internal.h"
+#include "cpu.h"
+
+struct jpeg_decoder_s {
+   convert_options     options;
+   /* For the decoder itself, its scratch state and the caches */
+   jpeg_arena         *persistent;
+   /* For each image, and reset once it is done */
+   jpeg_arena         *arena;
+   htable_cache       *htable_cache;
+   qtable_cache       *qtable_cache;
+   convert_spec_cache *spec_cache;
+   /* NULL when decoding on one thread */
+   thread_pool        *pool;
+   convert_state      *scratch;
+   bitmap             *output;
+};
+
+jpeg_decoder *jpeg_decoder_create(const convert_options *options, const jpeg_allocator *allocator) {
+   jpeg_arena   *persistent = jpeg_arena_create(allocator);
+   jpeg_decoder *d          = jpeg_arena_alloc(persistent, sizeof(jpeg_decoder));
+   unsigned int  num_threads;
+   if (options) {
+      d->options = *options;
+   } else {
+      convert_options_init(&d->options);
+   }
+   d->persistent   = persistent;
+   d->arena        = jpeg_arena_create(allocator);
+   d->htable_cache = htable_cache_create(persistent);
+   d->qtable_cache = qtable_cache_create(persistent);
+   d->spec_cache   = convert_spec_cache_create(persistent);
+   d->scratch      = jpeg_arena_alloc(persistent, sizeof(convert_state));
+   d->output       = NULL;
+   d->pool         = NULL;
+   num_threads = d->options.num_threads ? d->options.num_threads : cpu_num_cores();
+   /* The calling thread takes a share of each step itself */
+   if (num_threads >= 2) {
+      d->pool = thread_pool_create(num_threads - 1);
+   }
+   return d;
+}
+
+void jpeg_decoder_destroy(jpeg_decoder *d) {
+   if (d) {
+      jpeg_arena *persistent = d->persistent;
+      if (d->pool) {
+         thread_pool_destroy(d->pool);
+      }
+      bitmap_destroy(d->output);
+      convert_spec_cache_destroy(d->spec_cache);
+      jpeg_arena_destroy(d->arena);
+      jpeg_arena_destroy(persistent);
+   }
+}
+
+static void decoder_context(const jpeg_decoder *d, jpeg_context *context) {
+   context->arena        = d->arena;
+   context->htable_cache = d->htable_cache;
+   context->qtable_cache = d->qtable_cache;
+   context->spec_cache   = d->spec_cache;
+   context->pool         = d->pool;
+}
+
+static jpeg_decoder_status decoder_convert(jpeg_decoder *d, jpeg *j, bitmap **output) {
+   bitmap *b;
+   int     error;
+   assert(output);
+   *output = NULL;
+   if (!j) {
+      return JPEG_DECODER_ERROR_READ;
+   }
+   b = convert_image(j, &d->options, d->scratch, d->output, &error);
+   /* Gives the arena back for the next image */
+   jpeg_destroy(j);
+   if (b) {
+      d->output = b;
+   }
+   *output = b;
+   return error ? JPEG_DECODER_ERROR_DECODE : JPEG_DECODER_OK;
+}
+
+jpeg_decoder_status jpeg_decoder_decode(jpeg_decoder *d, const unsigned char *data, size_t data_size, bitmap **output) {
+   jpeg_context context;
+   decoder_context(d, &context);
+   return decoder_convert(d, jpeg_read_mem_context(data, data_size, &context), output);
+}
+
+jpeg_decoder_status jpeg_decoder_decode_file(jpeg_decoder *d, const char *filename, bitmap **output) {
+   jpeg_context context;
+   decoder_context(d, &context);
+   return decoder_convert(d, jpeg_read_context(filename, &context), output);
+}
+
+bitmap *jpeg_decoder_take_output(jpeg_decoder *d) {
+   bitmap *b = d->output;
+   d->output = NULL;
+   return b;
+}
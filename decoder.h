@@ -0,0 +1,41 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stddef.h>
+#include "arena.h"
+#include "bitmap.h"
+#include "convert.h"
+
+/* Decodes one image after another with the same options, keeping what it
+ * can between them: its arenas, the Huffman and quantisation tables, which
+ * are only rebuilt when an image defines different ones, a thread pool, and
+ * the output bitmap, which only grows when a bigger image comes along. Only
+ * one thread may use a decoder at a time. */
+typedef struct jpeg_decoder_s jpeg_decoder;
+
+typedef enum {
+   JPEG_DECODER_OK           = 0,
+   /* The data isn't a JPEG that can be read, so there is no output */
+   JPEG_DECODER_ERROR_READ   = 1,
+   /* The output may be incomplete, or NULL if the image isn't supported */
+   JPEG_DECODER_ERROR_DECODE = 2
+} jpeg_decoder_status;
+
+/* options may be NULL for the defaults, and are copied. If they ask for
+ * more than one thread the pool starts now and lives until the decoder is
+ * destroyed. allocator may be NULL for malloc; it backs the arenas, but not
+ * the output bitmap. */
+jpeg_decoder       *jpeg_decoder_create(const convert_options *options, const jpeg_allocator *allocator);
+void                jpeg_decoder_destroy(jpeg_decoder *d);
+
+/* Decode an image into the decoder's output bitmap and point *output at
+ * it. The decoder still owns the bitmap, and the next decode overwrites
+ * it. */
+jpeg_decoder_status jpeg_decoder_decode(jpeg_decoder *d, const unsigned char *data, size_t data_size, bitmap **output);
+jpeg_decoder_status jpeg_decoder_decode_file(jpeg_decoder *d, const char *filename, bitmap **output);
+
+/* Hand the last output to the caller, who destroys it. The next decode
+ * makes a new one. */
+bitmap             *jpeg_decoder_take_output(jpeg_decoder *d);
+
+#endif
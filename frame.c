@@ -6,14 +6,13 @@
 #define FRAME_SUPPORTED_PRECISION_BITS 8
 #define COMPONENT_LENGTH_BYTES         3
 
-static void read_component(unsigned char *buf, component *c) {
+static void read_component(const unsigned char *buf, component *c) {
    assert(c);
    assert(buf);
    c->id                         =  buf[0];
-   c->sampling_factor_horizontal =  buf[1]       & 0xF;
-   c->sampling_factor_vertical   = (buf[1] >> 4) & 0xF;
+   c->sampling_factor_horizontal = (buf[1] >> 4) & 0xF;
+   c->sampling_factor_vertical   =  buf[1]       & 0xF;
    c->qtable_id                  =  buf[2];
-   c->prev_dc_coeff              =  0;
 }
 
 component *frame_get_component_with_id(frame *f, component_id id) {
@@ -27,20 +26,23 @@ component *frame_get_component_with_id(frame *f, component_id id) {
    return c;
 }
 
-frame *frame_create(const jpeg_segment *segment) {
+frame *frame_create(const jpeg_segment *segment, jpeg_arena *arena) {
+   frame *f = jpeg_arena_alloc(arena, sizeof(frame));
+   return frame_read(segment, f) == 0 ? f : NULL;
+}
+
+int frame_read(const jpeg_segment *segment, frame *f) {
    size_t i = 0;
-   frame *f;
    assert(segment);
    if (segment->data_size < FRAME_MIN_LENGTH_BYTES) {
-      return NULL;
+      return 1;
    }
-   f = malloc(sizeof(frame));
-   assert(f);
    f->precision_bits = segment->data[i];
-   f->highest_sampling_factor = 0;
+   f->highest_sampling_factor_horizontal = 0;
+   f->highest_sampling_factor_vertical   = 0;
    i += 1;
    if (f->precision_bits != FRAME_SUPPORTED_PRECISION_BITS) {
-      return NULL;
+      return 1;
    }
    f->num_lines = read_word(&segment->data[i]);
    i += 2;
@@ -49,23 +51,27 @@ frame *frame_create(const jpeg_segment *segment) {
    f->num_components = segment->data[i];
    i += 1;
    if ((i + f->num_components * COMPONENT_LENGTH_BYTES) > segment->data_size) {
-      return NULL;
+      return 1;
    }
    size_t n = 0;
    for (n = 0; n < f->num_components; n++) {
       read_component(&segment->data[i], &f->components[n]);
-      if (f->components[n].sampling_factor_horizontal > f->highest_sampling_factor) {
-         f->highest_sampling_factor = f->components[n].sampling_factor_horizontal;
+      if (f->components[n].sampling_factor_horizontal > f->highest_sampling_factor_horizontal) {
+         f->highest_sampling_factor_horizontal = f->components[n].sampling_factor_horizontal;
       }
-      if (f->components[n].sampling_factor_vertical > f->highest_sampling_factor) {
-         f->highest_sampling_factor = f->components[n].sampling_factor_vertical;
+      if (f->components[n].sampling_factor_vertical > f->highest_sampling_factor_vertical) {
+         f->highest_sampling_factor_vertical = f->components[n].sampling_factor_vertical;
       }
       i += COMPONENT_LENGTH_BYTES;
    }
-   return f;
-}
-
-void frame_destroy(frame *f) {
-   free(f);
+   /* A lone component is coded a block at a time whatever its sampling
+    * factors say */
+   if (f->num_components == 1) {
+      f->components[0].sampling_factor_horizontal = 1;
+      f->components[0].sampling_factor_vertical   = 1;
+      f->highest_sampling_factor_horizontal       = 1;
+      f->highest_sampling_factor_vertical         = 1;
+   }
+   return 0;
 }
 
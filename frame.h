@@ -5,6 +5,7 @@ typedef struct frame_s frame;
 #include "htable.h"
 #include "qtable.h"
 #include "jpeg_segment.h"
+#include "arena.h"
 
 #define FRAME_MAX_COMPONENTS 255
 
@@ -24,7 +25,6 @@ typedef struct component_s {
    qtable_id    qtable_id;
    htable_id    dc_htable_id;
    htable_id    ac_htable_id;
-   int          prev_dc_coeff;
 } component;
 
 struct frame_s {
@@ -32,12 +32,16 @@ struct frame_s {
    unsigned int num_lines;
    unsigned int samples_per_line;
    unsigned int num_components;
-   unsigned int highest_sampling_factor;
+   /* The MCU is this many blocks of the most sampled component wide and high */
+   unsigned int highest_sampling_factor_horizontal;
+   unsigned int highest_sampling_factor_vertical;
    component components[FRAME_MAX_COMPONENTS];
 };
 
-frame     *frame_create(const jpeg_segment *segment);
+frame     *frame_create(const jpeg_segment *segment, jpeg_arena *arena);
+/* Into a frame the caller provides. Returns 0 on success, 1 if the segment
+ * can't be parsed. */
+int        frame_read(const jpeg_segment *segment, frame *f);
 component *frame_get_component_with_id(frame *f, component_id id);
-void       frame_destroy(frame *f);
 
 #endif
@@ -1,25 +1,80 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include "htable.h"
-#include "htree.h"
 #include "scan_start.h"
+#include "jpeg_stream_internal.h"
 
 #define HTABLE_METADATA_LENGTH_BYTES 1
 #define HTABLE_MAX_STRING_BITS       16
-#define HTABLE_CODE_BITS             8
+#define HTABLE_MAX_SYMBOLS           256
 #define HTABLE_MIN_LENGTH_BYTES     (HTABLE_METADATA_LENGTH_BYTES + HTABLE_MAX_STRING_BITS)
+/* A DC symbol is the number of extra bits after its code, 11 at most for
+ * 8 bit samples */
+#define HTABLE_MAX_DC_BITS           11
+/* Ids a baseline image can use, which are the ones cached */
+#define HTABLE_CACHE_IDS             4
+
+/* Codes of up to this many bits are resolved with a single table lookup,
+ * longer ones fall back to a search of the canonical code ranges */
+#define HTABLE_LOOKAHEAD_BITS        9
+#define HTABLE_LOOKAHEAD_SIZE       (1 << HTABLE_LOOKAHEAD_BITS)
+
+/* A lookahead entry holds the code length above the 8-bit symbol.
+ * Zero means the code is longer than HTABLE_LOOKAHEAD_BITS. */
+#define HTABLE_LOOKAHEAD_LENGTH_SHIFT 8
+#define HTABLE_LOOKAHEAD_SYMBOL_MASK  0xFF
 
 static int htable_read_bitstream_value(jpeg_stream *stream, size_t total_bits, htable_type type);
+static int htable_build_lookup(htable *table);
 
 struct htable_s {
    htable_type type;
    htable_id   id;
-   htree      *tree;
-   
+
    size_t        num_bit_codes[HTABLE_MAX_STRING_BITS];
-   unsigned int *bit_codes[HTABLE_MAX_STRING_BITS];
+   size_t        num_symbols;
+   unsigned char symbols[HTABLE_MAX_SYMBOLS];
+
+   /* Indexed by code length. maxcode[l] is the largest code of length l
+    * (-1 if there are none), and the symbol for a code c of length l is
+    * symbols[valoffset[l] + c]. */
+   int32_t maxcode[HTABLE_MAX_STRING_BITS + 1];
+   int32_t valoffset[HTABLE_MAX_STRING_BITS + 1];
+
+   uint16_t lookahead[HTABLE_LOOKAHEAD_SIZE];
+};
+
+/* Indexed by type * HTABLE_CACHE_IDS + id */
+struct htable_cache_s {
+   htable tables[2 * HTABLE_CACHE_IDS];
+   int    valid[2 * HTABLE_CACHE_IDS];
 };
 
+htable_cache *htable_cache_create(jpeg_arena *arena) {
+   htable_cache *cache = jpeg_arena_alloc(arena, sizeof(htable_cache));
+   memset(cache->valid, 0, sizeof(cache->valid));
+   return cache;
+}
+
+/* Whether table was built from these code counts and symbols */
+static int htable_matches(const htable        *table
+                         ,const unsigned char *counts
+                         ,const unsigned char *symbols
+                         ,size_t               num_symbols) {
+   size_t n;
+   if (table->num_symbols != num_symbols) {
+      return 0;
+   }
+   for (n = 0; n < HTABLE_MAX_STRING_BITS; n++) {
+      if (table->num_bit_codes[n] != counts[n]) {
+         return 0;
+      }
+   }
+   return memcmp(table->symbols, symbols, num_symbols) == 0;
+}
+
 htable *htable_get_table(htable *const htables[JPEG_MAX_HTABLES]
                         ,htable_type   type
                         ,htable_id     id) {
@@ -35,60 +90,114 @@ htable *htable_get_table(htable *const htables[JPEG_MAX_HTABLES]
    return h;
 }
 
-htable *htable_create_internal(unsigned char *data
-                              ,size_t  *bytes_remaining) {
-   size_t   i = 0;
-   htable  *table;
+static htable *htable_create_internal(const unsigned char *data
+                                     ,jpeg_arena    *arena
+                                     ,htable_cache  *cache
+                                     ,size_t        *bytes_remaining) {
+   const unsigned char *counts  = data + HTABLE_METADATA_LENGTH_BYTES;
+   const unsigned char *symbols = counts + HTABLE_MAX_STRING_BITS;
+   htable_type type;
+   htable_id   id;
+   size_t      num_symbols = 0;
+   size_t      n;
+   int         slot = -1;
+   htable     *table;
    assert(data);
    assert(bytes_remaining);
    if (*bytes_remaining < HTABLE_MIN_LENGTH_BYTES) {
       return NULL;
    }
-   table = malloc(sizeof(htable));
-   assert(table);
-   table->type = (data[i] >> 4) & 0xF;
-   table->id   =  data[i]       & 0xF;
-   i += 1;
-   *bytes_remaining -= 1;
-   if (table->type != HTABLE_TYPE_AC && table->type != HTABLE_TYPE_DC) {
-      free(table);
+   type = (data[0] >> 4) & 0xF;
+   id   =  data[0]       & 0xF;
+   if (type != HTABLE_TYPE_AC && type != HTABLE_TYPE_DC) {
       return NULL;
    }
-   size_t n;
-   size_t total_code_bytes = 0;
+   *bytes_remaining -= HTABLE_MIN_LENGTH_BYTES;
    for (n = 0; n < HTABLE_MAX_STRING_BITS; n++) {
-      table->num_bit_codes[n] = data[i];
-      if (table->num_bit_codes[n] > 0) {
-         table->bit_codes[n] = malloc(table->num_bit_codes[n] * sizeof(*table->bit_codes[0]));
-         assert(table->bit_codes[n]);
-         total_code_bytes += table->num_bit_codes[n];
-      } else {
-         table->bit_codes[n] = NULL;
-      }
-      i += 1;
-      *bytes_remaining -= 1;
+      num_symbols += counts[n];
    }
-   if (total_code_bytes > *bytes_remaining) {
-      free(table);
+   if (  num_symbols > *bytes_remaining
+      || num_symbols > HTABLE_MAX_SYMBOLS) {
       return NULL;
    }
-   for (n = 0; n < HTABLE_MAX_STRING_BITS; n++) {
-      size_t m;
-      for (m = 0; m < table->num_bit_codes[n]; m++) {
-         table->bit_codes[n][m] = data[i];
-         i += 1;
-         *bytes_remaining -= 1;
+   *bytes_remaining -= num_symbols;
+   if (type == HTABLE_TYPE_DC) {
+      for (n = 0; n < num_symbols; n++) {
+         if (symbols[n] > HTABLE_MAX_DC_BITS) {
+            return NULL;
+         }
       }
    }
-   table->tree = htree_create(HTABLE_MAX_STRING_BITS
-                             ,HTABLE_CODE_BITS
-                             ,table->num_bit_codes
-                             ,table->bit_codes);
-   
+   if (cache && id < HTABLE_CACHE_IDS) {
+      slot  = (int) (type * HTABLE_CACHE_IDS + id);
+      table = &cache->tables[slot];
+      if (cache->valid[slot] && htable_matches(table, counts, symbols, num_symbols)) {
+         return table;
+      }
+      /* Rebuilt in place, so not valid again until that succeeds */
+      cache->valid[slot] = 0;
+   } else {
+      table = jpeg_arena_alloc(arena, sizeof(htable));
+   }
+   table->type        = type;
+   table->id          = id;
+   table->num_symbols = num_symbols;
+   for (n = 0; n < HTABLE_MAX_STRING_BITS; n++) {
+      table->num_bit_codes[n] = counts[n];
+   }
+   memcpy(table->symbols, symbols, num_symbols);
+   if (htable_build_lookup(table) != 0) {
+      return NULL;
+   }
+   if (slot >= 0) {
+      cache->valid[slot] = 1;
+   }
    return table;
 }
 
+/* Assign canonical codes as per Annex C of the standard, then fill in
+ * the lookahead table. Returns 0 on success, 1 if the code lengths
+ * don't describe a valid prefix code. */
+static int htable_build_lookup(htable *table) {
+   size_t   length;
+   size_t   k = 0;
+   uint32_t code = 0;
+   for (length = 0; length < HTABLE_LOOKAHEAD_SIZE; length++) {
+      table->lookahead[length] = 0;
+   }
+   table->maxcode[0]   = -1;
+   table->valoffset[0] = 0;
+   for (length = 1; length <= HTABLE_MAX_STRING_BITS; length++) {
+      size_t n;
+      size_t num_codes = table->num_bit_codes[length - 1];
+      table->valoffset[length] = (int32_t) k - (int32_t) code;
+      for (n = 0; n < num_codes; n++) {
+         if (length <= HTABLE_LOOKAHEAD_BITS) {
+            /* Every lookahead index that starts with this code maps to it */
+            size_t   pad_bits = HTABLE_LOOKAHEAD_BITS - length;
+            uint32_t first = code << pad_bits;
+            uint32_t m;
+            for (m = 0; m < (1u << pad_bits); m++) {
+               table->lookahead[first + m] = (uint16_t) ((length << HTABLE_LOOKAHEAD_LENGTH_SHIFT)
+                                                         | table->symbols[k]);
+            }
+         }
+         code += 1;
+         k    += 1;
+      }
+      /* Codes of this length must not run past the all-ones code */
+      if (code > (1u << length)) {
+         return 1;
+      }
+      table->maxcode[length] = num_codes > 0 ? (int32_t) code - 1 : -1;
+      code <<= 1;
+   }
+   return 0;
+}
+
 int htable_create(const jpeg_segment *segment
+                 ,jpeg_arena         *arena
+                 ,htable_cache       *cache
                  ,htable *tables[JPEG_MAX_HTABLES]
                  ,size_t *num_htables) {
    size_t offset = 0;
@@ -98,57 +207,86 @@ int htable_create(const jpeg_segment *segment
    assert(segment->marker == JPEG_MARKER_DHT);
    assert(num_htables);
    bytes_remaining = segment->data_size;
-   while (bytes_remaining > 0 && *num_htables < JPEG_MAX_QTABLES && !error) {
-      tables[*num_htables] = htable_create_internal(segment->data + offset
-                                                   ,&bytes_remaining);
-      if (!tables[*num_htables]) {
+   while (bytes_remaining > 0 && !error) {
+      htable *table = htable_create_internal(segment->data + offset
+                                            ,arena
+                                            ,cache
+                                            ,&bytes_remaining);
+      size_t  i;
+      if (!table) {
          error = 1;
+         break;
+      }
+      offset = segment->data_size - bytes_remaining;
+      /* A table with the same type and id replaces the old one */
+      for (i = 0; i < *num_htables; i++) {
+         if (tables[i]->type == table->type && tables[i]->id == table->id) {
+            break;
+         }
+      }
+      if (i < *num_htables) {
+         tables[i] = table;
+      } else if (*num_htables < JPEG_MAX_HTABLES) {
+         tables[*num_htables] = table;
+         *num_htables += 1;
       } else {
-         offset = segment->data_size - bytes_remaining;
-        *num_htables += 1;
+         error = 1;
       }
    }
    return error;
 }
 
-void htable_destroy(htable *table) {
-   if (table) {
-      size_t n;
-      htree_destroy(table->tree);
-      for (n = 0; n < HTABLE_MAX_STRING_BITS; n++) {
-         free(table->bit_codes[n]);
-      }
-      free(table);
+/* Read total_bits of extra bits and extend them to a signed value
+ * as per section F.2.2.1 of the standard */
+static int htable_read_bitstream_value(jpeg_stream *stream
+                                      ,size_t       total_bits
+                                      ,htable_type  type) {
+   int value;
+   if (total_bits == 0) {
+      return 0;
+   }
+   value = (int) jpeg_stream_get_bits(stream, total_bits);
+   if (value < (1 << (total_bits - 1))) {
+      value -= (1 << total_bits) - 1;
    }
+   return value;
 }
 
-static int htable_read_bitstream_value(jpeg_stream *stream
-                                          ,size_t total_bits
-                                          ,htable_type type) {
-   int32_t value = 0;
-   size_t bits_read = 0;
-   while (bits_read < total_bits) {
-      value |= jpeg_stream_get_next_bit(stream) << (total_bits - bits_read - 1);
-      bits_read += 1;
-   }
-   int result = (int) value;
-   if (total_bits > 0 && !(value & (1 << (total_bits - 1)))) {
-      result -= (1 << total_bits) - 1;
-   }
-   return result;
+int htable_decode_symbol(jpeg_stream  *stream
+                        ,const htable *table
+                        ,unsigned int *symbol) {
+   unsigned int look = jpeg_stream_peek_bits(stream, HTABLE_LOOKAHEAD_BITS);
+   uint16_t     entry = table->lookahead[look];
+   if (entry != 0) {
+      *symbol = entry & HTABLE_LOOKAHEAD_SYMBOL_MASK;
+      jpeg_stream_consume_bits(stream, entry >> HTABLE_LOOKAHEAD_LENGTH_SHIFT);
+      return 0;
+   }
+   /* Slow path for codes longer than the lookahead */
+   unsigned int bits = jpeg_stream_peek_bits(stream, HTABLE_MAX_STRING_BITS);
+   size_t       length;
+   for (length = HTABLE_LOOKAHEAD_BITS + 1; length <= HTABLE_MAX_STRING_BITS; length++) {
+      int32_t code = (int32_t) (bits >> (HTABLE_MAX_STRING_BITS - length));
+      if (code <= table->maxcode[length]) {
+         *symbol = table->symbols[table->valoffset[length] + code];
+         jpeg_stream_consume_bits(stream, length);
+         return 0;
+      }
+   }
+   return 1;
 }
 
 int htable_decode(jpeg_stream  *stream
-                 ,htable       *table
+                 ,const htable *table
                  ,int          *result
                  ,size_t       *num_previous_zeros
                  ) {
    int     status;
    unsigned int code;
    *num_previous_zeros = 0;
-   status = htree_get(table->tree
-                     ,stream
-                     ,&code);
+   status = htable_decode_symbol(stream
+                                ,table
+                                ,&code);
    if (status != 0) {
       return HTABLE_ERR_DECODE;
    }
@@ -166,3 +304,21 @@ int htable_decode(jpeg_stream  *stream
    }
    return HTABLE_OK;
 }
+
+int htable_skip(jpeg_stream  *stream
+               ,const htable *table
+               ,size_t       *num_previous_zeros) {
+   unsigned int code;
+   /* A DC symbol's size isn't in its low four bits */
+   assert(table->type == HTABLE_TYPE_AC);
+   *num_previous_zeros = 0;
+   if (htable_decode_symbol(stream, table, &code) != 0) {
+      return HTABLE_ERR_DECODE;
+   }
+   if (code == 0) {
+      return HTABLE_END_OF_BLOCK;
+   }
+   *num_previous_zeros = (code & 0xF0) >> 4;
+   jpeg_stream_get_bits(stream, code & 0x0F);
+   return HTABLE_OK;
+}
@@ -3,6 +3,7 @@
 
 typedef struct htable_s htable;
 typedef unsigned int htable_id;
+typedef struct htable_cache_s htable_cache;
 
 #include "frame.h"
 #include "jpeg_segment.h"
@@ -19,20 +20,42 @@ typedef enum {
 } htable_type;
 
 
+/* The last table of each type and id, kept from one image to the next so
+ * that a table identical to the last one isn't built again. The cache
+ * lives in arena until it is destroyed or reset. */
+htable_cache *htable_cache_create(jpeg_arena *arena);
+
+/* Adds the tables in a DHT segment, allocated from arena, to the first
+ * num_htables of tables. A table with the same type and id as an earlier
+ * one replaces it. If cache isn't NULL the tables are taken from it where
+ * they can be, and are only valid until it is next used. */
 int     htable_create(const jpeg_segment *segment
+                     ,jpeg_arena         *arena
+                     ,htable_cache       *cache
                      ,htable *tables[JPEG_MAX_HTABLES]
                      ,size_t *num_htables);
 
 int     htable_decode(jpeg_stream  *stream
-                     ,htable       *table
+                     ,const htable *table
                      ,int          *result
                      ,size_t       *num_previous_zeros
                      );
 
+/* Decode the next huffman symbol itself, for progressive scans whose
+ * symbols mean something else. Returns 0 on success, 1 if the bits don't
+ * match any code in the table. */
+int     htable_decode_symbol(jpeg_stream  *stream
+                            ,const htable *table
+                            ,unsigned int *symbol);
+
+/* Like htable_decode for an AC table, but reads past the value's bits
+ * rather than extending them */
+int     htable_skip(jpeg_stream  *stream
+                   ,const htable *table
+                   ,size_t       *num_previous_zeros);
+
 htable *htable_get_table(htable *const htables[JPEG_MAX_HTABLES]
                         ,htable_type type
                         ,htable_id   id);
 
-void    htable_destroy(htable *table);
-
 #endif
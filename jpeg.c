@@ -1,6 +1,13 @@
+/* For madvise under --std=c99 */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "bitmap_internal.h"
 #include "jpeg.h"
@@ -14,27 +21,116 @@
 static unsigned char *read_file(const char *filename
                                ,size_t     *file_size_bytes);
 
-static jpeg_segment *read_next_segment(jpeg   *j
-                                      ,size_t *offset);
+static unsigned char *map_file(const char *filename
+                              ,size_t     *file_size_bytes);
 
-jpeg *jpeg_read(const char *filename) {
-   jpeg *j = malloc(sizeof(jpeg));
-   assert(j);
-   j->data = (unsigned char *) read_file(filename, &j->data_size);
+static jpeg *jpeg_parse(jpeg *j, const jpeg_context *context);
+
+static int read_next_segment(jpeg         *j
+                            ,size_t       *offset
+                            ,jpeg_segment *segment);
+
+static void use_scan_tables(jpeg *j);
+
+static jpeg *jpeg_create(const jpeg_context *context) {
+   jpeg_arena *arena = context->arena;
+   int         owns_arena = arena == NULL;
+   jpeg       *j;
+   if (owns_arena) {
+      arena = jpeg_arena_create(NULL);
+   }
+   j = jpeg_arena_alloc(arena, sizeof(jpeg));
+   j->arena = arena;
+   j->owns_arena = owns_arena;
+   j->pool       = context->pool;
+   j->spec_cache = context->spec_cache;
+   j->data = NULL;
+   j->data_size = 0;
+   j->data_source = JPEG_DATA_BORROWED;
    j->num_qtables = 0;
    j->num_htables = 0;
    unsigned int i;
    for (i = 0; i < JPEG_MAX_HTABLES; i++) {
       j->htables[i] = NULL;
    }
+   for (i = 0; i < JPEG_MAX_QTABLES; i++) {
+      j->qtables[i] = NULL;
+   }
    j->scan_start = NULL;
    j->frame = NULL;
+   j->progressive = 0;
    j->has_restart_interval = 0;
    j->restart_interval = 0;
+   return j;
+}
+
+jpeg *jpeg_read(const char *filename) {
+   return jpeg_read_arena(filename, NULL);
+}
+
+jpeg *jpeg_read_arena(const char *filename, jpeg_arena *arena) {
+   jpeg_context context = {arena, NULL, NULL, NULL, NULL};
+   return jpeg_read_context(filename, &context);
+}
+
+jpeg *jpeg_read_context(const char *filename, const jpeg_context *context) {
+   jpeg *j = jpeg_create(context);
+   j->data = map_file(filename, &j->data_size);
+   if (j->data) {
+      j->data_source = JPEG_DATA_MAPPED;
+   } else {
+      /* Pipes and the like can't be mapped */
+      j->data = read_file(filename, &j->data_size);
+      j->data_source = JPEG_DATA_ALLOCATED;
+   }
    if (!j->data) {
       jpeg_destroy(j);
       return NULL;
    }
+   return jpeg_parse(j, context);
+}
+
+jpeg *jpeg_read_mem(const unsigned char *data, size_t data_size) {
+   return jpeg_read_mem_arena(data, data_size, NULL);
+}
+
+jpeg *jpeg_read_mem_arena(const unsigned char *data, size_t data_size, jpeg_arena *arena) {
+   jpeg_context context = {arena, NULL, NULL, NULL, NULL};
+   return jpeg_read_mem_context(data, data_size, &context);
+}
+
+jpeg *jpeg_read_mem_context(const unsigned char *data, size_t data_size, const jpeg_context *context) {
+   jpeg *j = jpeg_create(context);
+   if (!data) {
+      jpeg_destroy(j);
+      return NULL;
+   }
+   j->data = data;
+   j->data_size = data_size;
+   return jpeg_parse(j, context);
+}
+
+size_t jpeg_headers_length(const unsigned char *data, size_t data_size) {
+   size_t i = JPEG_MARKER_LENGTH_BYTES;
+   while (i + JPEG_MARKER_LENGTH_BYTES + JPEG_SEGMENT_SIZE_LENGTH_BYTES <= data_size) {
+      if (data[i] != JPEG_MARKER_MAGIC_BYTE || data[i + 1] == JPEG_MARKER_MAGIC_BYTE) {
+         /* Skip anything between segments, as read_next_segment does */
+         i += 1;
+      } else {
+         unsigned char marker = data[i + 1];
+         i += JPEG_MARKER_LENGTH_BYTES + read_word(&data[i + JPEG_MARKER_LENGTH_BYTES]);
+         if (i > data_size) {
+            break;
+         }
+         if (marker == JPEG_MARKER_SOS) {
+            return i;
+         }
+      }
+   }
+   return 0;
+}
+
+static jpeg *jpeg_parse(jpeg *j, const jpeg_context *context) {
    if (  j->data_size < 6
       || j->data[0] != JPEG_MARKER_MAGIC_BYTE
       || j->data[1] != JPEG_HEADER_MAGIC_1
@@ -49,21 +145,25 @@ jpeg *jpeg_read(const char *filename) {
    size_t offset = header_length;
    unsigned char marker = '\0';
    while (offset < j->data_size && marker != JPEG_MARKER_SOS) {
-      jpeg_segment *segment = read_next_segment(j, &offset);
+      jpeg_segment  segment_storage;
+      jpeg_segment *segment = read_next_segment(j, &offset, &segment_storage) ? &segment_storage : NULL;
       if (segment) {
          switch (segment->marker) {
             case JPEG_MARKER_DQT: {
-               int result = qtable_create(segment, j->qtables, &j->num_qtables);
+               int result = qtable_create(segment, j->arena, context->qtable_cache, j->qtables, &j->num_qtables);
                if (result != 0) {
                   printf("Unable to parse DQT segment\n");
                }
                break;
             }
-            case JPEG_MARKER_SOF: {
+            case JPEG_MARKER_SOF:
+            case JPEG_MARKER_SOF_EXTENDED:
+            case JPEG_MARKER_SOF_PROGRESSIVE: {
                if (j->frame != NULL) {
                   printf("Extra SOF segment\n");
                } else {
-                  j->frame = frame_create(segment);
+                  j->frame = frame_create(segment, j->arena);
+                  j->progressive = segment->marker == JPEG_MARKER_SOF_PROGRESSIVE;
                   if (!j->frame) {
                      printf("Unable to parse SOF segment\n");
                   }
@@ -71,13 +171,9 @@ jpeg *jpeg_read(const char *filename) {
                break;
             }
             case JPEG_MARKER_DHT: {
-               if (j->num_htables == JPEG_MAX_HTABLES) {
-                  printf("Extra htable\n");
-               } else {
-                  int result = htable_create(segment, j->htables, &j->num_htables);
-                  if (result != 0) {
-                     printf("Unable to parse DHT segment\n");
-                  }
+               int result = htable_create(segment, j->arena, context->htable_cache, j->htables, &j->num_htables);
+               if (result != 0) {
+                  printf("Unable to parse DHT segment\n");
                }
                break;
             }
@@ -89,21 +185,25 @@ jpeg *jpeg_read(const char *filename) {
                   j->scan_start = scan_start_create(segment
                                                    ,j->frame
                                                    ,j->data_size - segment_start
+                                                   ,j->arena
                                                    );
                   if (!j->scan_start) {
                      printf("Unable to parse SOS segment\n");
+                  } else if (!j->progressive) {
+                     use_scan_tables(j);
                   }
                }
                break;
             }
             case JPEG_MARKER_DRI: {
                if (segment->data_size != 2) {
-                  printf("Invalid DRI segment");
-                  assert(0);
+                  printf("Invalid DRI segment\n");
+                  jpeg_destroy(j);
+                  return NULL;
                }
-               j->has_restart_interval = 1;
-               j->restart_interval = read_word(segment->data);
-               assert(j->restart_interval > 0);
+               /* An interval of 0 turns restarts off */
+               j->restart_interval     = read_word(segment->data);
+               j->has_restart_interval = j->restart_interval > 0;
                break;
             }
             default: {
@@ -113,66 +213,136 @@ jpeg *jpeg_read(const char *filename) {
             }
          }
          marker = segment->marker;
-         jpeg_segment_destroy(segment);
       }
    }
    return j;
 }
 
+/* A sequential image has one scan, with every component in it, so the
+ * tables it names are those each component uses throughout */
+static void use_scan_tables(jpeg *j) {
+   const scan_start *s = j->scan_start;
+   unsigned int      n;
+   if (s->num_components != j->frame->num_components) {
+      printf("Unsupported scan of %u of the %u components\n", s->num_components, j->frame->num_components);
+      j->scan_start = NULL;
+      return;
+   }
+   for (n = 0; n < s->num_components; n++) {
+      component *c = &j->frame->components[s->component_index[n]];
+      c->dc_htable_id = s->dc_htable_id[n];
+      c->ac_htable_id = s->ac_htable_id[n];
+   }
+}
+
 void jpeg_destroy(jpeg *j) {
    if (j) {
-      size_t i;
-      for (i = 0; i < j->num_qtables; i++) {
-         qtable_destroy(j->qtables[i]);
+      /* Everything else is in the arena, j included */
+      jpeg_arena *arena = j->arena;
+      if (j->data) {
+         switch (j->data_source) {
+            case JPEG_DATA_ALLOCATED:
+               free((unsigned char *) j->data);
+               break;
+            case JPEG_DATA_MAPPED:
+               munmap((unsigned char *) j->data, j->data_size);
+               break;
+            case JPEG_DATA_BORROWED:
+               break;
+         }
       }
-      for (i = 0; i < j->num_htables; i++) {
-         htable_destroy(j->htables[i]);
+      if (j->owns_arena) {
+         jpeg_arena_destroy(arena);
+      } else {
+         jpeg_arena_reset(arena);
       }
-      frame_destroy(j->frame);
-      scan_start_destroy(j->scan_start);
-      free(j->data);
    }
-   free(j);
 }
 
+size_t jpeg_num_rows(const jpeg *j) {
+   return j->frame ? j->frame->num_lines : 0;
+}
+
+size_t jpeg_num_cols(const jpeg *j) {
+   return j->frame ? j->frame->samples_per_line : 0;
+}
+
+/* Used for files that can't be mapped, which may not be seekable either, so
+ * the buffer grows as the data arrives */
 static unsigned char *read_file(const char *filename
                                ,size_t     *out_file_size) {
    FILE          *fp = fopen(filename, "rb");
-   unsigned char *data;
-   size_t         file_size; 
+   unsigned char *data = NULL;
+   size_t         capacity = 0;
+   size_t         file_size = 0;
    if (!fp) {
       perror("Error opening file");
       return NULL;
    }
-   fseek(fp, 0L, SEEK_END);
-   file_size = ftell(fp);
-   fseek(fp, 0L, SEEK_SET);
-   data = malloc(file_size);
-   assert(data);
-   size_t bytes_read = fread(data
-                            ,sizeof(unsigned char)
-                            ,file_size
-                            ,fp);
-   if (bytes_read != file_size) {
+   do {
+      if (file_size == capacity) {
+         capacity = capacity * 2 + 64 * 1024;
+         data = realloc(data, capacity);
+         assert(data);
+      }
+      file_size += fread(data + file_size
+                        ,sizeof(unsigned char)
+                        ,capacity - file_size
+                        ,fp);
+   } while (!feof(fp) && !ferror(fp));
+   if (ferror(fp)) {
       printf("Error reading data from file\n");
+      fclose(fp);
+      free(data);
       return NULL;
    }
+   fclose(fp);
    if (out_file_size) {
       *out_file_size = file_size;
    }
    return data;
 }
 
-static jpeg_segment *read_next_segment(jpeg   *j
-                                      ,size_t *offset) {
-   jpeg_segment *segment = NULL;
+/* Returns NULL without printing anything if the file can't be mapped, so
+ * that the caller can fall back to reading it */
+static unsigned char *map_file(const char *filename
+                              ,size_t     *out_file_size) {
+   struct stat    st;
+   unsigned char *data;
+   int            fd = open(filename, O_RDONLY);
+   if (fd < 0) {
+      return NULL;
+   }
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+      close(fd);
+      return NULL;
+   }
+   data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   /* The mapping keeps the file open */
+   close(fd);
+   if (data == MAP_FAILED) {
+      return NULL;
+   }
+   /* The headers and scan are read front to back, so ask for aggressive
+    * readahead. This is only a hint. */
+   madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+   *out_file_size = (size_t) st.st_size;
+   return data;
+}
+
+/* Fills in segment with the next one after offset and returns 1, or
+ * returns 0 if there isn't one */
+static int read_next_segment(jpeg         *j
+                            ,size_t       *offset
+                            ,jpeg_segment *segment) {
+   int found = 0;
    unsigned char marker = '\0';
    size_t i;
    assert(j);
    assert(j->data);
    assert(offset);
    i = *offset;
-   while (i < j->data_size && segment == NULL) {
+   while (i < j->data_size && !found) {
       if (j->data[i] == JPEG_MARKER_MAGIC_BYTE && (i + 1) < j->data_size) {
          i++;
          marker = j->data[i];
@@ -185,14 +355,13 @@ static jpeg_segment *read_next_segment(jpeg   *j
             if (segment_size >= JPEG_SEGMENT_SIZE_LENGTH_BYTES) {
                segment_size -= JPEG_SEGMENT_SIZE_LENGTH_BYTES;
             } else {
-               jpeg_segment_destroy(segment);
-               return NULL;
+               return 0;
             }
             i += JPEG_SEGMENT_SIZE_LENGTH_BYTES;
-            segment = jpeg_segment_create(marker
-                                         ,j->data + i
-                                         ,segment_size
-                                         );
+            segment->marker    = marker;
+            segment->data      = j->data + i;
+            segment->data_size = segment_size;
+            found = 1;
             /* Skip the rest of the segment */
             i += segment->data_size;
          } 
@@ -201,6 +370,6 @@ static jpeg_segment *read_next_segment(jpeg   *j
       }
    }
    *offset = i;
-   return segment;
+   return found;
 }
 
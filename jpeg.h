@@ -1,9 +1,29 @@
 #ifndef JPEG_H
 #define JPEG_H
 
+#include <stddef.h>
+#include "arena.h"
+
 typedef struct jpeg_s jpeg;
 
+/* Maps the file if possible rather than reading it into memory */
 jpeg *jpeg_read(const char *filename);
+
+/* Decodes straight from data without copying it, so data must outlive the
+ * jpeg */
+jpeg *jpeg_read_mem(const unsigned char *data, size_t data_size);
+
+/* As above, but the jpeg and everything decoding it allocates come from
+ * arena rather than one of its own. jpeg_destroy resets the arena, which
+ * must outlive the jpeg and can only hold one jpeg at a time. The data of
+ * a file that can't be mapped is still read into the heap. */
+jpeg *jpeg_read_arena(const char *filename, jpeg_arena *arena);
+jpeg *jpeg_read_mem_arena(const unsigned char *data, size_t data_size, jpeg_arena *arena);
+
 void  jpeg_destroy(jpeg *j);
 
+/* Image size in pixels, or 0 if there was no frame header */
+size_t jpeg_num_rows(const jpeg *j);
+size_t jpeg_num_cols(const jpeg *j);
+
 #endif
@@ -6,7 +6,8 @@
 #endif
 
 #define JPEG_MAX_QTABLES 4
-#define JPEG_MAX_HTABLES 4
+/* A DC and an AC table for each of the four ids */
+#define JPEG_MAX_HTABLES 8
 
 #define JPEG_CHUNK_SIDE_LENGTH  8
 #define JPEG_CHUNK_NUM_SAMPLES (JPEG_CHUNK_SIDE_LENGTH * JPEG_CHUNK_SIDE_LENGTH)
@@ -16,15 +17,52 @@
 #include "htable.h"
 #include "frame.h"
 #include "scan_start.h"
+#include "thread_pool.h"
+
+/* The block lists of speculative decoding, see convert_internal.h */
+typedef struct convert_spec_cache_s convert_spec_cache;
+
+/* What a jpeg_decoder keeps from one image to the next. Any of it may be
+ * NULL: without an arena the jpeg makes its own, without caches tables are
+ * built in the arena and speculative decoding allocates its block lists
+ * for each image, and without a pool each parallel step starts its own
+ * threads. */
+typedef struct jpeg_context_s {
+   jpeg_arena         *arena;
+   htable_cache       *htable_cache;
+   qtable_cache       *qtable_cache;
+   convert_spec_cache *spec_cache;
+   thread_pool        *pool;
+} jpeg_context;
+
+/* Where the data came from, and so how to release it */
+typedef enum {
+   /* Owned by the caller of jpeg_read_mem */
+   JPEG_DATA_BORROWED  = 0,
+   JPEG_DATA_MAPPED    = 1,
+   JPEG_DATA_ALLOCATED = 2
+} jpeg_data_source;
 
 struct jpeg_s {
-   unsigned char *data;
-   size_t         data_size;
+   const unsigned char *data;
+   size_t               data_size;
+   jpeg_data_source     data_source;
+
+   /* Where the jpeg itself, its tables and its decoding buffers live.
+    * Destroyed with the jpeg if it was made for it, otherwise reset. */
+   jpeg_arena  *arena;
+   int          owns_arena;
+   /* Runs the parallel steps of decoding it, if not NULL */
+   thread_pool *pool;
+   /* Kept by the decoder for speculative decoding, if not NULL */
+   convert_spec_cache *spec_cache;
 
    qtable *qtables[JPEG_MAX_QTABLES];
    size_t  num_qtables;
 
    frame *frame;
+   /* SOF2, so the first scan is followed by others that refine it */
+   int    progressive;
 
    htable *htables[JPEG_MAX_HTABLES];
    size_t  num_htables;
@@ -34,4 +72,14 @@ struct jpeg_s {
    size_t      restart_interval;
 };
 
+/* Length of data up to the end of the first SOS segment, or 0 if that
+ * hasn't all arrived yet */
+size_t jpeg_headers_length(const unsigned char *data, size_t data_size);
+
+/* jpeg_read and jpeg_read_mem, with what a decoder keeps between images.
+ * Tables from the caches are only valid until the next jpeg is read with
+ * them. */
+jpeg *jpeg_read_context(const char *filename, const jpeg_context *context);
+jpeg *jpeg_read_mem_context(const unsigned char *data, size_t data_size, const jpeg_context *context);
+
 #endif
@@ -15,24 +15,24 @@
 #define JPEG_MARKER_DQT                0xDB
 #define JPEG_MARKER_DHT                0xC4
 #define JPEG_MARKER_SOF                0xC0
+#define JPEG_MARKER_SOF_EXTENDED       0xC1
+#define JPEG_MARKER_SOF_PROGRESSIVE    0xC2
+/* The other SOFn markers run to 0xCF, apart from these */
+#define JPEG_MARKER_SOF_LAST           0xCF
+#define JPEG_MARKER_JPG                0xC8
+#define JPEG_MARKER_DAC                0xCC
 #define JPEG_MARKER_SOS                0xDA
 #define JPEG_MARKER_COMMENT            0xFE
 #define JPEG_MARKER_EOI                0xD9
 #define JPEG_MARKER_DRI                0xDD
 
 typedef struct jpeg_segment_s {
-   unsigned char  marker;
-   unsigned char *data;
-   size_t         data_size;
+   unsigned char        marker;
+   const unsigned char *data;
+   size_t               data_size;
 } jpeg_segment;
 
 /* Read a 2 byte word from a big-endian buffer */
-unsigned int  read_word(unsigned char *buf);
-
-jpeg_segment *jpeg_segment_create(unsigned char  marker
-                                 ,unsigned char *data
-                                 ,size_t   data_size);
-
-void          jpeg_segment_destroy(jpeg_segment *segment);
+unsigned int  read_word(const unsigned char *buf);
 
 #endif
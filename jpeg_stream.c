@@ -1,80 +1,273 @@
 #include "jpeg_stream.h"
+#include "jpeg_stream_internal.h"
 #include "jpeg_internal.h"
+#include "jpeg_segment.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
-static void advance_one_byte(jpeg_stream *stream);
+#define BYTE_BITS 8
 
-struct jpeg_stream_s {
-   unsigned char *data;
-   size_t   data_size_bytes;  
-   size_t   bytes_read;
-   size_t   bit_offset;
-};
+/* Number of bytes loaded at once by the fast refill path */
+#define JPEG_STREAM_WORD_BYTES (JPEG_STREAM_BUFFER_BITS / BYTE_BITS)
+
+static void refill_slow(jpeg_stream *stream);
 
 jpeg_stream *jpeg_stream_create(size_t  data_size_bytes
-                               ,unsigned char *data
+                               ,const unsigned char *data
                                ) {
    jpeg_stream *s = malloc(sizeof(jpeg_stream));
    assert(s);
+   jpeg_stream_init(s, data_size_bytes, data);
+   return s;
+}
+
+void jpeg_stream_init(jpeg_stream         *s
+                     ,size_t               data_size_bytes
+                     ,const unsigned char *data) {
    s->data_size_bytes = data_size_bytes;
    s->data = data;
    s->bytes_read = 0;
-   s->bit_offset = 0;
-   return s;
+   s->bit_buffer = 0;
+   s->bits_left = 0;
+   s->padding_bits = 0;
+   s->stuff_bytes = 0;
+   s->marker_found = 0;
+   s->marker = 0;
+   s->data_complete = 1;
 }
 
-unsigned char jpeg_stream_get_next_bit(jpeg_stream *stream) {
-   unsigned char next_bit = !!(stream->data[stream->bytes_read] & (1 << (7 - stream->bit_offset)));
-   stream->bit_offset += 1;
-   if (stream->bit_offset == 8) {
-      advance_one_byte(stream);
+void jpeg_stream_destroy(jpeg_stream *stream) {
+   free(stream);
+}
+
+static uint64_t load_big_endian_word(const unsigned char *buf) {
+   uint64_t word = 0;
+   size_t   i;
+   for (i = 0; i < JPEG_STREAM_WORD_BYTES; i++) {
+      word = (word << BYTE_BITS) | buf[i];
    }
-   return next_bit;
+   return word;
 }
 
-void jpeg_stream_destroy(jpeg_stream *stream) {
-   free(stream);
+/* Non-zero if any byte of the word is 0xFF */
+static int has_marker_byte(uint64_t word) {
+   uint64_t inverted = ~word;
+   return ((inverted - 0x0101010101010101ull) & ~inverted & 0x8080808080808080ull) != 0;
+}
+
+void jpeg_stream_refill(jpeg_stream *stream) {
+   /* Whole bytes that still fit in the buffer, between 1 and 8 */
+   size_t num_bytes = (JPEG_STREAM_BUFFER_BITS - stream->bits_left) / BYTE_BITS;
+   if (   !stream->marker_found
+       && stream->bytes_read + JPEG_STREAM_WORD_BYTES <= stream->data_size_bytes) {
+      uint64_t word = load_big_endian_word(stream->data + stream->bytes_read);
+      /* Only look at the bytes we are about to take */
+      word &= ~(uint64_t) 0 << (JPEG_STREAM_BUFFER_BITS - num_bytes * BYTE_BITS);
+      if (!has_marker_byte(word)) {
+         stream->bit_buffer |= word >> stream->bits_left;
+         stream->bits_left  += num_bytes * BYTE_BITS;
+         stream->bytes_read += num_bytes;
+         return;
+      }
+   }
+   refill_slow(stream);
+}
+
+/* Byte at a time refill which deals with stuff bytes and markers */
+static void refill_slow(jpeg_stream *stream) {
+   while (stream->bits_left <= JPEG_STREAM_BUFFER_BITS - BYTE_BITS) {
+      uint64_t byte    = 0;
+      int      padding = 1;
+      if (!stream->marker_found && stream->bytes_read < stream->data_size_bytes) {
+         byte = stream->data[stream->bytes_read];
+         if (byte != JPEG_MARKER_MAGIC_BYTE) {
+            stream->bytes_read += 1;
+            padding = 0;
+         } else if (   stream->bytes_read + 1 < stream->data_size_bytes
+                    && stream->data[stream->bytes_read + 1] == 0x00) {
+            /* Stuff byte */
+            stream->bytes_read += 2;
+            stream->stuff_bytes += 1;
+            padding = 0;
+         } else if (   stream->bytes_read + 1 == stream->data_size_bytes
+                    && !stream->data_complete) {
+            /* Can't tell a stuff byte from a marker until the next byte
+             * arrives, so pad for now */
+            byte = 0;
+         } else {
+            /* Leave bytes_read pointing at the marker */
+            stream->marker_found = 1;
+            if (stream->bytes_read + 1 < stream->data_size_bytes) {
+               stream->marker = stream->data[stream->bytes_read + 1];
+            }
+            byte = 0;
+         }
+      }
+      /* No more entropy coded data, feed in zeros */
+      if (padding) {
+         stream->padding_bits += BYTE_BITS;
+      }
+      stream->bit_buffer |= byte << (JPEG_STREAM_BUFFER_BITS - BYTE_BITS - stream->bits_left);
+      stream->bits_left  += BYTE_BITS;
+   }
 }
 
 int jpeg_stream_get_state(jpeg_stream *stream) {
    int ret = JPEG_STREAM_STATE_MORE_DATA;
-   if (stream->bytes_read >= stream->data_size_bytes) {
+   if (stream->bits_left < BYTE_BITS) {
+      jpeg_stream_refill(stream);
+   }
+   /* Read past the last real bit into padding */
+   if (stream->bits_left < stream->padding_bits) {
       ret = JPEG_STREAM_STATE_OUT_OF_DATA;
-      /* Check for EOI marker */
-   } else if ((stream->bytes_read + 2) < stream->data_size_bytes
-            && stream->data[stream->bytes_read + 1] == JPEG_MARKER_MAGIC_BYTE
-            && stream->data[stream->bytes_read + 2] == JPEG_MARKER_EOI) {
+   /* Only fill bits remain before the EOI marker */
+   } else if (   stream->marker_found
+              && stream->marker == JPEG_MARKER_EOI
+              && stream->bits_left - stream->padding_bits < BYTE_BITS) {
       ret = JPEG_STREAM_STATE_EOI;
-   } 
+   } else if (   !stream->marker_found
+              && stream->bits_left == stream->padding_bits) {
+      ret = JPEG_STREAM_STATE_OUT_OF_DATA;
+   }
    return ret;
 }
 
 void jpeg_stream_restart(jpeg_stream *stream) {
-   /* If current byte is 0xFF then still need to skip stuff bytes */
-   if (stream->bit_offset != 0) {
-      advance_one_byte(stream);
+   /* Throw away the fill bits at the end of the interval */
+   stream->bit_buffer   = 0;
+   stream->bits_left    = 0;
+   stream->padding_bits = 0;
+   stream->marker_found = 0;
+   /* Skip any fill bytes before the marker */
+   while (   stream->bytes_read + 1 < stream->data_size_bytes
+          && stream->data[stream->bytes_read]     == JPEG_MARKER_MAGIC_BYTE
+          && stream->data[stream->bytes_read + 1] == JPEG_MARKER_MAGIC_BYTE) {
+      stream->bytes_read += 1;
    }
-   /* Don't need to skip stuff bytes since we are reading a marker */
    assert(stream->bytes_read + 1 < stream->data_size_bytes);
    /* Assert that we actually see a restart marker */
-   assert(stream->data[stream->bytes_read] == 0xFF);
+   assert(stream->data[stream->bytes_read] == JPEG_MARKER_MAGIC_BYTE);
    stream->bytes_read += 1;
-   assert((stream->data[stream->bytes_read] & 0xF0) == 0xD0);
+   assert((stream->data[stream->bytes_read] & 0xF8) == 0xD0);
    stream->bytes_read += 1;
 }
 
-static void advance_one_byte(jpeg_stream *stream) {
-   /* Check for stuff bytes */
-   if (stream->data[stream->bytes_read] == 0xFF) {
-      stream->bytes_read += 1;
-      /* Not sure what to do with a marker in the middle of the huffman stream,
-       * just assert for now */
-      assert(stream->data[stream->bytes_read] == 0x00);
+int jpeg_stream_restart_ready(const jpeg_stream *stream) {
+   size_t i = stream->bytes_read;
+   while (   i + 1 < stream->data_size_bytes
+          && stream->data[i]     == JPEG_MARKER_MAGIC_BYTE
+          && stream->data[i + 1] == JPEG_MARKER_MAGIC_BYTE) {
+      i += 1;
    }
-   stream->bytes_read += 1;
-   stream->bit_offset = 0;
+   return stream->data_complete || i + 1 < stream->data_size_bytes;
+}
+
+void jpeg_stream_extend(jpeg_stream         *stream
+                       ,const unsigned char *data
+                       ,size_t               data_size_bytes
+                       ,int                  complete) {
+   assert(data_size_bytes >= stream->data_size_bytes);
+   assert(!jpeg_stream_starved(stream));
+   stream->data            = data;
+   stream->data_size_bytes = data_size_bytes;
+   stream->data_complete   = complete;
+}
+
+int jpeg_stream_starved(const jpeg_stream *stream) {
+   return !stream->data_complete && !stream->marker_found && stream->padding_bits > 0;
+}
+
+/* Walks the entropy coded data from the current position, storing up to
+ * max_offsets RSTn offsets. Returns the number of RSTn markers, and sets
+ * end to the offset of the marker which ends the scan. */
+static size_t scan_markers(const jpeg_stream *stream
+                          ,size_t            *offsets
+                          ,size_t             max_offsets
+                          ,size_t            *end) {
+   size_t num_found = 0;
+   size_t i = stream->bytes_read;
+   int    done = 0;
+   int    ended = 0;
+   while (!done && i + 1 < stream->data_size_bytes) {
+      const unsigned char *next = memchr(stream->data + i
+                                        ,JPEG_MARKER_MAGIC_BYTE
+                                        ,stream->data_size_bytes - i - 1);
+      if (!next) {
+         done = 1;
+      } else {
+         unsigned char marker;
+         i = next - stream->data;
+         marker = stream->data[i + 1];
+         if (marker == 0x00) {
+            /* Stuff byte */
+            i += 2;
+         } else if (marker == JPEG_MARKER_MAGIC_BYTE) {
+            /* Fill byte */
+            i += 1;
+         } else if ((marker & 0xF8) == 0xD0) {
+            if (num_found < max_offsets) {
+               offsets[num_found] = i + 2;
+            }
+            num_found += 1;
+            i += 2;
+         } else {
+            /* Any other marker ends the scan */
+            done  = 1;
+            ended = 1;
+         }
+      }
+   }
+   *end = ended ? i : stream->data_size_bytes;
+   return num_found;
+}
+
+size_t jpeg_stream_find_restarts(const jpeg_stream *stream
+                                ,size_t            *offsets
+                                ,size_t             max_offsets) {
+   size_t end;
+   return scan_markers(stream, offsets, max_offsets, &end);
+}
+
+size_t jpeg_stream_find_scan_end(const jpeg_stream *stream) {
+   size_t end;
+   scan_markers(stream, NULL, 0, &end);
+   return end;
+}
+
+size_t jpeg_stream_count_stuff_bytes(const jpeg_stream *stream, size_t start, size_t end) {
+   size_t count = 0;
+   size_t i = start;
+   while (i < end) {
+      const unsigned char *next = memchr(stream->data + i, JPEG_MARKER_MAGIC_BYTE, end - i);
+      if (!next) {
+         break;
+      }
+      i = next - stream->data + 1;
+      if (i < stream->data_size_bytes && stream->data[i] == 0x00) {
+         count += 1;
+         i += 1;
+      }
+   }
+   return count;
 }
 
+size_t jpeg_stream_split_point(const jpeg_stream *stream, size_t offset) {
+   if (   offset > 0
+       && offset < stream->data_size_bytes
+       && stream->data[offset - 1] == JPEG_MARKER_MAGIC_BYTE
+       && stream->data[offset]     == 0x00) {
+      offset += 1;
+   }
+   return offset;
+}
 
+size_t jpeg_stream_bit_position(const jpeg_stream *stream) {
+   size_t data_bits = (stream->bytes_read - stream->stuff_bytes) * BYTE_BITS;
+   return data_bits + stream->padding_bits - stream->bits_left;
+}
 
+jpeg_stream *jpeg_stream_create_at(const jpeg_stream *stream, size_t offset) {
+   assert(offset <= stream->data_size_bytes);
+   return jpeg_stream_create(stream->data_size_bytes - offset, stream->data + offset);
+}
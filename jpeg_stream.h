@@ -1,4 +1,3 @@
-
 #ifndef JPEG_STREAM_H
 #define JPEG_STREAM_H
 
@@ -11,15 +10,25 @@
 /* Data ran out before end of image */
 #define JPEG_STREAM_STATE_OUT_OF_DATA 2
 
+/* Largest number of bits that can be peeked at once */
+#define JPEG_STREAM_MAX_PEEK_BITS     32
+
 typedef struct jpeg_stream_s jpeg_stream;
 
 jpeg_stream *jpeg_stream_create(size_t         data_size_bytes
-                               ,unsigned char *data
+                               ,const unsigned char *data
                                );
 
+/* Sets up a stream in memory the caller provides, which must be
+ * sizeof(struct jpeg_stream_s) from jpeg_stream_internal.h */
+void jpeg_stream_init(jpeg_stream         *stream
+                     ,size_t               data_size_bytes
+                     ,const unsigned char *data);
+
 void jpeg_stream_destroy(jpeg_stream *stream);
 
-unsigned char jpeg_stream_get_next_bit(jpeg_stream *stream);
+/* The bit reader itself (peek, consume and get_bits) is inlined from
+ * jpeg_stream_internal.h */
 
 /* Return one of JPEG_STREAM_STATE_XXX */
 int jpeg_stream_get_state(jpeg_stream *stream);
@@ -27,4 +36,51 @@ int jpeg_stream_get_state(jpeg_stream *stream);
 /* Handle restart marker */
 void jpeg_stream_restart(jpeg_stream *stream);
 
-#endif
\ No newline at end of file
+/* Streams over data that is still arriving (see jpeg_stream_extend) can't
+ * restart until the marker has arrived. Always true otherwise. */
+int jpeg_stream_restart_ready(const jpeg_stream *stream);
+
+/* Point the stream at a longer copy of its data, which may have moved, for
+ * decoding data as it arrives. Until complete is set the end of the data
+ * is not treated as the end of the scan: reads past it see padding, and
+ * the stream is starved. A starved stream must be restored to a copy taken
+ * before it starved before it can be extended. */
+void jpeg_stream_extend(jpeg_stream         *stream
+                       ,const unsigned char *data
+                       ,size_t               data_size_bytes
+                       ,int                  complete);
+
+/* Non-zero if the stream has padded past the end of incomplete data, so
+ * anything decoded since it last wasn't starved may be wrong */
+int jpeg_stream_starved(const jpeg_stream *stream);
+
+/* Scan ahead through the entropy coded data, without moving the stream,
+ * for the RSTn markers up to the end of the scan. The offset of the first
+ * byte after each of the first max_offsets markers is stored. Returns the
+ * number of markers found, which may be more than max_offsets. */
+size_t jpeg_stream_find_restarts(const jpeg_stream *stream
+                                ,size_t            *offsets
+                                ,size_t             max_offsets);
+
+/* Offset of the marker that ends the scan, or the end of the data */
+size_t jpeg_stream_find_scan_end(const jpeg_stream *stream);
+
+/* Number of stuffed zero bytes in [start, end) of the stream's data.
+ * Neither end may split an 0xFF 0x00 pair. */
+size_t jpeg_stream_count_stuff_bytes(const jpeg_stream *stream, size_t start, size_t end);
+
+/* The first offset at or after offset which doesn't split an 0xFF 0x00
+ * pair, so is somewhere a new stream can start */
+size_t jpeg_stream_split_point(const jpeg_stream *stream, size_t offset);
+
+/* Bits of entropy coded data consumed since the start of the stream, not
+ * counting stuff bytes, so that a position doesn't depend on how far ahead
+ * the bit buffer has been filled */
+size_t jpeg_stream_bit_position(const jpeg_stream *stream);
+
+/* A new stream over the same data, starting at a byte offset such as one
+ * given by jpeg_stream_find_restarts. The offset must not split a marker
+ * or an 0xFF 0x00 pair. */
+jpeg_stream *jpeg_stream_create_at(const jpeg_stream *stream, size_t offset);
+
+#endif
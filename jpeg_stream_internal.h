@@ -0,0 +1,52 @@
+#ifndef JPEG_STREAM_INTERNAL_H
+#define JPEG_STREAM_INTERNAL_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "jpeg_stream.h"
+
+#define JPEG_STREAM_BUFFER_BITS 64
+
+/* The bit buffer is kept left aligned, so the next bit of the stream is
+ * always the top bit of bit_buffer */
+struct jpeg_stream_s {
+   const unsigned char *data;
+   size_t               data_size_bytes;
+   /* Bytes that have been moved into the bit buffer */
+   size_t               bytes_read;
+   uint64_t             bit_buffer;
+   size_t               bits_left;
+   /* Zero bits appended after a marker or the end of the data */
+   size_t               padding_bits;
+   /* Stuffed zero bytes that have been skipped */
+   size_t               stuff_bytes;
+   int                  marker_found;
+   unsigned char        marker;
+   /* Zero while more data may still be appended, see jpeg_stream_extend */
+   int                  data_complete;
+};
+
+/* Top up the bit buffer so it holds at least 57 bits */
+void jpeg_stream_refill(jpeg_stream *stream);
+
+static inline unsigned int jpeg_stream_peek_bits(jpeg_stream *stream, size_t num_bits) {
+   assert(num_bits <= JPEG_STREAM_MAX_PEEK_BITS);
+   if (stream->bits_left < num_bits) {
+      jpeg_stream_refill(stream);
+   }
+   return num_bits == 0 ? 0 : (unsigned int) (stream->bit_buffer >> (JPEG_STREAM_BUFFER_BITS - num_bits));
+}
+
+static inline void jpeg_stream_consume_bits(jpeg_stream *stream, size_t num_bits) {
+   stream->bit_buffer <<= num_bits;
+   stream->bits_left   -= num_bits;
+}
+
+static inline unsigned int jpeg_stream_get_bits(jpeg_stream *stream, size_t num_bits) {
+   unsigned int value = jpeg_stream_peek_bits(stream, num_bits);
+   jpeg_stream_consume_bits(stream, num_bits);
+   return value;
+}
+
+#endif
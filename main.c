@@ -2,29 +2,317 @@
 * japeg - a simple C JPEG decoder.
 */
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "jpeg.h"
 #include "convert.h"
 #include "bitmap.h"
+#include "batch.h"
+#include "push.h"
+#include "probe.h"
 
-#define NUM_ARGS     3
-#define ARG_IN_FILE  1
-#define ARG_OUT_FILE 2 
+#define NUM_FILE_ARGS 2
+
+static void usage(const char *program) {
+   printf("Usage: %s [-d islow|ifast|float] [-p] [-s] [-t threads] [-H] [-b] [-i bytes] [-r] [-S 1|2|4|8] [-c x,y,w,h] [-u nearest|fancy] [-P] [-V] [-R] in_file.jpg out_file.bmp ...\n", program);
+   printf("  -d  inverse DCT method\n");
+   printf("  -p  high precision float output\n");
+   printf("  -s  print decoder statistics\n");
+   printf("  -t  decoding threads, 0 for one per core (default)\n");
+   printf("  -H  speculative parallel Huffman decoding without restart markers\n");
+   printf("  -b  decode any number of in/out pairs, one image per thread\n");
+   printf("  -i  decode incrementally, feeding the file in chunks of this many bytes\n");
+   printf("  -r  decode a row of MCUs at a time, writing rows as they finish\n");
+   printf("  -S  decode at 1/n of full size\n");
+   printf("  -c  decode only this rectangle of the (scaled) image\n");
+   printf("  -u  chroma upsampling method\n");
+   printf("  -P  print what the headers say the decode will need first\n");
+   printf("  -V  write a preview after each scan of a progressive image to out_file.N.bmp\n");
+   printf("  -R  write raw top-down pixels with no header: BGR, or one byte of luma for greyscale\n");
+}
+
+/* Returns 0 on success, 1 if the method name isn't recognised */
+static int parse_dct_method(const char *name, jpeg_dct_method *method) {
+   if (strcmp(name, "islow") == 0) {
+      *method = JPEG_DCT_ISLOW;
+   } else if (strcmp(name, "ifast") == 0) {
+      *method = JPEG_DCT_IFAST;
+   } else if (strcmp(name, "float") == 0) {
+      *method = JPEG_DCT_FLOAT;
+   } else {
+      return 1;
+   }
+   return 0;
+}
+
+static int parse_upsample_method(const char *name, jpeg_upsample_method *method) {
+   if (strcmp(name, "nearest") == 0) {
+      *method = JPEG_UPSAMPLE_NEAREST;
+   } else if (strcmp(name, "fancy") == 0) {
+      *method = JPEG_UPSAMPLE_FANCY;
+   } else {
+      return 1;
+   }
+   return 0;
+}
+
+static void print_convert_stats(const convert_stats *stats) {
+   static const char *idct_paths[CONVERT_NUM_IDCT_PATHS] = {"dc only", "2x2", "4x4", "full"};
+   size_t total = 0;
+   unsigned int i;
+   for (i = 0; i < CONVERT_NUM_IDCT_PATHS; i++) {
+      total += stats->idct_blocks[i];
+   }
+   printf("IDCT blocks: %zu\n", total);
+   for (i = 0; i < CONVERT_NUM_IDCT_PATHS; i++) {
+      printf("  %-8s %10zu (%.1f%%)\n"
+            ,idct_paths[i]
+            ,stats->idct_blocks[i]
+            ,total ? 100.0 * stats->idct_blocks[i] / total : 0.0);
+   }
+}
+
+static void print_probe(const char *in_file, const convert_options *options) {
+   static const char *codings[] = {"baseline", "extended", "progressive", "other"};
+   jpeg_info info;
+   unsigned int c;
+   if (jpeg_probe_file(in_file, options, &info) != JPEG_PROBE_OK) {
+      printf("Unable to probe %s\n", in_file);
+      return;
+   }
+   printf("%s: %zux%zu %s, components", in_file, info.num_cols, info.num_rows, codings[info.coding]);
+   for (c = 0; c < info.num_components && c < JPEG_PROBE_MAX_COMPONENTS; c++) {
+      printf(" %ux%u"
+            ,info.components[c].sampling_factor_horizontal
+            ,info.components[c].sampling_factor_vertical);
+   }
+   printf(", restart interval %zu, %zu header bytes\n", info.restart_interval, info.header_bytes);
+   printf("  output %zux%zu, peak memory %zu bytes, relative cost %.2f\n"
+         ,info.output_cols, info.output_rows, info.peak_memory_bytes, info.relative_cost);
+}
+
+/* Decode num_items in/out pairs from files */
+static int decode_batch(const convert_options *options
+                       ,char                  *files[]
+                       ,size_t                 num_items
+                       ,bitmap_format          format
+                       ,int                    print_stats) {
+   jpeg_batch_item *items = malloc(num_items * sizeof(jpeg_batch_item));
+   jpeg_batch *batch;
+   size_t num_failed;
+   size_t i;
+   assert(items);
+   for (i = 0; i < num_items; i++) {
+      items[i].in_data    = NULL;
+      items[i].in_file    = files[i * NUM_FILE_ARGS];
+      items[i].out_file   = files[i * NUM_FILE_ARGS + 1];
+      items[i].out_format = format;
+   }
+   batch = jpeg_batch_create(options);
+   num_failed = jpeg_decode_batch(batch, items, num_items);
+   jpeg_batch_destroy(batch);
+   for (i = 0; i < num_items; i++) {
+      if (items[i].status != JPEG_BATCH_OK) {
+         printf("Failed to decode %s (%d)\n", items[i].in_file, (int) items[i].status);
+      }
+   }
+   if (print_stats) {
+      print_convert_stats(options->stats);
+   }
+   printf("Decoded %zu of %zu images.\n", num_items - num_failed, num_items);
+   free(items);
+   return num_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int write_rows(void                *user
+                     ,const unsigned char *pixels
+                     ,size_t               stride
+                     ,size_t               first_row
+                     ,size_t               num_rows) {
+   (void) first_row;
+   return bitmap_writer_write_rows(user, pixels, stride, num_rows);
+}
+
+/* Write each preview next to the output, numbered by scan */
+static int write_preview(void   *user
+                        ,bitmap *preview
+                        ,size_t  num_scans
+                        ,size_t  bytes_read) {
+   const char *out_file = user;
+   size_t      length   = strlen(out_file) + 32;
+   char       *filename = malloc(length);
+   assert(filename);
+   snprintf(filename, length, "%s.%zu.bmp", out_file, num_scans);
+   printf("Scan %zu ends %zu bytes in, preview in %s\n", num_scans, bytes_read, filename);
+   bitmap_write(preview, filename);
+   free(filename);
+   return 0;
+}
+
+/* Push the file through the decoder chunk_size bytes at a time, as if it
+ * were arriving over a slow connection */
+static int decode_incremental(const convert_options *options
+                             ,const char            *in_file
+                             ,const char            *out_file
+                             ,size_t                 chunk_size
+                             ,bitmap_format          format
+                             ,int                    print_stats) {
+   int ret = EXIT_FAILURE;
+   FILE *fp = fopen(in_file, "rb");
+   unsigned char *chunk;
+   jpeg_push *push;
+   jpeg_push_status status = JPEG_PUSH_NEED_MORE_DATA;
+   bitmap *b;
+   if (!fp) {
+      perror("Error opening file");
+      return EXIT_FAILURE;
+   }
+   chunk = malloc(chunk_size);
+   assert(chunk);
+   push = jpeg_push_create(options);
+   while (status == JPEG_PUSH_NEED_MORE_DATA) {
+      size_t num_bytes = fread(chunk, 1, chunk_size, fp);
+      if (num_bytes == 0) {
+         status = jpeg_push_finish(push);
+      } else {
+         status = jpeg_push_feed(push, chunk, num_bytes);
+      }
+   }
+   fclose(fp);
+   free(chunk);
+   b = jpeg_push_take_bitmap(push);
+   jpeg_push_destroy(push);
+   if (b && print_stats) {
+      print_convert_stats(options->stats);
+   }
+   if (b) {
+      if (bitmap_write_format(b, out_file, format) == 0 && status == JPEG_PUSH_DONE) {
+         ret = EXIT_SUCCESS;
+      }
+      bitmap_destroy(b);
+   }
+   return ret;
+}
 
 int main(int argc, char *argv[]) {
    int ret = EXIT_FAILURE;
-   if (argc < NUM_ARGS) {
-      printf("Usage: %s in_file.jpg out_file.bmp\n", argv[0]);
+   int arg = 1;
+   convert_options options;
+   convert_stats stats;
+   int print_stats = 0;
+   int batch_mode = 0;
+   size_t chunk_size = 0;
+   int row_mode = 0;
+   int probe = 0;
+   bitmap_format format = BITMAP_FORMAT_BMP;
+   convert_options_init(&options);
+   memset(&stats, 0, sizeof(stats));
+   while (arg < argc && argv[arg][0] == '-') {
+      int error = 1;
+      if (strcmp(argv[arg], "-d") == 0 && arg + 1 < argc) {
+         error = parse_dct_method(argv[arg + 1], &options.dct_method);
+         arg += 1;
+      } else if (strcmp(argv[arg], "-u") == 0 && arg + 1 < argc) {
+         error = parse_upsample_method(argv[arg + 1], &options.upsampling);
+         arg += 1;
+      } else if (strcmp(argv[arg], "-p") == 0) {
+         options.high_precision = 1;
+         error = 0;
+      } else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+         char *end;
+         options.num_threads = (unsigned int) strtoul(argv[arg + 1], &end, 10);
+         error = *end != '\0';
+         arg += 1;
+      } else if (strcmp(argv[arg], "-H") == 0) {
+         options.speculative_huffman = 1;
+         error = 0;
+      } else if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc) {
+         char *end;
+         chunk_size = (size_t) strtoul(argv[arg + 1], &end, 10);
+         error = *end != '\0' || chunk_size == 0;
+         arg += 1;
+      } else if (strcmp(argv[arg], "-S") == 0 && arg + 1 < argc) {
+         char *end;
+         options.scale_denom = (unsigned int) strtoul(argv[arg + 1], &end, 10);
+         error = *end != '\0';
+         arg += 1;
+      } else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc) {
+         convert_rect *crop = &options.crop;
+         char extra;
+         error = sscanf(argv[arg + 1], "%zu,%zu,%zu,%zu%c"
+                       ,&crop->col, &crop->row, &crop->num_cols, &crop->num_rows, &extra) != 4
+              || crop->num_cols == 0 || crop->num_rows == 0;
+         arg += 1;
+      } else if (strcmp(argv[arg], "-r") == 0) {
+         row_mode = 1;
+         error = 0;
+      } else if (strcmp(argv[arg], "-b") == 0) {
+         batch_mode = 1;
+         error = 0;
+      } else if (strcmp(argv[arg], "-P") == 0) {
+         probe = 1;
+         error = 0;
+      } else if (strcmp(argv[arg], "-V") == 0) {
+         options.scan_callback = write_preview;
+         error = 0;
+      } else if (strcmp(argv[arg], "-R") == 0) {
+         format = BITMAP_FORMAT_RAW;
+         error = 0;
+      } else if (strcmp(argv[arg], "-s") == 0) {
+         options.stats = &stats;
+         print_stats = 1;
+         error = 0;
+      }
+      if (error) {
+         usage(argv[0]);
+         return EXIT_FAILURE;
+      }
+      arg += 1;
+   }
+   if (argc - arg < NUM_FILE_ARGS || (batch_mode && (argc - arg) % NUM_FILE_ARGS != 0)) {
+      usage(argv[0]);
       return EXIT_FAILURE;
    }
-   char *in_file  = argv[ARG_IN_FILE];
-   char *out_file = argv[ARG_OUT_FILE]; 
+   if (batch_mode) {
+      /* Previews are named after a single output */
+      options.scan_callback = NULL;
+      return decode_batch(&options, &argv[arg], (size_t) (argc - arg) / NUM_FILE_ARGS, format, print_stats);
+   }
+   char *in_file  = argv[arg];
+   char *out_file = argv[arg + 1];
+   options.scan_user = out_file;
+   if (probe) {
+      print_probe(in_file, &options);
+   }
+   if (chunk_size > 0) {
+      return decode_incremental(&options, in_file, out_file, chunk_size, format, print_stats);
+   }
    jpeg *j = jpeg_read(in_file);
-   if (j) {
-      bitmap *b = jpeg_to_bitmap(j);
+   if (j && row_mode) {
+      size_t num_rows, num_cols;
+      bitmap_writer *w = NULL;
+      if (jpeg_output_size(j, &options, &num_rows, &num_cols) == 0) {
+         w = bitmap_writer_create(out_file, num_rows, num_cols, jpeg_output_channels(j), format);
+      }
+      if (w) {
+         int error = jpeg_decode_rows(j, &options, write_rows, w);
+         if (bitmap_writer_destroy(w) == 0 && !error) {
+            ret = EXIT_SUCCESS;
+         }
+         if (print_stats) {
+            print_convert_stats(&stats);
+         }
+      }
+      jpeg_destroy(j);
+   } else if (j) {
+      bitmap *b = jpeg_to_bitmap(j, &options);
+      if (b && print_stats) {
+         print_convert_stats(&stats);
+      }
       if (b) {
-         int err = bitmap_write(b, out_file);
+         int err = bitmap_write_format(b, out_file, format);
          if (!err) {
             ret = EXIT_SUCCESS;
          }
@@ -0,0 +1,284 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "probe.h"
+#include "bitmap_internal.h"
+#include "convert_internal.h"
+#include "cpu.h"
+#include "jpeg_internal.h"
+#include "jpeg_segment.h"
+
+/* jpeg_probe_file reads this much at first, doubling until it has the
+ * headers */
+#define PROBE_FIRST_READ_BYTES (4 * 1024)
+
+/* Cost model, in units of entropy decoding one block. The weights are
+ * from timing single threaded -O2 builds on large images. */
+#define PROBE_COST_ENTROPY_BLOCK    1.0
+/* Progressive scans go over each block several times */
+#define PROBE_COST_PROGRESSIVE      2.0
+#define PROBE_COST_IDCT_ISLOW       0.6
+#define PROBE_COST_IDCT_IFAST       0.7
+#define PROBE_COST_IDCT_FLOAT       2.0
+/* Each halving of the scale multiplies the IDCT cost by this */
+#define PROBE_COST_IDCT_HALVING     0.4
+/* Colour conversion and storing, per output pixel */
+#define PROBE_COST_PIXEL            0.02
+#define PROBE_COST_PIXEL_FANCY      0.01
+#define PROBE_COST_PIXEL_PRECISE    0.08
+/* The unit of relative_cost: a megapixel of 4:2:0, which is 1.5 blocks
+ * per 64 pixels */
+#define PROBE_REFERENCE_PIXELS      1000000.0
+#define PROBE_REFERENCE_BLOCKS      (PROBE_REFERENCE_PIXELS * 1.5 / JPEG_CHUNK_NUM_SAMPLES)
+
+static jpeg_coding coding_for_marker(unsigned char marker) {
+   switch (marker) {
+      case JPEG_MARKER_SOF:
+         return JPEG_CODING_BASELINE;
+      case JPEG_MARKER_SOF_EXTENDED:
+         return JPEG_CODING_EXTENDED;
+      case JPEG_MARKER_SOF_PROGRESSIVE:
+         return JPEG_CODING_PROGRESSIVE;
+      default:
+         return JPEG_CODING_OTHER;
+   }
+}
+
+static int is_sof(unsigned char marker) {
+   return    marker >= JPEG_MARKER_SOF && marker <= JPEG_MARKER_SOF_LAST
+          && marker != JPEG_MARKER_DHT && marker != JPEG_MARKER_JPG && marker != JPEG_MARKER_DAC;
+}
+
+/* IDCT cost of a block, which shrinks with the scaled IDCTs */
+static double idct_cost(const convert_options *options) {
+   double       cost;
+   unsigned int denom;
+   switch (convert_dct_method(options)) {
+      case JPEG_DCT_IFAST:
+         cost = PROBE_COST_IDCT_IFAST;
+         break;
+      case JPEG_DCT_FLOAT:
+         cost = PROBE_COST_IDCT_FLOAT;
+         break;
+      default:
+         cost = PROBE_COST_IDCT_ISLOW;
+         break;
+   }
+   for (denom = options->scale_denom; denom > 1; denom /= 2) {
+      cost *= PROBE_COST_IDCT_HALVING;
+   }
+   return cost;
+}
+
+/* MCUs with any of the output region in them */
+static size_t visible_mcus(const jpeg *j, const convert_options *options, const convert_rect *region) {
+   unsigned int block_side = JPEG_CHUNK_SIDE_LENGTH / options->scale_denom;
+   size_t       width      = j->frame->highest_sampling_factor_horizontal * block_side;
+   size_t       height     = j->frame->highest_sampling_factor_vertical   * block_side;
+   size_t       mcu_rows   = (region->row + region->num_rows + height - 1) / height - region->row / height;
+   size_t       mcu_cols   = (region->col + region->num_cols + width  - 1) / width  - region->col / width;
+   return mcu_rows * mcu_cols;
+}
+
+static void estimate(const jpeg *j, const convert_options *options, int progressive, jpeg_info *info) {
+   const frame *f = j->frame;
+   convert_rect region;
+   size_t       blocks_per_mcu = 0;
+   size_t       entropy_blocks;
+   size_t       num_pixels;
+   double       cost;
+   double       pixel_cost;
+   unsigned int num_threads;
+   unsigned int num_states = 1;
+   int          fancy      = convert_fancy_upsampling(j, options);
+   unsigned int num_channels = jpeg_output_channels(j);
+   unsigned int c;
+   for (c = 0; c < f->num_components; c++) {
+      blocks_per_mcu += f->components[c].sampling_factor_horizontal
+                      * f->components[c].sampling_factor_vertical;
+   }
+   convert_output_rect(j, options, &region);
+   info->output_rows = region.num_rows;
+   info->output_cols = region.num_cols;
+   num_pixels = region.num_rows * region.num_cols;
+
+   /* Memory: the bitmap, each thread's state, and whatever the decode
+    * holds on to besides */
+   num_threads = options->num_threads ? options->num_threads : cpu_num_cores();
+   info->peak_memory_bytes = num_pixels * num_channels * (options->high_precision
+                                                          ? sizeof(float)
+                                                          : BITMAP_BYTES_PER_CHANNEL);
+   if (progressive) {
+      /* The coefficients are rendered in parallel once they are all in */
+      info->peak_memory_bytes += convert_progressive_bytes(j);
+      if (num_threads >= 2) {
+         num_states = num_threads;
+      }
+   } else if (num_threads >= 2 && (j->has_restart_interval || options->speculative_huffman)) {
+      num_states = num_threads;
+      if (!j->has_restart_interval) {
+         info->peak_memory_bytes += convert_speculative_bytes(j);
+      }
+   }
+   info->peak_memory_bytes += num_states * sizeof(convert_state);
+   if (fancy) {
+      size_t num_bands = num_states > 1
+                       ? convert_num_mcus_needed(j, options) / convert_mcus_per_row(j)
+                       : CONVERT_RING_BANDS;
+      info->peak_memory_bytes += convert_planes_bytes(j, options, num_bands);
+   }
+
+   /* Every block up to the bottom of the region is entropy decoded, but
+    * only those in it are transformed */
+   entropy_blocks = (progressive ? convert_num_mcus(j) : convert_num_mcus_needed(j, options)) * blocks_per_mcu;
+   cost = entropy_blocks * PROBE_COST_ENTROPY_BLOCK * (progressive ? PROBE_COST_PROGRESSIVE : 1.0);
+   cost += visible_mcus(j, options, &region) * blocks_per_mcu * idct_cost(options);
+   pixel_cost = options->high_precision ? PROBE_COST_PIXEL_PRECISE : PROBE_COST_PIXEL;
+   if (fancy) {
+      pixel_cost += PROBE_COST_PIXEL_FANCY;
+   }
+   /* Greyscale pixels are copied rather than colour converted */
+   cost += num_pixels * pixel_cost * num_channels / BITMAP_NUM_CHANNELS;
+   info->relative_cost = cost / (PROBE_REFERENCE_BLOCKS * (PROBE_COST_ENTROPY_BLOCK + PROBE_COST_IDCT_ISLOW)
+                                 + PROBE_REFERENCE_PIXELS * PROBE_COST_PIXEL);
+}
+
+/* Fills in info, and f for the jpeg, from the frame header. Returns
+ * non-zero, after saying why, if the image can't be decoded. */
+static int read_frame(const jpeg_segment *segment, frame *f, jpeg *j, jpeg_info *info) {
+   unsigned int c;
+   info->coding = coding_for_marker(segment->marker);
+   if (segment->data_size > 0) {
+      info->precision_bits = segment->data[0];
+   }
+   if (frame_read(segment, f) != 0) {
+      printf("Unable to parse SOF segment\n");
+      return 1;
+   }
+   j->frame = f;
+   info->num_rows       = j->frame->num_lines;
+   info->num_cols       = j->frame->samples_per_line;
+   info->num_components = j->frame->num_components;
+   for (c = 0; c < j->frame->num_components && c < JPEG_PROBE_MAX_COMPONENTS; c++) {
+      info->components[c].id                         = j->frame->components[c].id;
+      info->components[c].sampling_factor_horizontal = j->frame->components[c].sampling_factor_horizontal;
+      info->components[c].sampling_factor_vertical   = j->frame->components[c].sampling_factor_vertical;
+   }
+   if (info->coding == JPEG_CODING_OTHER) {
+      printf("Unsupported SOF marker %02x\n", segment->marker);
+      return 1;
+   }
+   return 0;
+}
+
+jpeg_probe_status jpeg_probe(const unsigned char   *data
+                            ,size_t                 data_size
+                            ,const convert_options *options
+                            ,jpeg_info             *info) {
+   convert_options   defaults;
+   /* Just enough of a jpeg for the convert functions that work out sizes */
+   jpeg              j;
+   frame             f;
+   jpeg_probe_status status = JPEG_PROBE_NEED_MORE_DATA;
+   size_t            i      = JPEG_MARKER_LENGTH_BYTES;
+   if (!options) {
+      convert_options_init(&defaults);
+      options = &defaults;
+   }
+   memset(info, 0, sizeof(jpeg_info));
+   memset(&j, 0, sizeof(jpeg));
+   if (data_size < JPEG_MARKER_LENGTH_BYTES) {
+      return JPEG_PROBE_NEED_MORE_DATA;
+   }
+   if (data[0] != JPEG_MARKER_MAGIC_BYTE || data[1] != JPEG_MARKER_SOI) {
+      printf("File is not a JPEG file\n");
+      return JPEG_PROBE_ERROR;
+   }
+   while (   status == JPEG_PROBE_NEED_MORE_DATA
+          && i + JPEG_MARKER_LENGTH_BYTES + JPEG_SEGMENT_SIZE_LENGTH_BYTES <= data_size) {
+      jpeg_segment segment;
+      size_t       length;
+      if (data[i] != JPEG_MARKER_MAGIC_BYTE || data[i + 1] == JPEG_MARKER_MAGIC_BYTE) {
+         /* Skip anything between segments, as the full parser does */
+         i += 1;
+         continue;
+      }
+      length = read_word(&data[i + JPEG_MARKER_LENGTH_BYTES]);
+      if (length < JPEG_SEGMENT_SIZE_LENGTH_BYTES) {
+         printf("Invalid segment length\n");
+         status = JPEG_PROBE_ERROR;
+         break;
+      }
+      if (i + JPEG_MARKER_LENGTH_BYTES + length > data_size) {
+         break;
+      }
+      segment.marker    = data[i + 1];
+      segment.data      = &data[i + JPEG_MARKER_LENGTH_BYTES + JPEG_SEGMENT_SIZE_LENGTH_BYTES];
+      segment.data_size = length - JPEG_SEGMENT_SIZE_LENGTH_BYTES;
+      i += JPEG_MARKER_LENGTH_BYTES + length;
+      if (is_sof(segment.marker)) {
+         if (j.frame) {
+            printf("Extra SOF segment\n");
+            status = JPEG_PROBE_ERROR;
+         } else if (read_frame(&segment, &f, &j, info) != 0) {
+            status = JPEG_PROBE_ERROR;
+         }
+      } else if (segment.marker == JPEG_MARKER_DRI) {
+         if (segment.data_size != 2) {
+            printf("Invalid DRI segment\n");
+            status = JPEG_PROBE_ERROR;
+         } else {
+            j.restart_interval     = read_word(segment.data);
+            j.has_restart_interval = j.restart_interval > 0;
+         }
+      } else if (segment.marker == JPEG_MARKER_SOS) {
+         if (!j.frame) {
+            printf("Start of scan encountered before start of frame\n");
+            status = JPEG_PROBE_ERROR;
+         } else {
+            info->header_bytes = i;
+            status = JPEG_PROBE_OK;
+         }
+      }
+   }
+   info->restart_interval = j.has_restart_interval ? j.restart_interval : 0;
+   if (status == JPEG_PROBE_OK) {
+      if (convert_supported(&j, options)) {
+         estimate(&j, options, info->coding == JPEG_CODING_PROGRESSIVE, info);
+      } else {
+         status = JPEG_PROBE_ERROR;
+      }
+   }
+   return status;
+}
+
+jpeg_probe_status jpeg_probe_file(const char            *filename
+                                 ,const convert_options *options
+                                 ,jpeg_info             *info) {
+   FILE             *fp = fopen(filename, "rb");
+   unsigned char    *data = NULL;
+   size_t            capacity = 0;
+   size_t            data_size = 0;
+   jpeg_probe_status status = JPEG_PROBE_NEED_MORE_DATA;
+   if (!fp) {
+      perror("Error opening file");
+      return JPEG_PROBE_ERROR;
+   }
+   while (status == JPEG_PROBE_NEED_MORE_DATA && !feof(fp) && !ferror(fp)) {
+      capacity = capacity ? capacity * 2 : PROBE_FIRST_READ_BYTES;
+      data = realloc(data, capacity);
+      assert(data);
+      data_size += fread(data + data_size, 1, capacity - data_size, fp);
+      status = jpeg_probe(data, data_size, options, info);
+   }
+   if (ferror(fp)) {
+      printf("Error reading data from file\n");
+      status = JPEG_PROBE_ERROR;
+   } else if (status == JPEG_PROBE_NEED_MORE_DATA) {
+      printf("Data ended before the start of scan\n");
+   }
+   fclose(fp);
+   free(data);
+   return status;
+}
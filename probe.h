@@ -0,0 +1,68 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stddef.h>
+#include "convert.h"
+
+/* Reads just the headers of an image, without building any tables, so
+ * that a caller can decide whether and how to decode it */
+
+#define JPEG_PROBE_MAX_COMPONENTS 4
+
+typedef enum {
+   JPEG_PROBE_OK             = 0,
+   /* The data stops before the start of scan */
+   JPEG_PROBE_NEED_MORE_DATA = 1,
+   JPEG_PROBE_ERROR          = 2
+} jpeg_probe_status;
+
+typedef enum {
+   JPEG_CODING_BASELINE    = 0,
+   JPEG_CODING_EXTENDED    = 1,
+   JPEG_CODING_PROGRESSIVE = 2,
+   /* Lossless, hierarchical or arithmetic coded */
+   JPEG_CODING_OTHER       = 3
+} jpeg_coding;
+
+typedef struct jpeg_probe_component_s {
+   unsigned int id;
+   unsigned int sampling_factor_horizontal;
+   unsigned int sampling_factor_vertical;
+} jpeg_probe_component;
+
+typedef struct jpeg_info_s {
+   size_t               num_rows;
+   size_t               num_cols;
+   jpeg_coding          coding;
+   unsigned int         precision_bits;
+   unsigned int         num_components;
+   /* The first JPEG_PROBE_MAX_COMPONENTS of them */
+   jpeg_probe_component components[JPEG_PROBE_MAX_COMPONENTS];
+   /* MCUs between restart markers, or 0 if there aren't any */
+   size_t               restart_interval;
+   /* Bytes up to the end of the first start of scan header */
+   size_t               header_bytes;
+   /* Size of the output for the options */
+   size_t               output_rows;
+   size_t               output_cols;
+   /* Roughly the most memory jpeg_to_bitmap would allocate with the
+    * options, including the bitmap but not the compressed data */
+   size_t               peak_memory_bytes;
+   /* Roughly the CPU time a decode with the options takes, summed over
+    * threads, where 1 is a megapixel of baseline 4:2:0 at full size */
+   double               relative_cost;
+} jpeg_info;
+
+/* Fills info from the headers at the start of data, which may be any
+ * prefix of the file. options may be NULL for the defaults. */
+jpeg_probe_status jpeg_probe(const unsigned char   *data
+                            ,size_t                 data_size
+                            ,const convert_options *options
+                            ,jpeg_info             *info);
+
+/* Reads only as much of the file as the headers need */
+jpeg_probe_status jpeg_probe_file(const char            *filename
+                                 ,const convert_options *options
+                                 ,jpeg_info             *info);
+
+#endif
@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "push.h"
+#include "convert_internal.h"
+#include "jpeg_stream_internal.h"
+
+/* The smallest the data buffer grows by */
+#define PUSH_MIN_GROWTH_BYTES (64 * 1024)
+
+struct jpeg_push_s {
+   convert_options  options;
+   /* Everything fed so far, which the jpeg borrows */
+   unsigned char   *data;
+   size_t           data_size;
+   size_t           capacity;
+   jpeg            *j;
+   bitmap          *b;
+   convert_state   *state;
+   /* The last few rows of MCUs, when upsampling needs the neighbours */
+   convert_planes  *planes;
+   /* Scans decoded so far, for a progressive image, which is rendered
+    * into the bitmap when it is done or asked for */
+   convert_progressive *progressive;
+   /* Where the entropy coded data starts in data */
+   size_t           scan_offset;
+   size_t           next_mcu;
+   size_t           num_mcus;
+   jpeg_push_status status;
+};
+
+static void append(jpeg_push *push, const unsigned char *data, size_t data_size) {
+   if (push->data_size + data_size > push->capacity) {
+      size_t capacity = push->capacity * 2 + PUSH_MIN_GROWTH_BYTES;
+      if (capacity < push->data_size + data_size) {
+         capacity = push->data_size + data_size;
+      }
+      push->data = realloc(push->data, capacity);
+      assert(push->data);
+      push->capacity = capacity;
+   }
+   memcpy(push->data + push->data_size, data, data_size);
+   push->data_size += data_size;
+}
+
+/* Returns 0 without changing anything until all the headers are here */
+static int start_decoding(jpeg_push *push, int complete) {
+   const jpeg *j;
+   if (jpeg_headers_length(push->data, push->data_size) == 0) {
+      if (complete) {
+         printf("Data ended before the start of scan\n");
+         push->status = JPEG_PUSH_ERROR;
+      }
+      return 0;
+   }
+   push->j = jpeg_read_mem(push->data, push->data_size);
+   j = push->j;
+   if (!j || !j->frame || !j->scan_start) {
+      push->status = JPEG_PUSH_ERROR;
+      return 0;
+   }
+   push->b = convert_create_bitmap(j, &push->options, NULL);
+   if (!push->b) {
+      push->status = JPEG_PUSH_ERROR;
+      return 0;
+   }
+   push->state       = convert_state_create(j, &push->options, push->b, j->scan_start->stream);
+   push->scan_offset = (size_t) (j->scan_start->stream->data - push->data);
+   push->num_mcus    = convert_num_mcus_needed(j, &push->options);
+   if (j->progressive) {
+      push->progressive = convert_progressive_create(j);
+   } else if (convert_fancy_upsampling(j, &push->options)) {
+      push->planes        = convert_planes_create(j, &push->options, CONVERT_RING_BANDS);
+      push->state->planes = push->planes;
+   }
+   return 1;
+}
+
+/* Decode MCUs until one runs past the data. Everything is put back the way
+ * it was at the start of that MCU, so it can be decoded again once more
+ * data arrives. */
+static jpeg_push_status decode_available(jpeg_push *push) {
+   convert_state *state = push->state;
+   const jpeg    *j     = push->j;
+   size_t         mcus_per_row = convert_mcus_per_row(j);
+   while (push->next_mcu < push->num_mcus) {
+      jpeg_stream   saved_stream = *state->stream;
+      convert_stats saved_stats  = state->stats;
+      int           saved_dc[NUM_COMPONENTS];
+      int           error = 0;
+      memcpy(saved_dc, state->prev_dc_coeff, sizeof(saved_dc));
+      if (push->next_mcu > 0) {
+         int state_code = jpeg_stream_get_state(state->stream);
+         if (jpeg_stream_starved(state->stream)) {
+            *state->stream = saved_stream;
+            return JPEG_PUSH_NEED_MORE_DATA;
+         } else if (state_code == JPEG_STREAM_STATE_OUT_OF_DATA) {
+            printf("Error reading image.\n");
+            return JPEG_PUSH_ERROR;
+         } else if (state_code == JPEG_STREAM_STATE_EOI) {
+            convert_finish_rows(state, push->next_mcu / mcus_per_row, 1);
+            return JPEG_PUSH_DONE;
+         }
+      }
+      if (   j->has_restart_interval
+          && push->next_mcu > 0
+          && push->next_mcu % j->restart_interval == 0) {
+         if (!jpeg_stream_restart_ready(state->stream)) {
+            *state->stream = saved_stream;
+            return JPEG_PUSH_NEED_MORE_DATA;
+         }
+         jpeg_stream_restart(state->stream);
+         memset(state->prev_dc_coeff, 0, sizeof(state->prev_dc_coeff));
+      }
+      error = convert_decode_mcu(state, push->next_mcu);
+      if (jpeg_stream_starved(state->stream)) {
+         /* Some of what was decoded was padding, not data */
+         *state->stream = saved_stream;
+         state->stats   = saved_stats;
+         memcpy(state->prev_dc_coeff, saved_dc, sizeof(saved_dc));
+         return JPEG_PUSH_NEED_MORE_DATA;
+      }
+      if (error) {
+         printf("Error during huffman decoding\n");
+         return JPEG_PUSH_ERROR;
+      }
+      push->next_mcu += 1;
+      if (push->next_mcu % mcus_per_row == 0) {
+         convert_finish_rows(state, push->next_mcu / mcus_per_row, 0);
+      }
+   }
+   convert_finish_rows(state, push->next_mcu / mcus_per_row, 1);
+   return JPEG_PUSH_DONE;
+}
+
+/* Decode each scan once all of it has arrived */
+static jpeg_push_status decode_scans(jpeg_push *push, int complete) {
+   convert_progressive   *p       = push->progressive;
+   const convert_options *options = &push->options;
+   convert_scan_status    status;
+   int                    stop = 0;
+   do {
+      status = convert_progressive_next_scan(p, push->data, push->data_size, complete);
+      if (status == CONVERT_SCAN_DECODED && options->scan_callback) {
+         convert_progressive_render(p, options, push->b);
+         stop = options->scan_callback(options->scan_user
+                                      ,push->b
+                                      ,convert_progressive_scans_done(p)
+                                      ,convert_progressive_bytes_done(p));
+      }
+   } while (status == CONVERT_SCAN_DECODED && !stop);
+   if (status == CONVERT_SCAN_NEED_MORE_DATA) {
+      return JPEG_PUSH_NEED_MORE_DATA;
+   }
+   convert_progressive_render(p, options, push->b);
+   if (status == CONVERT_SCAN_DONE) {
+      push->state->mcu_rows_finished = push->num_mcus / convert_mcus_per_row(push->j);
+      return JPEG_PUSH_DONE;
+   }
+   if (!stop) {
+      printf("Error reading image.\n");
+   }
+   return JPEG_PUSH_ERROR;
+}
+
+static jpeg_push_status advance(jpeg_push *push, int complete) {
+   if (!push->j) {
+      if (!start_decoding(push, complete)) {
+         return push->status;
+      }
+   } else {
+      /* The data may have moved */
+      push->j->data      = push->data;
+      push->j->data_size = push->data_size;
+   }
+   if (push->progressive) {
+      push->status = decode_scans(push, complete);
+   } else {
+      jpeg_stream_extend(push->state->stream
+                        ,push->data + push->scan_offset
+                        ,push->data_size - push->scan_offset
+                        ,complete);
+      push->status = decode_available(push);
+   }
+   if (push->status == JPEG_PUSH_DONE) {
+      printf("Finished reading image.\n");
+   }
+   return push->status;
+}
+
+jpeg_push *jpeg_push_create(const convert_options *options) {
+   jpeg_push *push = malloc(sizeof(jpeg_push));
+   assert(push);
+   if (options) {
+      push->options = *options;
+   } else {
+      convert_options_init(&push->options);
+   }
+   push->options.num_threads = 1;
+   push->data        = NULL;
+   push->data_size   = 0;
+   push->capacity    = 0;
+   push->j           = NULL;
+   push->b           = NULL;
+   push->state       = NULL;
+   push->planes      = NULL;
+   push->progressive = NULL;
+   push->scan_offset = 0;
+   push->next_mcu    = 0;
+   push->num_mcus    = 0;
+   push->status      = JPEG_PUSH_NEED_MORE_DATA;
+   return push;
+}
+
+void jpeg_push_destroy(jpeg_push *push) {
+   if (push) {
+      /* The state, planes and scans live in the jpeg's arena */
+      if (push->state) {
+         convert_state_destroy(push->state);
+      }
+      jpeg_destroy(push->j);
+      bitmap_destroy(push->b);
+      free(push->data);
+   }
+   free(push);
+}
+
+jpeg_push_status jpeg_push_feed(jpeg_push *push, const unsigned char *data, size_t data_size) {
+   if (push->status != JPEG_PUSH_NEED_MORE_DATA) {
+      return push->status;
+   }
+   append(push, data, data_size);
+   return advance(push, 0);
+}
+
+jpeg_push_status jpeg_push_finish(jpeg_push *push) {
+   if (push->status != JPEG_PUSH_NEED_MORE_DATA) {
+      return push->status;
+   }
+   return advance(push, 1);
+}
+
+size_t jpeg_push_rows_done(const jpeg_push *push) {
+   const convert_rect *region;
+   size_t              rows;
+   if (!push->b) {
+      return 0;
+   }
+   region   = &push->state->region;
+   rows     = push->state->mcu_rows_finished * push->state->mcu_height;
+   if (rows <= region->row) {
+      return 0;
+   }
+   rows -= region->row;
+   return rows < region->num_rows ? rows : region->num_rows;
+}
+
+size_t jpeg_push_scans_done(const jpeg_push *push) {
+   if (push->progressive) {
+      return convert_progressive_scans_done(push->progressive);
+   }
+   return push->status == JPEG_PUSH_DONE ? 1 : 0;
+}
+
+bitmap *jpeg_push_preview(jpeg_push *push) {
+   if (   push->b
+       && push->progressive
+       && push->status == JPEG_PUSH_NEED_MORE_DATA) {
+      convert_progressive_render(push->progressive, &push->options, push->b);
+   }
+   return push->b;
+}
+
+bitmap *jpeg_push_take_bitmap(jpeg_push *push) {
+   bitmap *b = jpeg_push_preview(push);
+   push->b = NULL;
+   if (push->status == JPEG_PUSH_NEED_MORE_DATA) {
+      /* Nothing more can be decoded into it */
+      push->status = JPEG_PUSH_ERROR;
+   }
+   return b;
+}
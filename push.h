@@ -0,0 +1,50 @@
+#ifndef PUSH_H
+#define PUSH_H
+
+#include <stddef.h>
+#include "bitmap.h"
+#include "convert.h"
+
+/* Decodes an image as its data arrives, a chunk at a time, on the calling
+ * thread */
+typedef struct jpeg_push_s jpeg_push;
+
+typedef enum {
+   /* Everything that can be decoded from the data so far has been */
+   JPEG_PUSH_NEED_MORE_DATA = 0,
+   JPEG_PUSH_DONE           = 1,
+   /* The bitmap, if there is one, may be incomplete */
+   JPEG_PUSH_ERROR          = 2
+} jpeg_push_status;
+
+/* options may be NULL for the defaults. Only one thread is ever used. */
+jpeg_push       *jpeg_push_create(const convert_options *options);
+void             jpeg_push_destroy(jpeg_push *push);
+
+/* Append data, which is copied, and decode as many MCUs as it completes.
+ * Once done or in error, more data is ignored. */
+jpeg_push_status jpeg_push_feed(jpeg_push *push, const unsigned char *data, size_t data_size);
+
+/* No more data is coming, so decode whatever is left */
+jpeg_push_status jpeg_push_finish(jpeg_push *push);
+
+/* Rows from the top of the bitmap that have been decoded. A progressive
+ * image has none until every scan has. */
+size_t           jpeg_push_rows_done(const jpeg_push *push);
+
+/* Scans decoded so far. A progressive image is decoded a scan at a time,
+ * as each scan finishes arriving. */
+size_t           jpeg_push_scans_done(const jpeg_push *push);
+
+/* The bitmap as it stands, or NULL if the headers haven't all arrived. A
+ * progressive image is rendered from the scans decoded so far, which gives
+ * a blurry first approximation after the first scan, otherwise rows past
+ * jpeg_push_rows_done are undefined. The push still owns the bitmap, and
+ * feeding more data changes it. */
+bitmap          *jpeg_push_preview(jpeg_push *push);
+
+/* The bitmap, as jpeg_push_preview gives it. After this the caller owns
+ * the bitmap and the push can only be destroyed. */
+bitmap          *jpeg_push_take_bitmap(jpeg_push *push);
+
+#endif
@@ -1,8 +1,11 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include "jpeg_internal.h"
 #include "qtable.h"
 #include "jpeg_segment.h"
+#include "dct.h"
 
 /* 4 bits for precision, 4 bits for ID */
 #define QTABLE_METADATA_LENGTH_BYTES    1
@@ -18,36 +21,50 @@ typedef enum {
 struct qtable_s {
    qtable_precision precision;
    unsigned int id;
+   /* In zigzag order, as stored in the file */
    unsigned int values[JPEG_CHUNK_NUM_SAMPLES];
-   size_t zigzag[JPEG_CHUNK_NUM_SAMPLES];
+   /* Dequantisation multipliers in natural order. The ifast ones are
+    * prescaled by the AAN scale factors. */
+   int32_t      multipliers[JPEG_CHUNK_NUM_SAMPLES];
+   int32_t      ifast_multipliers[JPEG_CHUNK_NUM_SAMPLES];
 };
 
-static size_t triangle(size_t n) {
-   return (n * (n + 1)) / 2;
-}
+struct qtable_cache_s {
+   qtable tables[QTABLE_MAX_ID + 1];
+   int    valid[QTABLE_MAX_ID + 1];
+};
 
-/* http://stackoverflow.com/questions/15201395/zig-zag-scan-an-n-x-n-array */
-static void fill_elements(size_t zigzag[JPEG_CHUNK_NUM_SAMPLES], int is_odd) {
-   int x, y;
-   int n = JPEG_CHUNK_SIDE_LENGTH;
-   for (y = 0; y < n; y++) {
-      for (x = n - (y + 1 + is_odd); x >= 0; x -= 2) {
-         zigzag[x * n + y] = triangle(x + y + 1) - (is_odd ? x : y) - 1;
-         zigzag[n * (n - x - 1) + (n - y - 1)] = JPEG_CHUNK_NUM_SAMPLES - zigzag[x * n + y] - 1;
-      }
-   }
+qtable_cache *qtable_cache_create(jpeg_arena *arena) {
+   qtable_cache *cache = jpeg_arena_alloc(arena, sizeof(qtable_cache));
+   memset(cache->valid, 0, sizeof(cache->valid));
+   return cache;
 }
 
-static void create_zigzag(size_t zigzag[JPEG_CHUNK_NUM_SAMPLES]) {
-   fill_elements(zigzag, 0);
-   fill_elements(zigzag, 1);
-}
+/* Natural (row major) position of each coefficient in zigzag order. The
+ * extra entries catch a corrupt run length that overshoots the end of a
+ * block, so the decoder can index with it before checking. */
+const unsigned char qtable_natural_order[JPEG_CHUNK_NUM_SAMPLES + QTABLE_NATURAL_ORDER_GUARD]
+   = { 0,  1,  8, 16,  9,  2,  3, 10
+     ,17, 24, 32, 25, 18, 11,  4,  5
+     ,12, 19, 26, 33, 40, 48, 41, 34
+     ,27, 20, 13,  6,  7, 14, 21, 28
+     ,35, 42, 49, 56, 57, 50, 43, 36
+     ,29, 22, 15, 23, 30, 37, 44, 51
+     ,58, 59, 52, 45, 38, 31, 39, 46
+     ,53, 60, 61, 54, 47, 55, 62, 63
+     /* Guard entries */
+     ,63, 63, 63, 63, 63, 63, 63, 63
+     ,63, 63, 63, 63, 63, 63, 63, 63};
 
-static qtable *qtable_create_internal(unsigned char *block_data
+static qtable *qtable_create_internal(const unsigned char *block_data
+                                     ,jpeg_arena    *arena
+                                     ,qtable_cache  *cache
                                      ,size_t  *bytes_remaining) {
    qtable *table;
    unsigned char precision;
    unsigned char table_id;
+   unsigned int  values[JPEG_CHUNK_NUM_SAMPLES];
+   size_t        i;
    assert(block_data);
    assert(bytes_remaining);
    table_id = block_data[0] & 0xF;
@@ -73,34 +90,48 @@ static qtable *qtable_create_internal(unsigned char *block_data
          *bytes_remaining = *bytes_remaining - QTABLE_DATA_LENGTH_8BIT;
       }
    }
-   table = malloc(sizeof(struct qtable_s));
-   assert(table);
-   table->precision = precision;
-   table->id        = table_id;
-   create_zigzag(table->zigzag);
-   size_t i;
    for (i = 0; i < JPEG_CHUNK_NUM_SAMPLES; i++) {
-      if (table->precision == QTABLE_PRECISION_8BIT) {
-         table->values[i] = block_data[QTABLE_METADATA_LENGTH_BYTES + i];
+      if (precision == QTABLE_PRECISION_8BIT) {
+         values[i] = block_data[QTABLE_METADATA_LENGTH_BYTES + i];
       } else {
-         table->values[i] = read_word(&block_data[QTABLE_METADATA_LENGTH_BYTES + 2*i]);
+         values[i] = read_word(&block_data[QTABLE_METADATA_LENGTH_BYTES + 2*i]);
+      }
+   }
+   if (cache) {
+      table = &cache->tables[table_id];
+      if (  cache->valid[table_id]
+         && table->precision == precision
+         && memcmp(table->values, values, sizeof(values)) == 0) {
+         return table;
       }
+      cache->valid[table_id] = 1;
+   } else {
+      table = jpeg_arena_alloc(arena, sizeof(struct qtable_s));
+   }
+   table->precision = precision;
+   table->id        = table_id;
+   memcpy(table->values, values, sizeof(values));
+   for (i = 0; i < JPEG_CHUNK_NUM_SAMPLES; i++) {
+      const size_t shift   = DCT_AAN_SCALE_BITS - DCT_IFAST_SCALE_BITS;
+      size_t       natural = qtable_natural_order[i];
+      table->multipliers[natural]       = (int32_t) table->values[i];
+      table->ifast_multipliers[natural] = (int32_t) ((table->values[i] * dct_aan_scales[natural]
+                                                      + (1 << (shift - 1))) >> shift);
    }
    return table;
 }
 
-void qtable_dequantise(qtable *table, int chunk[JPEG_CHUNK_NUM_SAMPLES]) {
-   size_t i;
-   int chunk_copy[JPEG_CHUNK_NUM_SAMPLES];
-   for (i = 0; i < JPEG_CHUNK_NUM_SAMPLES; i++) {
-      chunk_copy[i] = chunk[i] * table->values[i];      
-   } 
-   for (i = 0; i < JPEG_CHUNK_NUM_SAMPLES; i++) {
-      chunk[i] = chunk_copy[table->zigzag[i]];
+const int32_t *qtable_get_multipliers(const qtable *table, jpeg_dct_method method) {
+   assert(table);
+   if (method == JPEG_DCT_IFAST) {
+      return table->ifast_multipliers;
    }
+   return table->multipliers;
 }
 
 int qtable_create(const jpeg_segment *segment
+                  ,jpeg_arena         *arena
+                  ,qtable_cache       *cache
                   ,qtable *tables[JPEG_MAX_QTABLES]
                   ,size_t *num_qtables) {
    size_t offset = 0;
@@ -110,23 +141,26 @@ int qtable_create(const jpeg_segment *segment
    assert(segment->marker == JPEG_MARKER_DQT);
    assert(num_qtables);
    bytes_remaining = segment->data_size;
-   while (bytes_remaining > 0 && *num_qtables < JPEG_MAX_QTABLES && !error) {
-      tables[*num_qtables] = qtable_create_internal(segment->data + offset
-                                                   ,&bytes_remaining);
-      if (!tables[*num_qtables]) {
+   while (bytes_remaining > 0 && !error) {
+      qtable *table = qtable_create_internal(segment->data + offset
+                                            ,arena
+                                            ,cache
+                                            ,&bytes_remaining);
+      if (!table) {
          error = 1;
       } else {
          offset = segment->data_size - bytes_remaining;
-        *num_qtables = *num_qtables + 1;
+         /* Components name their table by id, and a later table of the
+          * same id replaces the earlier one */
+         if (!tables[table->id]) {
+            *num_qtables = *num_qtables + 1;
+         }
+         tables[table->id] = table;
       }
    }
    return error;
 }
 
-void qtable_destroy(qtable *table) {
-   free(table);
-}
-
 unsigned int qtable_get(qtable *table, unsigned int pos) {
    assert(table);
    assert(pos < JPEG_CHUNK_NUM_SAMPLES);
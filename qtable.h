@@ -1,21 +1,40 @@
 #ifndef QTABLE_H
 #define QTABLE_H
 
+#include <stdint.h>
+
 typedef struct qtable_s qtable;
 typedef unsigned int qtable_id;
+typedef struct qtable_cache_s qtable_cache;
 
 #include "jpeg.h"
 #include "jpeg_internal.h"
 #include "jpeg_segment.h"
+#include "convert.h"
+
+/* The last table of each id, kept from one image to the next so that a
+ * table identical to the last one isn't set up again. The cache lives in
+ * arena until it is destroyed or reset. */
+qtable_cache *qtable_cache_create(jpeg_arena *arena);
 
+/* The tables are allocated from arena, or taken from cache if it isn't
+ * NULL, in which case they are only valid until it is next used. Each
+ * goes in tables at its id, replacing any table already there, and
+ * num_qtables counts the ids that have one. */
 int qtable_create(const jpeg_segment *segment
+                 ,jpeg_arena         *arena
+                 ,qtable_cache       *cache
                  ,qtable *tables[JPEG_MAX_QTABLES]
                  ,size_t *num_qtables);
 
-void qtable_destroy(qtable *table);
+#define QTABLE_NATURAL_ORDER_GUARD 16
+
+extern const unsigned char qtable_natural_order[JPEG_CHUNK_NUM_SAMPLES + QTABLE_NATURAL_ORDER_GUARD];
 
 unsigned int qtable_get(qtable *table, unsigned int pos);
 
-void qtable_dequantise(qtable *table, int chunk[JPEG_CHUNK_NUM_SAMPLES]);
+/* Multipliers to dequantise coefficients in natural order, scaled as
+ * the given IDCT method expects */
+const int32_t *qtable_get_multipliers(const qtable *table, jpeg_dct_method method);
 
 #endif
@@ -3,6 +3,7 @@
 #include "scan_start.h"
 #include "frame.h"
 #include "jpeg_segment.h"
+#include "jpeg_stream_internal.h"
 
 /* Number of bytes that are always present in SOS header */
 #define SCAN_START_HEADER_FIXED_BYTES         4
@@ -15,8 +16,9 @@
                                              + SCAN_START_HEADER_BYTES_PER_COMPONENT)
 
 scan_start *scan_start_create(const jpeg_segment *segment
-                             ,frame              *f
+                             ,const frame        *f
                              ,size_t              file_bytes_remaining
+                             ,jpeg_arena         *arena
                              ) {
    scan_start *s = NULL;
    size_t i = 0;
@@ -25,46 +27,47 @@ scan_start *scan_start_create(const jpeg_segment *segment
    if (segment->data_size < SCAN_START_HEADER_MIN_LENGTH_BYTES) {
       return NULL;
    }
-   s = malloc(sizeof(scan_start));
-   assert(s);
+   s = jpeg_arena_alloc(arena, sizeof(scan_start));
    num_components = segment->data[i];
    i += 1;
-   if (num_components != f->num_components) {
-      free(s);
+   if (num_components == 0 || num_components > SCAN_START_MAX_COMPONENTS) {
       return NULL;
    }
    if (segment->data_size != (SCAN_START_HEADER_FIXED_BYTES + 
                               num_components 
                               * SCAN_START_HEADER_BYTES_PER_COMPONENT)) {
-      free(s);
       return NULL;
    }
    size_t n;
+   s->num_components = num_components;
    for (n = 0; n < num_components; n++) {
-      component_id component_id = segment->data[i];
-      component *c = frame_get_component_with_id(f, component_id);
+      unsigned int index;
+      for (index = 0; index < f->num_components; index++) {
+         if (f->components[index].id == segment->data[i]) {
+            break;
+         }
+      }
+      if (index == f->num_components) {
+         return NULL;
+      }
       i += 1;
-      c->ac_htable_id =  segment->data[i]       & 0xF;
-      c->dc_htable_id = (segment->data[i] >> 4) & 0xF;
+      s->component_index[n] = index;
+      s->ac_htable_id[n]    =  segment->data[i]       & 0xF;
+      s->dc_htable_id[n]    = (segment->data[i] >> 4) & 0xF;
       i += 1;
    }
    s->spectral_selection_start = segment->data[i];
    i += 1;
    s->spectral_selection_end = segment->data[i];
    i += 1;
-   s->successive_approx_high =  segment->data[i]       & 0xF;
-   s->successive_approx_low  = (segment->data[i] >> 4) & 0xF;
+   s->successive_approx_high = (segment->data[i] >> 4) & 0xF;
+   s->successive_approx_low  =  segment->data[i]       & 0xF;
    i += 1; 
-   s->stream = jpeg_stream_create(file_bytes_remaining - i
-                                 ,segment->data + segment->data_size
-                                 );
+   s->stream = jpeg_arena_alloc(arena, sizeof(jpeg_stream));
+   jpeg_stream_init(s->stream
+                   ,file_bytes_remaining - i
+                   ,segment->data + segment->data_size
+                   );
    return s;
 }
 
-void scan_start_destroy(scan_start *s) {
-   if (s != NULL) {
-      jpeg_stream_destroy(s->stream);
-      free(s);
-   }
-}
-
@@ -9,7 +9,16 @@ typedef struct scan_start_s scan_start;
 #include "jpeg_stream.h"
 #include "frame.h"
 
+/* The most components a scan can have */
+#define SCAN_START_MAX_COMPONENTS 4
+
 struct scan_start_s {
+   /* The components in the scan, as indexes into the frame's, and the
+    * tables each uses */
+   unsigned int num_components;
+   unsigned int component_index[SCAN_START_MAX_COMPONENTS];
+   htable_id    dc_htable_id[SCAN_START_MAX_COMPONENTS];
+   htable_id    ac_htable_id[SCAN_START_MAX_COMPONENTS];
    unsigned int spectral_selection_start;
    unsigned int spectral_selection_end;
    unsigned int successive_approx_high;
@@ -17,11 +26,12 @@ struct scan_start_s {
    jpeg_stream *stream;  
 };
 
+/* The frame isn't changed, so a progressive image's scans can each use
+ * their own tables. The scan and its stream are allocated from arena. */
 scan_start *scan_start_create(const jpeg_segment *segment
-                             ,frame              *f
+                             ,const frame        *f
                              ,size_t              file_bytes_remaining
+                             ,jpeg_arena         *arena
                              );
 
-void scan_start_destroy(scan_start *s);
-
 #endif
@@ -1,12 +1,728 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <math.h>
+#include "bench_encode.h"
+#include "bitmap_internal.h"
+#include "colour.h"
+#include "dct.h"
+#include "decoder.h"
+#include "probe.h"
+#include "push.h"
 
-static void htable_test(void) {
+/* A fixed xorshift generator, so every run tests the same blocks */
+static uint32_t test_random_state = 2463534242u;
 
+static uint32_t test_random(void) {
+   test_random_state ^= test_random_state << 13;
+   test_random_state ^= test_random_state >> 17;
+   test_random_state ^= test_random_state << 5;
+   return test_random_state;
 }
 
-int main(int argc, char *argv[]) {
-   
+/* Uniform in [-range, range] */
+static int16_t test_random_coeff(int range) {
+   return (int16_t) ((int) (test_random() % (2 * range + 1)) - range);
+}
+
+/* Each reduced or vector IDCT kernel must write exactly the bytes
+ * dct_inverse_islow does, for any block of the path it's chosen for */
+static int idct_test(void) {
+   /* Wider than a block, so a kernel ignoring the stride shows up */
+   enum { STRIDE = 11 };
+   static const char *path_names[DCT_NUM_PATHS] = {"DC only", "2x2", "4x4", "full"};
+   dct_kernel   reduced[DCT_NUM_PATHS] = {dct_inverse_islow_dc
+                                         ,dct_inverse_islow_2x2
+                                         ,dct_inverse_islow_4x4
+                                         ,dct_inverse_islow};
+   dct_kernel   vector[2]              = {NULL, NULL};
+   const char  *vector_names[2]        = {"SSE2", "AVX2"};
+   int          failed                 = 0;
+   unsigned int path, trial, k;
+#if CPU_X86
+   if (cpu_simd_level() >= CPU_SIMD_SSE2) {
+      vector[0] = dct_inverse_islow_sse2;
+   }
+   if (cpu_simd_level() >= CPU_SIMD_AVX2) {
+      vector[1] = dct_inverse_islow_avx2;
+   }
+#endif
+   for (path = 0; path < DCT_NUM_PATHS; path++) {
+      unsigned int side = dct_path_size(path);
+      for (trial = 0; trial < 2000 && !failed; trial++) {
+         int16_t       coeffs[JPEG_CHUNK_NUM_SAMPLES] = {0};
+         unsigned char expected[8 * STRIDE];
+         unsigned char out[8 * STRIDE];
+         /* Mostly coefficients of the size real images dequantise to,
+          * with some large enough to need range limiting. Some blocks get
+          * a top left corner only corrupt data could give, too big for 16
+          * bits after one pass but not for the 32 of the scalar kernel. */
+         int           range = trial % 4 == 0 ? 2047 : 255;
+         int           large = trial % 8 == 1 ? 4000 : range;
+         unsigned int  row, col;
+         for (row = 0; row < side; row++) {
+            for (col = 0; col < side; col++) {
+               coeffs[row * 8 + col] = test_random_coeff(row < 2 && col < 2 ? large : range);
+            }
+         }
+         memset(expected, 0, sizeof(expected));
+         dct_inverse_islow(coeffs, expected, STRIDE);
+         memset(out, 0, sizeof(out));
+         reduced[path](coeffs, out, STRIDE);
+         if (memcmp(expected, out, sizeof(out)) != 0) {
+            printf("FAIL: %s IDCT differs from the full one\n", path_names[path]);
+            failed = 1;
+         }
+         for (k = 0; k < 2; k++) {
+            if (!vector[k]) {
+               continue;
+            }
+            memset(out, 0, sizeof(out));
+            vector[k](coeffs, out, STRIDE);
+            if (memcmp(expected, out, sizeof(out)) != 0) {
+               printf("FAIL: %s IDCT differs from the scalar one on a %s block\n"
+                     ,vector_names[k], path_names[path]);
+               failed = 1;
+            }
+         }
+      }
+   }
+   return failed;
+}
+
+/* The vector colour kernels must match the scalar ones byte for byte, at
+ * every Y, Cb and Cr and at lengths that leave a partial vector, without
+ * writing past the end of the row */
+static int colour_test(void) {
+   /* Every Y and Cb for one Cr per call */
+   enum { ALL = 256 * 256, MAX_ODD = 67, GUARD = 0xA5 };
+   colour_kernel        convert[2]       = {NULL, NULL};
+   const char          *convert_names[2] = {"SSE2", "AVX2"};
+   colour_merged_kernel merged           = NULL;
+   colour_float_kernel  from_float       = NULL;
+   unsigned char       *y                = malloc(2 * ALL);
+   unsigned char       *cb               = malloc(ALL);
+   unsigned char       *cr               = malloc(ALL);
+   unsigned char       *expected         = malloc(3 * ALL + 1);
+   unsigned char       *out              = malloc(3 * ALL + 1);
+   unsigned char       *expected1        = malloc(3 * ALL + 1);
+   unsigned char       *out1             = malloc(3 * ALL + 1);
+   float                planes[3][MAX_ODD + 1];
+   int                  failed           = 0;
+   size_t               i, n;
+   unsigned int         c, k;
+   assert(y && cb && cr && expected && out && expected1 && out1);
+#if CPU_X86
+   if (cpu_simd_level() >= CPU_SIMD_SSE2) {
+      convert[0] = colour_ycc_to_bgr_sse2;
+      merged     = colour_merged_h2_to_bgr_sse2;
+      from_float = colour_float_to_bgr_sse2;
+   }
+   if (cpu_simd_level() >= CPU_SIMD_AVX2) {
+      convert[1] = colour_ycc_to_bgr_avx2;
+   }
+#endif
+   for (i = 0; i < ALL; i++) {
+      y[i]  = (unsigned char) i;
+      cb[i] = (unsigned char) (i >> 8);
+   }
+   for (k = 0; k < 2; k++) {
+      if (!convert[k]) {
+         continue;
+      }
+      for (c = 0; c < 256 && !failed; c++) {
+         memset(cr, c, ALL);
+         colour_ycc_to_bgr(y, cb, cr, expected, ALL);
+         convert[k](y, cb, cr, out, ALL);
+         if (memcmp(expected, out, 3 * ALL) != 0) {
+            printf("FAIL: %s colour conversion differs from the scalar one at Cr %u\n", convert_names[k], c);
+            failed = 1;
+         }
+      }
+      /* Short rows from unaligned starts, with random samples */
+      for (n = 1; n <= MAX_ODD && !failed; n++) {
+         for (i = 0; i < n + 1; i++) {
+            y[i]  = (unsigned char) test_random();
+            cb[i] = (unsigned char) test_random();
+            cr[i] = (unsigned char) test_random();
+         }
+         colour_ycc_to_bgr(y + 1, cb + 1, cr + 1, expected, n);
+         out[3 * n] = GUARD;
+         convert[k](y + 1, cb + 1, cr + 1, out, n);
+         if (memcmp(expected, out, 3 * n) != 0 || out[3 * n] != GUARD) {
+            printf("FAIL: %s colour conversion of %zu pixels differs from the scalar one\n", convert_names[k], n);
+            failed = 1;
+         }
+      }
+   }
+   if (merged) {
+      /* Every pair of Cb and Cr, each shared by two pixels of each row */
+      for (i = 0; i < ALL; i++) {
+         cb[i] = (unsigned char) i;
+         cr[i] = (unsigned char) (i >> 8);
+      }
+      for (i = 0; i < 2 * ALL; i++) {
+         y[i] = (unsigned char) test_random();
+      }
+      colour_merged_h2_to_bgr(y, y + ALL, cb, cr, expected, expected1, ALL);
+      merged(y, y + ALL, cb, cr, out, out1, ALL);
+      if (memcmp(expected, out, 3 * ALL) != 0 || memcmp(expected1, out1, 3 * ALL) != 0) {
+         printf("FAIL: SSE2 merged colour conversion differs from the scalar one\n");
+         failed = 1;
+      }
+      for (n = 1; n <= MAX_ODD && !failed; n++) {
+         int rows;
+         for (rows = 1; rows <= 2; rows++) {
+            unsigned char *second = rows == 2 ? out1 : NULL;
+            colour_merged_h2_to_bgr(y + 1, rows == 2 ? y + ALL : NULL, cb + 1, cr + 1
+                                   ,expected, rows == 2 ? expected1 : NULL, n);
+            out[3 * n] = GUARD;
+            out1[3 * n] = GUARD;
+            merged(y + 1, rows == 2 ? y + ALL : NULL, cb + 1, cr + 1, out, second, n);
+            if (   memcmp(expected, out, 3 * n) != 0 || out[3 * n] != GUARD
+                || (second && (memcmp(expected1, out1, 3 * n) != 0 || out1[3 * n] != GUARD))) {
+               printf("FAIL: SSE2 merged colour conversion of %zu pixels in %d rows differs from the scalar one\n"
+                     ,n, rows);
+               failed = 1;
+            }
+         }
+      }
+   }
+   if (from_float) {
+      /* Values either side of every clamp and rounding edge, and ones
+       * that aren't numbers */
+      static const float edges[] = {-1.0f, -0.5f, 0.0f, 0.4999f, 0.5f, 1.0f, 254.5f, 254.9999f
+                                   ,255.0f, 255.5f, 256.0f, 1e9f, -1e9f};
+      for (n = 1; n <= MAX_ODD && !failed; n++) {
+         unsigned int p;
+         for (p = 0; p < 3; p++) {
+            for (i = 0; i < n + 1; i++) {
+               uint32_t r = test_random();
+               planes[p][i] = r % 8 == 0 ? edges[(r >> 3) % (sizeof(edges) / sizeof(edges[0]))]
+                            : r % 8 == 1 ? (r & 8 ? NAN : (r & 16 ? INFINITY : -INFINITY))
+                            :              (float) (r % 40000) / 100.0f - 50.0f;
+            }
+         }
+         colour_float_to_bgr(planes[0] + 1, planes[1] + 1, planes[2] + 1, expected, n);
+         out[3 * n] = GUARD;
+         from_float(planes[0] + 1, planes[1] + 1, planes[2] + 1, out, n);
+         if (memcmp(expected, out, 3 * n) != 0 || out[3 * n] != GUARD) {
+            printf("FAIL: SSE2 float colour conversion of %zu pixels differs from the scalar one\n", n);
+            failed = 1;
+         }
+      }
+   }
+   free(y);
+   free(cb);
+   free(cr);
+   free(expected);
+   free(out);
+   free(expected1);
+   free(out1);
+   return failed;
+}
+
+/* One size ending on an MCU edge and one ending partway through */
+static const size_t test_sizes[][2] = {{640, 480}
+                                      ,{333, 251}};
+
+static const bench_sampling test_samplings[] = {BENCH_SAMPLING_444
+                                               ,BENCH_SAMPLING_422
+                                               ,BENCH_SAMPLING_420
+                                               ,BENCH_SAMPLING_GRAY};
+
+static const unsigned int test_threads[] = {2, 4, 8};
+
+static unsigned char *test_encode(size_t width, size_t height, bench_sampling sampling, int restart, size_t *size) {
+   bench_image image;
+   image.width    = width;
+   image.height   = height;
+   image.sampling = sampling;
+   image.restart  = restart;
+   image.quality  = 85;
+   return bench_encode(&image, size);
+}
+
+/* Returns the bitmap for the caller to destroy, or NULL if the decode
+ * failed */
+static bitmap *test_decode(const unsigned char *data, size_t size, const convert_options *options) {
+   jpeg_decoder *d = jpeg_decoder_create(options, NULL);
+   bitmap       *b = NULL;
+   if (jpeg_decoder_decode(d, data, size, &b) == JPEG_DECODER_OK) {
+      b = jpeg_decoder_take_output(d);
+   }
+   jpeg_decoder_destroy(d);
+   return b;
+}
+
+static int bitmaps_equal(const bitmap *a, const bitmap *b) {
+   return a->num_rows     == b->num_rows
+       && a->num_cols     == b->num_cols
+       && a->num_channels == b->num_channels
+       && memcmp(a->pixels, b->pixels, a->num_rows * a->num_cols * a->num_channels) == 0;
+}
+
+/* Speculative Huffman decoding and restart intervals split the scan
+ * between threads, which must give exactly what one thread does */
+static int parallel_test(void) {
+   int    failed = 0;
+   size_t s, p, t;
+   int    restart;
+   int    fancy;
+   for (s = 0; s < sizeof(test_sizes) / sizeof(test_sizes[0]); s++) {
+      for (p = 0; p < sizeof(test_samplings) / sizeof(test_samplings[0]); p++) {
+         for (restart = 0; restart <= 1; restart++) {
+            size_t         size;
+            unsigned char *data = test_encode(test_sizes[s][0], test_sizes[s][1], test_samplings[p], restart, &size);
+            for (fancy = 0; fancy <= 1; fancy++) {
+               convert_options options;
+               bitmap         *serial;
+               convert_options_init(&options);
+               options.num_threads = 1;
+               options.upsampling  = fancy ? JPEG_UPSAMPLE_FANCY : JPEG_UPSAMPLE_NEAREST;
+               serial = test_decode(data, size, &options);
+               if (!serial) {
+                  printf("FAIL: serial decode of %zux%zu %s\n"
+                        ,test_sizes[s][0], test_sizes[s][1], bench_sampling_name(test_samplings[p]));
+                  failed = 1;
+                  continue;
+               }
+               options.speculative_huffman = 1;
+               for (t = 0; t < sizeof(test_threads) / sizeof(test_threads[0]); t++) {
+                  bitmap *b;
+                  options.num_threads = test_threads[t];
+                  b = test_decode(data, size, &options);
+                  if (!b || !bitmaps_equal(serial, b)) {
+                     printf("FAIL: %zux%zu %s%s%s on %u threads differs from one thread\n"
+                           ,test_sizes[s][0], test_sizes[s][1], bench_sampling_name(test_samplings[p])
+                           ,restart ? " with restarts" : "", fancy ? " fancy" : "", test_threads[t]);
+                     failed = 1;
+                  }
+                  bitmap_destroy(b);
+               }
+               bitmap_destroy(serial);
+            }
+            free(data);
+         }
+      }
+   }
+   return failed;
+}
+
+/* A probe only reads the headers, and must still agree with the decode */
+static int probe_test(void) {
+   static const unsigned int scales[] = {1, 2, 8};
+   int    failed = 0;
+   size_t p, k;
+   int    restart;
+   for (p = 0; p < sizeof(test_samplings) / sizeof(test_samplings[0]); p++) {
+      for (restart = 0; restart <= 1; restart++) {
+         size_t         size;
+         unsigned char *data = test_encode(333, 251, test_samplings[p], restart, &size);
+         for (k = 0; k < sizeof(scales) / sizeof(scales[0]); k++) {
+            convert_options options;
+            jpeg_info       info;
+            bitmap         *b;
+            convert_options_init(&options);
+            options.scale_denom = scales[k];
+            b = test_decode(data, size, &options);
+            if (   jpeg_probe(data, size, &options, &info) != JPEG_PROBE_OK
+                || !b
+                || info.output_rows != b->num_rows
+                || info.output_cols != b->num_cols
+                || (info.restart_interval != 0) != restart) {
+               printf("FAIL: probe of %s%s at 1/%u doesn't match the decode\n"
+                     ,bench_sampling_name(test_samplings[p]), restart ? " with restarts" : "", scales[k]);
+               failed = 1;
+            }
+            bitmap_destroy(b);
+         }
+         free(data);
+      }
+   }
+   return failed;
+}
+
+/* Pixels of the rectangle of b, for comparing a cropped decode with */
+static bitmap *test_crop(const bitmap *b, const convert_rect *rect) {
+   bitmap *cropped = malloc(sizeof(bitmap));
+   size_t  row_size = rect->num_cols * b->num_channels;
+   size_t  row;
+   assert(cropped);
+   *cropped = *b;
+   cropped->num_rows = rect->num_rows;
+   cropped->num_cols = rect->num_cols;
+   cropped->pixels   = malloc(rect->num_rows * row_size);
+   assert(cropped->pixels);
+   for (row = 0; row < rect->num_rows; row++) {
+      memcpy(&cropped->pixels[row * row_size]
+            ,&b->pixels[((rect->row + row) * b->num_cols + rect->col) * b->num_channels]
+            ,row_size);
+   }
+   return cropped;
+}
+
+static void test_crop_destroy(bitmap *b) {
+   free(b->pixels);
+   free(b);
+}
+
+/* Feeding the data in small pieces must give what decoding it all at
+ * once does, wherever the pieces split markers and entropy coded data */
+static int push_test(void) {
+   static const size_t chunk_sizes[] = {1, 7};
+   int    failed = 0;
+   size_t p, k;
+   int    restart;
+   int    fancy;
+   for (p = 0; p < sizeof(test_samplings) / sizeof(test_samplings[0]); p++) {
+      for (restart = 0; restart <= 1; restart++) {
+         size_t         size;
+         unsigned char *data = test_encode(333, 251, test_samplings[p], restart, &size);
+         for (fancy = 0; fancy <= 1; fancy++) {
+            convert_options options;
+            bitmap         *full;
+            convert_options_init(&options);
+            options.num_threads = 1;
+            options.upsampling  = fancy ? JPEG_UPSAMPLE_FANCY : JPEG_UPSAMPLE_NEAREST;
+            full = test_decode(data, size, &options);
+            assert(full);
+            for (k = 0; k < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); k++) {
+               jpeg_push       *push   = jpeg_push_create(&options);
+               jpeg_push_status status = JPEG_PUSH_NEED_MORE_DATA;
+               bitmap          *b      = NULL;
+               size_t           offset;
+               for (offset = 0; offset < size && status == JPEG_PUSH_NEED_MORE_DATA; offset += chunk_sizes[k]) {
+                  size_t chunk = size - offset < chunk_sizes[k] ? size - offset : chunk_sizes[k];
+                  status = jpeg_push_feed(push, &data[offset], chunk);
+               }
+               if (status == JPEG_PUSH_NEED_MORE_DATA) {
+                  status = jpeg_push_finish(push);
+               }
+               if (status == JPEG_PUSH_DONE) {
+                  b = jpeg_push_take_bitmap(push);
+               }
+               if (!b || !bitmaps_equal(full, b)) {
+                  printf("FAIL: %s%s%s pushed %zu bytes at a time differs from the full decode\n"
+                        ,bench_sampling_name(test_samplings[p]), restart ? " with restarts" : ""
+                        ,fancy ? " fancy" : "", chunk_sizes[k]);
+                  failed = 1;
+               }
+               bitmap_destroy(b);
+               jpeg_push_destroy(push);
+            }
+            bitmap_destroy(full);
+         }
+         free(data);
+      }
+   }
+   return failed;
+}
+
+typedef struct test_rows_s {
+   bitmap *b;
+   size_t  next_row;
+   int     out_of_order;
+} test_rows;
+
+static int copy_rows(void *user, const unsigned char *pixels, size_t stride, size_t first_row, size_t num_rows) {
+   test_rows *rows     = (test_rows *) user;
+   bitmap    *b        = rows->b;
+   size_t     row_size = b->num_cols * b->num_channels;
+   size_t     row;
+   if (first_row != rows->next_row || first_row + num_rows > b->num_rows) {
+      rows->out_of_order = 1;
+      return 1;
+   }
+   for (row = 0; row < num_rows; row++) {
+      memcpy(&b->pixels[(first_row + row) * row_size], &pixels[row * stride], row_size);
+   }
+   rows->next_row += num_rows;
    return 0;
 }
+
+/* Decoding a band at a time must give every row once, in order, and the
+ * same rows as a whole bitmap, for every option that changes them */
+static int rows_test(void) {
+   static const char *variants[] = {"", " fancy", " at 1/2", " cropped"};
+   int    failed = 0;
+   size_t p, v;
+   for (p = 0; p < sizeof(test_samplings) / sizeof(test_samplings[0]); p++) {
+      size_t         size;
+      unsigned char *data = test_encode(333, 251, test_samplings[p], 0, &size);
+      for (v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+         convert_options options;
+         jpeg           *j = jpeg_read_mem(data, size);
+         bitmap         *full;
+         test_rows       rows;
+         bitmap          band_bitmap;
+         convert_options_init(&options);
+         options.num_threads = 1;
+         if (v == 1) {
+            options.upsampling = JPEG_UPSAMPLE_FANCY;
+         } else if (v == 2) {
+            options.scale_denom = 2;
+         } else if (v == 3) {
+            options.crop.row      = 21;
+            options.crop.col      = 9;
+            options.crop.num_rows = 150;
+            options.crop.num_cols = 201;
+         }
+         full = test_decode(data, size, &options);
+         assert(j && full);
+         band_bitmap        = *full;
+         band_bitmap.pixels = calloc(full->num_rows * full->num_cols, full->num_channels);
+         assert(band_bitmap.pixels);
+         rows.b            = &band_bitmap;
+         rows.next_row     = 0;
+         rows.out_of_order = 0;
+         if (   jpeg_decode_rows(j, &options, copy_rows, &rows) != 0
+             || rows.out_of_order
+             || rows.next_row != full->num_rows
+             || !bitmaps_equal(full, &band_bitmap)) {
+            printf("FAIL: %s%s decoded in rows differs from the full decode\n"
+                  ,bench_sampling_name(test_samplings[p]), variants[v]);
+            failed = 1;
+         }
+         free(band_bitmap.pixels);
+         bitmap_destroy(full);
+         jpeg_destroy(j);
+      }
+      free(data);
+   }
+   return failed;
+}
+
+/* A crop must give exactly that part of the full decode, at any position
+ * against the MCU grid, on any number of threads and at any scale */
+static int crop_test(void) {
+   static const unsigned int scales[] = {1, 2};
+   int    failed = 0;
+   size_t p, k, r;
+   int    restart;
+   int    fancy;
+   for (p = 0; p < sizeof(test_samplings) / sizeof(test_samplings[0]); p++) {
+      for (restart = 0; restart <= 1; restart++) {
+         size_t         size;
+         unsigned char *data = test_encode(333, 251, test_samplings[p], restart, &size);
+         for (k = 0; k < sizeof(scales) / sizeof(scales[0]); k++) {
+            for (fancy = 0; fancy <= 1; fancy++) {
+               convert_options options;
+               bitmap         *full;
+               convert_options_init(&options);
+               options.num_threads = restart ? 4 : 1;
+               options.scale_denom = scales[k];
+               options.upsampling  = fancy ? JPEG_UPSAMPLE_FANCY : JPEG_UPSAMPLE_NEAREST;
+               full = test_decode(data, size, &options);
+               assert(full);
+               {
+                  /* The top left MCU, one straddling MCU edges, one
+                   * against the bottom right corner and a single row */
+                  convert_rect rects[4] = {{0, 0, 16, 16}
+                                          ,{5, 13, 100, 77}
+                                          ,{0, 0, 33, 51}
+                                          ,{17, 0, 1, 0}};
+                  rects[2].row      = full->num_rows - rects[2].num_rows;
+                  rects[2].col      = full->num_cols - rects[2].num_cols;
+                  rects[3].num_cols = full->num_cols;
+                  for (r = 0; r < sizeof(rects) / sizeof(rects[0]); r++) {
+                     bitmap *expected = test_crop(full, &rects[r]);
+                     bitmap *b;
+                     options.crop = rects[r];
+                     b = test_decode(data, size, &options);
+                     if (!b || !bitmaps_equal(expected, b)) {
+                        printf("FAIL: %s%s%s at 1/%u cropped to %zux%zu at %zu,%zu differs from the full decode\n"
+                              ,bench_sampling_name(test_samplings[p]), restart ? " with restarts" : ""
+                              ,fancy ? " fancy" : "", scales[k]
+                              ,rects[r].num_cols, rects[r].num_rows, rects[r].col, rects[r].row);
+                        failed = 1;
+                     }
+                     bitmap_destroy(b);
+                     test_crop_destroy(expected);
+                  }
+                  options.crop.num_rows = 0;
+                  options.crop.num_cols = 0;
+               }
+               bitmap_destroy(full);
+            }
+         }
+         free(data);
+      }
+   }
+   return failed;
+}
+
+/* A scaled decode must have the scaled size, rounded up, and be close to
+ * the full decode averaged down to it, which real scaled decodes are to
+ * within a level or two */
+static int scale_test(void) {
+   static const unsigned int scales[] = {2, 4, 8};
+   int    failed = 0;
+   size_t p, k;
+   for (p = 0; p < sizeof(test_samplings) / sizeof(test_samplings[0]); p++) {
+      size_t          size;
+      unsigned char  *data = test_encode(333, 251, test_samplings[p], 0, &size);
+      convert_options options;
+      bitmap         *full;
+      convert_options_init(&options);
+      full = test_decode(data, size, &options);
+      assert(full);
+      for (k = 0; k < sizeof(scales) / sizeof(scales[0]); k++) {
+         unsigned int d         = scales[k];
+         double       total     = 0;
+         size_t       num_bytes = 0;
+         size_t       row, col, c;
+         bitmap      *b;
+         options.scale_denom = d;
+         b = test_decode(data, size, &options);
+         if (   !b
+             || b->num_rows     != (full->num_rows + d - 1) / d
+             || b->num_cols     != (full->num_cols + d - 1) / d
+             || b->num_channels != full->num_channels) {
+            printf("FAIL: %s at 1/%u is the wrong size\n", bench_sampling_name(test_samplings[p]), d);
+            failed = 1;
+            bitmap_destroy(b);
+            continue;
+         }
+         for (row = 0; row < b->num_rows; row++) {
+            for (col = 0; col < b->num_cols; col++) {
+               for (c = 0; c < b->num_channels; c++) {
+                  /* The last row and column of blocks may be partial */
+                  size_t sum = 0, n = 0, r2, c2;
+                  for (r2 = row * d; r2 < row * d + d && r2 < full->num_rows; r2++) {
+                     for (c2 = col * d; c2 < col * d + d && c2 < full->num_cols; c2++) {
+                        sum += full->pixels[(r2 * full->num_cols + c2) * full->num_channels + c];
+                        n++;
+                     }
+                  }
+                  total += fabs((double) sum / n - b->pixels[(row * b->num_cols + col) * b->num_channels + c]);
+                  num_bytes++;
+               }
+            }
+         }
+         if (total / num_bytes > 3.0) {
+            printf("FAIL: %s at 1/%u is %.2f levels from the full decode on average\n"
+                  ,bench_sampling_name(test_samplings[p]), d, total / num_bytes);
+            failed = 1;
+         }
+         bitmap_destroy(b);
+      }
+      bitmap_destroy(full);
+      free(data);
+   }
+   return failed;
+}
+
+/* Returns the file's contents for the caller to free, or NULL */
+static unsigned char *test_read_file(const char *filename, size_t *size) {
+   FILE          *f = fopen(filename, "rb");
+   unsigned char *data;
+   long           length;
+   if (!f) {
+      return NULL;
+   }
+   fseek(f, 0, SEEK_END);
+   length = ftell(f);
+   fseek(f, 0, SEEK_SET);
+   data = malloc(length > 0 ? (size_t) length : 1);
+   assert(data);
+   *size = fread(data, 1, (size_t) length, f);
+   fclose(f);
+   return data;
+}
+
+/* Whether a file from bitmap_writer matches one bitmap_write_format wrote.
+ * Raw files are the same, but the writer goes top down, so its BMP header
+ * has the height negated and its rows are in the opposite order. */
+static int test_files_match(const unsigned char *whole
+                           ,const unsigned char *rows
+                           ,size_t               size
+                           ,const bitmap        *b
+                           ,bitmap_format        format) {
+   /* The height is a little endian 32-bit field 22 bytes in */
+   enum { HEIGHT = 22 };
+   size_t row_size, offset, row;
+   if (format == BITMAP_FORMAT_RAW) {
+      return memcmp(whole, rows, size) == 0;
+   }
+   row_size = (b->num_cols * b->num_channels + 3) / 4 * 4;
+   offset   = size - b->num_rows * row_size;
+   if (   offset < HEIGHT + 4
+       || memcmp(whole, rows, HEIGHT) != 0
+       || memcmp(&whole[HEIGHT + 4], &rows[HEIGHT + 4], offset - HEIGHT - 4) != 0
+       || (uint32_t) (whole[HEIGHT] | whole[HEIGHT + 1] << 8 | whole[HEIGHT + 2] << 16 | (uint32_t) whole[HEIGHT + 3] << 24)
+          != (uint32_t) -(uint32_t) (rows[HEIGHT] | rows[HEIGHT + 1] << 8 | rows[HEIGHT + 2] << 16 | (uint32_t) rows[HEIGHT + 3] << 24)) {
+      return 0;
+   }
+   for (row = 0; row < b->num_rows; row++) {
+      if (memcmp(&whole[offset + row * row_size], &rows[offset + (b->num_rows - 1 - row) * row_size], row_size) != 0) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/* Writing a band at a time must give the same image as writing the whole
+ * bitmap, in each format, for greyscale and colour, at a width that
+ * needs padding */
+static int writer_test(void) {
+   static const bench_sampling samplings[] = {BENCH_SAMPLING_GRAY, BENCH_SAMPLING_444};
+   static const bitmap_format  formats[]   = {BITMAP_FORMAT_BMP, BITMAP_FORMAT_RAW};
+   static const char          *whole_file  = "test_writer_whole.tmp";
+   static const char          *rows_file   = "test_writer_rows.tmp";
+   int    failed = 0;
+   size_t p, k;
+   for (p = 0; p < sizeof(samplings) / sizeof(samplings[0]); p++) {
+      size_t         size;
+      unsigned char *data = test_encode(333, 251, samplings[p], 0, &size);
+      bitmap        *b    = test_decode(data, size, NULL);
+      assert(b);
+      for (k = 0; k < sizeof(formats) / sizeof(formats[0]); k++) {
+         bitmap_writer *w = bitmap_writer_create(rows_file, b->num_rows, b->num_cols, b->num_channels, formats[k]);
+         size_t         stride = b->num_cols * b->num_channels;
+         size_t         row;
+         unsigned char *whole, *rows;
+         size_t         whole_size = 0, rows_size = 0;
+         int            error = !w || bitmap_write_format(b, whole_file, formats[k]) != 0;
+         for (row = 0; w && row < b->num_rows; row += 7) {
+            size_t num_rows = b->num_rows - row < 7 ? b->num_rows - row : 7;
+            error |= bitmap_writer_write_rows(w, &b->pixels[row * stride], stride, num_rows) != 0;
+         }
+         error |= w && bitmap_writer_destroy(w) != 0;
+         whole = test_read_file(whole_file, &whole_size);
+         rows  = test_read_file(rows_file, &rows_size);
+         if (   error
+             || !whole
+             || !rows
+             || whole_size != rows_size
+             || !test_files_match(whole, rows, whole_size, b, formats[k])) {
+            printf("FAIL: %s written in rows as %s differs from writing the whole bitmap\n"
+                  ,bench_sampling_name(samplings[p]), formats[k] == BITMAP_FORMAT_BMP ? "BMP" : "raw");
+            failed = 1;
+         }
+         free(whole);
+         free(rows);
+         remove(whole_file);
+         remove(rows_file);
+      }
+      bitmap_destroy(b);
+      free(data);
+   }
+   return failed;
+}
+
+int main(int argc, char *argv[]) {
+   int failed = 0;
+   failed |= idct_test();
+   failed |= colour_test();
+   failed |= parallel_test();
+   failed |= probe_test();
+   failed |= push_test();
+   failed |= rows_test();
+   failed |= crop_test();
+   failed |= scale_test();
+   failed |= writer_test();
+   printf(failed ? "Tests failed\n" : "Tests passed\n");
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
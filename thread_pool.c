@@ -0,0 +1,140 @@
+#include <assert.h>
+#include <pthread.h>
+#include "thread_pool.h"
+
+typedef struct thread_pool_task_s {
+   thread_pool_fn fn;
+   void          *arg;
+} thread_pool_task;
+
+typedef struct thread_pool_worker_s {
+   thread_pool *pool;
+   unsigned int index;
+   pthread_t    thread;
+} thread_pool_worker;
+
+/* Tasks are kept in a ring buffer which grows as needed */
+struct thread_pool_s {
+   pthread_mutex_t     lock;
+   pthread_cond_t      task_ready;
+   pthread_cond_t      all_done;
+   thread_pool_task   *tasks;
+   size_t              capacity;
+   size_t              head;
+   size_t              num_queued;
+   /* Tasks queued or running */
+   size_t              num_pending;
+   int                 shutdown;
+   thread_pool_worker *workers;
+   unsigned int        num_threads;
+};
+
+static void *worker_main(void *arg) {
+   thread_pool_worker *worker = arg;
+   thread_pool        *pool   = worker->pool;
+   pthread_mutex_lock(&pool->lock);
+   for (;;) {
+      thread_pool_task task;
+      while (pool->num_queued == 0 && !pool->shutdown) {
+         pthread_cond_wait(&pool->task_ready, &pool->lock);
+      }
+      if (pool->num_queued == 0) {
+         break;
+      }
+      task = pool->tasks[pool->head];
+      pool->head        = (pool->head + 1) % pool->capacity;
+      pool->num_queued -= 1;
+      pthread_mutex_unlock(&pool->lock);
+      task.fn(task.arg, worker->index);
+      pthread_mutex_lock(&pool->lock);
+      pool->num_pending -= 1;
+      if (pool->num_pending == 0) {
+         pthread_cond_broadcast(&pool->all_done);
+      }
+   }
+   pthread_mutex_unlock(&pool->lock);
+   return NULL;
+}
+
+thread_pool *thread_pool_create(unsigned int num_threads) {
+   thread_pool *pool = malloc(sizeof(thread_pool));
+   unsigned int i;
+   assert(pool);
+   assert(num_threads > 0);
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->task_ready, NULL);
+   pthread_cond_init(&pool->all_done, NULL);
+   pool->tasks       = NULL;
+   pool->capacity    = 0;
+   pool->head        = 0;
+   pool->num_queued  = 0;
+   pool->num_pending = 0;
+   pool->shutdown    = 0;
+   pool->workers     = malloc(num_threads * sizeof(thread_pool_worker));
+   assert(pool->workers);
+   pool->num_threads = 0;
+   for (i = 0; i < num_threads; i++) {
+      thread_pool_worker *worker = &pool->workers[pool->num_threads];
+      worker->pool  = pool;
+      worker->index = pool->num_threads;
+      if (pthread_create(&worker->thread, NULL, worker_main, worker) == 0) {
+         pool->num_threads += 1;
+      }
+   }
+   /* Can't do anything without at least one worker */
+   assert(pool->num_threads > 0);
+   return pool;
+}
+
+void thread_pool_destroy(thread_pool *pool) {
+   unsigned int i;
+   pthread_mutex_lock(&pool->lock);
+   pool->shutdown = 1;
+   pthread_cond_broadcast(&pool->task_ready);
+   pthread_mutex_unlock(&pool->lock);
+   for (i = 0; i < pool->num_threads; i++) {
+      pthread_join(pool->workers[i].thread, NULL);
+   }
+   pthread_cond_destroy(&pool->all_done);
+   pthread_cond_destroy(&pool->task_ready);
+   pthread_mutex_destroy(&pool->lock);
+   free(pool->workers);
+   free(pool->tasks);
+   free(pool);
+}
+
+unsigned int thread_pool_num_threads(const thread_pool *pool) {
+   return pool->num_threads;
+}
+
+void thread_pool_submit(thread_pool *pool, thread_pool_fn fn, void *arg) {
+   pthread_mutex_lock(&pool->lock);
+   if (pool->num_queued == pool->capacity) {
+      /* Grow, unwrapping the ring so it starts at zero again */
+      size_t            capacity = pool->capacity * 2 + 16;
+      thread_pool_task *tasks    = malloc(capacity * sizeof(thread_pool_task));
+      size_t            i;
+      assert(tasks);
+      for (i = 0; i < pool->num_queued; i++) {
+         tasks[i] = pool->tasks[(pool->head + i) % pool->capacity];
+      }
+      free(pool->tasks);
+      pool->tasks    = tasks;
+      pool->capacity = capacity;
+      pool->head     = 0;
+   }
+   pool->tasks[(pool->head + pool->num_queued) % pool->capacity].fn  = fn;
+   pool->tasks[(pool->head + pool->num_queued) % pool->capacity].arg = arg;
+   pool->num_queued  += 1;
+   pool->num_pending += 1;
+   pthread_cond_signal(&pool->task_ready);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(thread_pool *pool) {
+   pthread_mutex_lock(&pool->lock);
+   while (pool->num_pending > 0) {
+      pthread_cond_wait(&pool->all_done, &pool->lock);
+   }
+   pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,26 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdlib.h>
+
+typedef struct thread_pool_s thread_pool;
+
+/* A task, given the index of the worker running it so that it can use
+ * that worker's scratch space */
+typedef void (*thread_pool_fn)(void *arg, unsigned int worker);
+
+/* Start num_threads workers, which wait for tasks until destroyed */
+thread_pool *thread_pool_create(unsigned int num_threads);
+
+/* Finishes any queued tasks first */
+void thread_pool_destroy(thread_pool *pool);
+
+unsigned int thread_pool_num_threads(const thread_pool *pool);
+
+/* Queue a task. Tasks may start in any order. */
+void thread_pool_submit(thread_pool *pool, thread_pool_fn fn, void *arg);
+
+/* Wait until every task submitted so far has finished */
+void thread_pool_wait(thread_pool *pool);
+
+#endif
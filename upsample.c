@@ -0,0 +1,39 @@
+#include "upsample.h"
+
+void upsample_fancy_h2v1(const unsigned char *in
+                        ,size_t               width
+                        ,size_t               first
+                        ,size_t               num_cols
+                        ,unsigned char       *out) {
+   size_t x;
+   for (x = first; x < first + num_cols; x++) {
+      size_t i = x / 2;
+      int    nearest = in[i] * 3;
+      if (x % 2 == 0) {
+         *out++ = (unsigned char) ((nearest + in[i > 0 ? i - 1 : 0] + 1) >> 2);
+      } else {
+         *out++ = (unsigned char) ((nearest + in[i + 1 < width ? i + 1 : i] + 2) >> 2);
+      }
+   }
+}
+
+void upsample_fancy_h2v2(const unsigned char *in
+                        ,const unsigned char *near
+                        ,size_t               width
+                        ,size_t               first
+                        ,size_t               num_cols
+                        ,unsigned char       *out) {
+   size_t x;
+   /* Filter vertically first, into column sums scaled by 4 */
+   for (x = first; x < first + num_cols; x++) {
+      size_t i    = x / 2;
+      int    this = in[i] * 3 + near[i];
+      if (x % 2 == 0) {
+         size_t left = i > 0 ? i - 1 : 0;
+         *out++ = (unsigned char) ((this * 3 + in[left] * 3 + near[left] + 8) >> 4);
+      } else {
+         size_t right = i + 1 < width ? i + 1 : i;
+         *out++ = (unsigned char) ((this * 3 + in[right] * 3 + near[right] + 7) >> 4);
+      }
+   }
+}
@@ -0,0 +1,29 @@
+#ifndef UPSAMPLE_H
+#define UPSAMPLE_H
+
+#include <stddef.h>
+
+/* libjpeg's "fancy" triangle filter for chroma at half resolution. Each
+ * output sample is weighted 3:1 between the nearest input sample and the
+ * next nearest, with the same rounding as libjpeg, and the edges repeat
+ * the outermost sample. The functions write output columns first to
+ * first + num_cols - 1 of a row upsampled from width input samples. */
+
+/* Twice the width */
+void upsample_fancy_h2v1(const unsigned char *in
+                        ,size_t               width
+                        ,size_t               first
+                        ,size_t               num_cols
+                        ,unsigned char       *out);
+
+/* Twice the width and height. in is the input row nearest the output row,
+ * and near the one on the other side of it: above for the upper of the two
+ * output rows in is between, below for the lower. */
+void upsample_fancy_h2v2(const unsigned char *in
+                        ,const unsigned char *near
+                        ,size_t               width
+                        ,size_t               first
+                        ,size_t               num_cols
+                        ,unsigned char       *out);
+
+#endif